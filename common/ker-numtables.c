@@ -193,6 +193,30 @@ struct rl_msg_layout rl_ker_numtables[] = {
         {
             .copylen = sizeof(struct rl_kmsg_ipcp_sched_pfifo),
         },
+    [RLITE_KER_IPCP_SCHED_DRR] =
+        {
+            .copylen = sizeof(struct rl_kmsg_ipcp_sched_drr) -
+                       1 * sizeof(struct rl_msg_array_field),
+            .arrays = 1,
+        },
+    [RLITE_KER_IPCP_SCHED_PRIO_DRR] =
+        {
+            .copylen = sizeof(struct rl_kmsg_ipcp_sched_prio_drr) -
+                       1 * sizeof(struct rl_msg_array_field),
+            .arrays = 1,
+        },
+    [RLITE_KER_IPCP_SCHED_FQ_CODEL] =
+        {
+            .copylen = sizeof(struct rl_kmsg_ipcp_sched_fq_codel),
+        },
+    [RLITE_KER_FLOW_LAT_REQ] =
+        {
+            .copylen = sizeof(struct rl_kmsg_flow_lat_req),
+        },
+    [RLITE_KER_FLOW_LAT_RESP] =
+        {
+            .copylen = sizeof(struct rl_kmsg_flow_lat_resp),
+        },
     [RLITE_KER_MSG_MAX] =
         {
             .copylen = 0,
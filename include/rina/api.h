@@ -218,9 +218,39 @@ void rina_flow_spec_unreliable(struct rina_flow_spec *spec);
 /*
  * Retrieve the MSS (Maximum SDU Size) that can be written to the flow
  * with a single write. Returns 0 on error with errno set properly.
+ * On flows that preserve message boundaries, a normal DIF can also
+ * accept single writes up to 1 MiB, which are fragmented and reassembled
+ * by EFCP and delivered to the remote reader as a single SDU.
  */
 unsigned int rina_flow_mss_get(int fd);
 
+struct iovec;
+
+/*
+ * Write up to @num SDUs to the flow @fd, where the i-th SDU is described
+ * by @sdus[i]. SDUs are passed to the kernel in batches, so that a single
+ * system call is issued for many SDUs.
+ *
+ * Returns the number of SDUs actually written, which may be smaller than
+ * @num if the flow is in non-blocking mode. On error -1 is returned, with
+ * the errno code properly set.
+ */
+int rina_flow_write_batch(int fd, const struct iovec *sdus, unsigned int num);
+
+/*
+ * Read up to @num SDUs from the flow @fd with a single system call, storing
+ * the i-th SDU in the buffer described by @sdus[i]. Less than @num SDUs may
+ * be returned, even in blocking mode. On return, the iov_len
+ * field of each consumed entry is set to the length of the SDU received.
+ * An SDU bigger than the corresponding buffer is read partially and ends
+ * the batch; like with read(), the rest of the SDU is returned by the
+ * next read.
+ *
+ * Returns the number of SDUs read, or 0 if the flow has been deallocated.
+ * On error -1 is returned, with the errno code properly set.
+ */
+int rina_flow_read_batch(int fd, struct iovec *sdus, unsigned int num);
+
 #ifdef __cplusplus
 }
 #endif
@@ -171,6 +171,94 @@ struct rl_ioctl_info {
 #define RLITE_IOCTL_CHFLAGS _IOW(0xAF, 0x01, uint64_t)
 #define RLITE_IOCTL_MSS_GET _IOW(0xAF, 0x02, uint32_t *)
 
+/* Descriptor of a single SDU for batched I/O on rlite-io devices.
+ * On write, 'len' is the length of the SDU stored at 'buf'. On read,
+ * 'len' is the size of the buffer at 'buf' and it is overwritten
+ * with the number of bytes actually copied. */
+struct rl_sdu_desc {
+    uint64_t buf; /* userspace pointer */
+    uint32_t len;
+    uint32_t pad1;
+};
+
+/* Maximum number of SDUs processed by a single batched ioctl. */
+#define RLITE_IO_BATCH_MAX 64
+
+struct rl_ioctl_batch {
+    uint64_t descs; /* userspace pointer to an array of rl_sdu_desc */
+    uint32_t num;   /* number of descriptors in the array */
+    uint32_t pad1;
+};
+
+/* Write or read up to 'num' SDUs with a single system call. The ioctl
+ * returns the number of SDUs actually written or read. */
+#define RLITE_IOCTL_WRITE_BATCH _IOW(0xAF, 0x03, struct rl_ioctl_batch)
+#define RLITE_IOCTL_READ_BATCH _IOW(0xAF, 0x04, struct rl_ioctl_batch)
+
+/*
+ * Shared-memory rings for rlite-io devices bound to an application flow.
+ *
+ * The memory region mapped with mmap() contains the RX ring, followed
+ * by the TX ring (at offset 'tx_ofs'). Each ring is made of a struct
+ * rl_ring header, followed by 'num_slots' struct rl_ring_slot, followed
+ * by 'num_slots' buffers of 'slot_size' bytes each. Ring indices are
+ * free-running: the i-th index refers to slot (i & (num_slots - 1)).
+ * The slots in [tail, head) contain SDUs that are owned by the consumer,
+ * all the other slots are owned by the producer. The kernel is the
+ * producer of the RX ring and the consumer of the TX ring.
+ */
+struct rl_ring_slot {
+    uint32_t len; /* SDU length */
+    uint32_t pad1;
+};
+
+struct rl_ring {
+    uint32_t head;      /* next slot to be filled, written by producer */
+    uint32_t tail;      /* next slot to be consumed, written by consumer */
+    uint32_t num_slots; /* power of two */
+    uint32_t slot_size; /* size of each slot buffer, in bytes */
+    uint32_t slots_ofs; /* offset of the slot array from the header */
+    uint32_t bufs_ofs;  /* offset of the first buffer from the header */
+    uint32_t pad1[2];
+};
+
+/* Maximum number of slots in a ring. */
+#define RLITE_RING_SLOTS_MAX 4096
+
+struct rl_ioctl_ring_setup {
+    uint32_t num_slots; /* in/out: slots per ring, a power of two */
+    uint32_t slot_size; /* in/out: bytes per slot buffer */
+    uint32_t tx_ofs;    /* out: offset of the TX ring */
+    uint32_t mem_size;  /* out: size of the region to be mapped */
+};
+
+/* Allocate the rings for a flow, to be mapped with mmap() afterwards. */
+#define RLITE_IOCTL_RING_SETUP _IOWR(0xAF, 0x05, struct rl_ioctl_ring_setup)
+
+/* Doorbell: ask the kernel to transmit the SDUs published on the TX
+ * ring and/or to move the SDUs pending on the flow to the RX ring.
+ * The result of each direction is reported separately, as the number
+ * of SDUs moved or a negative errno; the RX side fails with EPIPE if
+ * the flow has been deallocated and no more SDUs are pending.
+ * Each SDU must fit in a single slot. On the RX side, an SDU larger
+ * than 'slot_size' stays pending on the flow and must be retrieved
+ * with read(); the RX result is EMSGSIZE if no SDU could be moved
+ * because of that. On the TX side, a slot longer than 'slot_size' or
+ * than the maximum SDU size of the flow is dropped, with an EMSGSIZE
+ * result. A TX error that stops the sync after some SDUs have been
+ * transmitted is reported by the next TX sync. */
+#define RLITE_RING_TX (1 << 0)
+#define RLITE_RING_RX (1 << 1)
+
+struct rl_ioctl_ring_sync {
+    uint32_t which; /* in: RLITE_RING_TX and/or RLITE_RING_RX */
+    int32_t tx;     /* out: SDUs transmitted, or -errno */
+    int32_t rx;     /* out: SDUs moved to the RX ring, or -errno */
+    uint32_t pad1;
+};
+
+#define RLITE_IOCTL_RING_SYNC _IOWR(0xAF, 0x06, struct rl_ioctl_ring_sync)
+
 #define RLITE_MGMT_HDR_T_OUT_LOCAL_PORT 1
 #define RLITE_MGMT_HDR_T_OUT_DST_ADDR 2
 #define RLITE_MGMT_HDR_T_IN 3
@@ -237,7 +325,11 @@ struct dtcp_config {
         uint16_t data_rxms_max;
         uint16_t max_rtxq_len;
         uint32_t initial_rtx_timeout;
-        uint32_t pad2;
+        uint8_t cc_type; /* congestion control algorithm */
+#define RLITE_CC_T_NEWRENO 0
+#define RLITE_CC_T_CUBIC 1
+#define RLITE_CC_T_VEGAS 2
+        uint8_t pad2[3];
     } rtx;
 
     uint32_t initial_a; /* A */
@@ -282,6 +374,25 @@ struct rl_flow_stats {
     uint64_t rx_overrun_byte;
 };
 
+/* Log2 histogram of latency samples, in microseconds. Bucket 0 counts
+ * the samples below 1 us, bucket i the ones in [2^(i-1), 2^i) us, and
+ * the last bucket also the ones above. */
+#define RL_LAT_BUCKETS 24
+struct rl_lat_hist {
+    uint64_t samples;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[RL_LAT_BUCKETS];
+};
+
+/* Latency statistics of a flow. */
+struct rl_flow_lat {
+    struct rl_lat_hist rxq;        /* SDU sojourn time in the rx queue */
+    struct rl_lat_hist rtt;        /* RTT samples */
+    struct rl_lat_hist rtt_jitter; /* deviation of RTT samples from SRTT */
+    struct rl_lat_hist rmtq;       /* PDU scheduler delay (N-1 flows) */
+};
+
 /* RMT statistics. All counters must be 64 bits wide. */
 struct rl_rmt_stats {
     uint64_t fwd_pkt;
@@ -326,7 +437,7 @@ struct rl_flow_dtp {
     uint32_t rtt;        /* estimated round trip time, in usecs. */
     uint32_t rtt_stddev; /* stddev in usecs */
     uint32_t cgwin;      /* congestion window size, in PDUs */
-    uint32_t pad1;
+    uint32_t ack_every;  /* PDUs covered by a delayed ACK */
 
     /* Receiver state. */
     rlm_seq_t rcv_lwe;
@@ -337,7 +448,9 @@ struct rl_flow_dtp {
     rlm_seq_t last_seq_num_acked;
     rlm_seq_t next_snd_ctl_seq;
     uint32_t seqq_len;
-    uint32_t pad2;
+    uint32_t seqq_depth_max; /* max reordering seen, in PDUs */
+    uint64_t rx_dt_pdus;     /* data transfer PDUs received */
+    uint64_t tx_ctrl_pdus;   /* control PDUs sent */
 };
 
 #define RL_SHIM_UDP_PORT 0x0d1f
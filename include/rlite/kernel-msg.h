@@ -67,6 +67,11 @@ enum {
     RLITE_KER_IPCP_CONFIG_GET_RESP,  /* 35 */
     RLITE_KER_IPCP_SCHED_WRR,        /* 36 */
     RLITE_KER_IPCP_SCHED_PFIFO,      /* 37 */
+    RLITE_KER_IPCP_SCHED_DRR,        /* 38 */
+    RLITE_KER_IPCP_SCHED_PRIO_DRR,   /* 39 */
+    RLITE_KER_IPCP_SCHED_FQ_CODEL,   /* 40 */
+    RLITE_KER_FLOW_LAT_REQ,          /* 41 */
+    RLITE_KER_FLOW_LAT_RESP,         /* 42 */
 
     RLITE_KER_MSG_MAX,
 };
@@ -419,6 +424,23 @@ struct rl_kmsg_flow_stats_resp {
     struct rl_flow_dtp dtp;
 };
 
+/* application --> kernel message to ask for the latency histograms
+ * of a given flow. */
+struct rl_kmsg_flow_lat_req {
+    struct rl_msg_hdr hdr;
+
+    rl_port_t port_id;
+    uint16_t pad1[3];
+};
+
+/* application <-- kernel message to report the latency histograms
+ * of a given flow. */
+struct rl_kmsg_flow_lat_resp {
+    struct rl_msg_hdr hdr;
+
+    struct rl_flow_lat lat;
+};
+
 /* application --> kernel message to ask an IPCP if a given
  * QoS can be supported. */
 struct rl_kmsg_ipcp_qos_supported {
@@ -471,4 +493,60 @@ struct rl_kmsg_ipcp_sched_pfifo {
     rlm_qosid_t prio_levels;
 };
 
+/* application --> kernel message to configure a DRR PDU scheduler. */
+struct rl_kmsg_ipcp_sched_drr {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+
+    /* Quantum size in bytes, assigned to the class with the
+     * smallest weight. */
+    uint32_t quantum;
+
+    /* DRR weights are dwords. */
+    struct rl_msg_array_field weights;
+};
+
+/* application --> kernel message to configure a PDU scheduler with
+ * strict priority classes on top of a pool of DRR classes. */
+struct rl_kmsg_ipcp_sched_prio_drr {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max queue size in bytes. */
+    uint32_t max_queue_size;
+
+    /* Quantum size in bytes, assigned to the DRR class with the
+     * smallest weight. */
+    uint32_t quantum;
+
+    /* Number of strict priority levels, served before the DRR classes. */
+    rlm_qosid_t prio_levels;
+
+    /* Weights of the DRR classes (dwords). */
+    struct rl_msg_array_field weights;
+};
+
+/* application --> kernel message to configure a FQ-CoDel PDU scheduler. */
+struct rl_kmsg_ipcp_sched_fq_codel {
+    struct rl_msg_ipcp ipcp_hdr;
+
+    /* Max size of all the queues together, in bytes. */
+    uint32_t max_queue_size;
+
+    /* Number of per-flow queues (rounded up to a power of two). */
+    uint32_t flows;
+
+    /* Quantum size in bytes. */
+    uint32_t quantum;
+
+    /* CoDel target queueing delay and interval, in microseconds. */
+    uint32_t target_us;
+    uint32_t interval_us;
+
+    /* Mark PDUs with PDU_F_ECN rather than dropping them. */
+    uint8_t ecn;
+    uint8_t pad1[3];
+};
+
 #endif /* __RLITE_KER_H__ */
@@ -0,0 +1,5 @@
+#ifndef __RLITE_VERSION_H__
+#define __RLITE_VERSION_H__
+#define RL_REVISION_ID "dev"
+#define RL_REVISION_DATE "dev"
+#endif
@@ -24,8 +24,218 @@
 
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/shrinker.h>
 #include "rlite-kernel.h"
 
+#ifndef RL_SKB
+/*
+ * Buffer headers and raw buffers are allocated from dedicated slab caches
+ * (one for the headers and one for each size class of raw buffers). On top
+ * of the slab caches, each CPU keeps a bounded list of recently freed
+ * objects, so that in steady state allocation and deallocation of packet
+ * buffers reduce to a few pointer operations. The per-CPU lists are bounded
+ * in bytes for each size class, so that only a few of the biggest buffers
+ * are kept, and they are drained by a shrinker under memory pressure.
+ * Raw buffers larger than the biggest size class are allocated with
+ * kmalloc(). Buffers allocated with enough tailroom for a struct
+ * skb_shared_info can be turned into an sk_buff by build_skb(), whether
+ * they come from a size class or from kmalloc().
+ * Raw buffers can also borrow the data of a received sk_buff; in this case
+ * only the struct rl_rawbuf is allocated, from a dedicated slab cache.
+ */
+static const unsigned int rl_rawbuf_class_size[RL_BUF_CLASSES] = {
+    512, 2048, 9216, 66560};
+
+static const char *rl_rawbuf_class_name[RL_BUF_CLASSES] = {
+    "rl_rawbuf_512", "rl_rawbuf_2048", "rl_rawbuf_9216", "rl_rawbuf_66560"};
+
+#define RL_BUF_CACHE_LEN 128
+#define RL_BUF_CACHE_BYTES (128 * 1024) /* per CPU and size class */
+
+static inline unsigned int
+rl_rawbuf_cache_len(unsigned int cls)
+{
+    return min_t(unsigned int, RL_BUF_CACHE_LEN,
+                 RL_BUF_CACHE_BYTES / rl_rawbuf_class_size[cls]);
+}
+
+/* A free raw buffer, linked in a per-CPU list. */
+struct rl_rawbuf_link {
+    struct rl_rawbuf_link *next;
+};
+
+struct rl_buf_cache {
+    /* Free buffer headers, linked through their node field. */
+    struct list_head hdrs;
+    unsigned int num_hdrs;
+
+    /* Free raw buffers, one list for each size class. */
+    struct rl_rawbuf_link *raws[RL_BUF_CLASSES];
+    unsigned int num_raws[RL_BUF_CLASSES];
+
+    /* Hit and miss counters. */
+    unsigned long hdr_hit;
+    unsigned long hdr_miss;
+    unsigned long raw_hit[RL_BUF_CLASSES];
+    unsigned long raw_miss[RL_BUF_CLASSES];
+};
+
+static DEFINE_PER_CPU(struct rl_buf_cache, rl_buf_caches);
+static struct kmem_cache *rl_buf_hdr_cache;
+static struct kmem_cache *rl_rawbuf_cache[RL_BUF_CLASSES];
+static struct kmem_cache *rl_rawbuf_skb_cache;
+
+static struct rl_buf *
+rl_buf_hdr_get(gfp_t gfp)
+{
+    struct rl_buf *rb = NULL;
+    struct rl_buf_cache *c;
+    unsigned long flags;
+
+    local_irq_save(flags);
+    c = this_cpu_ptr(&rl_buf_caches);
+    if (!list_empty(&c->hdrs)) {
+        rb = list_first_entry(&c->hdrs, struct rl_buf, node);
+        list_del(&rb->node);
+        c->num_hdrs--;
+        c->hdr_hit++;
+    } else {
+        c->hdr_miss++;
+    }
+    local_irq_restore(flags);
+
+    if (!rb) {
+        rb = kmem_cache_alloc(rl_buf_hdr_cache, gfp);
+        if (unlikely(!rb)) {
+            return NULL;
+        }
+    }
+    rl_memtrack_get(RL_MT_BUFHDR);
+
+    return rb;
+}
+
+static void
+rl_buf_hdr_put(struct rl_buf *rb)
+{
+    struct rl_buf_cache *c;
+    unsigned long flags;
+
+    rl_memtrack_put(RL_MT_BUFHDR);
+    local_irq_save(flags);
+    c = this_cpu_ptr(&rl_buf_caches);
+    if (c->num_hdrs < RL_BUF_CACHE_LEN) {
+        list_add(&rb->node, &c->hdrs);
+        c->num_hdrs++;
+        rb = NULL;
+    }
+    local_irq_restore(flags);
+
+    if (rb) {
+        kmem_cache_free(rl_buf_hdr_cache, rb);
+    }
+}
+
+static inline unsigned int
+rl_rawbuf_class(size_t size)
+{
+    unsigned int cls;
+
+    for (cls = 0; cls < RL_BUF_CLASSES; cls++) {
+        if (size <= rl_rawbuf_class_size[cls]) {
+            break;
+        }
+    }
+
+    return cls;
+}
+
+static struct rl_rawbuf *
+rl_rawbuf_get(size_t size, gfp_t gfp)
+{
+    unsigned int cls = rl_rawbuf_class(size);
+    struct rl_rawbuf_link *link = NULL;
+    struct rl_rawbuf *raw;
+    struct rl_buf_cache *c;
+    unsigned long flags;
+
+    if (cls == RL_BUF_CLASS_KMALLOC) {
+        /* Too big for the caches. */
+        raw = rl_alloc(size, gfp, RL_MT_BUFDATA);
+        if (raw) {
+            raw->cls = cls;
+        }
+        return raw;
+    }
+
+    local_irq_save(flags);
+    c    = this_cpu_ptr(&rl_buf_caches);
+    link = c->raws[cls];
+    if (link) {
+        c->raws[cls] = link->next;
+        c->num_raws[cls]--;
+        c->raw_hit[cls]++;
+    } else {
+        c->raw_miss[cls]++;
+    }
+    local_irq_restore(flags);
+
+    if (link) {
+        raw = (struct rl_rawbuf *)link;
+    } else {
+        raw = kmem_cache_alloc(rl_rawbuf_cache[cls], gfp);
+        if (unlikely(!raw)) {
+            return NULL;
+        }
+    }
+    raw->cls = cls;
+    rl_memtrack_get(RL_MT_BUFDATA);
+
+    return raw;
+}
+
+static void
+rl_rawbuf_put(struct rl_rawbuf *raw)
+{
+    unsigned int cls = raw->cls;
+    struct rl_buf_cache *c;
+    unsigned long flags;
+
+    if (cls == RL_BUF_CLASS_KMALLOC) {
+        rl_free(raw, RL_MT_BUFDATA);
+        return;
+    }
+
+    if (cls == RL_BUF_CLASS_SKB) {
+        rl_memtrack_put(RL_MT_BUFDATA);
+        dev_kfree_skb_any(raw->skb);
+        kmem_cache_free(rl_rawbuf_skb_cache, raw);
+        return;
+    }
+
+    rl_memtrack_put(RL_MT_BUFDATA);
+    local_irq_save(flags);
+    c = this_cpu_ptr(&rl_buf_caches);
+    if (c->num_raws[cls] < rl_rawbuf_cache_len(cls)) {
+        struct rl_rawbuf_link *link = (struct rl_rawbuf_link *)raw;
+
+        link->next   = c->raws[cls];
+        c->raws[cls] = link;
+        c->num_raws[cls]++;
+        raw = NULL;
+    }
+    local_irq_restore(flags);
+
+    if (raw) {
+        kmem_cache_free(rl_rawbuf_cache[cls], raw);
+    }
+}
+#endif /* !RL_SKB */
+
 /*
  * Allocate a buffer to hold PDU header and data.
  * The returned buffer has zero length (i.e. it's empty).
@@ -36,25 +246,25 @@ rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
     struct rl_buf *rb;
 #ifndef RL_SKB
     size_t real_size = hdroom + size + tailroom;
-    uint8_t *kbuf;
 
-    rb = rl_alloc(sizeof(*rb), gfp, RL_MT_BUFHDR);
+    rb = rl_buf_hdr_get(gfp);
     if (unlikely(!rb)) {
         RPV(1, "Out of memory\n");
         return NULL;
     }
 
-    kbuf = rl_alloc(sizeof(*rb->raw) + real_size, gfp, RL_MT_BUFDATA);
-    if (unlikely(!kbuf)) {
-        rl_free(rb, RL_MT_BUFHDR);
+    rb->raw = rl_rawbuf_get(sizeof(*rb->raw) + real_size, gfp);
+    if (unlikely(!rb->raw)) {
+        rl_buf_hdr_put(rb);
         RPV(1, "Out of memory\n");
         return NULL;
     }
 
-    rb->raw       = (struct rl_rawbuf *)kbuf;
     rb->raw->size = real_size;
     atomic_set(&rb->raw->refcnt, 1);
-    rb->pci = (struct rina_pci *)(rb->raw->buf + hdroom);
+    rb->raw->buf = (uint8_t *)(rb->raw + 1);
+    rb->raw->skb = NULL;
+    rb->pci      = (struct rina_pci *)(rb->raw->buf + hdroom);
     rb->len = 0;
     rb_list_init(&rb->node);
 
@@ -75,13 +285,135 @@ rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom, gfp_t gfp)
 }
 EXPORT_SYMBOL(rl_buf_alloc);
 
+#ifndef RL_SKB
+/*
+ * Wrap a received sk_buff into an rl_buf, without copying the data.
+ * On success the rl_buf takes ownership of @skb. On failure NULL is
+ * returned, and the caller still owns @skb.
+ */
+struct rl_buf *
+rl_buf_from_skb(struct sk_buff *skb, size_t hdroom)
+{
+    struct rl_rawbuf *raw;
+    struct rl_buf *rb;
+
+    /* The data must be linear and private, since PDU headers are
+     * modified in place (e.g. TTL and ECN). */
+    if (skb_is_nonlinear(skb) || skb_cloned(skb) || skb_shared(skb) ||
+        skb_headroom(skb) < hdroom) {
+        return NULL;
+    }
+
+    rb = rl_buf_hdr_get(GFP_ATOMIC);
+    if (unlikely(!rb)) {
+        return NULL;
+    }
+
+    raw = kmem_cache_alloc(rl_rawbuf_skb_cache, GFP_ATOMIC);
+    if (unlikely(!raw)) {
+        rl_buf_hdr_put(rb);
+        return NULL;
+    }
+    rl_memtrack_get(RL_MT_BUFDATA);
+
+    raw->size = skb_end_pointer(skb) - skb->head;
+    atomic_set(&raw->refcnt, 1);
+    raw->cls = RL_BUF_CLASS_SKB;
+    raw->buf = skb->head;
+    raw->skb = skb;
+
+    rb->raw = raw;
+    rb->pci = (struct rina_pci *)skb->data;
+    rb->len = skb->len;
+    rb_list_init(&rb->node);
+    RL_BUF_RMT(rb).lower_flow = NULL;
+
+    return rb;
+}
+EXPORT_SYMBOL(rl_buf_from_skb);
+
+/*
+ * Turn @rb into an sk_buff carrying the same data, without copying it.
+ * The sk_buff has at least @hdroom bytes of headroom and @tailroom bytes
+ * of tailroom. On success @rb is consumed. On failure NULL is returned,
+ * and the caller still owns @rb.
+ */
+struct sk_buff *
+rl_buf_to_skb(struct rl_buf *rb, size_t hdroom, size_t tailroom)
+{
+    struct rl_rawbuf *raw = rb->raw;
+    uint8_t *data         = RL_BUF_DATA(rb);
+    struct sk_buff *skb;
+
+    if (atomic_read(&raw->refcnt) != 1) {
+        /* The data is shared with a clone (e.g. in a retransmission
+         * queue), which may outlive the sk_buff. */
+        return NULL;
+    }
+
+    if ((size_t)(data - raw->buf) < hdroom ||
+        data + rb->len + tailroom > raw->buf + raw->size) {
+        return NULL;
+    }
+
+    switch (raw->cls) {
+    case RL_BUF_CLASS_SKB:
+        /* Give the borrowed sk_buff back, pointing it to the current
+         * PDU boundaries. */
+        skb       = raw->skb;
+        skb->data = data;
+        skb->len  = rb->len;
+        skb_set_tail_pointer(skb, rb->len);
+        skb_scrub_packet(skb, true);
+        skb->ip_summed = CHECKSUM_NONE;
+        skb_set_queue_mapping(skb, 0);
+        kmem_cache_free(rl_rawbuf_skb_cache, raw);
+        break;
+
+    case RL_BUF_CLASS_KMALLOC:
+    default:
+        /* Build the sk_buff around the whole slab object, including the
+         * struct rl_rawbuf, which becomes part of the headroom. The
+         * allocation tailroom hosts the struct skb_shared_info, and the
+         * network stack will release the object with kfree(). */
+#ifdef CONFIG_SLOB
+        if (raw->cls != RL_BUF_CLASS_KMALLOC) {
+            /* SLOB cannot kfree() objects of a dedicated cache. */
+            return NULL;
+        }
+#endif /* CONFIG_SLOB */
+        if (data + rb->len + tailroom + RL_BUF_SKB_TAILROOM >
+            raw->buf + raw->size) {
+            return NULL;
+        }
+#ifdef RL_HAVE_SLAB_BUILD_SKB
+        skb = slab_build_skb(raw);
+#else  /* !RL_HAVE_SLAB_BUILD_SKB */
+        skb = build_skb(raw, 0);
+#endif /* !RL_HAVE_SLAB_BUILD_SKB */
+        if (unlikely(!skb)) {
+            return NULL;
+        }
+        skb_reserve(skb, data - (uint8_t *)raw);
+        skb_put(skb, rb->len);
+        break;
+    }
+
+    rl_memtrack_put(RL_MT_BUFDATA);
+    rl_buf_hdr_put(rb);
+
+    return skb;
+}
+EXPORT_SYMBOL(rl_buf_to_skb);
+#endif /* !RL_SKB */
+
 struct rl_buf *
 rl_buf_clone(struct rl_buf *rb, gfp_t gfp)
 {
     struct rl_buf *crb;
 
 #ifndef RL_SKB
-    crb = rl_alloc(sizeof(*crb), gfp, RL_MT_BUFHDR);
+    crb = rl_buf_hdr_get(gfp);
     if (unlikely(!crb)) {
         return NULL;
     }
@@ -115,12 +447,250 @@ __rl_buf_free(struct rl_buf *rb)
 {
 #ifndef RL_SKB
     if (atomic_dec_and_test(&rb->raw->refcnt)) {
-        rl_free(rb->raw, RL_MT_BUFDATA);
+        rl_rawbuf_put(rb->raw);
     }
 
-    rl_free(rb, RL_MT_BUFHDR);
+    rl_buf_hdr_put(rb);
 #else  /* RL_SKB */
     kfree_skb(rb);
 #endif /* RL_SKB */
 }
 EXPORT_SYMBOL(__rl_buf_free);
+
+#ifndef RL_SKB
+/* Release the objects held in a per-CPU list. Called with interrupts
+ * disabled, or when no CPU can use the list anymore. */
+static unsigned long
+rl_buf_cache_drain(struct rl_buf_cache *c)
+{
+    unsigned long freed = 0;
+    struct rl_buf *rb, *tmp;
+    int i;
+
+    list_for_each_entry_safe (rb, tmp, &c->hdrs, node) {
+        list_del(&rb->node);
+        kmem_cache_free(rl_buf_hdr_cache, rb);
+        freed++;
+    }
+    c->num_hdrs = 0;
+
+    for (i = 0; i < RL_BUF_CLASSES; i++) {
+        while (c->raws[i]) {
+            struct rl_rawbuf_link *link = c->raws[i];
+
+            c->raws[i] = link->next;
+            kmem_cache_free(rl_rawbuf_cache[i], link);
+            freed++;
+        }
+        c->num_raws[i] = 0;
+    }
+
+    return freed;
+}
+
+/* Runs on each CPU, in IPI context. */
+static void
+rl_buf_cache_drain_local(void *arg)
+{
+    atomic_long_add(rl_buf_cache_drain(this_cpu_ptr(&rl_buf_caches)),
+                    (atomic_long_t *)arg);
+}
+
+static unsigned long
+rl_bufs_shrink_count(struct shrinker *s, struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    int cpu;
+    int i;
+
+    for_each_online_cpu (cpu) {
+        struct rl_buf_cache *c = per_cpu_ptr(&rl_buf_caches, cpu);
+
+        count += READ_ONCE(c->num_hdrs);
+        for (i = 0; i < RL_BUF_CLASSES; i++) {
+            count += READ_ONCE(c->num_raws[i]);
+        }
+    }
+
+    return count;
+}
+
+/* The per-CPU lists are small, so they are drained completely, no
+ * matter how many objects the shrinker asks for. */
+static unsigned long
+rl_bufs_shrink_scan(struct shrinker *s, struct shrink_control *sc)
+{
+    atomic_long_t freed = ATOMIC_LONG_INIT(0);
+
+    on_each_cpu(rl_buf_cache_drain_local, &freed, 1);
+
+    return atomic_long_read(&freed) ? atomic_long_read(&freed) : SHRINK_STOP;
+}
+
+#ifdef RL_HAVE_SHRINKER_ALLOC
+static struct shrinker *rl_bufs_shrinker;
+#else  /* !RL_HAVE_SHRINKER_ALLOC */
+static struct shrinker rl_bufs_shrinker_s = {
+    .count_objects = rl_bufs_shrink_count,
+    .scan_objects  = rl_bufs_shrink_scan,
+    .seeks         = DEFAULT_SEEKS,
+};
+static struct shrinker *rl_bufs_shrinker;
+#endif /* !RL_HAVE_SHRINKER_ALLOC */
+
+static int
+rl_bufs_shrinker_register(void)
+{
+#ifdef RL_HAVE_SHRINKER_ALLOC
+    struct shrinker *s = shrinker_alloc(0, "rlite-bufs");
+
+    if (!s) {
+        return -ENOMEM;
+    }
+    s->count_objects = rl_bufs_shrink_count;
+    s->scan_objects  = rl_bufs_shrink_scan;
+    shrinker_register(s);
+#else  /* !RL_HAVE_SHRINKER_ALLOC */
+    struct shrinker *s = &rl_bufs_shrinker_s;
+    int ret;
+
+#ifdef RL_HAVE_REGISTER_SHRINKER_NAME
+    ret = register_shrinker(s, "rlite-bufs");
+#else  /* !RL_HAVE_REGISTER_SHRINKER_NAME */
+    ret = register_shrinker(s);
+#endif /* !RL_HAVE_REGISTER_SHRINKER_NAME */
+    if (ret) {
+        return ret;
+    }
+#endif /* !RL_HAVE_SHRINKER_ALLOC */
+    rl_bufs_shrinker = s;
+
+    return 0;
+}
+
+static void
+rl_bufs_shrinker_unregister(void)
+{
+    if (!rl_bufs_shrinker) {
+        return;
+    }
+#ifdef RL_HAVE_SHRINKER_ALLOC
+    shrinker_free(rl_bufs_shrinker);
+#else  /* !RL_HAVE_SHRINKER_ALLOC */
+    unregister_shrinker(rl_bufs_shrinker);
+#endif /* !RL_HAVE_SHRINKER_ALLOC */
+    rl_bufs_shrinker = NULL;
+}
+#endif /* !RL_SKB */
+
+int
+rl_bufs_init(void)
+{
+#ifndef RL_SKB
+    int cpu;
+    int ret;
+    int i;
+
+    for_each_possible_cpu (cpu) {
+        struct rl_buf_cache *c = per_cpu_ptr(&rl_buf_caches, cpu);
+
+        memset(c, 0, sizeof(*c));
+        INIT_LIST_HEAD(&c->hdrs);
+    }
+
+    rl_buf_hdr_cache = kmem_cache_create("rl_buf", sizeof(struct rl_buf), 0,
+                                         SLAB_HWCACHE_ALIGN, NULL);
+    if (!rl_buf_hdr_cache) {
+        return -ENOMEM;
+    }
+
+    rl_rawbuf_skb_cache =
+        kmem_cache_create("rl_rawbuf_skb", sizeof(struct rl_rawbuf), 0,
+                          SLAB_HWCACHE_ALIGN, NULL);
+    if (!rl_rawbuf_skb_cache) {
+        rl_bufs_fini();
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < RL_BUF_CLASSES; i++) {
+        rl_rawbuf_cache[i] =
+            kmem_cache_create(rl_rawbuf_class_name[i], rl_rawbuf_class_size[i],
+                              0, SLAB_HWCACHE_ALIGN, NULL);
+        if (!rl_rawbuf_cache[i]) {
+            rl_bufs_fini();
+            return -ENOMEM;
+        }
+    }
+
+    ret = rl_bufs_shrinker_register();
+    if (ret) {
+        rl_bufs_fini();
+        return ret;
+    }
+#endif /* !RL_SKB */
+
+    return 0;
+}
+
+void
+rl_bufs_fini(void)
+{
+#ifndef RL_SKB
+    int cpu;
+    int i;
+
+    rl_bufs_shrinker_unregister();
+
+    /* Release the objects held in the per-CPU lists. */
+    for_each_possible_cpu (cpu) {
+        rl_buf_cache_drain(per_cpu_ptr(&rl_buf_caches, cpu));
+    }
+
+    for (i = 0; i < RL_BUF_CLASSES; i++) {
+        if (rl_rawbuf_cache[i]) {
+            kmem_cache_destroy(rl_rawbuf_cache[i]);
+            rl_rawbuf_cache[i] = NULL;
+        }
+    }
+
+    if (rl_rawbuf_skb_cache) {
+        kmem_cache_destroy(rl_rawbuf_skb_cache);
+        rl_rawbuf_skb_cache = NULL;
+    }
+
+    if (rl_buf_hdr_cache) {
+        kmem_cache_destroy(rl_buf_hdr_cache);
+        rl_buf_hdr_cache = NULL;
+    }
+#endif /* !RL_SKB */
+}
+
+void
+rl_bufs_dump_stats(void)
+{
+#ifndef RL_SKB
+    unsigned long hdr_hit = 0, hdr_miss = 0;
+    unsigned long raw_hit[RL_BUF_CLASSES]  = {0};
+    unsigned long raw_miss[RL_BUF_CLASSES] = {0};
+    int cpu;
+    int i;
+
+    for_each_possible_cpu (cpu) {
+        struct rl_buf_cache *c = per_cpu_ptr(&rl_buf_caches, cpu);
+
+        hdr_hit += c->hdr_hit;
+        hdr_miss += c->hdr_miss;
+        for (i = 0; i < RL_BUF_CLASSES; i++) {
+            raw_hit[i] += c->raw_hit[i];
+            raw_miss[i] += c->raw_miss[i];
+        }
+    }
+
+    PI("Buffer caches stats (hit/miss):\n");
+    PI("    %-16s:%12lu%12lu\n", "rl_buf", hdr_hit, hdr_miss);
+    for (i = 0; i < RL_BUF_CLASSES; i++) {
+        PI("    %-16s:%12lu%12lu\n", rl_rawbuf_class_name[i], raw_hit[i],
+           raw_miss[i]);
+    }
+#endif /* !RL_SKB */
+}
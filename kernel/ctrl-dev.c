@@ -37,6 +37,7 @@
 #include <linux/sched.h>
 #include <linux/bitmap.h>
 #include <linux/hashtable.h>
+#include <linux/idr.h>
 #include <linux/spinlock.h>
 #include <linux/nsproxy.h>
 #include <linux/compat.h>
@@ -109,11 +110,10 @@ struct registered_appl {
 };
 
 #define IPCP_ID_BITMAP_SIZE 256
-#define PORT_ID_BITMAP_SIZE 65536
-#define CEP_ID_BITMAP_SIZE PORT_ID_BITMAP_SIZE
 #define IPCP_HASHTABLE_BITS 6
-#define PORT_ID_HASHTABLE_BITS 10
-#define CEP_ID_HASHTABLE_BITS 10
+/* Port ids and cep ids are allocated in [0, RL_FLOW_ID_LIMIT), since
+ * RL_PORT_ID_NONE (65535) is reserved. */
+#define RL_FLOW_ID_LIMIT 65535
 
 /* Global data structures, shared by all the rl_dm instances. In other works
  * this is common to all the network namespaces. */
@@ -138,16 +138,20 @@ struct rl_dm {
     /* Hash table to store information about each IPC process. */
     DECLARE_HASHTABLE(ipcp_table, IPCP_HASHTABLE_BITS);
 
-    /* Bitmap to manage port ids. */
-    DECLARE_BITMAP(port_id_bitmap, PORT_ID_BITMAP_SIZE);
-
-    /* Hash tables to store information about each flow. */
-    DECLARE_HASHTABLE(flow_table, PORT_ID_HASHTABLE_BITS);
-    DECLARE_HASHTABLE(flow_table_by_cep, CEP_ID_HASHTABLE_BITS);
+    /* Allocators for port ids and connection endpoint ids, which also
+     * map each id to its flow. Ids are allocated cyclically, in O(1)
+     * amortized time, and the tables grow with the number of flows.
+     * Lookups run under RCU, while updates are serialized by the
+     * flows_lock. */
+    struct idr port_idr;
+    struct idr cep_idr;
     uint32_t uid_cnt;
 
-    /* Bitmap to manage connection endpoint ids. */
-    DECLARE_BITMAP(cep_id_bitmap, CEP_ID_BITMAP_SIZE);
+    /* Flow table load statistics, protected by the flows_lock. */
+    unsigned int flows_cnt;
+    unsigned int ceps_cnt;
+    unsigned int flows_peak;
+    unsigned int flows_alloc_fail;
 
     struct list_head difs;
 
@@ -940,36 +944,36 @@ application_del_by_rc(struct rl_ctrl *rc)
     }
 }
 
-/* To be called under FLOCK or FRLOCK. */
+/* To be called under FLOCK, FRLOCK or rcu_read_lock(). */
 struct flow_entry *
 flow_lookup(struct rl_dm *dm, rl_port_t port_id)
 {
-    struct flow_entry *entry;
-    struct hlist_head *head;
-    head = &dm->flow_table[hash_min(port_id, HASH_BITS(dm->flow_table))];
-    hlist_for_each_entry (entry, head, node) {
-        if (entry->local_port == port_id) {
-            return entry;
-        }
+    return idr_find(&dm->port_idr, port_id);
+}
+EXPORT_SYMBOL(flow_lookup);
+
+/* Grab a reference to a flow found with a lockless lookup. A flow whose
+ * reference counter already dropped to zero is being destroyed by
+ * __flow_put(), and so it cannot be returned. */
+static inline struct flow_entry *
+flow_lookup_getref(struct flow_entry *flow)
+{
+    if (!flow || !atomic_inc_not_zero(&flow->refcnt)) {
+        return NULL;
     }
+    PV("FLOWREFCNT %u ++: %u\n", flow->local_port, atomic_read(&flow->refcnt));
 
-    return NULL;
+    return flow;
 }
-EXPORT_SYMBOL(flow_lookup);
 
 struct flow_entry *
 flow_get(struct rl_dm *dm, rl_port_t port_id)
 {
     struct flow_entry *flow;
 
-    FRLOCK(dm);
-    flow = flow_lookup(dm, port_id);
-    if (flow) {
-        atomic_inc(&flow->refcnt);
-        PV("FLOWREFCNT %u ++: %u\n", flow->local_port,
-           atomic_read(&flow->refcnt));
-    }
-    FRUNLOCK(dm);
+    rcu_read_lock();
+    flow = flow_lookup_getref(flow_lookup(dm, port_id));
+    rcu_read_unlock();
 
     return flow;
 }
@@ -990,26 +994,17 @@ flow_nodm_get(rl_port_t port_id)
 struct flow_entry *
 flow_get_by_cep(struct rl_dm *dm, rlm_cepid_t cep_id)
 {
-    struct flow_entry *entry;
-    struct hlist_head *head;
-
-    FRLOCK(dm);
+    struct flow_entry *flow;
 
-    head = &dm->flow_table_by_cep[hash_min(cep_id,
-                                           HASH_BITS(dm->flow_table_by_cep))];
-    hlist_for_each_entry (entry, head, node_cep) {
-        if (entry->local_cep == cep_id) {
-            atomic_inc(&entry->refcnt);
-            PV("FLOWREFCNT %u ++: %u\n", entry->local_port,
-               atomic_read(&entry->refcnt));
-            FRUNLOCK(dm);
-            return entry;
-        }
+    if (unlikely(cep_id >= RL_FLOW_ID_LIMIT)) {
+        return NULL;
     }
 
-    FRUNLOCK(dm);
+    rcu_read_lock();
+    flow = flow_lookup_getref(idr_find(&dm->cep_idr, cep_id));
+    rcu_read_unlock();
 
-    return NULL;
+    return flow;
 }
 EXPORT_SYMBOL(flow_get_by_cep);
 
@@ -1130,10 +1125,9 @@ __flow_put(struct flow_entry *entry, bool lock)
 
     /* Although the flow reference counter does not generally need to be
      * accessed under FLOCK(), here it is necessary to avoid a race
-     * condition. If we decremented the reference counter before taking
-     * the FLOCK, a CPU could call flow_get (or similar) after the
-     * reference counter drops to 0 and before the FLOCK is taken,
-     * which would basically result into a double free. */
+     * condition with the postponed removal below, which brings the
+     * reference counter back to 1. Lockless lookups (flow_get() and
+     * similar) never resurrect a flow whose counter dropped to 0. */
     if (!atomic_dec_and_test(&entry->refcnt)) {
         /* Flow is still being used by someone. */
         FUNLOCK(dm);
@@ -1176,12 +1170,13 @@ __flow_put(struct flow_entry *entry, bool lock)
         return;
     }
 
-    /* Detach from tables. */
-    hash_del(&entry->node);
-    bitmap_clear(dm->port_id_bitmap, entry->local_port, 1);
+    /* Detach from tables. Lockless readers may still be using the
+     * entry, which is freed after a grace period. */
+    idr_remove(&dm->port_idr, entry->local_port);
+    dm->flows_cnt--;
     if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        hash_del(&entry->node_cep);
-        bitmap_clear(dm->cep_id_bitmap, entry->local_cep, 1);
+        idr_remove(&dm->cep_idr, entry->local_cep);
+        dm->ceps_cnt--;
     }
 
     /* Enqueue into the remove list and schedule the work. */
@@ -1328,6 +1323,14 @@ flows_removew_func(struct work_struct *w)
     }
     FUNLOCK(dm);
 
+    if (list_empty(&removeq)) {
+        return;
+    }
+
+    /* Wait for the lockless lookups that may have found the entries
+     * before they were detached from the tables. */
+    synchronize_rcu();
+
     /* Destroy the entries without holding the lock (but still grab
      * the lock to modify flow->node_rm). */
     list_for_each_entry_safe (flow, tmp, &removeq, node_rm) {
@@ -1345,8 +1348,11 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
          const struct rina_flow_spec *flowspec, struct flow_entry **pentry,
          gfp_t gfp)
 {
+    bool use_cep = ipcp->flags & RL_K_IPCP_USE_CEP_IDS;
     struct rl_dm *dm = ipcp->dm;
     struct flow_entry *entry;
+    int cep_id = 0;
+    int port_id;
     int ret = 0;
 
     if (ipcp->flags & RL_K_IPCP_ZOMBIE) {
@@ -1361,26 +1367,25 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
 
     FLOCK(dm);
 
-    /* Try to alloc a port id and a cep id from the bitmaps, cep
-     * ids being allocated only if needed. */
-    entry->local_port = bitmap_find_next_zero_area(
-        dm->port_id_bitmap, PORT_ID_BITMAP_SIZE, 0, 1, 0);
-    if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-        entry->local_cep = bitmap_find_next_zero_area(
-            dm->cep_id_bitmap, CEP_ID_BITMAP_SIZE, 0, 1, 0);
-    } else {
-        entry->local_cep = 0;
+    /* Try to alloc a port id and a cep id, cep ids being allocated only
+     * if needed. The ids are reserved with a NULL entry, which is
+     * replaced below when the entry is ready for lockless readers. */
+    port_id =
+        idr_alloc_cyclic(&dm->port_idr, NULL, 0, RL_FLOW_ID_LIMIT, GFP_ATOMIC);
+    if (port_id >= 0 && use_cep) {
+        cep_id = idr_alloc_cyclic(&dm->cep_idr, NULL, 0, RL_FLOW_ID_LIMIT,
+                                  GFP_ATOMIC);
+        if (cep_id < 0) {
+            idr_remove(&dm->port_idr, port_id);
+            port_id = cep_id;
+        }
     }
 
-    if (entry->local_port < PORT_ID_BITMAP_SIZE &&
-        entry->local_cep < CEP_ID_BITMAP_SIZE) {
-        bitmap_set(dm->port_id_bitmap, entry->local_port, 1);
-
-        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            bitmap_set(dm->cep_id_bitmap, entry->local_cep, 1);
-        }
+    if (port_id >= 0) {
+        entry->local_port = port_id;
+        entry->local_cep  = cep_id;
 
-        /* Build and insert a flow entry in the hash table. */
+        /* Build and insert a flow entry in the tables. */
         entry->local_appl  = rl_strdup(local_appl, GFP_ATOMIC, RL_MT_FLOW);
         entry->remote_appl = rl_strdup(remote_appl, GFP_ATOMIC, RL_MT_FLOW);
         entry->remote_port = RL_PORT_ID_NONE; /* Not valid. */
@@ -1396,14 +1401,17 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
         entry->flags = RL_FLOW_PENDING | RL_FLOW_NEVER_BOUND;
         memcpy(&entry->spec, flowspec, sizeof(*flowspec));
         txrx_init(&entry->txrx, ipcp);
-        hash_add(dm->flow_table, &entry->node, entry->local_port);
-        if (ipcp->flags & RL_K_IPCP_USE_CEP_IDS) {
-            hash_add(dm->flow_table_by_cep, &entry->node_cep, entry->local_cep);
-        }
         entry->uid = dm->uid_cnt++; /* generate an unique id */
         INIT_LIST_HEAD(&entry->node_rm);
         entry->expires = ~0U;
         dtp_init(&entry->dtp);
+        if (use_cep) {
+            dm->ceps_cnt++;
+        }
+        dm->flows_cnt++;
+        if (dm->flows_cnt > dm->flows_peak) {
+            dm->flows_peak = dm->flows_cnt;
+        }
 
         atomic_inc(&entry->refcnt); /* on behalf of the caller */
         PV("FLOWREFCNT %u = %u\n", entry->local_port,
@@ -1423,15 +1431,36 @@ flow_add(struct ipcp_entry *ipcp, struct upper_ref upper, uint32_t event_id,
             if (ipcp->ops.flow_init) {
                 /* Let the IPCP do some
                  * specific initialization. */
-                ipcp->ops.flow_init(ipcp, entry);
+                ret = ipcp->ops.flow_init(ipcp, entry);
+            }
+            if (ret) {
+                PE("Failed to initialize flow %u [%d]\n", entry->local_port,
+                   ret);
+                flow_put(entry);       /* match the reference above */
+                flows_putq_del(entry); /* match flows_putq_add() */
+                flow_put(entry);       /* delete */
+                *pentry = NULL;
+
+                return ret;
             }
         }
+
+        /* Publish the entry to the lockless lookups (e.g. the RX path)
+         * only now that it is fully initialized. Until then the ids
+         * stay reserved, and flow_del() releases them on failure. */
+        FLOCK(dm);
+        idr_replace(&dm->port_idr, entry, port_id);
+        if (use_cep) {
+            idr_replace(&dm->cep_idr, entry, cep_id);
+        }
+        FUNLOCK(dm);
     } else {
+        dm->flows_alloc_fail++;
         FUNLOCK(dm);
 
         rl_free(entry, RL_MT_FLOW);
         *pentry = NULL;
-        ret     = -ENOSPC;
+        ret     = port_id == -ENOMEM ? -ENOMEM : -ENOSPC;
     }
 
     return ret;
@@ -1441,12 +1470,10 @@ static void
 flow_rc_probe_references(struct rl_ctrl *rc)
 {
     struct flow_entry *flow;
-    struct hlist_node *tmp;
-    int bucket;
+    int id;
 
     FLOCK(rc->dm);
-    hash_for_each_safe(rc->dm->flow_table, bucket, tmp, flow, node)
-    {
+    idr_for_each_entry (&rc->dm->port_idr, flow, id) {
         if (flow->upper.rc == rc) {
             PE("Flow %u has a dangling reference to rc %p\n", flow->local_port,
                rc);
@@ -1491,12 +1518,11 @@ bool
 rl_ipcp_has_flows(struct ipcp_entry *ipcp, bool report_all)
 {
     struct flow_entry *flow;
-    int bucket;
+    int id;
     bool has_flows = false;
 
     FRLOCK(ipcp->dm);
-    hash_for_each(ipcp->dm->flow_table, bucket, flow, node)
-    {
+    idr_for_each_entry (&ipcp->dm->port_idr, flow, id) {
         if (flow->txrx.ipcp == ipcp) {
             has_flows = true;
             if (report_all) {
@@ -1866,7 +1892,7 @@ rl_flow_fetch(struct rl_ctrl *rc, struct rl_msg_base *b_req)
     struct rl_kmsg_flow_fetch *req = (struct rl_kmsg_flow_fetch *)b_req;
     struct flows_fetch_q_entry *fqe;
     struct flow_entry *entry;
-    int bucket;
+    int id;
     int ret = -ENOMEM;
 
     if (req->ipcp_id != 0xffff) {
@@ -1882,8 +1908,7 @@ rl_flow_fetch(struct rl_ctrl *rc, struct rl_msg_base *b_req)
     FLOCK(rc->dm);
 
     if (list_empty(&rc->flows_fetch_q)) {
-        hash_for_each(rc->dm->flow_table, bucket, entry, node)
-        {
+        idr_for_each_entry (&rc->dm->port_idr, entry, id) {
             if (req->ipcp_id != 0xffff &&
                 entry->txrx.ipcp->id != req->ipcp_id) {
                 /* Filter out this flow as user asked only for flows
@@ -2102,6 +2127,8 @@ rl_ipcp_config(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
             ret = rl_configstr_to_u16(req->value, &entry->txhdroom, NULL);
         } else if (strcmp(req->name, "rxhdroom") == 0) {
             ret = rl_configstr_to_u16(req->value, &entry->rxhdroom, NULL);
+        } else if (strcmp(req->name, "tailroom") == 0) {
+            ret = rl_configstr_to_u16(req->value, &entry->tailroom, NULL);
         } else if (strcmp(req->name, "mss") == 0) {
             ret =
                 rl_configstr_to_u32(req->value, &entry->max_sdu_size, &notify);
@@ -2135,7 +2162,7 @@ rl_ipcp_config_get(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     struct rl_kmsg_ipcp_config_get_req *req =
         (struct rl_kmsg_ipcp_config_get_req *)bmsg;
     struct ipcp_entry *entry;
-    char valbuf[64];
+    char valbuf[512];
     int ret;
 
     if (!req->param_name) {
@@ -2166,10 +2193,21 @@ rl_ipcp_config_get(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
             snprintf(valbuf, sizeof(valbuf), "%u", entry->txhdroom);
         } else if (strcmp(req->param_name, "rxhdroom") == 0) {
             snprintf(valbuf, sizeof(valbuf), "%u", entry->rxhdroom);
+        } else if (strcmp(req->param_name, "tailroom") == 0) {
+            snprintf(valbuf, sizeof(valbuf), "%u", entry->tailroom);
         } else if (strcmp(req->param_name, "mss") == 0) {
             snprintf(valbuf, sizeof(valbuf), "%u", entry->max_sdu_size);
         } else if (strcmp(req->param_name, "flow-del-wait-ms") == 0) {
             snprintf(valbuf, sizeof(valbuf), "%u", entry->flow_del_wait_ms);
+        } else if (strcmp(req->param_name, "flow-table-stats") == 0) {
+            struct rl_dm *dm = entry->dm;
+
+            FRLOCK(dm);
+            snprintf(valbuf, sizeof(valbuf),
+                     "flows=%u ceps=%u limit=%u peak=%u alloc_fail=%u",
+                     dm->flows_cnt, dm->ceps_cnt, RL_FLOW_ID_LIMIT,
+                     dm->flows_peak, dm->flows_alloc_fail);
+            FRUNLOCK(dm);
         } else {
             ret = -EINVAL; /* unknown request */
         }
@@ -2538,9 +2576,10 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     resp.dtp.max_cwq_len            = dtp->max_cwq_len;
     resp.dtp.rtxq_len               = dtp->rtxq_len;
     resp.dtp.max_rtxq_len           = dtp->max_rtxq_len;
-    resp.dtp.rtt                    = jiffies_to_msecs(dtp->rtt) * 1000;
-    resp.dtp.rtt_stddev             = jiffies_to_msecs(dtp->rtt_stddev) * 1000;
+    resp.dtp.rtt                    = dtp->srtt_us >> 3;
+    resp.dtp.rtt_stddev             = dtp->rttvar_us >> 2;
     resp.dtp.cgwin                  = dtp->cgwin;
+    resp.dtp.ack_every              = dtp->ack_every;
     resp.dtp.rcv_lwe                = dtp->rcv_lwe;
     resp.dtp.rcv_next_seq_num       = dtp->rcv_next_seq_num;
     resp.dtp.rcv_rwe                = dtp->rcv_rwe;
@@ -2549,6 +2588,9 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     resp.dtp.last_seq_num_acked     = dtp->last_seq_num_acked;
     resp.dtp.next_snd_ctl_seq       = dtp->next_snd_ctl_seq;
     resp.dtp.seqq_len               = dtp->seqq_len;
+    resp.dtp.seqq_depth_max         = dtp->seqq_depth_max;
+    resp.dtp.rx_dt_pdus             = dtp->rx_dt_pdus;
+    resp.dtp.tx_ctrl_pdus           = dtp->tx_ctrl_pdus;
 
     spin_unlock_bh(&dtp->lock);
     spin_unlock_bh(&flow->txrx.rx_lock);
@@ -2561,6 +2603,45 @@ rl_flow_get_stats(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
     return ret;
 }
 
+static int
+rl_flow_get_lat(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_flow_lat_req *req = (struct rl_kmsg_flow_lat_req *)bmsg;
+    struct rl_kmsg_flow_lat_resp *resp;
+    struct flow_entry *flow;
+    int ret;
+
+    flow = flow_get(rc->dm, req->port_id);
+    if (!flow) {
+        return -EINVAL;
+    }
+
+    /* The histograms are too large for the stack. */
+    resp = rl_alloc(sizeof(*resp), GFP_KERNEL | __GFP_ZERO, RL_MT_MSG);
+    if (!resp) {
+        flow_put(flow);
+        return -ENOMEM;
+    }
+    resp->hdr.msg_type = RLITE_KER_FLOW_LAT_RESP;
+    resp->hdr.event_id = req->hdr.event_id;
+
+    /* The rmtq histogram is updated under the lock of a PDU scheduler,
+     * so it is copied without synchronization. */
+    spin_lock_bh(&flow->txrx.rx_lock);
+    spin_lock_bh(&flow->dtp.lock);
+    memcpy(&resp->lat, &flow->lat, sizeof(resp->lat));
+    spin_unlock_bh(&flow->dtp.lock);
+    spin_unlock_bh(&flow->txrx.rx_lock);
+
+    flow_put(flow);
+
+    ret = rl_upqueue_append(rc, (const struct rl_msg_base *)resp, false);
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
+    rl_free(resp, RL_MT_MSG);
+
+    return ret;
+}
+
 static int
 rl_flow_cfg_update(struct rl_ctrl *rc, struct rl_msg_base *bmsg)
 {
@@ -3081,6 +3162,7 @@ rl_fa_resp_arrived(struct ipcp_entry *ipcp, rl_port_t local_port,
 {
     struct flow_entry *flow_entry = NULL;
     int ret                       = -EINVAL;
+    int init_ret                  = 0;
     struct rl_ctrl *rc;
 
     flow_entry = flow_get(ipcp->dm, local_port);
@@ -3095,10 +3177,6 @@ rl_fa_resp_arrived(struct ipcp_entry *ipcp, rl_port_t local_port,
     }
     rc = flow_entry->upper.rc;
     flow_entry->flags &= ~RL_FLOW_PENDING;
-    if (response == 0) {
-        flow_entry->flags |= RL_FLOW_ALLOCATED;
-        flow_entry->upper.rc = NULL;
-    }
     flow_entry->remote_port = remote_port;
     flow_entry->remote_cep  = remote_cep;
     flow_entry->qos_id      = qos_id;
@@ -3110,10 +3188,22 @@ rl_fa_resp_arrived(struct ipcp_entry *ipcp, rl_port_t local_port,
         if (ipcp->ops.flow_init) {
             /* Let the IPCP do some
              * specific initialization. */
-            ipcp->ops.flow_init(ipcp, flow_entry);
+            init_ret = ipcp->ops.flow_init(ipcp, flow_entry);
+        }
+        if (init_ret && response == 0) {
+            /* Turn this into a negative response. */
+            PE("Failed to initialize flow %u [%d]\n", local_port, init_ret);
+            response = 1;
         }
     }
 
+    if (response == 0) {
+        spin_lock_bh(&flow_entry->txrx.rx_lock);
+        flow_entry->flags |= RL_FLOW_ALLOCATED;
+        flow_entry->upper.rc = NULL;
+        spin_unlock_bh(&flow_entry->txrx.rx_lock);
+    }
+
     PD("Flow allocation response arrived to IPC process %s, "
        "port-id %u, remote addr %llu\n",
        ipcp->name, local_port, (long long unsigned)remote_addr);
@@ -3129,6 +3219,9 @@ rl_fa_resp_arrived(struct ipcp_entry *ipcp, rl_port_t local_port,
         flows_putq_del(flow_entry);
         flow_put(flow_entry);
     }
+    if (!ret) {
+        ret = init_ret;
+    }
 
 out:
     flow_put(flow_entry);
@@ -3181,6 +3274,10 @@ static rl_msg_handler_t rl_ctrl_handlers[] = {
     [RLITE_KER_IPCP_CONFIG_GET_REQ]   = rl_ipcp_config_get,
     [RLITE_KER_IPCP_SCHED_WRR]        = rl_ipcp_sched_config,
     [RLITE_KER_IPCP_SCHED_PFIFO]      = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_DRR]        = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_PRIO_DRR]   = rl_ipcp_sched_config,
+    [RLITE_KER_IPCP_SCHED_FQ_CODEL]   = rl_ipcp_sched_config,
+    [RLITE_KER_FLOW_LAT_REQ]          = rl_flow_get_lat,
 #ifdef RL_MEMTRACK
     [RLITE_KER_MEMTRACK_DUMP] = rl_memtrack_dump,
 #endif /* RL_MEMTRACK */
@@ -3535,8 +3632,8 @@ extern struct miscdevice rl_io_misc;
 static bool
 rl_dm_empty(struct rl_dm *dm)
 {
-    return hash_empty(dm->ipcp_table) && hash_empty(dm->flow_table) &&
-           hash_empty(dm->flow_table_by_cep) && list_empty(&dm->difs) &&
+    return hash_empty(dm->ipcp_table) && dm->flows_cnt == 0 &&
+           dm->ceps_cnt == 0 && list_empty(&dm->difs) &&
            list_empty(&dm->ctrl_devs) && list_empty(&dm->appl_removeq) &&
            !work_pending(&dm->appl_removew) &&
            !timer_pending(&dm->flows_putq_tmr) &&
@@ -3588,10 +3685,13 @@ rl_dm_get(void)
 
     bitmap_zero(dm->ipcp_id_bitmap, IPCP_ID_BITMAP_SIZE);
     hash_init(dm->ipcp_table);
-    bitmap_zero(dm->port_id_bitmap, PORT_ID_BITMAP_SIZE);
-    hash_init(dm->flow_table);
-    bitmap_zero(dm->cep_id_bitmap, CEP_ID_BITMAP_SIZE);
-    hash_init(dm->flow_table_by_cep);
+    idr_init(&dm->port_idr);
+    idr_init(&dm->cep_idr);
+    dm->uid_cnt          = 0;
+    dm->flows_cnt        = 0;
+    dm->ceps_cnt         = 0;
+    dm->flows_peak       = 0;
+    dm->flows_alloc_fail = 0;
     mutex_init(&dm->general_lock);
     rwlock_init(&dm->flows_lock);
     spin_lock_init(&dm->ipcps_lock);
@@ -3654,6 +3754,8 @@ rl_dm_put(struct rl_dm *dm)
     cancel_work_sync(&dm->flows_removew);
     cancel_work_sync(&dm->appl_removew);
     BUG_ON(!rl_dm_empty(dm));
+    idr_destroy(&dm->port_idr);
+    idr_destroy(&dm->cep_idr);
     put_net(dm->net);
     PD("Data model for namespace %p destroyed\n", dm->net);
     dm->net = NULL;
@@ -3669,8 +3771,15 @@ rlite_init(void)
     INIT_LIST_HEAD(&rl_global.ipcp_factories);
     hash_init(rl_global.netns_table);
 
+    ret = rl_bufs_init();
+    if (ret) {
+        PE("Failed to initialize packet buffers caches\n");
+        return ret;
+    }
+
     ret = misc_register(&rl_ctrl_misc);
     if (ret) {
+        rl_bufs_fini();
         PE("Failed to register rlite misc device\n");
         return ret;
     }
@@ -3678,6 +3787,7 @@ rlite_init(void)
     ret = misc_register(&rl_io_misc);
     if (ret) {
         misc_deregister(&rl_ctrl_misc);
+        rl_bufs_fini();
         PE("Failed to register rlite-io misc device\n");
         return ret;
     }
@@ -3700,6 +3810,7 @@ rlite_fini(void)
 {
     misc_deregister(&rl_io_misc);
     misc_deregister(&rl_ctrl_misc);
+    rl_bufs_fini();
 }
 
 module_init(rlite_init);
@@ -38,6 +38,9 @@
 #include <linux/spinlock.h>
 #include <linux/uio.h>
 #include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
 
 static LIST_HEAD(rl_iodevs);
 static DEFINE_MUTEX(rl_iodevs_lock);
@@ -65,6 +68,121 @@ hms_time(void)
 /* Userspace queue threshold in bytes. */
 #define RL_RXQ_SIZE_MAX (1 << 20)
 
+/* Limits for the shared-memory rings. */
+#define RL_IO_RING_SLOT_SIZE_MAX (1 << 16)
+#define RL_IO_RING_MEM_MAX (64 << 20)
+
+/* Kernel-side state of the shared-memory rings of a flow. The ring
+ * geometry and the indices owned by the kernel are kept here, as the
+ * shared memory can be modified by userspace at any time. */
+struct rl_io_ring {
+    void *mem; /* vmalloc_user() memory mapped by userspace */
+    size_t mem_size;
+    struct rl_ring *rx;
+    struct rl_ring *tx;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t bufs_ofs;
+    uint32_t rx_head;
+    uint32_t tx_tail;
+    int tx_err;           /* error to be reported by the next TX sync */
+    struct mutex tx_lock; /* serializes TX ring consumers */
+};
+
+static inline struct rl_ring_slot *
+rl_io_ring_slot(struct rl_io_ring *ring, struct rl_ring *r, uint32_t idx)
+{
+    return (struct rl_ring_slot *)(r + 1) + (idx & (ring->num_slots - 1));
+}
+
+static inline uint8_t *
+rl_io_ring_buf(struct rl_io_ring *ring, struct rl_ring *r, uint32_t idx)
+{
+    return (uint8_t *)r + ring->bufs_ofs +
+           (size_t)(idx & (ring->num_slots - 1)) * ring->slot_size;
+}
+
+/* Return the buffer of the next free slot of the RX ring, or NULL if
+ * the ring is full. Called with rx_lock held. */
+static inline uint8_t *
+rl_io_ring_rx_slot(struct rl_io_ring *ring)
+{
+    struct rl_ring *r = ring->rx;
+
+    if (ring->rx_head - smp_load_acquire(&r->tail) >= ring->num_slots) {
+        return NULL;
+    }
+
+    return rl_io_ring_buf(ring, r, ring->rx_head);
+}
+
+/* Publish to userspace the slot returned by rl_io_ring_rx_slot(), which
+ * has been filled with an SDU of @len bytes. Called with rx_lock held. */
+static inline void
+rl_io_ring_rx_publish(struct rl_io_ring *ring, uint32_t len)
+{
+    struct rl_ring *r = ring->rx;
+
+    rl_io_ring_slot(ring, r, ring->rx_head)->len = len;
+    ring->rx_head++;
+    smp_store_release(&r->head, ring->rx_head);
+}
+
+/* Copy an SDU into the next free slot of the RX ring. Returns false if
+ * the ring is full or the SDU does not fit in a slot. Called with
+ * rx_lock held. */
+static bool
+rl_io_ring_rx_put(struct rl_io_ring *ring, struct rl_buf *rb)
+{
+    uint8_t *dst;
+
+    if (rb->len > ring->slot_size) {
+        return false;
+    }
+
+    dst = rl_io_ring_rx_slot(ring);
+    if (!dst) {
+        return false;
+    }
+    rl_buf_copy_bits(rb, dst, rb->len);
+    rl_io_ring_rx_publish(ring, rb->len);
+
+    return true;
+}
+
+/* Queue an SDU received on @flow to @txrx, for userspace to read it. */
+static void
+rl_sdu_rx_queue(struct flow_entry *flow, struct txrx *txrx, struct rl_buf *rb,
+                bool qlimit)
+{
+    RL_BUF_RX(rb).more = false;
+    spin_lock_bh(&txrx->rx_lock);
+    if (txrx->ring && !flow->sdu_rx_consumed && rb_list_empty(&txrx->rx_q) &&
+        rl_io_ring_rx_put(txrx->ring, rb)) {
+        /* Fast path: the SDU goes straight into the RX ring. This is not
+         * possible if consumption must be reported to flow control. */
+        flow->stats.rx_pkt++;
+        flow->stats.rx_byte += rb->len;
+        rl_buf_free(rb);
+    } else if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
+        /* This is useful when flow control is not used on a flow. */
+        RPD(1,
+            "dropping PDU [length %lu] to avoid userspace rx queue "
+            "overrun\n",
+            (long unsigned)rb->len);
+        flow->stats.rx_overrun_pkt++;
+        flow->stats.rx_overrun_byte += rb->len;
+        rl_buf_free(rb);
+    } else {
+        RL_BUF_RX(rb).enq_time = ktime_get();
+        rb_list_enq(rb, &txrx->rx_q);
+        txrx->rx_qsize += rl_buf_truesize(rb);
+        flow->stats.rx_pkt++;
+        flow->stats.rx_byte += rb->len;
+    }
+    spin_unlock_bh(&txrx->rx_lock);
+}
+
 int
 rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                struct rl_buf *rb, bool qlimit)
@@ -88,28 +206,96 @@ rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
         txrx = &flow->txrx;
     }
 
+    rl_sdu_rx_queue(flow, txrx, rb, qlimit);
+    wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_sdu_rx_flow);
+
+/* Receive a burst of SDUs on @flow. If the upper IPCP supports it, the
+ * whole train is passed up at once, so that per-PDU overhead (e.g.
+ * locking) is amortized. The train is consumed. */
+int
+rl_sdu_rx_flow_train(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                     struct rb_list *train, bool qlimit)
+{
+    struct ipcp_entry *upper_ipcp = flow->upper.ipcp;
+    struct rl_buf *rb, *tmp;
+    struct txrx *txrx;
+    int ret = 0;
+
+    if (!upper_ipcp || !upper_ipcp->ops.sdu_rx_train) {
+        rb_list_foreach_safe (rb, tmp, train) {
+            rb_list_del(rb);
+            ret |= rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        }
+
+        return ret;
+    }
+
+    upper_ipcp->ops.sdu_rx_train(upper_ipcp, train, flow);
+    if (rb_list_empty(train)) {
+        return 0;
+    }
+
+    /* Management SDUs to be queued to userspace. */
+    txrx = upper_ipcp->mgmt_txrx;
+    rb_list_foreach_safe (rb, tmp, train) {
+        rb_list_del(rb);
+        rl_sdu_rx_queue(flow, txrx, rb, qlimit);
+    }
+    wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
+
+    return 0;
+}
+EXPORT_SYMBOL(rl_sdu_rx_flow_train);
+
+/* Queue the fragments of an SDU received on the application flow @flow,
+ * in order, as a single unit, so that the reader never sees a partial
+ * SDU and the whole SDU is dropped on rx queue overrun. The fragments
+ * bypass the RX ring. The list is consumed. */
+int
+rl_sdu_rx_flow_frags(struct flow_entry *flow, struct rb_list *frags,
+                     bool qlimit)
+{
+    struct txrx *txrx = &flow->txrx;
+    struct rl_buf *rb, *tmp;
+    size_t len = 0;
+
     spin_lock_bh(&txrx->rx_lock);
     if (unlikely(qlimit && txrx->rx_qsize > RL_RXQ_SIZE_MAX)) {
-        /* This is useful when flow control is not used on a flow. */
+        rb_list_foreach_safe (rb, tmp, frags) {
+            rb_list_del(rb);
+            len += rb->len;
+            rl_buf_free(rb);
+        }
         RPD(1,
-            "dropping PDU [length %lu] to avoid userspace rx queue "
+            "dropping SDU [length %lu] to avoid userspace rx queue "
             "overrun\n",
-            (long unsigned)rb->len);
+            (long unsigned)len);
         flow->stats.rx_overrun_pkt++;
-        flow->stats.rx_overrun_byte += rb->len;
-        rl_buf_free(rb);
+        flow->stats.rx_overrun_byte += len;
     } else {
-        rb_list_enq(rb, &txrx->rx_q);
-        txrx->rx_qsize += rl_buf_truesize(rb);
+        ktime_t now = ktime_get();
+
+        rb_list_foreach_safe (rb, tmp, frags) {
+            rb_list_del(rb);
+            RL_BUF_RX(rb).more     = !rb_list_empty(frags);
+            RL_BUF_RX(rb).enq_time = now;
+            rb_list_enq(rb, &txrx->rx_q);
+            txrx->rx_qsize += rl_buf_truesize(rb);
+            len += rb->len;
+        }
         flow->stats.rx_pkt++;
-        flow->stats.rx_byte += rb->len;
+        flow->stats.rx_byte += len;
     }
     spin_unlock_bh(&txrx->rx_lock);
     wake_up_interruptible_poll(&txrx->rx_wqh, POLLIN | POLLRDNORM | POLLRDBAND);
 
     return 0;
 }
-EXPORT_SYMBOL(rl_sdu_rx_flow);
+EXPORT_SYMBOL(rl_sdu_rx_flow_frags);
 
 int
 rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port)
@@ -195,6 +381,57 @@ rl_io_open(struct inode *inode, struct file *f)
     return 0;
 }
 
+/* Push an SDU down to the IPCP, sleeping on the flow tx_wqh if the IPCP
+ * exerts backpressure and 'flags' allow it. The rb is always consumed. */
+static int
+rl_io_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                struct rl_buf *rb, unsigned flags)
+{
+    DECLARE_WAITQUEUE(wait, current);
+    int ret;
+
+    if (flags & RL_RMT_F_MAYSLEEP) {
+        add_wait_queue(flow->txrx.tx_wqh, &wait);
+    }
+
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        ret = ipcp->ops.sdu_write(ipcp, flow, rb, flags);
+
+        if (ret == -EAGAIN) {
+            if (signal_pending(current)) {
+                rl_buf_free(rb);
+                rb = NULL;
+                /* We avoid restarting the system call, because the other
+                 * end could have shutdown the flow, ops.sdu_write()
+                 * could keep returning -EAGAIN forever, and application
+                 * could get stuck in the write() syscall forever. */
+                ret = -EINTR;
+                break;
+            }
+
+            if (!(flags & RL_RMT_F_MAYSLEEP)) {
+                rl_buf_free(rb);
+                rb = NULL;
+                break;
+            }
+
+            /* No room to write, let's sleep. */
+            schedule();
+            continue;
+        }
+        break;
+    }
+
+    __set_current_state(TASK_RUNNING);
+    if ((flags & RL_RMT_F_MAYSLEEP)) {
+        remove_wait_queue(flow->txrx.tx_wqh, &wait);
+    }
+
+    return ret;
+}
+
 static ssize_t
 rl_io_write_iter(struct kiocb *iocb,
 #ifdef RL_HAVE_CHRDEV_RW_ITER
@@ -219,8 +456,8 @@ rl_io_write_iter(struct kiocb *iocb,
     unsigned flags = (f->f_flags & O_NONBLOCK) ? 0 : RL_RMT_F_MAYSLEEP;
     bool mgmt_sdu;
     bool something_sent = false;
-    DECLARE_WAITQUEUE(wait, current);
-    ssize_t ret = 0;
+    bool frag           = false;
+    ssize_t ret         = 0;
 
     if (unlikely(!rio->txrx)) {
         PE("Error: Not bound to a flow nor IPCP\n");
@@ -251,13 +488,26 @@ rl_io_write_iter(struct kiocb *iocb,
 
     if (unlikely((mgmt_sdu || flow->cfg.msg_boundaries) &&
                  left > ipcp->max_sdu_size)) {
-        /* We cannot split the write(): message boundaries need to be handled
-         * by EFCP fragmentation and reassembly. */
-        return -EMSGSIZE;
+        /* We cannot split the write() unless the IPCP can preserve
+         * message boundaries through fragmentation and reassembly. */
+        if (mgmt_sdu || !(ipcp->flags & RL_K_IPCP_SDU_FRAG) ||
+            left > RL_SDU_FRAG_MAX) {
+            return -EMSGSIZE;
+        }
+        frag = true;
+
+        /* On a non-blocking flow, do not start an SDU that cannot be
+         * written completely without waiting. */
+        if (!(flags & RL_RMT_F_MAYSLEEP) && ipcp->ops.flow_tx_room &&
+            !ipcp->ops.flow_tx_room(
+                flow, DIV_ROUND_UP(left, (size_t)ipcp->max_sdu_size))) {
+            return -EAGAIN;
+        }
     }
 
     while (left) {
-        size_t copylen = min(left, (size_t)ipcp->max_sdu_size);
+        size_t copylen  = min(left, (size_t)ipcp->max_sdu_size);
+        unsigned wflags = flags;
 
         rb = rl_buf_alloc(copylen, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
         if (unlikely(!rb)) {
@@ -310,47 +560,22 @@ rl_io_write_iter(struct kiocb *iocb,
             flow = lower_flow;
         }
 
-        /* Write to the flow, sleeping if needed. This can be a management write
-         * (to an N-1 flow) or an application write (to an N-flow). */
-        if (flags & RL_RMT_F_MAYSLEEP) {
-            add_wait_queue(flow->txrx.tx_wqh, &wait);
-        }
-
-        for (;;) {
-            set_current_state(TASK_INTERRUPTIBLE);
-
-            ret = ipcp->ops.sdu_write(ipcp, flow, rb, flags);
-
-            if (ret == -EAGAIN) {
-                if (signal_pending(current)) {
-                    rl_buf_free(rb);
-                    rb = NULL;
-                    /* We avoid restarting the system call, because the other
-                     * end could have shutdown the flow, ops.sdu_write()
-                     * could keep returning -EAGAIN forever, and application
-                     * could get stuck in the write() syscall forever. */
-                    ret = -EINTR;
-                    break;
-                }
-
-                if (!(flags & RL_RMT_F_MAYSLEEP)) {
-                    rl_buf_free(rb);
-                    rb = NULL;
-                    break;
-                }
-
-                /* No room to write, let's sleep. */
-                schedule();
-                continue;
+        if (frag) {
+            wflags |= (left > copylen ? RL_RMT_F_FRAG_MORE : 0) |
+                      (something_sent ? RL_RMT_F_FRAG_CONT : 0);
+            if (something_sent) {
+                /* Once the first fragment is out, the SDU must be
+                 * completed, even on a non-blocking flow. The room
+                 * was checked above, so this only waits if the room
+                 * was taken by a concurrent writer, or on traffic
+                 * shaping or backpressure from the lower layers. */
+                wflags |= RL_RMT_F_MAYSLEEP;
             }
-            break;
-        }
-
-        __set_current_state(TASK_RUNNING);
-        if ((flags & RL_RMT_F_MAYSLEEP)) {
-            remove_wait_queue(flow->txrx.tx_wqh, &wait);
         }
 
+        /* Write to the flow, sleeping if needed. This can be a management write
+         * (to an N-1 flow) or an application write (to an N-flow). */
+        ret = rl_io_sdu_write(ipcp, flow, rb, wflags);
         if (unlikely(ret < 0)) {
             break;
         }
@@ -358,11 +583,15 @@ rl_io_write_iter(struct kiocb *iocb,
         something_sent = true;
         left -= copylen;
         tot += copylen;
-        flow->stats.tx_pkt++;
         flow->stats.tx_byte += copylen;
+        if (!(wflags & RL_RMT_F_FRAG_MORE)) {
+            flow->stats.tx_pkt++;
+        }
     }
 
-    return something_sent ? tot : ret;
+    /* A fragmented SDU is either written completely or not at all, as
+     * the receiver drops incomplete ones. */
+    return something_sent && !(frag && left) ? tot : ret;
 }
 
 static ssize_t
@@ -385,6 +614,7 @@ rl_io_read_iter(struct kiocb *iocb,
 #else  /* AIO_RW */
     size_t ulen = iov_length(to, iov_cnt);
 #endif /* AIO_RW */
+    ssize_t tot = 0;
     ssize_t ret = 0;
 
     if (unlikely(!txrx)) {
@@ -436,18 +666,38 @@ rl_io_read_iter(struct kiocb *iocb,
             spin_unlock_bh(&txrx->rx_lock);
 
         } else {
+            bool more = RL_BUF_RX(rb).more;
+
             /* Complete SDU read, consume the rb. */
             rb_list_del(rb);
             txrx->rx_qsize -= rl_buf_truesize(rb);
+            if (flow && !more) {
+                rl_lat_hist_add(
+                    &flow->lat.rxq,
+                    ktime_us_delta(ktime_get(), RL_BUF_RX(rb).enq_time));
+            }
             spin_unlock_bh(&txrx->rx_lock);
 
             ret = rl_buf_copy_to_user(rb, to, rb->len);
-            if (flow && flow->sdu_rx_consumed && ret >= 0) {
+            /* Consumption of a fragmented SDU is reported once, with the
+             * last fragment. */
+            if (flow && flow->sdu_rx_consumed && ret >= 0 && !more) {
                 flow->sdu_rx_consumed(flow, RL_BUF_RX(rb).cons_seqnum,
                                       blocking);
             }
 
             rl_buf_free(rb);
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+            if (more && ret >= 0) {
+                /* Go on with the next fragment of the same SDU, which
+                 * is already queued. Without iov_iter, each fragment is
+                 * returned by a separate read(). */
+                tot += ret;
+                ulen -= ret;
+                ret = 0;
+                continue;
+            }
+#endif /* RL_HAVE_CHRDEV_RW_ITER */
         }
 
         break;
@@ -459,6 +709,11 @@ rl_io_read_iter(struct kiocb *iocb,
         remove_wait_queue(&txrx->rx_wqh, &wait);
     }
 
+    if (tot) {
+        /* Part of the SDU has been read, errors are not reported. */
+        return tot + max_t(ssize_t, ret, 0);
+    }
+
     return ret;
 }
 
@@ -478,9 +733,11 @@ rl_io_poll(struct file *f, poll_table *wait)
     poll_wait(f, txrx->tx_wqh, wait);
 
     spin_lock_bh(&txrx->rx_lock);
-    if (!rb_list_empty(&txrx->rx_q) || (txrx->flags & RL_TXRX_EOF)) {
-        /* Userspace can read when the flow rxq is not empty
-         * or when the flow has been deallocated, so that
+    if (!rb_list_empty(&txrx->rx_q) || (txrx->flags & RL_TXRX_EOF) ||
+        (txrx->ring &&
+         txrx->ring->rx_head != READ_ONCE(txrx->ring->rx->tail))) {
+        /* Userspace can read when the flow rxq (or the RX ring) is not
+         * empty or when the flow has been deallocated, so that
          * we can report EOF. */
         mask |= POLLIN | POLLRDNORM;
     }
@@ -605,11 +862,33 @@ rl_io_ioctl_mgmt(struct rl_io *rio, struct rl_ioctl_info *info)
     return 0;
 }
 
+static void
+rl_io_ring_destroy(struct txrx *txrx)
+{
+    struct rl_io_ring *ring;
+
+    spin_lock_bh(&txrx->rx_lock);
+    ring       = txrx->ring;
+    txrx->ring = NULL;
+    spin_unlock_bh(&txrx->rx_lock);
+
+    if (ring) {
+        /* Pages still mapped by userspace are kept alive by the
+         * references taken by remap_vmalloc_range(). */
+        vfree(ring->mem);
+        rl_free(ring, RL_MT_IODEV);
+    }
+}
+
 static int
 rl_io_release_internal(struct rl_io *rio)
 {
     BUG_ON(!rio);
 
+    if (rio->mode == RLITE_IO_MODE_APPL_BIND) {
+        rl_io_ring_destroy(rio->txrx);
+    }
+
     if (rio->txrx) {
         /* Drain rx queue. */
         struct rl_buf *rb, *tmp;
@@ -658,6 +937,489 @@ rl_io_release_internal(struct rl_io *rio)
     return 0;
 }
 
+/* Number of SDU descriptors copied from/to userspace at once by the
+ * batched I/O ioctls. It bounds the stack usage of the handlers. */
+#define RL_IO_BATCH_CHUNK 16
+
+static int
+rl_buf_copy_to_ubuf(struct rl_buf *rb, void __user *ubuf, size_t bytes)
+{
+    struct iovec iov = {.iov_base = ubuf, .iov_len = bytes};
+#ifdef RL_HAVE_CHRDEV_RW_ITER
+    struct iov_iter to;
+
+    iov_iter_init(&to, READ, &iov, 1, bytes);
+
+    return rl_buf_copy_to_user(rb, &to, bytes);
+#else  /* AIO_RW */
+    return rl_buf_copy_to_user(rb, &iov, bytes);
+#endif /* AIO_RW */
+}
+
+/* Write a vector of SDUs to the bound flow. Each descriptor is written as
+ * a separate SDU, and processing stops at the first error. Returns the
+ * number of SDUs written, or an error if none could be written. */
+static long
+rl_io_ioctl_write_batch(struct file *f, struct rl_io *rio,
+                        const struct rl_ioctl_batch *batch)
+{
+    unsigned flags = (f->f_flags & O_NONBLOCK) ? 0 : RL_RMT_F_MAYSLEEP;
+    unsigned int num = min_t(unsigned int, batch->num, RLITE_IO_BATCH_MAX);
+    struct rl_sdu_desc __user *udescs =
+        (struct rl_sdu_desc __user *)(uintptr_t)batch->descs;
+    struct rl_sdu_desc descs[RL_IO_BATCH_CHUNK];
+    struct flow_entry *flow = rio->flow;
+    struct ipcp_entry *ipcp = rio->txrx->ipcp;
+    unsigned int done       = 0;
+    long ret                = 0;
+
+    while (done < num) {
+        unsigned int n = min_t(unsigned int, num - done, RL_IO_BATCH_CHUNK);
+        unsigned int i;
+
+        if (copy_from_user(descs, udescs + done, n * sizeof(descs[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            size_t len = descs[i].len;
+            struct rl_buf *rb;
+
+            if (unlikely(len > ipcp->max_sdu_size)) {
+                /* Each descriptor maps to exactly one SDU. */
+                ret = -EMSGSIZE;
+                goto out;
+            }
+
+            rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_KERNEL);
+            if (unlikely(!rb)) {
+                ret = -ENOMEM;
+                goto out;
+            }
+
+            if (unlikely(copy_from_user(
+                    RL_BUF_DATA(rb), (void __user *)(uintptr_t)descs[i].buf,
+                    len))) {
+                rl_buf_free(rb);
+                ret = -EFAULT;
+                goto out;
+            }
+            rl_buf_append(rb, len);
+
+            ret = rl_io_sdu_write(ipcp, flow, rb, flags);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+
+            done++;
+            flow->stats.tx_pkt++;
+            flow->stats.tx_byte += len;
+        }
+    }
+out:
+    return done ? done : ret;
+}
+
+/* Read up to batch->num SDUs from the bound flow, waiting (if blocking)
+ * only for the first one. An SDU larger than its user buffer is read
+ * partially and ends the batch, while the remainder is left in the rx
+ * queue for the next call, like read() does. Returns the number of SDUs
+ * read, 0 on EOF, or an error. */
+static long
+rl_io_ioctl_read_batch(struct file *f, struct rl_io *rio,
+                       const struct rl_ioctl_batch *batch)
+{
+    unsigned int num = min_t(unsigned int, batch->num, RLITE_IO_BATCH_MAX);
+    struct rl_sdu_desc __user *udescs =
+        (struct rl_sdu_desc __user *)(uintptr_t)batch->descs;
+    struct rl_sdu_desc descs[RL_IO_BATCH_CHUNK];
+    struct flow_entry *flow = rio->flow;
+    bool blocking           = !(f->f_flags & O_NONBLOCK);
+    struct txrx *txrx       = rio->txrx;
+    DECLARE_WAITQUEUE(wait, current);
+    unsigned int done = 0;
+    long ret          = 0;
+
+    if (unlikely(!num)) {
+        return 0;
+    }
+
+    /* Wait for the first SDU, exactly like rl_io_read_iter(). */
+    if (blocking) {
+        add_wait_queue(&txrx->rx_wqh, &wait);
+    }
+
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        spin_lock_bh(&txrx->rx_lock);
+        if (!rb_list_empty(&txrx->rx_q)) {
+            spin_unlock_bh(&txrx->rx_lock);
+            break;
+        }
+
+        if (unlikely(txrx->flags & RL_TXRX_EOF)) {
+            ret = 0;
+        } else if (signal_pending(current)) {
+            ret = -EINTR; /* -ERESTARTSYS */
+        } else if (!blocking) {
+            ret = -EAGAIN;
+        } else {
+            spin_unlock_bh(&txrx->rx_lock);
+            /* Nothing to read, let's sleep. */
+            schedule();
+            continue;
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+        num = 0;
+        break;
+    }
+
+    __set_current_state(TASK_RUNNING);
+
+    if (blocking) {
+        remove_wait_queue(&txrx->rx_wqh, &wait);
+    }
+
+    /* Drain the rx queue one chunk at a time, taking the lock only
+     * once per chunk. */
+    while (done < num) {
+        unsigned int n = min_t(unsigned int, num - done, RL_IO_BATCH_CHUNK);
+        struct rl_buf *partial = NULL;
+        struct rl_buf *rb, *tmp;
+        rlm_seq_t cons_seqnum = 0;
+        bool consumed         = false;
+        struct rb_list qrbs;
+        ktime_t now;
+        size_t off;
+        unsigned int i;
+
+        if (copy_from_user(descs, udescs + done, n * sizeof(descs[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        /* The fragments of an SDU are always dequeued together, and
+         * gathered in the same descriptor. A buffer that does not fit
+         * in the space left in its descriptor is not dequeued. */
+        rb_list_init(&qrbs);
+        now = ktime_get();
+        off = 0;
+        spin_lock_bh(&txrx->rx_lock);
+        for (i = 0; i < n && !rb_list_empty(&txrx->rx_q);) {
+            rb = rb_list_front(&txrx->rx_q);
+            if (unlikely(rb->len > descs[i].len - off)) {
+                partial = rb;
+                break;
+            }
+            rb_list_del(rb);
+            txrx->rx_qsize -= rl_buf_truesize(rb);
+            rb_list_enq(rb, &qrbs);
+            off += rb->len;
+            if (!RL_BUF_RX(rb).more) {
+                if (flow) {
+                    rl_lat_hist_add(
+                        &flow->lat.rxq,
+                        ktime_us_delta(now, RL_BUF_RX(rb).enq_time));
+                }
+                off = 0;
+                i++;
+            }
+        }
+        spin_unlock_bh(&txrx->rx_lock);
+
+        if (i == 0 && !partial) {
+            break; /* rx queue drained */
+        }
+        n = partial ? i + 1 : i;
+
+        i   = 0;
+        off = 0;
+        rb_list_foreach_safe (rb, tmp, &qrbs) {
+            int cret;
+
+            rb_list_del(rb);
+            cret = rl_buf_copy_to_ubuf(
+                rb, (void __user *)(uintptr_t)(descs[i].buf + off), rb->len);
+            if (cret >= 0) {
+                off += cret;
+            } else if (ret == 0) {
+                ret = cret;
+            }
+            if (!RL_BUF_RX(rb).more) {
+                cons_seqnum  = RL_BUF_RX(rb).cons_seqnum;
+                consumed     = true;
+                descs[i].len = off;
+                off          = 0;
+                i++;
+            }
+            rl_buf_free(rb);
+        }
+
+        if (partial) {
+            /* Partial SDU read, don't consume the rb, unless another
+             * reader got there first. */
+            int cret = 0;
+
+            spin_lock_bh(&txrx->rx_lock);
+            if (!rb_list_empty(&txrx->rx_q) &&
+                rb_list_front(&txrx->rx_q) == partial) {
+                cret = rl_buf_copy_to_ubuf(
+                    partial, (void __user *)(uintptr_t)(descs[i].buf + off),
+                    descs[i].len - off);
+                if (cret >= 0) {
+                    rl_buf_custom_pop(partial, cret);
+                }
+            }
+            spin_unlock_bh(&txrx->rx_lock);
+            if (cret >= 0) {
+                off += cret;
+            } else if (ret == 0) {
+                ret = cret;
+            }
+            descs[i].len = off;
+        }
+
+        /* Report the consumption of the whole chunk at once, so that
+         * flow control updates are aggregated. */
+        if (consumed && flow && flow->sdu_rx_consumed) {
+            flow->sdu_rx_consumed(flow, cons_seqnum, blocking);
+        }
+
+        if (copy_to_user(udescs + done, descs, n * sizeof(descs[0]))) {
+            ret = -EFAULT;
+        }
+        done += n;
+
+        if (unlikely(ret < 0 || partial)) {
+            break;
+        }
+    }
+
+    return done ? done : ret;
+}
+
+static void
+rl_io_ring_init(struct rl_io_ring *ring, struct rl_ring *r)
+{
+    r->head      = 0;
+    r->tail      = 0;
+    r->num_slots = ring->num_slots;
+    r->slot_size = ring->slot_size;
+    r->slots_ofs = sizeof(*r);
+    r->bufs_ofs  = ring->bufs_ofs;
+}
+
+static long
+rl_io_ioctl_ring_setup(struct rl_io *rio, struct rl_ioctl_ring_setup *rs)
+{
+    struct txrx *txrx = rio->txrx;
+    struct rl_io_ring *ring;
+    size_t ring_size;
+
+    if (rs->num_slots == 0 || rs->num_slots > RLITE_RING_SLOTS_MAX ||
+        rs->slot_size == 0 || rs->slot_size > RL_IO_RING_SLOT_SIZE_MAX) {
+        return -EINVAL;
+    }
+
+    ring = rl_alloc(sizeof(*ring), GFP_KERNEL | __GFP_ZERO, RL_MT_IODEV);
+    if (!ring) {
+        RPV(1, "Out of memory\n");
+        return -ENOMEM;
+    }
+
+    ring->num_slots = roundup_pow_of_two(rs->num_slots);
+    ring->slot_size = ALIGN(rs->slot_size, SMP_CACHE_BYTES);
+
+    /* Each ring is page aligned, with cache aligned buffers. */
+    ring_size      = ring->num_slots * sizeof(struct rl_ring_slot);
+    ring->bufs_ofs = ALIGN(sizeof(struct rl_ring) + ring_size, SMP_CACHE_BYTES);
+    ring_size      = ring->bufs_ofs + (size_t)ring->num_slots * ring->slot_size;
+    ring_size      = PAGE_ALIGN(ring_size);
+    ring->mem_size = 2 * ring_size;
+    if (ring->mem_size > RL_IO_RING_MEM_MAX) {
+        rl_free(ring, RL_MT_IODEV);
+        return -EINVAL;
+    }
+
+    ring->mem = vmalloc_user(ring->mem_size);
+    if (!ring->mem) {
+        rl_free(ring, RL_MT_IODEV);
+        RPV(1, "Out of memory\n");
+        return -ENOMEM;
+    }
+    ring->rx = (struct rl_ring *)ring->mem;
+    ring->tx = (struct rl_ring *)((uint8_t *)ring->mem + ring_size);
+    rl_io_ring_init(ring, ring->rx);
+    rl_io_ring_init(ring, ring->tx);
+    mutex_init(&ring->tx_lock);
+
+    spin_lock_bh(&txrx->rx_lock);
+    if (txrx->ring) {
+        spin_unlock_bh(&txrx->rx_lock);
+        vfree(ring->mem);
+        rl_free(ring, RL_MT_IODEV);
+        return -EBUSY;
+    }
+    txrx->ring = ring;
+    spin_unlock_bh(&txrx->rx_lock);
+
+    rs->num_slots = ring->num_slots;
+    rs->slot_size = ring->slot_size;
+    rs->tx_ofs    = ring_size;
+    rs->mem_size  = ring->mem_size;
+
+    return 0;
+}
+
+/* Consume the SDUs published by userspace on the TX ring. A slot is
+ * released only once its SDU has been accepted by the IPCP, so that
+ * SDUs refused because of backpressure are retried at the next sync.
+ * A slot that is too long is dropped, like a bad write(). Returns the
+ * number of SDUs transmitted; if an error stops the sync after some SDUs
+ * have been transmitted, the error is reported by the next sync. */
+static long
+rl_io_ring_tx_sync(struct file *f, struct rl_io *rio)
+{
+    unsigned flags = (f->f_flags & O_NONBLOCK) ? 0 : RL_RMT_F_MAYSLEEP;
+    struct rl_io_ring *ring = rio->txrx->ring;
+    struct ipcp_entry *ipcp = rio->txrx->ipcp;
+    struct flow_entry *flow = rio->flow;
+    struct rl_ring *r       = ring->tx;
+    long done               = 0;
+    long ret                = 0;
+    uint32_t head;
+
+    mutex_lock(&ring->tx_lock);
+    if (unlikely(ring->tx_err)) {
+        ret          = ring->tx_err;
+        ring->tx_err = 0;
+        mutex_unlock(&ring->tx_lock);
+        return ret;
+    }
+
+    head = smp_load_acquire(&r->head);
+    if (unlikely(head - ring->tx_tail > ring->num_slots)) {
+        mutex_unlock(&ring->tx_lock);
+        RPD(1, "Invalid TX ring head %u (tail %u)\n", head, ring->tx_tail);
+        return -EINVAL;
+    }
+
+    while (ring->tx_tail != head) {
+        uint32_t len =
+            READ_ONCE(rl_io_ring_slot(ring, r, ring->tx_tail)->len);
+        struct rl_buf *rb;
+
+        if (unlikely(len > ring->slot_size || len > ipcp->max_sdu_size)) {
+            RPD(1, "Dropping TX ring slot of %u bytes\n", len);
+            raw_cpu_ptr(ipcp->stats)->tx_err++;
+            ring->tx_tail++;
+            ret = -EMSGSIZE;
+            break;
+        }
+
+        if (len) {
+            rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom,
+                              GFP_KERNEL);
+            if (unlikely(!rb)) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(RL_BUF_DATA(rb), rl_io_ring_buf(ring, r, ring->tx_tail),
+                   len);
+            rl_buf_append(rb, len);
+
+            ret = rl_io_sdu_write(ipcp, flow, rb, flags);
+            if (unlikely(ret < 0)) {
+                break;
+            }
+            flow->stats.tx_pkt++;
+            flow->stats.tx_byte += len;
+            done++;
+        }
+        ring->tx_tail++;
+    }
+    smp_store_release(&r->tail, ring->tx_tail);
+    if (done && ret < 0 && ret != -EAGAIN && ret != -EINTR) {
+        /* Don't lose the error, the caller only gets the count. */
+        ring->tx_err = ret;
+    }
+    mutex_unlock(&ring->tx_lock);
+
+    return done ? done : ret;
+}
+
+/* Move the SDUs queued on the flow to the RX ring. The fragments of an
+ * SDU (see rl_sdu_rx_flow_frags()) are gathered into a single slot. An
+ * SDU that does not fit in a slot is left at the front of the queue, and
+ * must be retrieved with read(); in that case -EMSGSIZE is returned if
+ * no SDU could be moved. */
+static long
+rl_io_ring_rx_sync(struct file *f, struct rl_io *rio)
+{
+    struct flow_entry *flow = rio->flow;
+    struct txrx *txrx       = rio->txrx;
+    struct rl_io_ring *ring = txrx->ring;
+    rlm_seq_t cons_seqnum   = 0;
+    bool toobig             = false;
+    struct rl_buf *rb;
+    bool eof;
+    long done = 0;
+
+    spin_lock_bh(&txrx->rx_lock);
+    while (!rb_list_empty(&txrx->rx_q)) {
+        unsigned int frags = 0;
+        size_t len         = 0;
+        uint8_t *dst;
+
+        /* The fragments of an SDU are queued all together. */
+        rb_list_foreach (rb, &txrx->rx_q) {
+            len += rb->len;
+            frags++;
+            if (!RL_BUF_RX(rb).more) {
+                break;
+            }
+        }
+
+        if (len > ring->slot_size) {
+            toobig = true;
+            break;
+        }
+
+        dst = rl_io_ring_rx_slot(ring);
+        if (!dst) {
+            break;
+        }
+
+        while (frags--) {
+            rb = rb_list_front(&txrx->rx_q);
+            rl_buf_copy_bits(rb, dst, rb->len);
+            dst += rb->len;
+            rb_list_del(rb);
+            txrx->rx_qsize -= rl_buf_truesize(rb);
+            cons_seqnum = RL_BUF_RX(rb).cons_seqnum;
+            rl_buf_free(rb);
+        }
+        rl_io_ring_rx_publish(ring, len);
+        done++;
+    }
+    eof = rb_list_empty(&txrx->rx_q) && (txrx->flags & RL_TXRX_EOF);
+    spin_unlock_bh(&txrx->rx_lock);
+
+    if (done && flow->sdu_rx_consumed) {
+        flow->sdu_rx_consumed(flow, cons_seqnum,
+                              !(f->f_flags & O_NONBLOCK));
+    }
+
+    if (done == 0 && toobig) {
+        return -EMSGSIZE;
+    }
+
+    /* Report EOF only when there is nothing else to deliver. */
+    return (done == 0 && eof) ? -EPIPE : done;
+}
+
 static long
 rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
@@ -706,6 +1468,70 @@ rl_io_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         break;
     }
 
+    case RLITE_IOCTL_WRITE_BATCH:
+    case RLITE_IOCTL_READ_BATCH: {
+        struct rl_ioctl_batch batch;
+
+        if (rio->mode != RLITE_IO_MODE_APPL_BIND) {
+            /* Batched I/O is only supported on application flows. */
+            return -ENXIO;
+        }
+
+        if (copy_from_user(&batch, argp, sizeof(batch))) {
+            return -EFAULT;
+        }
+
+        if (cmd == RLITE_IOCTL_WRITE_BATCH) {
+            ret = rl_io_ioctl_write_batch(f, rio, &batch);
+        } else {
+            ret = rl_io_ioctl_read_batch(f, rio, &batch);
+        }
+        break;
+    }
+
+    case RLITE_IOCTL_RING_SETUP: {
+        struct rl_ioctl_ring_setup rs;
+
+        if (rio->mode != RLITE_IO_MODE_APPL_BIND) {
+            /* Rings are only supported on application flows. */
+            return -ENXIO;
+        }
+
+        if (copy_from_user(&rs, argp, sizeof(rs))) {
+            return -EFAULT;
+        }
+
+        ret = rl_io_ioctl_ring_setup(rio, &rs);
+        if (ret == 0 && copy_to_user(argp, &rs, sizeof(rs))) {
+            ret = -EFAULT;
+        }
+        break;
+    }
+
+    case RLITE_IOCTL_RING_SYNC: {
+        struct rl_ioctl_ring_sync sync;
+
+        if (rio->mode != RLITE_IO_MODE_APPL_BIND || !rio->txrx->ring) {
+            return -ENXIO;
+        }
+
+        if (copy_from_user(&sync, argp, sizeof(sync))) {
+            return -EFAULT;
+        }
+
+        sync.tx = sync.rx = 0;
+        if (sync.which & RLITE_RING_TX) {
+            sync.tx = rl_io_ring_tx_sync(f, rio);
+        }
+        if (sync.which & RLITE_RING_RX) {
+            sync.rx = rl_io_ring_rx_sync(f, rio);
+        }
+        if (copy_to_user(argp, &sync, sizeof(sync))) {
+            ret = -EFAULT;
+        }
+        break;
+    }
+
     default:
         ret = -EINVAL;
         break;
@@ -728,6 +1554,25 @@ rl_io_release(struct inode *inode, struct file *f)
     return 0;
 }
 
+static int
+rl_io_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct rl_io *rio = (struct rl_io *)f->private_data;
+    struct rl_io_ring *ring;
+
+    if (rio->mode != RLITE_IO_MODE_APPL_BIND || !rio->txrx->ring) {
+        return -ENXIO;
+    }
+    ring = rio->txrx->ring;
+
+    if (vma->vm_pgoff != 0 ||
+        vma->vm_end - vma->vm_start > PAGE_ALIGN(ring->mem_size)) {
+        return -EINVAL;
+    }
+
+    return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
 #ifdef CONFIG_COMPAT
 static long
 rl_io_compat_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
@@ -748,6 +1593,7 @@ static const struct file_operations rl_io_fops = {
     .aio_read  = rl_io_read_iter,
 #endif /* AIO_RW */
     .poll           = rl_io_poll,
+    .mmap           = rl_io_mmap,
     .unlocked_ioctl = rl_io_ioctl,
 #ifdef CONFIG_COMPAT
     .compat_ioctl = rl_io_compat_ioctl,
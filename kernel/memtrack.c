@@ -78,6 +78,22 @@ rl_free(void *obj, rl_memtrack_t type)
 }
 EXPORT_SYMBOL(rl_free);
 
+void
+rl_memtrack_get(rl_memtrack_t type)
+{
+    BUG_ON(type >= RL_MT_MAX);
+    atomic_inc(mt_count + type);
+}
+EXPORT_SYMBOL(rl_memtrack_get);
+
+void
+rl_memtrack_put(rl_memtrack_t type)
+{
+    BUG_ON(type >= RL_MT_MAX);
+    atomic_dec(mt_count + type);
+}
+EXPORT_SYMBOL(rl_memtrack_put);
+
 void
 rl_memtrack_dump_stats(void)
 {
@@ -87,6 +103,7 @@ rl_memtrack_dump_stats(void)
     for (i = 0; i < RL_MT_MAX; i++) {
         PI("    %-8s:%8d\n", mt_names[i], atomic_read(mt_count + i));
     }
+    rl_bufs_dump_stats();
 }
 
 #endif /* RL_MEMTRACK */
@@ -25,9 +25,82 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/timer.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/bitops.h>
 #include "rlite/utils.h"
 #include "rlite-kernel.h"
 
+static enum hrtimer_restart
+rl_hrtimer_fire(struct hrtimer *hrt)
+{
+    struct rl_hrtimer *t = container_of(hrt, struct rl_hrtimer, hrt);
+
+#ifdef RL_HAVE_HRTIMER_SOFT
+    t->func(t);
+#else  /* !RL_HAVE_HRTIMER_SOFT */
+    tasklet_schedule(&t->tasklet);
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+
+    return HRTIMER_NORESTART;
+}
+
+#ifndef RL_HAVE_HRTIMER_SOFT
+static void
+rl_hrtimer_tasklet(unsigned long arg)
+{
+    struct rl_hrtimer *t = (struct rl_hrtimer *)arg;
+
+    t->func(t);
+}
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+
+void
+rl_hrtimer_init(struct rl_hrtimer *t, void (*func)(struct rl_hrtimer *))
+{
+    t->func = func;
+#ifdef RL_HAVE_HRTIMER_SOFT
+    hrtimer_init(&t->hrt, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+#else  /* !RL_HAVE_HRTIMER_SOFT */
+    hrtimer_init(&t->hrt, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    tasklet_init(&t->tasklet, rl_hrtimer_tasklet, (unsigned long)t);
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+    t->hrt.function = rl_hrtimer_fire;
+}
+EXPORT_SYMBOL(rl_hrtimer_init);
+
+/* (Re)arm the timer to expire at @expires, on the ktime_get() clock. */
+void
+rl_hrtimer_mod(struct rl_hrtimer *t, ktime_t expires)
+{
+#ifdef RL_HAVE_HRTIMER_SOFT
+    hrtimer_start(&t->hrt, expires, HRTIMER_MODE_ABS_SOFT);
+#else  /* !RL_HAVE_HRTIMER_SOFT */
+    hrtimer_start(&t->hrt, expires, HRTIMER_MODE_ABS);
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+}
+EXPORT_SYMBOL(rl_hrtimer_mod);
+
+/* Like del_timer(), it does not wait for a running callback. */
+void
+rl_hrtimer_del(struct rl_hrtimer *t)
+{
+    hrtimer_try_to_cancel(&t->hrt);
+}
+EXPORT_SYMBOL(rl_hrtimer_del);
+
+void
+rl_hrtimer_del_sync(struct rl_hrtimer *t)
+{
+    hrtimer_cancel(&t->hrt);
+#ifndef RL_HAVE_HRTIMER_SOFT
+    /* The tasklet may have rearmed the timer. */
+    tasklet_kill(&t->tasklet);
+    hrtimer_cancel(&t->hrt);
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+}
+EXPORT_SYMBOL(rl_hrtimer_del_sync);
+
 void
 dtp_init(struct dtp *dtp)
 {
@@ -36,9 +109,11 @@ dtp_init(struct dtp *dtp)
     spin_lock_init(&dtp->lock);
     rb_list_init(&dtp->cwq);
     dtp->cwq_len = dtp->max_cwq_len = 0;
-    rb_list_init(&dtp->seqq);
     dtp->seqq_len = 0;
+    rb_list_init(&dtp->rsmq);
+    dtp->rsmq_len = 0;
     rb_list_init(&dtp->rtxq);
+    INIT_LIST_HEAD(&dtp->rtxq_exp);
     dtp->rtxq_len = dtp->max_rtxq_len = 0;
     dtp->flags                        = 0;
 }
@@ -48,6 +123,8 @@ void
 dtp_fini(struct dtp *dtp)
 {
     struct flow_entry *flow = container_of(dtp, struct flow_entry, dtp);
+    struct rl_buf **rtxq_ring;
+    struct rl_buf **seqq_ring;
     struct rl_buf *rb, *tmp;
 
 #if 0
@@ -56,16 +133,19 @@ dtp_fini(struct dtp *dtp)
     if (dtp->flags & DTP_F_TIMERS_INITIALIZED) {
         del_timer_sync(&dtp->snd_inact_tmr);
         del_timer_sync(&dtp->rcv_inact_tmr);
-        del_timer_sync(&dtp->rtx_tmr);
-        del_timer_sync(&dtp->a_tmr);
+        rl_hrtimer_del_sync(&dtp->rtx_tmr);
+        rl_hrtimer_del_sync(&dtp->a_tmr);
+        rl_hrtimer_del_sync(&dtp->pace_tmr);
     }
 
     spin_lock_bh(&dtp->lock);
 
-    if (dtp->cwq_len || dtp->seqq_len || dtp->rtxq_len || flow->txrx.rx_qsize) {
-        PD("dropping %u PDUs from cwq, %u from seqq, %u from rtxq, "
-           "and %u bytes from rxq\n",
-           dtp->cwq_len, dtp->seqq_len, dtp->rtxq_len, flow->txrx.rx_qsize);
+    if (dtp->cwq_len || dtp->seqq_len || dtp->rsmq_len || dtp->rtxq_len ||
+        flow->txrx.rx_qsize) {
+        PD("dropping %u PDUs from cwq, %u from seqq, %u from rsmq, "
+           "%u from rtxq, and %u bytes from rxq\n",
+           dtp->cwq_len, dtp->seqq_len, dtp->rsmq_len, dtp->rtxq_len,
+           flow->txrx.rx_qsize);
     }
     rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
         rb_list_del(rb);
@@ -73,19 +153,43 @@ dtp_fini(struct dtp *dtp)
     }
     dtp->cwq_len = 0;
 
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
+    seqq_ring = dtp->seqq_ring;
+    if (seqq_ring) {
+        unsigned int slot;
+
+        for_each_set_bit (slot, dtp->seqq_bmap, dtp->seqq_ring_mask + 1) {
+            rl_buf_free(seqq_ring[slot]);
+        }
+        /* The bitmap lives in the same allocation, freed below. */
+        dtp->seqq_ring = NULL;
+        dtp->seqq_bmap = NULL;
+    }
+    dtp->seqq_len = 0;
+    if (dtp->seqq_ipcp_mem) {
+        atomic_long_sub(dtp->seqq_mem, dtp->seqq_ipcp_mem);
+    }
+    dtp->seqq_mem = 0;
+
+    rb_list_foreach_safe (rb, tmp, &dtp->rsmq) {
         rb_list_del(rb);
         rl_buf_free(rb);
     }
-    dtp->seqq_len = 0;
+    dtp->rsmq_len   = 0;
+    dtp->rsmq_bytes = 0;
 
     rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
         rb_list_del(rb);
         rl_buf_free(rb);
     }
     dtp->rtxq_len = 0;
+    INIT_LIST_HEAD(&dtp->rtxq_exp);
+    rtxq_ring      = dtp->rtxq_ring;
+    dtp->rtxq_ring = NULL;
 
     spin_unlock_bh(&dtp->lock);
+
+    rl_kvfree(seqq_ring, RL_MT_FLOW);
+    rl_kvfree(rtxq_ring, RL_MT_FLOW);
 }
 EXPORT_SYMBOL(dtp_fini);
 
@@ -105,8 +209,9 @@ dtp_dump(struct dtp *dtp)
            "    max_cwq_len=%lu\n"
            "    rtxq_len=%lu\n"
            "    max_rtxq_len=%lu\n"
-           "    rtt=%lu\n"
-           "    rtt_stddev=%lu\n"
+           "    srtt_us=%lu\n"
+           "    rttvar_us=%lu\n"
+           "    rto_us=%lu\n"
            "    cgwin=%lu\n"
            "    rcv_lwe=%lu\n"
            "    rcv_next_seq_num=%lu\n"
@@ -115,7 +220,8 @@ dtp_dump(struct dtp *dtp)
            "    last_lwe_sent=%lu\n"
            "    last_seq_num_acked=%lu\n"
            "    next_snd_ctl_seq=%lu\n"
-           "    seqq_len=%lu\n",
+           "    seqq_len=%lu\n"
+           "    seqq_depth_max=%lu\n",
            (long unsigned)flow->local_port, dtp->flags,
            (long unsigned)dtp->snd_lwe, (long unsigned)dtp->snd_rwe,
            (long unsigned)dtp->next_seq_num_to_use,
@@ -123,49 +229,307 @@ dtp_dump(struct dtp *dtp)
            (long unsigned)dtp->last_ctrl_seq_num_rcvd,
            (long unsigned)dtp->cwq_len, (long unsigned)dtp->max_cwq_len,
            (long unsigned)dtp->rtxq_len, (long unsigned)dtp->max_rtxq_len,
-           (long unsigned)dtp->rtt, (long unsigned)dtp->rtt_stddev,
+           (long unsigned)dtp->srtt_us >> 3,
+           (long unsigned)dtp->rttvar_us >> 2, (long unsigned)dtp->rto_us,
            (long unsigned)dtp->cgwin, (long unsigned)dtp->rcv_lwe,
            (long unsigned)dtp->rcv_next_seq_num, (long unsigned)dtp->rcv_rwe,
            (long unsigned)dtp->max_seq_num_rcvd,
            (long unsigned)dtp->last_lwe_sent,
            (long unsigned)dtp->last_seq_num_acked,
-           (long unsigned)dtp->next_snd_ctl_seq, (long unsigned)dtp->seqq_len);
+           (long unsigned)dtp->next_snd_ctl_seq, (long unsigned)dtp->seqq_len,
+           (long unsigned)dtp->seqq_depth_max);
 }
 EXPORT_SYMBOL(dtp_dump);
 
 #define PDUFT_PERFLOW_KEY(daddr, dcep) ((daddr) | (dcep) << 16)
 
+/*
+ * The PDUFT hash tables are read locklessly under RCU on the datapath,
+ * while updates are serialized by priv->pduft_lock. Each table grows
+ * (doubling the buckets) when its load factor exceeds one. The new bucket
+ * array is populated through the spare node of each entry, so that
+ * concurrent readers can keep walking the old array until the end of the
+ * grace period.
+ */
+
+/* Walk a hash chain, either under rcu_read_lock() or under pduft_lock. */
+#define pduft_for_each_node(_n, _head)                                         \
+    for (_n = rcu_dereference_raw(hlist_first_rcu(_head)); _n;                 \
+         _n = rcu_dereference_raw(hlist_next_rcu(_n)))
+
+static inline struct pduft_entry *
+pduft_entry_of(struct hlist_node *n, unsigned int idx)
+{
+    /* 'n' points to node[idx]. */
+    return container_of(n - idx, struct pduft_entry, node[0]);
+}
+
+static inline uint64_t
+pduft_key(const struct rl_pci_match *match, bool perflow)
+{
+    return perflow ? PDUFT_PERFLOW_KEY((uint64_t)match->dst_addr,
+                                       (uint64_t)match->dst_cepid)
+                   : (uint64_t)match->dst_addr;
+}
+
+static inline struct hlist_head *
+pduft_bucket(struct rl_pduft_buckets *b, uint64_t key)
+{
+    return b->heads + hash_64(key, b->bits);
+}
+
+/* Bucket arrays are allocated in process context, out of pduft_lock,
+ * since the biggest ones take hundreds of KBs. */
+static struct rl_pduft_buckets *
+pduft_buckets_alloc(struct rl_pduft_table *table, unsigned int bits)
+{
+    struct rl_pduft_buckets *b;
+    unsigned int i;
+
+    b = rl_kvzalloc(sizeof(*b) + (sizeof(b->heads[0]) << bits), RL_MT_PDUFT);
+    if (!b) {
+        return NULL;
+    }
+
+    b->bits  = bits;
+    b->idx   = 0;
+    b->table = table;
+    for (i = 0; i < (1U << bits); i++) {
+        INIT_HLIST_HEAD(b->heads + i);
+    }
+
+    return b;
+}
+
+static void
+pduft_buckets_free_rcu(struct rcu_head *rcu)
+{
+    struct rl_pduft_buckets *b =
+        container_of(rcu, struct rl_pduft_buckets, rcu);
+
+    /* No reader can be walking the old array anymore, so the spare
+     * nodes of the entries can be used by the next resize. */
+    WRITE_ONCE(b->table->resize_pending, false);
+    rl_kvfree(b, RL_MT_PDUFT);
+}
+
+static void
+pduft_entry_free_rcu(struct rcu_head *rcu)
+{
+    rl_free(container_of(rcu, struct pduft_entry, rcu), RL_MT_PDUFT);
+}
+
 static struct pduft_entry *
-pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
+pduft_table_lookup(struct rl_pduft_table *table,
+                   const struct rl_pci_match *pci, bool perflow)
 {
-    struct pduft_entry *entry;
-    struct hlist_head *head;
+    struct rl_pduft_buckets *b = rcu_dereference_raw(table->buckets);
+    struct hlist_node *n;
 
-    /* If the per-flow table is not empty, lookup there first. */
-    if (priv->perflow_present) {
-        head = &priv->pdu_ft_perflow[hash_min(
-            PDUFT_PERFLOW_KEY(pci->dst_addr, pci->dst_cepid),
-            HASH_BITS(priv->pdu_ft_perflow))];
-        hlist_for_each_entry (entry, head, node) {
-            if (entry->match.dst_addr == pci->dst_addr &&
-                entry->match.src_addr == pci->src_addr &&
-                entry->match.dst_cepid == pci->dst_cepid &&
-                entry->match.src_cepid == pci->src_cepid &&
-                entry->match.qos_id == pci->qos_id) {
-                return entry;
-            }
+    pduft_for_each_node(n, pduft_bucket(b, pduft_key(pci, perflow)))
+    {
+        struct pduft_entry *entry = pduft_entry_of(n, b->idx);
+
+        if (entry->match.dst_addr != pci->dst_addr) {
+            continue;
+        }
+        if (!perflow || (entry->match.src_addr == pci->src_addr &&
+                         entry->match.dst_cepid == pci->dst_cepid &&
+                         entry->match.src_cepid == pci->src_cepid &&
+                         entry->match.qos_id == pci->qos_id)) {
+            return entry;
         }
     }
 
-    /* Lookup the regular (destination-based) table. */
-    head = &priv->pdu_ft[hash_min(pci->dst_addr, HASH_BITS(priv->pdu_ft))];
-    hlist_for_each_entry (entry, head, node) {
-        if (entry->match.dst_addr == pci->dst_addr) {
+    return NULL;
+}
+
+/* Check if adding an entry to the table would make it grow. The answer
+ * may be stale if pduft_lock is not held. */
+static bool
+pduft_table_needs_grow(struct rl_pduft_table *table)
+{
+    struct rl_pduft_buckets *b = rcu_dereference_raw(table->buckets);
+
+    return READ_ONCE(table->count) + 1 > (1U << b->bits) &&
+           b->bits < PDUFT_HASHTABLE_BITS_MAX &&
+           !READ_ONCE(table->resize_pending);
+}
+
+/* Replace the bucket array with @new, if it is still the right size.
+ * Returns true if @new has been consumed. Called with pduft_lock held. */
+static bool
+pduft_table_grow(struct rl_pduft_table *table, struct rl_pduft_buckets *new,
+                 bool perflow)
+{
+    struct rl_pduft_buckets *old = rcu_dereference_raw(table->buckets);
+    struct hlist_node *n;
+    unsigned int i;
+
+    if (!new || table->count <= (1U << old->bits) ||
+        new->bits != old->bits + 1 || READ_ONCE(table->resize_pending)) {
+        /* Not fatal, we just keep the longer chains. */
+        return false;
+    }
+
+    new->idx = !old->idx;
+
+    for (i = 0; i < (1U << old->bits); i++) {
+        hlist_for_each(n, old->heads + i)
+        {
+            struct pduft_entry *entry = pduft_entry_of(n, old->idx);
+
+            hlist_add_head_rcu(&entry->node[new->idx],
+                               pduft_bucket(new, pduft_key(&entry->match,
+                                                           perflow)));
+        }
+    }
+
+    table->resize_pending = true;
+    rcu_assign_pointer(table->buckets, new);
+    call_rcu(&old->rcu, pduft_buckets_free_rcu);
+
+    return true;
+}
+
+/* Add an entry, growing the table with the preallocated @new bucket
+ * array if needed. Returns true if @new has been consumed. Called with
+ * pduft_lock held. */
+static bool
+pduft_table_add(struct rl_pduft_table *table, struct pduft_entry *entry,
+                struct rl_pduft_buckets *new, bool perflow)
+{
+    struct rl_pduft_buckets *b = rcu_dereference_raw(table->buckets);
+
+    hlist_add_head_rcu(&entry->node[b->idx],
+                       pduft_bucket(b, pduft_key(&entry->match, perflow)));
+    table->count++;
+
+    return pduft_table_grow(table, new, perflow);
+}
+
+static int
+pduft_table_init(struct rl_pduft_table *table)
+{
+    struct rl_pduft_buckets *b;
+
+    b = pduft_buckets_alloc(table, PDUFT_HASHTABLE_BITS);
+    if (!b) {
+        return -ENOMEM;
+    }
+
+    RCU_INIT_POINTER(table->buckets, b);
+    table->count          = 0;
+    table->resize_pending = false;
+
+    return 0;
+}
+
+static void
+pduft_table_stats(struct rl_pduft_table *table, unsigned int *buckets,
+                  unsigned int *used, unsigned int *max_chain)
+{
+    struct rl_pduft_buckets *b;
+    unsigned int i;
+
+    rcu_read_lock();
+    b        = rcu_dereference(table->buckets);
+    *buckets = 1U << b->bits;
+    *used = *max_chain = 0;
+    for (i = 0; i < *buckets; i++) {
+        unsigned int chain = 0;
+        struct hlist_node *n;
+
+        pduft_for_each_node(n, b->heads + i)
+        {
+            chain++;
+        }
+        if (chain) {
+            (*used)++;
+        }
+        if (chain > *max_chain) {
+            *max_chain = chain;
+        }
+    }
+    rcu_read_unlock();
+}
+
+int
+rl_pduft_init(struct rl_normal *priv)
+{
+    int ret;
+
+    spin_lock_init(&priv->pduft_lock);
+    RCU_INIT_POINTER(priv->pduft_dflt, NULL);
+
+    ret = pduft_table_init(&priv->pdu_ft);
+    if (ret) {
+        return ret;
+    }
+
+    ret = pduft_table_init(&priv->pdu_ft_perflow);
+    if (ret) {
+        rl_kvfree(rcu_dereference_raw(priv->pdu_ft.buckets), RL_MT_PDUFT);
+    }
+
+    return ret;
+}
+EXPORT_SYMBOL(rl_pduft_init);
+
+void
+rl_pduft_fini(struct ipcp_entry *ipcp)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+
+    rl_pduft_flush(ipcp);
+
+    /* Wait for the readers and for the pending RCU callbacks, which
+     * may still reference the tables. */
+    synchronize_rcu();
+    rcu_barrier();
+    rl_kvfree(rcu_dereference_raw(priv->pdu_ft.buckets), RL_MT_PDUFT);
+    rl_kvfree(rcu_dereference_raw(priv->pdu_ft_perflow.buckets), RL_MT_PDUFT);
+}
+EXPORT_SYMBOL(rl_pduft_fini);
+
+/* Format occupancy and chain length statistics for both tables. */
+int
+rl_pduft_stats(struct rl_normal *priv, char *buf, int buflen)
+{
+    unsigned int buckets, used, max_chain;
+    unsigned int pf_buckets, pf_used, pf_max_chain;
+
+    pduft_table_stats(&priv->pdu_ft, &buckets, &used, &max_chain);
+    pduft_table_stats(&priv->pdu_ft_perflow, &pf_buckets, &pf_used,
+                      &pf_max_chain);
+
+    return snprintf(buf, buflen,
+                    "entries=%u buckets=%u used=%u max_chain=%u "
+                    "perflow_entries=%u perflow_buckets=%u perflow_used=%u "
+                    "perflow_max_chain=%u",
+                    READ_ONCE(priv->pdu_ft.count), buckets, used, max_chain,
+                    READ_ONCE(priv->pdu_ft_perflow.count), pf_buckets, pf_used,
+                    pf_max_chain);
+}
+EXPORT_SYMBOL(rl_pduft_stats);
+
+/* Called with pduft_lock held or under rcu_read_lock(). */
+static struct pduft_entry *
+pduft_lookup_internal(struct rl_normal *priv, const struct rl_pci_match *pci)
+{
+    struct pduft_entry *entry;
+
+    /* If the per-flow table is not empty, lookup there first. */
+    if (READ_ONCE(priv->pdu_ft_perflow.count)) {
+        entry = pduft_table_lookup(&priv->pdu_ft_perflow, pci,
+                                   /*perflow=*/true);
+        if (entry) {
             return entry;
         }
     }
 
-    return NULL;
+    /* Lookup the regular (destination-based) table. */
+    return pduft_table_lookup(&priv->pdu_ft, pci, /*perflow=*/false);
 }
 
 struct flow_entry *
@@ -174,10 +538,10 @@ rl_pduft_lookup(struct rl_normal *priv, const struct rl_pci_match *pci)
     struct pduft_entry *entry;
     struct flow_entry *flow;
 
-    read_lock_bh(&priv->pduft_lock);
+    rcu_read_lock();
     entry = pduft_lookup_internal(priv, pci);
-    flow  = entry ? entry->flow : priv->pduft_dflt;
-    read_unlock_bh(&priv->pduft_lock);
+    flow  = entry ? READ_ONCE(entry->flow) : rcu_dereference(priv->pduft_dflt);
+    rcu_read_unlock();
 
     return flow;
 }
@@ -197,93 +561,139 @@ rl_pduft_match_is_perflow(const struct rl_pci_match *match)
            match->dst_cepid != 0 && match->src_cepid != 0;
 }
 
+/* Called with pduft_lock held. */
+static void
+pduft_dflt_clear(struct rl_normal *priv)
+{
+    struct flow_entry *dflt = rcu_dereference_raw(priv->pduft_dflt);
+
+    if (dflt) {
+        RCU_INIT_POINTER(priv->pduft_dflt, NULL);
+        flow_put(dflt);
+    }
+}
+
 int
 rl_pduft_set(struct ipcp_entry *ipcp, const struct rl_pci_match *match,
              struct flow_entry *flow)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct rl_normal *priv       = (struct rl_normal *)ipcp->priv;
+    bool perflow                 = rl_pduft_match_is_perflow(match);
+    struct rl_pduft_table *table =
+        perflow ? &priv->pdu_ft_perflow : &priv->pdu_ft;
+    struct rl_pduft_buckets *new = NULL;
     struct pduft_entry *entry;
 
-    if (!rl_pduft_match_is_dstonly(match) &&
-        !rl_pduft_match_is_perflow(match)) {
+    if (!rl_pduft_match_is_dstonly(match) && !perflow) {
         PE("Invalid route: neither dst-only nor per-flow\n");
         return -EINVAL;
     }
 
-    write_lock_bh(&priv->pduft_lock);
+    if (match->dst_addr != RL_ADDR_NULL) {
+        unsigned int bits = 0;
+
+        /* Prepare a bigger bucket array, in case the new entry
+         * makes the table grow. */
+        rcu_read_lock();
+        if (pduft_table_needs_grow(table)) {
+            bits = rcu_dereference(table->buckets)->bits + 1;
+        }
+        rcu_read_unlock();
+        if (bits) {
+            new = pduft_buckets_alloc(table, bits);
+        }
+    }
+
+    flow_get_ref(flow);
+
+    spin_lock_bh(&priv->pduft_lock);
 
     if (match->dst_addr == RL_ADDR_NULL) {
         /* Default entry. */
-        priv->pduft_dflt = flow;
+        pduft_dflt_clear(priv);
+        rcu_assign_pointer(priv->pduft_dflt, flow);
     } else {
-        entry = pduft_lookup_internal(priv, match);
+        entry = pduft_table_lookup(table, match, perflow);
+
+        if (entry) {
+            /* Readers may see either the old or the new lower flow. */
+            struct flow_entry *old = entry->flow;
 
-        if (!entry) {
+            WRITE_ONCE(entry->flow, flow);
+            flow_put(old);
+        } else {
             entry = rl_alloc(sizeof(*entry), GFP_ATOMIC, RL_MT_PDUFT);
             if (!entry) {
-                write_unlock_bh(&priv->pduft_lock);
+                spin_unlock_bh(&priv->pduft_lock);
+                flow_put(flow);
+                rl_kvfree(new, RL_MT_PDUFT);
                 return -ENOMEM;
             }
 
-            if (rl_pduft_match_is_dstonly(match)) {
-                hash_add(priv->pdu_ft, &entry->node, match->dst_addr);
-            } else {
-                BUG_ON(!rl_pduft_match_is_perflow(match));
-                hash_add(priv->pdu_ft_perflow, &entry->node,
-                         PDUFT_PERFLOW_KEY(match->dst_addr, match->dst_cepid));
-                priv->perflow_present = true;
+            entry->flow  = flow;
+            entry->match = *match;
+            if (pduft_table_add(table, entry, new, perflow)) {
+                new = NULL;
             }
-        } else {
-            flow_put(entry->flow);
         }
-
-        entry->flow  = flow;
-        entry->match = *match;
     }
-    write_unlock_bh(&priv->pduft_lock);
+    spin_unlock_bh(&priv->pduft_lock);
 
-    flow_get_ref(flow);
+    /* The preallocated array was not needed. */
+    rl_kvfree(new, RL_MT_PDUFT);
 
     return 0;
 }
 EXPORT_SYMBOL(rl_pduft_set);
 
+/* Unlink an entry and free it after a grace period. Called with
+ * pduft_lock held. */
 static void
 pduft_entry_unlink(struct rl_normal *priv, struct pduft_entry *entry)
 {
-    hash_del(&entry->node);
-    if (hash_empty(priv->pdu_ft_perflow)) {
-        priv->perflow_present = false;
-    }
+    bool perflow = rl_pduft_match_is_perflow(&entry->match);
+    struct rl_pduft_table *table =
+        perflow ? &priv->pdu_ft_perflow : &priv->pdu_ft;
+    struct rl_pduft_buckets *b = rcu_dereference_raw(table->buckets);
+
+    hlist_del_rcu(&entry->node[b->idx]);
+    table->count--;
     flow_put(entry->flow);
+    call_rcu(&entry->rcu, pduft_entry_free_rcu);
 }
 
-int
-rl_pduft_flush(struct ipcp_entry *ipcp)
+/* Unlink all the entries of a table that use 'flow' (all of them if
+ * 'flow' is NULL). Called with pduft_lock held. */
+static void
+pduft_table_flush(struct rl_normal *priv, struct rl_pduft_table *table,
+                  const struct flow_entry *flow)
 {
-    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
-    struct hlist_node *tmp;
-    int bucket;
+    struct rl_pduft_buckets *b = rcu_dereference_raw(table->buckets);
+    struct hlist_node *n, *tmp;
+    unsigned int i;
 
-    write_lock_bh(&priv->pduft_lock);
+    for (i = 0; i < (1U << b->bits); i++) {
+        hlist_for_each_safe(n, tmp, b->heads + i)
+        {
+            struct pduft_entry *entry = pduft_entry_of(n, b->idx);
 
-    if (priv->pduft_dflt) {
-        flow_put(priv->pduft_dflt);
-        priv->pduft_dflt = NULL;
-    }
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
-        pduft_entry_unlink(priv, entry);
-        rl_free(entry, RL_MT_PDUFT);
-    }
-    hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
-    {
-        pduft_entry_unlink(priv, entry);
-        rl_free(entry, RL_MT_PDUFT);
+            if (!flow || entry->flow == flow) {
+                pduft_entry_unlink(priv, entry);
+            }
+        }
     }
+}
+
+int
+rl_pduft_flush(struct ipcp_entry *ipcp)
+{
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    write_unlock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
+    pduft_dflt_clear(priv);
+    pduft_table_flush(priv, &priv->pdu_ft, NULL);
+    pduft_table_flush(priv, &priv->pdu_ft_perflow, NULL);
+    spin_unlock_bh(&priv->pduft_lock);
 
     return 0;
 }
@@ -293,29 +703,11 @@ int
 rl_pduft_flush_by_flow(struct ipcp_entry *ipcp, const struct flow_entry *flow)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry;
-    struct hlist_node *tmp;
-    int bucket;
-
-    write_lock_bh(&priv->pduft_lock);
 
-    hash_for_each_safe(priv->pdu_ft, bucket, tmp, entry, node)
-    {
-        if (entry->flow == flow) {
-            pduft_entry_unlink(priv, entry);
-            rl_free(entry, RL_MT_PDUFT);
-        }
-    }
-
-    hash_for_each_safe(priv->pdu_ft_perflow, bucket, tmp, entry, node)
-    {
-        if (entry->flow == flow) {
-            pduft_entry_unlink(priv, entry);
-            rl_free(entry, RL_MT_PDUFT);
-        }
-    }
-
-    write_unlock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
+    pduft_table_flush(priv, &priv->pdu_ft, flow);
+    pduft_table_flush(priv, &priv->pdu_ft_perflow, flow);
+    spin_unlock_bh(&priv->pduft_lock);
 
     return 0;
 }
@@ -326,11 +718,9 @@ rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
     pduft_entry_unlink(priv, entry);
-    write_unlock_bh(&priv->pduft_lock);
-
-    rl_free(entry, RL_MT_PDUFT);
+    spin_unlock_bh(&priv->pduft_lock);
 
     return 0;
 }
@@ -339,17 +729,16 @@ EXPORT_SYMBOL(rl_pduft_del);
 int
 rl_pduft_del_addr(struct ipcp_entry *ipcp, const struct rl_pci_match *match)
 {
-    struct rl_normal *priv    = (struct rl_normal *)ipcp->priv;
-    struct pduft_entry *entry = NULL;
-    int ret                   = -1;
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+    struct pduft_entry *entry;
+    int ret = -1;
 
-    write_lock_bh(&priv->pduft_lock);
+    spin_lock_bh(&priv->pduft_lock);
     if (match->dst_addr == RL_ADDR_NULL) {
         /* Default entry. */
-        if (priv->pduft_dflt) {
-            flow_put(priv->pduft_dflt);
-            priv->pduft_dflt = NULL;
-            ret              = 0;
+        if (rcu_dereference_raw(priv->pduft_dflt)) {
+            pduft_dflt_clear(priv);
+            ret = 0;
         }
     } else {
         entry = pduft_lookup_internal(priv, match);
@@ -358,11 +747,7 @@ rl_pduft_del_addr(struct ipcp_entry *ipcp, const struct rl_pci_match *match)
             ret = 0;
         }
     }
-    write_unlock_bh(&priv->pduft_lock);
-
-    if (entry) {
-        rl_free(entry, RL_MT_PDUFT);
-    }
+    spin_unlock_bh(&priv->pduft_lock);
 
     return ret;
 }
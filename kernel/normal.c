@@ -37,6 +37,14 @@
 #include <linux/spinlock.h>
 #include <linux/delay.h>
 #include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/jhash.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/crc32c.h>
+#include <net/checksum.h>
 #include <asm/div64.h>
 
 #define RMTQ_MAX_SIZE (1 << 17)
@@ -73,6 +81,27 @@ struct rina_pci_ctrl {
     rl_seq_t my_rwe; /* sent but unused */
 } __attribute__((__packed__));
 
+/* Range of sequence numbers [start, end). SACK control PDUs carry a list
+ * of these right after the control PCI, to report the PDUs received
+ * beyond ack_nack_seq_num; SNACK control PDUs use them to report the
+ * missing PDUs instead. Blocks are sorted by ascending sequence number. */
+struct rina_sack_block {
+    rl_seq_t start;
+    rl_seq_t end;
+} __attribute__((__packed__));
+
+/* Maximum number of blocks in the SACK control PDUs we send. */
+#define RL_SACK_BLOCKS_MAX 8
+
+/* ECN echo, carried by control PDUs with the PDU_F_ECE flag set, right
+ * after the control PCI and before the SACK blocks. It reports how many
+ * DT PDUs were received since the previous control PDU, and how many of
+ * them were ECN marked. */
+struct rina_ecn_echo {
+    uint32_t pkts;
+    uint32_t marked;
+} __attribute__((__packed__));
+
 static inline void
 rl_buf_pci_pop(struct rl_buf *rb)
 {
@@ -89,7 +118,7 @@ static inline int
 rl_buf_pci_push(struct rl_buf *rb)
 {
 #ifndef RL_SKB
-    if (unlikely((uint8_t *)(RL_BUF_PCI(rb) - 1) < &rb->raw->buf[0])) {
+    if (unlikely((uint8_t *)(RL_BUF_PCI(rb) - 1) < rb->raw->buf)) {
         RPD(1, "No space to push another PCI\n");
         return -1;
     }
@@ -110,6 +139,99 @@ rl_buf_pci_push(struct rl_buf *rb)
     return 0;
 }
 
+/* Compute the integrity check of a PDU, according to the "csum"
+ * parameter. For the Internet checksum the pdu_csum field must be zero.
+ * The Internet checksum is endianness independent, so it is computed on
+ * host order words by csum_partial() and stored as it is. The CRC32C
+ * (hardware accelerated where available) skips the fields that change hop
+ * by hop, so that forwarding does not need to update it; it is folded to
+ * fit the 16 bits field of the PCI. */
+static uint16_t
+pdu_csum_compute(struct rl_normal *priv, const struct rina_pci *pci,
+                 size_t len)
+{
+    const uint8_t *data = (const uint8_t *)pci;
+    uint16_t flags;
+    uint32_t crc;
+
+    if (priv->csum == RL_CSUM_INET) {
+        return (__force uint16_t)csum_fold(csum_partial(pci, len, 0));
+    }
+
+    flags = pci->pdu_flags & ~PDU_F_ECN;
+    crc   = crc32c(~0, data, offsetof(struct rina_pci, pdu_flags));
+    crc   = crc32c(crc, &flags, sizeof(flags));
+    crc   = crc32c(crc, data + offsetof(struct rina_pci, seqnum),
+                 len - offsetof(struct rina_pci, seqnum));
+    crc   = ~crc;
+
+    return (uint16_t)(crc ^ (crc >> 16));
+}
+
+/* Verify the integrity check of a received PDU. */
+static inline bool
+pdu_csum_ok(struct rl_normal *priv, const struct rina_pci *pci, size_t len)
+{
+    if (priv->csum == RL_CSUM_INET) {
+        /* The checksum field is included, so a correct PDU sums up to
+         * all ones. */
+        return csum_fold(csum_partial(pci, len, 0)) == 0;
+    }
+
+    return pdu_csum_compute(priv, pci, len) == pci->pdu_csum;
+}
+
+/* Incrementally update the Internet checksum of a PDU, after a 16 bits
+ * word of the PCI changed from @old to @new. The CRC32C does not cover
+ * the fields that may change, so there is nothing to do for it. */
+static inline void
+pdu_csum_replace(struct rl_normal *priv, struct rina_pci *pci, uint16_t old,
+                 uint16_t new)
+{
+    if (priv->csum == RL_CSUM_INET) {
+        __sum16 sum = (__force __sum16)pci->pdu_csum;
+
+        csum_replace2(&sum, (__force __be16)old, (__force __be16)new);
+        pci->pdu_csum = (__force uint16_t)sum;
+    }
+}
+
+/* Set the ECN flag on a data transfer PDU, updating the checksum
+ * incrementally (RFC 1624) if needed. Returns false if the PDU cannot
+ * be marked. */
+static bool
+rl_pdu_ecn_mark(struct rl_normal *priv, struct rl_buf *rb)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+    uint16_t flags       = pci->pdu_flags;
+
+    if (pci->pdu_type != PDU_T_DT) {
+        return false;
+    }
+
+    if (flags & PDU_F_ECN) {
+        return true; /* already marked */
+    }
+
+    pci->pdu_flags = flags | PDU_F_ECN;
+    pdu_csum_replace(priv, pci, flags, pci->pdu_flags);
+
+    return true;
+}
+
+/* Called by the PDU schedulers before enqueueing @rb in a queue that
+ * holds @qlen bytes. */
+static inline void
+rl_sched_ecn_check(struct rl_sched *sched, struct rl_buf *rb,
+                   unsigned int qlen)
+{
+    uint32_t thresh = READ_ONCE(sched->normal->ecn_thresh);
+
+    if (thresh && qlen > thresh) {
+        rl_pdu_ecn_mark(sched->normal, rb);
+    }
+}
+
 void
 rina_pci_dump(struct rina_pci *pci)
 {
@@ -224,6 +346,7 @@ sched_pfifo_enq(struct rl_sched *sched, struct rl_buf *rb)
         return -1;
     }
 
+    rl_sched_ecn_check(sched, rb, pq->qlen);
     rb_list_enq(rb, &pq->q);
     pq->qlen += rl_buf_truesize(rb);
 
@@ -397,6 +520,7 @@ sched_wrr_enq(struct rl_sched *sched, struct rl_buf *rb)
         return -1;
     }
 
+    rl_sched_ecn_check(sched, rb, wrrq->qlen);
     rb_list_enq(rb, &wrrq->q);
     wrrq->qlen += rl_buf_truesize(rb);
 
@@ -456,204 +580,1605 @@ static struct rl_sched_ops rl_sched_wrr_ops = {
     .deq       = sched_wrr_deq,
 };
 
-/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
- * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
- * compiler may need to insert padding. */
-#define RL_PCI_LEN                                                             \
-    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
-     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+/* Deficit Round Robin (DRR) scheduler, optionally preceded by a number
+ * of strict priority classes. Classes [0, prio_levels) are served in
+ * strict priority order (0 is the highest priority), while classes
+ * [prio_levels, num_queues) share the remaining capacity according to
+ * their quantum, with the unused deficit carried over to the next round.
+ * The plain DRR scheduler is the special case with prio_levels == 0. */
+struct rl_sched_drr {
+    /* Array indexed by qos_id. */
+    struct rl_sched_drr_queue {
+        struct rb_list q;
+        int qlen;
+        /* Bytes added to the deficit at each round. */
+        unsigned int quantum;
+        /* Number of bytes that can still be sent in this round. */
+        int deficit;
+        /* Link for the list of active (backlogged) DRR queues. */
+        struct list_head active;
+    } * queues;
 
-#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+    /* Maximum size of each queue, in bytes. */
+    unsigned int max_queue_size;
 
-/* Maximum and minimum values for the congestion control window. */
-#define RL_CGWIN_MIN 4
-#define RL_CGWIN_MAX (1U << 16)
+    /* Number of queues (traffic classes). */
+    rl_qosid_t num_queues;
 
-/* To be called under DTP lock */
-static void
-dtp_snd_reset(struct flow_entry *flow)
+    /* Number of strict priority queues, before the DRR ones. */
+    rl_qosid_t prio_levels;
+
+    /* DRR queues with a backlog, in round robin order. */
+    struct list_head active;
+};
+
+static int
+sched_drr_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                    unsigned int quantum, rl_qosid_t prio_levels,
+                    rl_qosid_t num_weights, unsigned int weights[])
 {
-    struct dtcp_config *dc = &flow->cfg.dtcp;
-    struct dtp *dtp        = &flow->dtp;
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    unsigned int min_weight         = -1;
+    rl_qosid_t num_queues           = prio_levels + num_weights;
+    int i;
 
-    dtp->flags |= DTP_F_DRF_SET;
-    /* InitialSeqNumPolicy */
-    dtp->next_seq_num_to_use = 0;
-    dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
-    dtp->last_seq_num_sent      = -1;
-    dtp->last_ctrl_seq_num_rcvd = 0;
-    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
-        dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
-        dtp->cgwin = RL_CGWIN_MIN;
+    if (quantum == 0 || num_weights == 0 || max_queue_size == 0 ||
+        num_queues < num_weights) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    /* Find the minimum weight and check that it is not 0. */
+    for (i = 0; i < num_weights; i++) {
+        min_weight = min(min_weight, weights[i]);
+    }
+    if (min_weight < 1) {
+        return -1;
+    }
+
+    /* Clean up the old queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new queues. */
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->num_queues     = num_queues;
+    sched_priv->prio_levels    = prio_levels;
+    INIT_LIST_HEAD(&sched_priv->active);
+    sched_priv->queues = rl_alloc(num_queues * sizeof(sched_priv->queues[0]),
+                                  GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->queues) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        struct rl_sched_drr_queue *drrq = sched_priv->queues + i;
+
+        rb_list_init(&drrq->q);
+        INIT_LIST_HEAD(&drrq->active);
+        drrq->qlen    = 0;
+        drrq->deficit = 0;
+        if (i >= prio_levels) {
+            /* Scale the quantum by the weight, normalized to the
+             * minimum one. */
+            uint64_t q = (uint64_t)quantum * weights[i - prio_levels];
+
+            do_div(q, min_weight);
+            drrq->quantum = (unsigned int)q;
+        }
     }
+
+    return 0;
 }
 
-/* To be called under DTP lock */
-static void
-dtp_rcv_reset(struct flow_entry *flow)
+static int
+sched_drr_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
 {
-    struct dtcp_config *dc = &flow->cfg.dtcp;
-    struct dtp *dtp        = &flow->dtp;
+    if (bmsg->hdr.msg_type == RLITE_KER_IPCP_SCHED_PRIO_DRR) {
+        struct rl_kmsg_ipcp_sched_prio_drr *req =
+            (struct rl_kmsg_ipcp_sched_prio_drr *)bmsg;
 
-    dtp->flags |= DTP_F_DRF_EXPECTED;
-    dtp->rcv_lwe = dtp->rcv_next_seq_num = dtp->rcv_rwe = 0;
-    dtp->max_seq_num_rcvd                               = -1;
-#if 0
-    /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
-    dtp->next_snd_ctl_seq = 0;
-#endif
-    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
-        dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
+        return sched_drr_do_config(sched, req->max_queue_size, req->quantum,
+                                   req->prio_levels, req->weights.num_elements,
+                                   req->weights.slots.dwords);
+    } else {
+        struct rl_kmsg_ipcp_sched_drr *req =
+            (struct rl_kmsg_ipcp_sched_drr *)bmsg;
+
+        return sched_drr_do_config(sched, req->max_queue_size, req->quantum,
+                                   /*prio_levels=*/0, req->weights.num_elements,
+                                   req->weights.slots.dwords);
     }
-    dtp->last_lwe_sent      = 0;
-    dtp->last_seq_num_acked = 0;
 }
 
-static void
-snd_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+static int
+sched_drr_init(struct rl_sched *sched)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
+    unsigned int weights[2] = {1, 4};
 
-    spin_lock_bh(&dtp->lock);
+    return sched_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*quantum=*/1500, /*prio_levels=*/0,
+                               /*num_weights=*/2, /*weights=*/weights);
+}
 
-    del_timer(&dtp->rtx_tmr);
+static int
+sched_prio_drr_init(struct rl_sched *sched)
+{
+    unsigned int weights[2] = {1, 4};
 
-    dtp_dump(dtp);
+    return sched_drr_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                               /*quantum=*/1500, /*prio_levels=*/1,
+                               /*num_weights=*/2, /*weights=*/weights);
+}
 
-    /* Re-initialize send-side state variables. */
-    dtp_snd_reset(flow);
+static void
+sched_drr_fini(struct rl_sched *sched)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
 
-    /* Flush the retransmission queue. */
-    PD("dropping %u PDUs from rtxq\n", dtp->rtxq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        dtp->rtxq_len--;
+    if (!sched_priv->queues) {
+        return;
     }
 
-    /* Flush the closed window queue */
-    PD("dropping %u PDUs from cwq\n", dtp->cwq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
-        rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->tx_err++;
-        dtp->cwq_len--;
+    for (i = 0; i < sched_priv->num_queues; i++) {
+        struct rl_sched_drr_queue *drrq = sched_priv->queues + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &drrq->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        drrq->qlen = 0;
     }
 
-    /* Send control ack PDU */
+    rl_free(sched_priv->queues, RL_MT_SHIM);
+    sched_priv->queues = NULL;
+    INIT_LIST_HEAD(&sched_priv->active);
+}
 
-    /* Send transfer PDU with zero length. */
+static int
+sched_drr_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    rl_qosid_t qos_class =
+        min((rl_qosid_t)(sched_priv->num_queues - 1), RL_BUF_PCI(rb)->qos_id);
+    struct rl_sched_drr_queue *drrq = sched_priv->queues + qos_class;
 
-    /* Notify user flow that there has been no activity for a while */
+    if (drrq->qlen > sched_priv->max_queue_size) {
+        return -1;
+    }
 
-    spin_unlock_bh(&dtp->lock);
+    rl_sched_ecn_check(sched, rb, drrq->qlen);
+    if (qos_class >= sched_priv->prio_levels && rb_list_empty(&drrq->q)) {
+        /* The queue becomes active: append it to the round robin list,
+         * with a fresh quantum. */
+        list_add_tail(&drrq->active, &sched_priv->active);
+        drrq->deficit = drrq->quantum;
+    }
+    rb_list_enq(rb, &drrq->q);
+    drrq->qlen += rl_buf_truesize(rb);
 
-    /* Wake up processes sleeping on write(), since cwq and rtxq have been
-     * emptied. */
-    rl_write_restart_flow(flow);
+    return 0;
 }
 
-static void
-rcv_inact_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
+static struct rl_buf *
+sched_drr_deq(struct rl_sched *sched)
 {
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct dtp *dtp             = &flow->dtp;
-    struct rl_buf *rb, *tmp;
+    struct rl_sched_drr *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_sched_drr_queue *drrq;
+    struct rl_buf *rb;
+    rl_qosid_t qos_class;
 
-    spin_lock_bh(&dtp->lock);
+    /* Strict priority classes first. */
+    for (qos_class = 0; qos_class < sched_priv->prio_levels; qos_class++) {
+        drrq = sched_priv->queues + qos_class;
+        if (!rb_list_empty(&drrq->q)) {
+            rb = rb_list_front(&drrq->q);
+            rb_list_del(rb);
+            drrq->qlen -= rl_buf_truesize(rb);
+            BUG_ON(drrq->qlen < 0);
+            return rb;
+        }
+    }
 
-    /* Re-initialize receive-side state variables. */
-    dtp_rcv_reset(flow);
+    /* Then the DRR classes. The head of the active list is the queue
+     * currently being served: it keeps sending as long as its deficit
+     * covers the PDU at the front, otherwise it gets a new quantum and
+     * moves to the tail of the list. */
+    while (!list_empty(&sched_priv->active)) {
+        drrq = list_first_entry(&sched_priv->active, struct rl_sched_drr_queue,
+                                active);
+        rb   = rb_list_front(&drrq->q);
+        if ((int)rb->len > drrq->deficit) {
+            drrq->deficit += drrq->quantum;
+            list_move_tail(&drrq->active, &sched_priv->active);
+            continue;
+        }
 
-    /* Flush sequencing queue. */
-    PD("dropping %u PDUs from seqq\n", dtp->seqq_len);
-    rb_list_foreach_safe (rb, tmp, &dtp->seqq) {
         rb_list_del(rb);
-        rl_buf_free(rb);
-        stats->rx_err++;
-        dtp->seqq_len--;
+        drrq->qlen -= rl_buf_truesize(rb);
+        BUG_ON(drrq->qlen < 0);
+        drrq->deficit -= rb->len;
+        if (rb_list_empty(&drrq->q)) {
+            /* No backlog, no carry-over. */
+            list_del_init(&drrq->active);
+            drrq->deficit = 0;
+        }
+
+        return rb;
     }
 
-    spin_unlock_bh(&dtp->lock);
+    return NULL;
 }
 
-static int rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags);
+static struct rl_sched_ops rl_sched_drr_ops = {
+    .name      = "drr",
+    .priv_size = sizeof(struct rl_sched_drr),
+    .init      = sched_drr_init,
+    .fini      = sched_drr_fini,
+    .config    = sched_drr_config,
+    .enq       = sched_drr_enq,
+    .deq       = sched_drr_deq,
+};
 
-static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
-                                       struct flow_entry *flow,
-                                       bool ack_immediate);
+static struct rl_sched_ops rl_sched_prio_drr_ops = {
+    .name      = "prio-drr",
+    .priv_size = sizeof(struct rl_sched_drr),
+    .init      = sched_prio_drr_init,
+    .fini      = sched_drr_fini,
+    .config    = sched_drr_config,
+    .enq       = sched_drr_enq,
+    .deq       = sched_drr_deq,
+};
 
-static void
-a_tmr_cb(
-#ifdef RL_HAVE_TIMER_SETUP
-    struct timer_list *tmr
-#else  /* !RL_HAVE_TIMER_SETUP */
-    long unsigned arg
-#endif /* !RL_HAVE_TIMER_SETUP */
-)
-{
-#ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.a_tmr);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    struct flow_entry *flow = (struct flow_entry *)arg;
-#endif /* !RL_HAVE_TIMER_SETUP */
-    struct ipcp_entry *ipcp = flow->txrx.ipcp;
-    struct dtp *dtp         = &flow->dtp;
-    struct rl_buf *crb;
+/* Flow Queue CoDel (FQ-CoDel) scheduler, as described in RFC 8290.
+ * PDUs are hashed on (src_addr, dst_addr, src_cep, dst_cep) to a set of
+ * per-flow queues, which are served with DRR giving priority to the
+ * flows that just became active ("new" flows). Each queue runs the
+ * CoDel AQM algorithm (RFC 8289), which drops (or ECN marks) PDUs when
+ * their sojourn time stays above the target delay for more than an
+ * interval. */
+struct rl_sched_fq_codel {
+    struct rl_sched_fq_flow {
+        struct rb_list q;
+        int qlen;
+        /* DRR deficit, in bytes. */
+        int deficit;
+        /* Link for the new_flows or old_flows lists. */
+        struct list_head node;
+
+        /* CoDel state, times are in nanoseconds. */
+        uint64_t first_above_time;
+        uint64_t drop_next;
+        unsigned int count;
+        unsigned int lastcount;
+        bool dropping;
+
+        /* Statistics. */
+        uint64_t pkts;
+        uint64_t drops;
+        uint64_t marks;
+        uint64_t delay_avg; /* moving average of the sojourn time (ns) */
+        uint64_t delay_max; /* max sojourn time (ns) */
+    } * flows;
+
+    /* Number of per-flow queues, a power of two. */
+    unsigned int num_flows;
+#define RL_FQ_CODEL_FLOWS_MAX 1024
+
+    /* Maximum size of all the queues together, and current backlog,
+     * in bytes. */
+    unsigned int max_queue_size;
+    unsigned int backlog;
 
-    RPV(1, "A tmr callback\n");
+    /* DRR quantum in bytes. */
+    unsigned int quantum;
 
-    spin_lock_bh(&dtp->lock);
-    crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
-    spin_unlock_bh(&dtp->lock);
+    /* CoDel parameters, in nanoseconds. */
+    uint64_t target;
+    uint64_t interval;
 
-    if (crb) {
-        rmt_tx(ipcp, crb, RL_RMT_F_CONSUME);
+    /* Mark PDUs rather than dropping them. */
+    bool ecn;
+
+    /* Hash seed. */
+    uint32_t perturb;
+
+    /* PDUs dropped because the max_queue_size was exceeded. */
+    uint64_t overlimit_drops;
+
+    struct list_head new_flows;
+    struct list_head old_flows;
+};
+
+static int
+sched_fq_codel_do_config(struct rl_sched *sched, unsigned int max_queue_size,
+                         unsigned int num_flows, unsigned int quantum,
+                         unsigned int target_us, unsigned int interval_us,
+                         bool ecn)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (max_queue_size == 0 || quantum == 0 || num_flows == 0 ||
+        num_flows > RL_FQ_CODEL_FLOWS_MAX || target_us == 0 ||
+        interval_us <= target_us) {
+        /* Invalid parameters. */
+        return -1;
+    }
+
+    /* Clean up the old queues (if any). */
+    sched->ops.fini(sched);
+
+    /* Build the new queues. */
+    sched_priv->num_flows      = roundup_pow_of_two(num_flows);
+    sched_priv->max_queue_size = max_queue_size;
+    sched_priv->backlog        = 0;
+    sched_priv->quantum        = quantum;
+    sched_priv->target         = (uint64_t)target_us * NSEC_PER_USEC;
+    sched_priv->interval       = (uint64_t)interval_us * NSEC_PER_USEC;
+    sched_priv->ecn            = ecn;
+    get_random_bytes(&sched_priv->perturb, sizeof(sched_priv->perturb));
+    INIT_LIST_HEAD(&sched_priv->new_flows);
+    INIT_LIST_HEAD(&sched_priv->old_flows);
+    sched_priv->flows =
+        rl_alloc(sched_priv->num_flows * sizeof(sched_priv->flows[0]),
+                 GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_priv->flows) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < sched_priv->num_flows; i++) {
+        struct rl_sched_fq_flow *flow = sched_priv->flows + i;
+
+        rb_list_init(&flow->q);
+        INIT_LIST_HEAD(&flow->node);
+    }
+
+    return 0;
+}
+
+static int
+sched_fq_codel_config(struct rl_sched *sched, const struct rl_msg_base *bmsg)
+{
+    struct rl_kmsg_ipcp_sched_fq_codel *req =
+        (struct rl_kmsg_ipcp_sched_fq_codel *)bmsg;
+
+    return sched_fq_codel_do_config(sched, req->max_queue_size, req->flows,
+                                    req->quantum, req->target_us,
+                                    req->interval_us, req->ecn);
+}
+
+static int
+sched_fq_codel_init(struct rl_sched *sched)
+{
+    return sched_fq_codel_do_config(sched, /*max_queue_size=*/RMTQ_MAX_SIZE,
+                                    /*num_flows=*/256, /*quantum=*/1500,
+                                    /*target_us=*/5000, /*interval_us=*/100000,
+                                    /*ecn=*/false);
+}
+
+static void
+sched_fq_codel_fini(struct rl_sched *sched)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    int i;
+
+    if (!sched_priv->flows) {
+        return;
+    }
+
+    for (i = 0; i < sched_priv->num_flows; i++) {
+        struct rl_sched_fq_flow *flow = sched_priv->flows + i;
+        struct rl_buf *rb, *tmp;
+
+        rb_list_foreach_safe (rb, tmp, &flow->q) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+        }
+        flow->qlen = 0;
+    }
+
+    rl_free(sched_priv->flows, RL_MT_SHIM);
+    sched_priv->flows   = NULL;
+    sched_priv->backlog = 0;
+    INIT_LIST_HEAD(&sched_priv->new_flows);
+    INIT_LIST_HEAD(&sched_priv->old_flows);
+}
+
+static inline unsigned int
+fq_codel_hash(struct rl_sched_fq_codel *sched_priv, const struct rina_pci *pci)
+{
+    uint64_t src = pci->src_addr;
+    uint64_t dst = pci->dst_addr;
+
+    return jhash_3words((uint32_t)(src ^ (src >> 32)),
+                        (uint32_t)(dst ^ (dst >> 32)),
+                        (uint32_t)pci->src_cep ^ ((uint32_t)pci->dst_cep << 16),
+                        sched_priv->perturb) &
+           (sched_priv->num_flows - 1);
+}
+
+/* Remove the PDU at the head of a flow queue. */
+static inline struct rl_buf *
+fq_codel_pop(struct rl_sched_fq_codel *sched_priv,
+             struct rl_sched_fq_flow *flow)
+{
+    struct rl_buf *rb = rb_list_front(&flow->q);
+
+    rb_list_del(rb);
+    flow->qlen -= rl_buf_truesize(rb);
+    sched_priv->backlog -= rl_buf_truesize(rb);
+    BUG_ON(flow->qlen < 0);
+
+    return rb;
+}
+
+static int
+sched_fq_codel_enq(struct rl_sched *sched, struct rl_buf *rb)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_sched_fq_flow *flow =
+        sched_priv->flows + fq_codel_hash(sched_priv, RL_BUF_PCI(rb));
+    unsigned int truesize = rl_buf_truesize(rb);
+
+    while (sched_priv->backlog + truesize > sched_priv->max_queue_size) {
+        /* Make room by dropping from the head of the longest queue.
+         * If the longest queue is the one of this PDU, we rather
+         * report that the scheduler is full, so that the sender can
+         * be backpressured. */
+        struct rl_sched_fq_flow *fat = sched_priv->flows;
+        int i;
+
+        for (i = 1; i < sched_priv->num_flows; i++) {
+            if (sched_priv->flows[i].qlen > fat->qlen) {
+                fat = sched_priv->flows + i;
+            }
+        }
+        if (fat == flow || fat->qlen == 0) {
+            return -1;
+        }
+        rl_buf_free(fq_codel_pop(sched_priv, fat));
+        fat->drops++;
+        sched_priv->overlimit_drops++;
+    }
+
+    /* RL_BUF_RMT(rb).enq_time has been set by rmt_tx(). */
+    rb_list_enq(rb, &flow->q);
+    flow->qlen += truesize;
+    sched_priv->backlog += truesize;
+    if (list_empty(&flow->node)) {
+        /* The flow becomes active. */
+        list_add_tail(&flow->node, &sched_priv->new_flows);
+        flow->deficit = sched_priv->quantum;
+    }
+
+    return 0;
+}
+
+/* Dequeue the PDU at the head of a flow queue, updating the delay
+ * statistics and telling whether CoDel allows to drop it, i.e. whether
+ * the sojourn time has been above target for at least an interval. */
+static struct rl_buf *
+fq_codel_dodeq(struct rl_sched_fq_codel *sched_priv,
+               struct rl_sched_fq_flow *flow, uint64_t now, bool *ok_to_drop)
+{
+    struct rl_buf *rb;
+    uint64_t sojourn;
+
+    *ok_to_drop = false;
+    if (rb_list_empty(&flow->q)) {
+        flow->first_above_time = 0;
+        return NULL;
+    }
+
+    rb      = fq_codel_pop(sched_priv, flow);
+    sojourn = now - ktime_to_ns(RL_BUF_RMT(rb).enq_time);
+
+    flow->pkts++;
+    flow->delay_avg += (sojourn >> 3) - (flow->delay_avg >> 3);
+    flow->delay_max = max(flow->delay_max, sojourn);
+
+    if (sojourn < sched_priv->target || flow->qlen <= sched_priv->quantum) {
+        /* Went below target (or there is less than a quantum of
+         * backlog), stay below for at least an interval. */
+        flow->first_above_time = 0;
+    } else if (flow->first_above_time == 0) {
+        flow->first_above_time = now + sched_priv->interval;
+    } else if (now >= flow->first_above_time) {
+        *ok_to_drop = true;
+    }
+
+    return rb;
+}
+
+static inline uint64_t
+fq_codel_control_law(uint64_t t, uint64_t interval, unsigned int count)
+{
+    return t + div_u64(interval, int_sqrt(count));
+}
+
+/* Drop or ECN mark a PDU. Returns the PDU if it was marked, and
+ * therefore it can still be transmitted, or NULL if it was dropped. */
+static struct rl_buf *
+fq_codel_drop(struct rl_sched *sched, struct rl_sched_fq_flow *flow,
+              struct rl_buf *rb)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+
+    if (sched_priv->ecn && rl_pdu_ecn_mark(sched->normal, rb)) {
+        flow->marks++;
+        return rb;
+    }
+    flow->drops++;
+    rl_buf_free(rb);
+
+    return NULL;
+}
+
+/* CoDel dequeue for a single flow queue. */
+static struct rl_buf *
+fq_codel_flow_deq(struct rl_sched *sched, struct rl_sched_fq_flow *flow,
+                  uint64_t now)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    struct rl_buf *rb;
+    bool ok_to_drop;
+
+    rb = fq_codel_dodeq(sched_priv, flow, now, &ok_to_drop);
+
+    if (flow->dropping) {
+        if (!ok_to_drop) {
+            /* Sojourn time went below target, leave the dropping
+             * state. */
+            flow->dropping = false;
+        }
+        while (flow->dropping && now >= flow->drop_next) {
+            /* Drop PDUs at an increasing rate (the interval between
+             * drops shrinks as the inverse square root of the number
+             * of drops), until the sojourn time goes below target. */
+            flow->count++;
+            flow->drop_next = fq_codel_control_law(
+                flow->drop_next, sched_priv->interval, flow->count);
+            if (fq_codel_drop(sched, flow, rb)) {
+                return rb;
+            }
+            rb = fq_codel_dodeq(sched_priv, flow, now, &ok_to_drop);
+            if (!ok_to_drop) {
+                flow->dropping = false;
+            }
+        }
+    } else if (ok_to_drop) {
+        unsigned int delta = flow->count - flow->lastcount;
+
+        /* Enter the dropping state. If we were dropping recently,
+         * restart from a drop rate close to the last one. */
+        flow->dropping = true;
+        if (delta > 1 && (int64_t)(now - flow->drop_next) <
+                             (int64_t)(16 * sched_priv->interval)) {
+            flow->count = delta;
+        } else {
+            flow->count = 1;
+        }
+        flow->lastcount = flow->count;
+        flow->drop_next =
+            fq_codel_control_law(now, sched_priv->interval, flow->count);
+        if (!fq_codel_drop(sched, flow, rb)) {
+            rb = fq_codel_dodeq(sched_priv, flow, now, &ok_to_drop);
+        }
+    }
+
+    return rb;
+}
+
+static struct rl_buf *
+sched_fq_codel_deq(struct rl_sched *sched)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    uint64_t now                         = ktime_to_ns(ktime_get());
+    struct rl_sched_fq_flow *flow;
+    struct list_head *head;
+    struct rl_buf *rb;
+
+    for (;;) {
+        head = &sched_priv->new_flows;
+        if (list_empty(head)) {
+            head = &sched_priv->old_flows;
+            if (list_empty(head)) {
+                return NULL;
+            }
+        }
+
+        flow = list_first_entry(head, struct rl_sched_fq_flow, node);
+        if (flow->deficit <= 0) {
+            flow->deficit += sched_priv->quantum;
+            list_move_tail(&flow->node, &sched_priv->old_flows);
+            continue;
+        }
+
+        rb = fq_codel_flow_deq(sched, flow, now);
+        if (!rb) {
+            /* The queue is empty. A new flow is moved to the old list
+             * (so that it cannot starve old flows by going idle and
+             * coming back), while an old flow becomes inactive. */
+            if (head == &sched_priv->new_flows &&
+                !list_empty(&sched_priv->old_flows)) {
+                list_move_tail(&flow->node, &sched_priv->old_flows);
+            } else {
+                list_del_init(&flow->node);
+            }
+            continue;
+        }
+
+        flow->deficit -= rb->len;
+
+        return rb;
+    }
+}
+
+static int
+sched_fq_codel_stats(struct rl_sched *sched, char *buf, int buflen)
+{
+    struct rl_sched_fq_codel *sched_priv = RL_SCHED_PRIV(sched);
+    uint64_t pkts = 0, drops = 0, marks = 0, delay_max = 0;
+    int n;
+    int i;
+
+    for (i = 0; i < sched_priv->num_flows; i++) {
+        struct rl_sched_fq_flow *flow = sched_priv->flows + i;
+
+        pkts += flow->pkts;
+        drops += flow->drops;
+        marks += flow->marks;
+        delay_max = max(delay_max, flow->delay_max);
+    }
+
+    if (pkts == 0 && drops == 0) {
+        return 0; /* nothing to report */
+    }
+
+    n = snprintf(buf, buflen,
+                 "pkts=%llu drops=%llu marks=%llu overlimit=%llu "
+                 "delay-max=%lluus",
+                 (long long unsigned)pkts, (long long unsigned)drops,
+                 (long long unsigned)marks,
+                 (long long unsigned)sched_priv->overlimit_drops,
+                 (long long unsigned)div_u64(delay_max, NSEC_PER_USEC));
+
+    /* Per-queue average and max sojourn time, for the active queues. */
+    for (i = 0; i < sched_priv->num_flows && n < buflen; i++) {
+        struct rl_sched_fq_flow *flow = sched_priv->flows + i;
+
+        if (list_empty(&flow->node)) {
+            continue;
+        }
+        n += snprintf(
+            buf + n, buflen - n, " q%d=%llu/%lluus", i,
+            (long long unsigned)div_u64(flow->delay_avg, NSEC_PER_USEC),
+            (long long unsigned)div_u64(flow->delay_max, NSEC_PER_USEC));
+    }
+
+    return min(n, buflen - 1);
+}
+
+static struct rl_sched_ops rl_sched_fq_codel_ops = {
+    .name      = "fq-codel",
+    .priv_size = sizeof(struct rl_sched_fq_codel),
+    .init      = sched_fq_codel_init,
+    .fini      = sched_fq_codel_fini,
+    .config    = sched_fq_codel_config,
+    .enq       = sched_fq_codel_enq,
+    .deq       = sched_fq_codel_deq,
+    .stats     = sched_fq_codel_stats,
+};
+
+/* In general RL_PCI_LEN != sizeof(struct rina_pci) and
+ * RL_PCI_CTRL_LEN != sizeof(struct rina_pci_ctrl), since
+ * compiler may need to insert padding. */
+#define RL_PCI_LEN                                                             \
+    (8 + 2 * sizeof(rl_addr_t) + 2 * sizeof(rl_cepid_t) + sizeof(rl_qosid_t) + \
+     sizeof(rl_pdulen_t) + sizeof(rl_seq_t))
+
+#define RL_PCI_CTRL_LEN (RL_PCI_LEN + 6 * sizeof(rl_seq_t))
+
+/* Maximum and minimum values for the congestion control window. */
+#define RL_CGWIN_MIN 4
+#define RL_CGWIN_MAX (1U << 16)
+
+static LIST_HEAD(rl_cc_algorithms);
+
+static void
+cc_slow_start(struct dtp *dtp, unsigned int ssthresh, unsigned int *acked)
+{
+    unsigned int cgwin = min(dtp->cgwin + *acked, ssthresh);
+
+    *acked -= cgwin - dtp->cgwin;
+    dtp->cgwin = cgwin;
+}
+
+/* Additive increase of one PDU per window, with @cnt used to count the
+ * acked PDUs. */
+static void
+cc_cong_avoid(struct dtp *dtp, unsigned int w, unsigned int *cnt,
+              unsigned int acked)
+{
+    *cnt += acked;
+    if (*cnt >= w) {
+        dtp->cgwin += *cnt / w;
+        *cnt %= w;
+    }
+}
+
+/* DCTCP reduction, proportional to the fraction of marked PDUs:
+ *     cgwin = cgwin * (1 - alpha/2)
+ * Returns the new window. */
+static unsigned int
+cc_ecn_reduce(struct dtp *dtp, unsigned int alpha)
+{
+    unsigned int cut = (uint64_t)dtp->cgwin * alpha >>
+                       (RL_ECN_ALPHA_SHIFT + 1);
+
+    dtp->cgwin = max_t(unsigned int, dtp->cgwin - cut, RL_CGWIN_MIN);
+
+    return dtp->cgwin;
+}
+
+/*
+ * NewReno (RFC 6582): slow start up to ssthresh, then additive increase
+ * of one PDU per window; the window is halved on losses detected by
+ * SACK/NACK, and reset to the minimum on timeout.
+ */
+struct rl_cc_newreno {
+    unsigned int ssthresh;
+    unsigned int cnt;
+};
+
+static void
+cc_newreno_init(struct dtp *dtp)
+{
+    struct rl_cc_newreno *ca = RL_CC_PRIV(dtp);
+
+    ca->ssthresh = RL_CGWIN_MAX;
+    ca->cnt      = 0;
+}
+
+static void
+cc_newreno_ack(struct dtp *dtp, unsigned int acked)
+{
+    struct rl_cc_newreno *ca = RL_CC_PRIV(dtp);
+
+    if (dtp->cgwin < ca->ssthresh) {
+        cc_slow_start(dtp, ca->ssthresh, &acked);
+    }
+    if (acked) {
+        cc_cong_avoid(dtp, dtp->cgwin, &ca->cnt, acked);
+    }
+}
+
+static void
+cc_newreno_loss(struct dtp *dtp, bool timeout)
+{
+    struct rl_cc_newreno *ca = RL_CC_PRIV(dtp);
+
+    ca->ssthresh = max_t(unsigned int, dtp->cgwin >> 1, RL_CGWIN_MIN);
+    dtp->cgwin   = timeout ? RL_CGWIN_MIN : ca->ssthresh;
+    ca->cnt      = 0;
+}
+
+static void
+cc_newreno_ecn(struct dtp *dtp, unsigned int alpha)
+{
+    struct rl_cc_newreno *ca = RL_CC_PRIV(dtp);
+
+    ca->ssthresh = cc_ecn_reduce(dtp, alpha);
+    ca->cnt      = 0;
+}
+
+static struct rl_cc_ops rl_cc_newreno_ops = {
+    .name = "newreno",
+    .type = RLITE_CC_T_NEWRENO,
+    .init = cc_newreno_init,
+    .ack  = cc_newreno_ack,
+    .loss = cc_newreno_loss,
+    .ecn  = cc_newreno_ecn,
+};
+
+/*
+ * CUBIC (RFC 8312): in congestion avoidance the window follows
+ *     W(t) = C * (t - K)^3 + W_max
+ * where t is the time since the last loss and K is the time needed to get
+ * back to W_max, so that growth is independent of the RTT and fast far
+ * from W_max. Times are in milliseconds, C = 0.4 and beta = 0.7.
+ */
+struct rl_cc_cubic {
+    unsigned int ssthresh;
+    unsigned int cnt;
+    unsigned int w_max;  /* window before the last reduction */
+    unsigned int origin; /* W_max for the current epoch */
+    unsigned int k;      /* msecs */
+    unsigned long epoch; /* start of the current epoch, in jiffies */
+};
+
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+/* 1/C scaled by 10^9, to turn W(t) in PDUs with t in msecs. */
+#define CUBIC_INV_C_MS3 2500000000ULL
+/* Clamp |t - K| so that its cube does not overflow 64 bits. */
+#define CUBIC_T_MAX_MS (1 << 19)
+
+/* Integer cube root, bit by bit. */
+static uint32_t
+cubic_root(uint64_t a)
+{
+    uint64_t y = 0;
+    int s;
+
+    for (s = 63; s >= 0; s -= 3) {
+        uint64_t b;
+
+        y <<= 1;
+        b = 3 * y * (y + 1) + 1;
+        if ((a >> s) >= b) {
+            a -= b << s;
+            y++;
+        }
+    }
+
+    return (uint32_t)y;
+}
+
+static void
+cc_cubic_init(struct dtp *dtp)
+{
+    struct rl_cc_cubic *ca = RL_CC_PRIV(dtp);
+
+    memset(ca, 0, sizeof(*ca));
+    ca->ssthresh = RL_CGWIN_MAX;
+}
+
+static void
+cc_cubic_ack(struct dtp *dtp, unsigned int acked)
+{
+    struct rl_cc_cubic *ca = RL_CC_PRIV(dtp);
+    unsigned int target;
+    unsigned int w;
+    int64_t delta;
+    int64_t t;
+
+    if (dtp->cgwin < ca->ssthresh) {
+        cc_slow_start(dtp, ca->ssthresh, &acked);
+        if (!acked) {
+            return;
+        }
+    }
+
+    if (!ca->epoch) {
+        ca->epoch = jiffies | 1;
+        if (dtp->cgwin < ca->w_max) {
+            ca->k = cubic_root((ca->w_max - dtp->cgwin) * CUBIC_INV_C_MS3);
+            ca->origin = ca->w_max;
+        } else {
+            ca->k      = 0;
+            ca->origin = dtp->cgwin;
+        }
+    }
+
+    /* Aim at the window one RTT ahead. */
+    t = (int64_t)jiffies_to_msecs(jiffies - ca->epoch) +
+        (dtp->srtt_us >> 3) / USEC_PER_MSEC - ca->k;
+    t = clamp_t(int64_t, t, -CUBIC_T_MAX_MS, CUBIC_T_MAX_MS);
+    delta = div64_s64(t * t * t, CUBIC_INV_C_MS3);
+    if (delta < -(int64_t)ca->origin) {
+        delta = -(int64_t)ca->origin;
+    }
+    target = min_t(int64_t, ca->origin + delta, RL_CGWIN_MAX);
+
+    /* Grow by (target - cgwin) PDUs over the next window. */
+    if (target > dtp->cgwin) {
+        w = max(dtp->cgwin / (target - dtp->cgwin), 1U);
+    } else {
+        w = 100 * dtp->cgwin;
+    }
+    cc_cong_avoid(dtp, w, &ca->cnt, acked);
+}
+
+static void
+cc_cubic_loss(struct dtp *dtp, bool timeout)
+{
+    struct rl_cc_cubic *ca = RL_CC_PRIV(dtp);
+
+    /* Fast convergence: release bandwidth to newer flows if the
+     * window stopped growing before reaching the previous W_max. */
+    if (dtp->cgwin < ca->w_max) {
+        ca->w_max = dtp->cgwin * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) /
+                    (2 * CUBIC_BETA_DEN);
+    } else {
+        ca->w_max = dtp->cgwin;
+    }
+    ca->epoch    = 0;
+    ca->cnt      = 0;
+    ca->ssthresh = max_t(unsigned int,
+                         dtp->cgwin * CUBIC_BETA_NUM / CUBIC_BETA_DEN,
+                         RL_CGWIN_MIN);
+    dtp->cgwin   = timeout ? RL_CGWIN_MIN : ca->ssthresh;
+}
+
+static void
+cc_cubic_ecn(struct dtp *dtp, unsigned int alpha)
+{
+    struct rl_cc_cubic *ca = RL_CC_PRIV(dtp);
+
+    ca->w_max    = dtp->cgwin;
+    ca->epoch    = 0;
+    ca->cnt      = 0;
+    ca->ssthresh = cc_ecn_reduce(dtp, alpha);
+}
+
+static struct rl_cc_ops rl_cc_cubic_ops = {
+    .name = "cubic",
+    .type = RLITE_CC_T_CUBIC,
+    .init = cc_cubic_init,
+    .ack  = cc_cubic_ack,
+    .loss = cc_cubic_loss,
+    .ecn  = cc_cubic_ecn,
+};
+
+/*
+ * Vegas: once per RTT, estimate the number of PDUs queued in the network
+ * as cgwin * (RTT - base RTT) / RTT, and keep it between alpha and beta
+ * by increasing or decreasing the window linearly. Slow start ends as
+ * soon as more than gamma PDUs are queued. Losses are handled like
+ * NewReno.
+ */
+struct rl_cc_vegas {
+    unsigned int ssthresh;
+    unsigned int cnt;
+    uint32_t base_rtt;    /* minimum RTT ever seen, in usecs */
+    uint32_t min_rtt;     /* minimum RTT in the current round, in usecs */
+    unsigned int samples; /* RTT samples in the current round */
+    unsigned long round;  /* end of the current round, in jiffies */
+};
+
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA 4
+#define VEGAS_GAMMA 1
+
+static void
+cc_vegas_init(struct dtp *dtp)
+{
+    struct rl_cc_vegas *ca = RL_CC_PRIV(dtp);
+
+    ca->ssthresh = RL_CGWIN_MAX;
+    ca->cnt      = 0;
+    ca->base_rtt = ~0U;
+    ca->min_rtt  = ~0U;
+    ca->samples  = 0;
+    ca->round    = jiffies;
+}
+
+static void
+cc_vegas_rtt_sample(struct dtp *dtp, uint32_t rtt_us)
+{
+    struct rl_cc_vegas *ca = RL_CC_PRIV(dtp);
+
+    rtt_us       = max(rtt_us, 1U);
+    ca->base_rtt = min(ca->base_rtt, rtt_us);
+    ca->min_rtt  = min(ca->min_rtt, rtt_us);
+    ca->samples++;
+}
+
+static void
+cc_vegas_ack(struct dtp *dtp, unsigned int acked)
+{
+    struct rl_cc_vegas *ca = RL_CC_PRIV(dtp);
+    uint64_t diff;
+
+    if (ca->samples < 3 || time_before(jiffies, ca->round)) {
+        /* Not enough information yet: only slow start, if in
+         * progress. */
+        if (dtp->cgwin < ca->ssthresh) {
+            cc_slow_start(dtp, ca->ssthresh, &acked);
+        }
+        if (ca->samples < 3 && acked) {
+            cc_cong_avoid(dtp, dtp->cgwin, &ca->cnt, acked);
+        }
+        return;
+    }
+
+    /* End of a round: PDUs queued in the network. */
+    diff = div_u64((uint64_t)dtp->cgwin * (ca->min_rtt - ca->base_rtt),
+                   ca->min_rtt);
+
+    if (dtp->cgwin < ca->ssthresh) {
+        if (diff > VEGAS_GAMMA) {
+            /* Leave slow start, going down to the window that
+             * matches the base RTT. */
+            dtp->cgwin   = dtp->cgwin - diff + 1;
+            ca->ssthresh = max_t(unsigned int, dtp->cgwin - 1, RL_CGWIN_MIN);
+        }
+    } else if (diff > VEGAS_BETA) {
+        dtp->cgwin--;
+    } else if (diff < VEGAS_ALPHA) {
+        dtp->cgwin++;
+    }
+
+    ca->min_rtt = ~0U;
+    ca->samples = 0;
+    ca->round   = jiffies + max(usecs_to_jiffies(dtp->srtt_us >> 3), 1UL);
+}
+
+static void
+cc_vegas_loss(struct dtp *dtp, bool timeout)
+{
+    struct rl_cc_vegas *ca = RL_CC_PRIV(dtp);
+
+    ca->ssthresh = max_t(unsigned int, dtp->cgwin >> 1, RL_CGWIN_MIN);
+    dtp->cgwin   = timeout ? RL_CGWIN_MIN : ca->ssthresh;
+    ca->cnt      = 0;
+}
+
+static void
+cc_vegas_ecn(struct dtp *dtp, unsigned int alpha)
+{
+    struct rl_cc_vegas *ca = RL_CC_PRIV(dtp);
+
+    ca->ssthresh = cc_ecn_reduce(dtp, alpha);
+    ca->cnt      = 0;
+}
+
+static struct rl_cc_ops rl_cc_vegas_ops = {
+    .name       = "vegas",
+    .type       = RLITE_CC_T_VEGAS,
+    .init       = cc_vegas_init,
+    .ack        = cc_vegas_ack,
+    .loss       = cc_vegas_loss,
+    .ecn        = cc_vegas_ecn,
+    .rtt_sample = cc_vegas_rtt_sample,
+};
+
+static const struct rl_cc_ops *
+rl_cc_lookup(uint8_t type)
+{
+    struct rl_cc_ops *ops;
+
+    list_for_each_entry (ops, &rl_cc_algorithms, node) {
+        if (ops->type == type) {
+            return ops;
+        }
+    }
+
+    return NULL;
+}
+
+static inline void
+dtp_cc_clamp(struct dtp *dtp)
+{
+    dtp->cgwin = clamp_t(unsigned, dtp->cgwin, RL_CGWIN_MIN, RL_CGWIN_MAX);
+}
+
+/* Called under DTP lock when @acked PDUs have been acked. */
+static void
+dtp_cc_ack(struct dtp *dtp, unsigned int acked)
+{
+    if (dtp->cc && acked) {
+        dtp->cc->ack(dtp, acked);
+        dtp_cc_clamp(dtp);
+    }
+}
+
+/* Called under DTP lock when the PDU @seqnum is found to be lost. Only
+ * one reduction per window is applied on SACK/NACK, since the losses
+ * of PDUs sent before the last reduction belong to the same event. */
+static void
+dtp_cc_loss(struct dtp *dtp, rl_seq_t seqnum, bool timeout)
+{
+    if (!dtp->cc || (!timeout && seqnum < dtp->cc_recover)) {
+        return;
+    }
+    dtp->cc_recover = dtp->next_seq_num_to_use;
+    dtp->cc->loss(dtp, timeout);
+    dtp_cc_clamp(dtp);
+}
+
+/* Called under DTP lock when the peer echoes that @marked out of @pkts
+ * DT PDUs were ECN marked, in a control PDU acking up to @ack_seq.
+ * As in DCTCP (RFC 8257), the counters are accumulated over a window
+ * of data, at the end of which the fraction F of marked PDUs updates
+ *     alpha = (1 - g) * alpha + g * F,  g = 1/16
+ * and the window is reduced if any PDU was marked. */
+static void
+dtp_cc_ecn(struct dtp *dtp, rl_seq_t ack_seq, unsigned int pkts,
+           unsigned int marked)
+{
+    unsigned int frac;
+
+    if (!dtp->cc) {
+        return;
+    }
+
+    dtp->ecn_pkts += pkts;
+    dtp->ecn_marked += min(marked, pkts);
+    if (ack_seq < dtp->ecn_wnd_end || !dtp->ecn_pkts) {
+        return;
+    }
+
+    frac = div_u64((uint64_t)dtp->ecn_marked << RL_ECN_ALPHA_SHIFT,
+                   dtp->ecn_pkts);
+    dtp->ecn_alpha = dtp->ecn_alpha - (dtp->ecn_alpha >> 4) + (frac >> 4);
+
+    if (dtp->ecn_marked && ack_seq >= dtp->cc_recover) {
+        if (dtp->cc->ecn) {
+            dtp->cc->ecn(dtp, dtp->ecn_alpha);
+        } else {
+            dtp->cc->loss(dtp, /*timeout=*/false);
+        }
+        dtp_cc_clamp(dtp);
+        dtp->cc_recover = dtp->next_seq_num_to_use;
+    }
+    dtp->ecn_pkts    = 0;
+    dtp->ecn_marked  = 0;
+    dtp->ecn_wnd_end = dtp->next_seq_num_to_use;
+}
+
+/* Bounds for the number of PDUs covered by a delayed ACK, and number of
+ * ACKs sent one per PDU in quick-ack mode (see sdu_rx_sv_update()). */
+#define RL_ACK_EVERY_MIN 2
+#define RL_ACK_EVERY_MAX 64
+#define RL_ACK_QUICK_PDUS 16
+
+/* The largest number of PDUs that a delayed ACK can cover without
+ * stalling the sender, which cannot go past half of the flow control
+ * window, nor too far into the rtxq, without hearing from us. Without
+ * retransmission control, the sender is not clocked by our ACKs, and
+ * half of the window is the only bound. */
+static inline rl_seq_t
+ack_every_max(const struct flow_entry *flow)
+{
+    const struct dtcp_config *dc = &flow->cfg.dtcp;
+    rl_seq_t m                   = RL_ACK_EVERY_MAX;
+
+    if ((dc->flags & DTCP_CFG_FLOW_CTRL) && dc->fc.fc_type == RLITE_FC_T_WIN) {
+        rl_seq_t half = dc->fc.cfg.w.initial_credit >> 1;
+
+        m = (dc->flags & DTCP_CFG_RTX_CTRL) ? min_t(rl_seq_t, m, half) : half;
+    }
+    if (dc->flags & DTCP_CFG_RTX_CTRL) {
+        m = min_t(rl_seq_t, m, flow->dtp.max_rtxq_len >> 2);
+    }
+
+    return max_t(rl_seq_t, m, 1);
+}
+
+/* Reset the adaptive ACK state at the start of a run. Quick-ack helps
+ * the sender to grow its congestion window, so it is only used with
+ * retransmission control. Flows with flow control only start from the
+ * half-window threshold. */
+static inline void
+dtp_ack_reset(struct flow_entry *flow)
+{
+    struct dtp *dtp = &flow->dtp;
+
+    if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
+        dtp->ack_every = RL_ACK_EVERY_MIN;
+        dtp->ack_quick = RL_ACK_QUICK_PDUS;
+    } else {
+        dtp->ack_every = ack_every_max(flow);
+        dtp->ack_quick = 0;
+    }
+}
+
+/* To be called under DTP lock */
+static void
+dtp_snd_reset(struct flow_entry *flow)
+{
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct dtp *dtp        = &flow->dtp;
+
+    dtp->flags |= DTP_F_DRF_SET;
+    /* InitialSeqNumPolicy */
+    dtp->next_seq_num_to_use = 0;
+    dtp->snd_lwe = dtp->snd_rwe = dtp->next_seq_num_to_use;
+    dtp->last_seq_num_sent      = -1;
+    dtp->last_ctrl_seq_num_rcvd = 0;
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        dtp->snd_rwe += dc->fc.cfg.w.initial_credit;
+        dtp->cgwin = RL_CGWIN_MIN;
+    }
+    if (dtp->cc) {
+        dtp->cgwin       = RL_CGWIN_MIN;
+        dtp->cc_recover  = 0;
+        dtp->ecn_alpha   = 1 << RL_ECN_ALPHA_SHIFT;
+        dtp->ecn_pkts    = 0;
+        dtp->ecn_marked  = 0;
+        dtp->ecn_wnd_end = 0;
+        dtp->cc->init(dtp);
+    }
+}
+
+/* To be called under DTP lock */
+static void
+dtp_rcv_reset(struct flow_entry *flow)
+{
+    struct dtcp_config *dc = &flow->cfg.dtcp;
+    struct dtp *dtp        = &flow->dtp;
+
+    dtp->flags |= DTP_F_DRF_EXPECTED;
+    dtp->rcv_lwe = dtp->rcv_next_seq_num = dtp->rcv_rwe = 0;
+    dtp->max_seq_num_rcvd                               = -1;
+#if 0
+    /* This is reset in the receive datapath (see rl_normal_sdu_rx) */
+    dtp->next_snd_ctl_seq = 0;
+#endif
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        dtp->rcv_rwe += dc->fc.cfg.w.initial_credit;
     }
+    dtp->last_lwe_sent      = 0;
+    dtp->last_seq_num_acked = 0;
+    dtp_ack_reset(flow);
 }
 
 /*
- * Compute the RTX timeout interval using the estimate of RTT mean
- * and standard deviation. However, we have to make sure that the
- * interval is bigger than the A timeout interval by a good margin, otherwise
- * the sender will incur into unnecessary retransmits.
+ * The PDUs in the rtxq are reachable in three ways, all maintained
+ * under the DTP lock:
+ *   - dtp->rtxq, a list sorted by seqnum;
+ *   - dtp->rtxq_ring, indexed by seqnum, so that acked PDUs are found in
+ *     O(1) each. Since the sender never has more than max_rtxq_len
+ *     seqnums in flight past the oldest unacked PDU (see flow_blocked()),
+ *     a ring with at least max_rtxq_len slots has no collisions;
+ *   - dtp->rtxq_exp, a list sorted by expiration time, so that the rtx
+ *     timer only touches the expired PDUs.
  */
-static inline unsigned long
-rtt_to_rtx(struct flow_entry *flow)
+
+static inline struct rl_buf *
+rtxq_lookup(struct dtp *dtp, rlm_seq_t seqnum)
+{
+    struct rl_buf *rb = dtp->rtxq_ring[seqnum & dtp->rtxq_ring_mask];
+
+    return (rb && RL_BUF_PCI(rb)->seqnum == seqnum) ? rb : NULL;
+}
+
+/* Link @rb in the expiration list. New expiration times are normally the
+ * latest ones, so the backward scan usually stops at the tail. */
+static void
+rtxq_exp_insert(struct dtp *dtp, struct rl_buf *rb)
+{
+    struct list_head *pos;
+
+    for (pos = dtp->rtxq_exp.prev; pos != &dtp->rtxq_exp; pos = pos->prev) {
+        if (ktime_compare(RL_BUF_RTX(RL_BUF_RTX_ENTRY(pos)).rtx_time,
+                          RL_BUF_RTX(rb).rtx_time) <= 0) {
+            break;
+        }
+    }
+    list_add(&RL_BUF_RTX(rb).exp_node, pos);
+}
+
+static inline struct rl_buf *
+rtxq_exp_front(struct dtp *dtp)
+{
+    if (list_empty(&dtp->rtxq_exp)) {
+        return NULL;
+    }
+
+    return RL_BUF_RTX_ENTRY(dtp->rtxq_exp.next);
+}
+
+/* Remove @rb from the rtxq, passing its ownership to the caller. */
+static void
+rtxq_unlink(struct dtp *dtp, struct rl_buf *rb)
+{
+    dtp->rtxq_ring[RL_BUF_PCI(rb)->seqnum & dtp->rtxq_ring_mask] = NULL;
+    list_del(&RL_BUF_RTX(rb).exp_node);
+    rb_list_del(rb);
+    dtp->rtxq_len--;
+}
+
+/* Restrict [*start, *end) to the seqnums that can be in the rtxq.
+ * Returns false if the resulting range is empty. */
+static inline bool
+rtxq_clamp(struct dtp *dtp, rlm_seq_t *start, rlm_seq_t *end)
+{
+    rlm_seq_t front;
+
+    if (rb_list_empty(&dtp->rtxq)) {
+        return false;
+    }
+    front  = RL_BUF_PCI(rb_list_front(&dtp->rtxq))->seqnum;
+    *start = max(*start, front);
+    *end   = min(*end, front + dtp->rtxq_ring_mask + 1);
+    *end   = min(*end, dtp->next_seq_num_to_use);
+
+    return *start < *end;
+}
+
+/* Forward the rtx timer to the earliest expiration, or stop it if the
+ * rtxq is empty. */
+static void
+rtxq_tmr_update(struct dtp *dtp)
+{
+    struct rl_buf *rb = rtxq_exp_front(dtp);
+
+    if (rb) {
+        rl_hrtimer_mod(&dtp->rtx_tmr, RL_BUF_RTX(rb).rtx_time);
+    } else {
+        rl_hrtimer_del(&dtp->rtx_tmr);
+    }
+}
+
+static void
+rtxq_flush(struct dtp *dtp)
+{
+    struct rl_buf *rb, *tmp;
+
+    rb_list_foreach_safe (rb, tmp, &dtp->rtxq) {
+        rtxq_unlink(dtp, rb);
+        rl_buf_free(rb);
+    }
+}
+
+static void
+snd_inact_tmr_cb(
+#ifdef RL_HAVE_TIMER_SETUP
+    struct timer_list *tmr
+#else  /* !RL_HAVE_TIMER_SETUP */
+    long unsigned arg
+#endif /* !RL_HAVE_TIMER_SETUP */
+)
+{
+#ifdef RL_HAVE_TIMER_SETUP
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.snd_inact_tmr);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    struct flow_entry *flow = (struct flow_entry *)arg;
+#endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct rl_buf *rb, *tmp;
+
+    spin_lock_bh(&dtp->lock);
+
+    rl_hrtimer_del(&dtp->rtx_tmr);
+    rl_hrtimer_del(&dtp->pace_tmr);
+
+    dtp_dump(dtp);
+
+    /* Re-initialize send-side state variables. */
+    dtp_snd_reset(flow);
+
+    /* Flush the retransmission queue. */
+    PD("dropping %u PDUs from rtxq\n", dtp->rtxq_len);
+    rtxq_flush(dtp);
+
+    /* Flush the closed window queue */
+    PD("dropping %u PDUs from cwq\n", dtp->cwq_len);
+    rb_list_foreach_safe (rb, tmp, &dtp->cwq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+        stats->tx_err++;
+        dtp->cwq_len--;
+    }
+
+    /* Send control ack PDU */
+
+    /* Send transfer PDU with zero length. */
+
+    /* Notify user flow that there has been no activity for a while */
+
+    spin_unlock_bh(&dtp->lock);
+
+    /* Wake up processes sleeping on write(), since cwq and rtxq have been
+     * emptied. */
+    rl_write_restart_flow(flow);
+}
+
+/*
+ * The seqq ring has a power of two number of slots, and the PDU with
+ * sequence number S sits in the slot S & seqq_ring_mask. Only the
+ * seqnums in [rcv_next_seq_num, rcv_next_seq_num + seqq_ring_mask] are
+ * accepted, so that there are no collisions. Since the sender cannot go
+ * past the receiver window (flow control) or past max_rtxq_len PDUs
+ * from the oldest unacked one (retransmission control), a ring sized
+ * after the larger of the two never drops a PDU in the window.
+ * Insertion and in-order extraction are O(1); the bitmap is scanned
+ * only to skip over gaps.
+ */
+#define SEQQ_MIN_LEN 64
+#define SEQQ_MAX_LEN (1 << 14)
+
+/* Return the distance from rcv_next_seq_num of the first slot at
+ * distance @from or more that is occupied (or empty, if @occupied is
+ * false), or the ring size if there is none. */
+static unsigned int
+seqq_find(struct dtp *dtp, unsigned int from, bool occupied)
+{
+    unsigned int size  = dtp->seqq_ring_mask + 1;
+    unsigned int base  = dtp->rcv_next_seq_num & dtp->seqq_ring_mask;
+    unsigned int start = (base + from) & dtp->seqq_ring_mask;
+    unsigned int end   = start < base ? base : size;
+    unsigned int i;
+
+    if (from >= size) {
+        return size;
+    }
+
+    i = occupied ? find_next_bit(dtp->seqq_bmap, end, start)
+                 : find_next_zero_bit(dtp->seqq_bmap, end, start);
+    if (i >= end && end == size) {
+        /* Wrap around and scan the slots before the base. */
+        i = occupied ? find_next_bit(dtp->seqq_bmap, base, 0)
+                     : find_next_zero_bit(dtp->seqq_bmap, base, 0);
+        end = base;
+    }
+
+    return i < end ? (i - base) & dtp->seqq_ring_mask : size;
+}
+
+static struct rl_buf *
+seqq_take(struct dtp *dtp, unsigned int slot)
+{
+    struct rl_buf *rb     = dtp->seqq_ring[slot];
+    unsigned int truesize = rl_buf_truesize(rb);
+
+    dtp->seqq_ring[slot] = NULL;
+    __clear_bit(slot, dtp->seqq_bmap);
+    dtp->seqq_len--;
+    dtp->seqq_mem -= truesize;
+    atomic_long_sub(truesize, dtp->seqq_ipcp_mem);
+
+    return rb;
+}
+
+/* Drop all the PDUs in the seqq, returning how many they were. */
+static unsigned int
+seqq_flush(struct dtp *dtp)
+{
+    unsigned int n = dtp->seqq_len;
+    unsigned int slot;
+
+    if (!n) {
+        return 0;
+    }
+
+    PD("dropping %u PDUs from seqq\n", n);
+    for_each_set_bit (slot, dtp->seqq_bmap, dtp->seqq_ring_mask + 1) {
+        rl_buf_free(seqq_take(dtp, slot));
+    }
+
+    return n;
+}
+
+/*
+ * Reassembly of the SDUs fragmented by the sender (see PDU_F_MF and
+ * PDU_F_CF). The PDUs to be delivered go through dtp_rsm() in seqnum
+ * order. Fragments are held in the rsmq until the last one arrives, and
+ * are then delivered together, linked by RL_BUF_RX().more, so that no
+ * big linear buffer has to be allocated in softirq context. An SDU with
+ * missing fragments, which can only happen without retransmission
+ * control, is dropped as soon as the gap is detected.
+ */
+
+static unsigned int
+rsmq_flush(struct dtp *dtp)
+{
+    unsigned int n = dtp->rsmq_len;
+    struct rl_buf *rb, *tmp;
+
+    rb_list_foreach_safe (rb, tmp, &dtp->rsmq) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
+    dtp->rsmq_len   = 0;
+    dtp->rsmq_bytes = 0;
+
+    return n;
+}
+
+/* Append @rb, the next PDU to be delivered, to @qrbs, unless it is a
+ * fragment of an SDU that is not complete yet. Called under DTP lock. */
+static void
+dtp_rsm(struct flow_entry *flow, struct rl_buf *rb, struct rb_list *qrbs)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+    uint8_t frag         = pci->pdu_flags & (PDU_F_MF | PDU_F_CF);
+    struct dtp *dtp      = &flow->dtp;
+    struct rl_ipcp_stats *stats;
+    struct rl_buf *frb, *tmp;
+
+    RL_BUF_RX(rb).cons_seqnum = pci->seqnum;
+    RL_BUF_RX(rb).more        = false;
+
+    if (likely(!frag && !dtp->rsmq_len) || flow->upper.ipcp) {
+        /* Whole SDU. Upper IPCPs never write fragmented SDUs. */
+        rb_list_enq(rb, qrbs);
+        return;
+    }
+
+    stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    if (dtp->rsmq_len &&
+        (!(frag & PDU_F_CF) || pci->seqnum != dtp->rsm_next)) {
+        RPD(1, "dropping incomplete SDU [%lu-%lu]\n",
+            (long unsigned)dtp->rsm_first, (long unsigned)dtp->rsm_next - 1);
+        stats->rx_err += rsmq_flush(dtp);
+    }
+
+    if (!frag) {
+        rb_list_enq(rb, qrbs);
+        return;
+    }
+
+    if ((frag & PDU_F_CF) && !dtp->rsmq_len) {
+        /* The previous fragments were lost or dropped. */
+        RPD(1, "dropping orphan fragment [%lu]\n", (long unsigned)pci->seqnum);
+        stats->rx_err++;
+        rl_buf_free(rb);
+        return;
+    }
+
+    if (dtp->rsmq_bytes + rb->len - sizeof(*pci) > RL_SDU_FRAG_MAX) {
+        RPD(1, "dropping SDU longer than %u bytes\n", RL_SDU_FRAG_MAX);
+        stats->rx_err += rsmq_flush(dtp) + 1;
+        rl_buf_free(rb);
+        return;
+    }
+
+    if (!(frag & PDU_F_CF)) {
+        dtp->rsm_first = pci->seqnum;
+    }
+    dtp->rsm_next = pci->seqnum + 1;
+    dtp->rsmq_bytes += rb->len - sizeof(*pci);
+    dtp->rsmq_len++;
+    rb_list_enq(rb, &dtp->rsmq);
+    if (frag & PDU_F_MF) {
+        if (dtp->rcv_lwe == pci->seqnum) {
+            /* Everything before has been consumed, and the reader
+             * will only report the consumption of the last fragment.
+             * Don't let this one hold the window, or SDUs longer than
+             * the window would never complete. */
+            dtp->rcv_lwe++;
+        }
+        return;
+    }
+
+    /* This was the last fragment. */
+    rb_list_foreach_safe (frb, tmp, &dtp->rsmq) {
+        rb_list_del(frb);
+        RL_BUF_RX(frb).more = !rb_list_empty(&dtp->rsmq);
+        rb_list_enq(frb, qrbs);
+    }
+    dtp->rsmq_len   = 0;
+    dtp->rsmq_bytes = 0;
+}
+
+/* Pop the PCI and deliver the SDUs in @qrbs, as prepared by dtp_rsm().
+ * The list is consumed. */
+static int
+dtp_deliver(struct ipcp_entry *ipcp, struct flow_entry *flow,
+            struct rb_list *qrbs, bool qlimit)
 {
-    struct dtp *dtp    = &flow->dtp;
-    unsigned long x    = dtp->rtt + (dtp->rtt_stddev << 1);
-    unsigned int two_a = flow->cfg.dtcp.initial_a << 1;
+    struct rl_buf *rb, *tmp;
+    struct rb_list frags;
+    int ret = 0;
+
+    rb_list_init(&frags);
+    rb_list_foreach_safe (rb, tmp, qrbs) {
+        bool more = RL_BUF_RX(rb).more;
+
+        rb_list_del(rb);
+        rl_buf_pci_pop(rb);
+        if (more || !rb_list_empty(&frags)) {
+            rb_list_enq(rb, &frags);
+            if (!more) {
+                ret |= rl_sdu_rx_flow_frags(flow, &frags, qlimit);
+            }
+        } else {
+            ret |= rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        }
+    }
 
-    return x > (two_a) ? x : (two_a);
+    return ret;
 }
 
 static void
-rtx_tmr_cb(
+rcv_inact_tmr_cb(
 #ifdef RL_HAVE_TIMER_SETUP
     struct timer_list *tmr
 #else  /* !RL_HAVE_TIMER_SETUP */
@@ -662,17 +2187,104 @@ rtx_tmr_cb(
 )
 {
 #ifdef RL_HAVE_TIMER_SETUP
-    struct flow_entry *flow = from_timer(flow, tmr, dtp.rtx_tmr);
+    struct flow_entry *flow = from_timer(flow, tmr, dtp.rcv_inact_tmr);
 #else  /* !RL_HAVE_TIMER_SETUP */
     struct flow_entry *flow = (struct flow_entry *)arg;
 #endif /* !RL_HAVE_TIMER_SETUP */
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+
+    spin_lock_bh(&dtp->lock);
+
+    /* Re-initialize receive-side state variables. */
+    dtp_rcv_reset(flow);
+
+    /* Flush sequencing and reassembly queues. */
+    stats->rx_err += seqq_flush(dtp) + rsmq_flush(dtp);
+
+    spin_unlock_bh(&dtp->lock);
+}
+
+static int rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags);
+
+static struct rl_buf *sdu_rx_sv_update(struct ipcp_entry *ipcp,
+                                       struct flow_entry *flow,
+                                       bool ack_immediate);
+
+static void
+a_tmr_cb(struct rl_hrtimer *tmr)
+{
+    struct flow_entry *flow = container_of(tmr, struct flow_entry, dtp.a_tmr);
+    struct ipcp_entry *ipcp = flow->txrx.ipcp;
+    struct dtcp_config *dc  = &flow->cfg.dtcp;
+    struct dtp *dtp         = &flow->dtp;
+    bool pending            = false;
+    struct rl_buf *crb;
+
+    RPV(1, "A tmr callback\n");
+
+    spin_lock_bh(&dtp->lock);
+    /* Only look at what we actually report to the sender. */
+    if (dc->flags & DTCP_CFG_RTX_CTRL) {
+        pending |= dtp->rcv_next_seq_num != dtp->last_seq_num_acked;
+    }
+    if ((dc->flags & DTCP_CFG_FLOW_CTRL) && dc->fc.fc_type == RLITE_FC_T_WIN) {
+        pending |= dtp->rcv_lwe != dtp->last_lwe_sent;
+    }
+    if (pending) {
+        /* Not enough PDUs came within A to fill a delayed ACK. The
+         * sender may be limited by its window, so coalesce less. */
+        dtp->ack_every =
+            max_t(unsigned int, dtp->ack_every >> 1, RL_ACK_EVERY_MIN);
+    }
+    crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
+    spin_unlock_bh(&dtp->lock);
+
+    if (crb) {
+        rmt_tx(ipcp, crb, RL_RMT_F_CONSUME);
+    }
+}
+
+/* Bounds for the RTX timeout, in microseconds. */
+#define RL_RTO_MIN_US 200
+#define RL_RTO_MAX_US (60 * USEC_PER_SEC)
+
+/*
+ * Compute the RTX timeout interval as in RFC 6298, using the estimate of
+ * RTT mean and variation. However, we have to make sure that the
+ * interval is bigger than the A timeout interval by a good margin, otherwise
+ * the sender will incur into unnecessary retransmits.
+ * Called under DTP lock.
+ */
+static void
+dtp_rto_update(struct flow_entry *flow)
+{
+    struct dtp *dtp = &flow->dtp;
+    uint32_t two_a  = flow->cfg.dtcp.initial_a * 2 * USEC_PER_MSEC;
+    uint32_t rto    = (dtp->srtt_us >> 3) + max(dtp->rttvar_us, 1U);
+
+    rto         = max3(rto, two_a, (uint32_t)RL_RTO_MIN_US);
+    dtp->rto_us = min_t(uint32_t, rto, RL_RTO_MAX_US);
+}
+
+static inline ktime_t
+rtt_to_rtx(struct flow_entry *flow)
+{
+    return ns_to_ktime((uint64_t)flow->dtp.rto_us * NSEC_PER_USEC);
+}
+
+static void
+rtx_tmr_cb(struct rl_hrtimer *tmr)
+{
+    struct flow_entry *flow =
+        container_of(tmr, struct flow_entry, dtp.rtx_tmr);
     struct ipcp_entry *ipcp     = flow->txrx.ipcp;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct dtp *dtp             = &flow->dtp;
     struct rl_buf *rb, *crb, *tmp;
-    long unsigned next_exp = ~0U;
-    bool next_exp_set      = false;
+    bool backoff = false;
     struct rb_list rrbq;
+    ktime_t now;
 
     rb_list_init(&rrbq);
 
@@ -682,46 +2294,39 @@ rtx_tmr_cb(
      * at the end of the function, after the burst of
      * retransmissions. */
     del_timer(&dtp->snd_inact_tmr);
-
-    /* We scan all the elements in the retransmission list, since they are
-     * sorted by ascending sequence number, and not by ascending expiration
-     * time. */
-    rb_list_foreach (rb, &dtp->rtxq) {
-        if (!time_before(jiffies, RL_BUF_RTX(rb).rtx_jiffies)) {
-            /* This rb should be retransmitted. We also invalidate
-             * RL_BUF_RTX(rb).jiffies, so that RTT is not updated on
-             * retransmitted packets. */
-            RL_BUF_RTX(rb).rtx_jiffies += rtt_to_rtx(flow);
-            RL_BUF_RTX(rb).jiffies = 0;
-
-            crb = rl_buf_clone(rb, GFP_ATOMIC);
-            if (unlikely(!crb)) {
-                RPV(1, "Out of memory\n");
-            } else {
-                rb_list_enq(crb, &rrbq);
-                stats->rtx_pkt++;
-                stats->rtx_byte += rb->len;
-            }
+    now = ktime_get();
+
+    /* Only the expired PDUs are visited, in expiration order. */
+    while ((rb = rtxq_exp_front(dtp)) &&
+           ktime_compare(now, RL_BUF_RTX(rb).rtx_time) >= 0) {
+        /* This rb should be retransmitted. The RTO is backed off
+         * once per expiration (Karn's algorithm), and
+         * RL_BUF_RTX(rb).tx_time is invalidated, so that RTT is
+         * not updated on retransmitted packets. */
+        if (!backoff) {
+            dtp->rto_us = min_t(uint32_t, dtp->rto_us << 1, RL_RTO_MAX_US);
+            backoff     = true;
         }
-        if (!next_exp_set ||
-            time_before(RL_BUF_RTX(rb).rtx_jiffies, next_exp)) {
-            next_exp     = RL_BUF_RTX(rb).rtx_jiffies;
-            next_exp_set = true;
+        RL_BUF_RTX(rb).rtx_time = ktime_add(now, rtt_to_rtx(flow));
+        RL_BUF_RTX(rb).tx_time  = ktime_set(0, 0);
+        list_del(&RL_BUF_RTX(rb).exp_node);
+        rtxq_exp_insert(dtp, rb);
+
+        crb = rl_buf_clone(rb, GFP_ATOMIC);
+        if (unlikely(!crb)) {
+            RPV(1, "Out of memory\n");
+        } else {
+            rb_list_enq(crb, &rrbq);
+            stats->rtx_pkt++;
+            stats->rtx_byte += rb->len;
         }
     }
 
     if (!rb_list_empty(&rrbq)) {
-        /* Halve the congestion window on retransmission. */
-        dtp->cgwin >>= 1;
-        if (unlikely(dtp->cgwin < RL_CGWIN_MIN)) {
-            dtp->cgwin = RL_CGWIN_MIN;
-        }
+        dtp_cc_loss(dtp, 0, /*timeout=*/true);
     }
 
-    if (next_exp_set) {
-        NPD("Forward rtx timer by %u\n", jiffies_to_msecs(next_exp - jiffies));
-        mod_timer(&dtp->rtx_tmr, next_exp);
-    }
+    rtxq_tmr_update(dtp);
 
     spin_unlock_bh(&dtp->lock);
 
@@ -741,17 +2346,50 @@ rtx_tmr_cb(
 
 static int rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
                                      bool maysleep);
+static void pace_tmr_cb(struct rl_hrtimer *tmr);
 
 #define TKBK_INTVAL_MSEC 2
 
+/* Bounds for the cwq of rate based flows, that holds the PDUs sent in a
+ * time period. */
+#define RL_RATE_CWQ_MIN 64
+#define RL_RATE_CWQ_MAX 4096
+
 static int
 rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
+    struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
     struct dtp *dtp        = &flow->dtp;
     struct dtcp_config *dc = &flow->cfg.dtcp;
     unsigned long mpl      = 0;
+    rlm_seq_t seqq_win     = SEQQ_MIN_LEN;
     unsigned long r;
 
+    /* Initialize the timers before anything that can fail, since
+     * dtp_fini() stops them if the flow is torn down. */
+#ifdef RL_HAVE_TIMER_SETUP
+    timer_setup(&dtp->snd_inact_tmr, snd_inact_tmr_cb, 0);
+    timer_setup(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, 0);
+#else  /* !RL_HAVE_TIMER_SETUP */
+    setup_timer(&dtp->snd_inact_tmr, snd_inact_tmr_cb, (unsigned long)flow);
+    setup_timer(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, (unsigned long)flow);
+#endif /* !RL_HAVE_TIMER_SETUP */
+    /* The RTX and A timers need a resolution finer than jiffies, since
+     * RTTs may be in the order of microseconds. */
+    rl_hrtimer_init(&dtp->rtx_tmr, rtx_tmr_cb);
+    rl_hrtimer_init(&dtp->a_tmr, a_tmr_cb);
+    rl_hrtimer_init(&dtp->pace_tmr, pace_tmr_cb);
+    dtp->flags |= DTP_F_TIMERS_INITIALIZED;
+
+    if (dc->flags & DTCP_CFG_RTX_CTRL) {
+        dtp->cc = rl_cc_lookup(dc->rtx.cc_type);
+        if (!dtp->cc) {
+            PI("Unknown congestion control %u, using newreno\n",
+               dc->rtx.cc_type);
+            dtp->cc = &rl_cc_newreno_ops;
+        }
+    }
+
     dtp_snd_reset(flow);
     dtp_rcv_reset(flow);
 
@@ -781,6 +2419,51 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
             return -EINVAL;
         }
         dtp->max_rtxq_len = flow->cfg.dtcp.rtx.max_rtxq_len;
+        if (!dtp->rtxq_ring) {
+            unsigned int slots = roundup_pow_of_two(dtp->max_rtxq_len);
+
+            dtp->rtxq_ring =
+                rl_kvzalloc(slots * sizeof(dtp->rtxq_ring[0]), RL_MT_FLOW);
+            if (!dtp->rtxq_ring) {
+                PE("Out of memory for a rtxq of %u PDUs\n",
+                   dtp->max_rtxq_len);
+                return -ENOMEM;
+            }
+            dtp->rtxq_ring_mask = slots - 1;
+        }
+        seqq_win = max_t(rlm_seq_t, seqq_win, dtp->max_rtxq_len);
+    }
+
+    if (dc->fc.fc_type == RLITE_FC_T_WIN) {
+        /* The sender may go up to rcv_rwe included. */
+        seqq_win =
+            max_t(rlm_seq_t, seqq_win, dc->fc.cfg.w.initial_credit + 1);
+    } else if (dc->fc.fc_type == RLITE_FC_T_RATE) {
+        if (!dc->fc.cfg.r.sender_rate || !dc->fc.cfg.r.time_period) {
+            PE("Invalid rate based flow control parameters (%llu PDUs "
+               "every %llu us)\n",
+               (long long unsigned)dc->fc.cfg.r.sender_rate,
+               (long long unsigned)dc->fc.cfg.r.time_period);
+            return -EINVAL;
+        }
+    }
+
+    if (!dtp->seqq_ring) {
+        unsigned int slots =
+            roundup_pow_of_two(min_t(rlm_seq_t, seqq_win, SEQQ_MAX_LEN));
+
+        /* The bitmap of the occupied slots follows the ring. */
+        dtp->seqq_ring =
+            rl_kvzalloc(slots * sizeof(dtp->seqq_ring[0]) +
+                            BITS_TO_LONGS(slots) * sizeof(unsigned long),
+                        RL_MT_FLOW);
+        if (!dtp->seqq_ring) {
+            PE("Out of memory for a seqq of %u PDUs\n", slots);
+            return -ENOMEM;
+        }
+        dtp->seqq_bmap      = (unsigned long *)(dtp->seqq_ring + slots);
+        dtp->seqq_ring_mask = slots - 1;
+        dtp->seqq_ipcp_mem  = &priv->seqq_mem;
     }
 
     r = msecs_to_jiffies(flow->cfg.dtcp.rtx.initial_rtx_timeout) *
@@ -790,24 +2473,25 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     dtp->mpl_r_a = mpl + r + msecs_to_jiffies(flow->cfg.dtcp.initial_a);
     PV("MPL+R+A = %u ms\n", jiffies_to_msecs(dtp->mpl_r_a));
 
-#ifdef RL_HAVE_TIMER_SETUP
-    timer_setup(&dtp->snd_inact_tmr, snd_inact_tmr_cb, 0);
-    timer_setup(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, 0);
-    timer_setup(&dtp->rtx_tmr, rtx_tmr_cb, 0);
-    timer_setup(&dtp->a_tmr, a_tmr_cb, 0);
-#else  /* !RL_HAVE_TIMER_SETUP */
-    setup_timer(&dtp->snd_inact_tmr, snd_inact_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->rcv_inact_tmr, rcv_inact_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->rtx_tmr, rtx_tmr_cb, (unsigned long)flow);
-    setup_timer(&dtp->a_tmr, a_tmr_cb, (unsigned long)flow);
-#endif /* !RL_HAVE_TIMER_SETUP */
-    dtp->flags |= DTP_F_TIMERS_INITIALIZED;
-
-    dtp->rtt        = msecs_to_jiffies(flow->cfg.dtcp.rtx.initial_rtx_timeout);
-    dtp->rtt_stddev = 1;
+    /* Until the first sample, the RTO is the configured one. */
+    dtp->srtt_us   = flow->cfg.dtcp.rtx.initial_rtx_timeout * USEC_PER_MSEC
+                     << 3;
+    dtp->rttvar_us = 0;
+    dtp->flags &= ~DTP_F_RTT_VALID;
+    dtp_rto_update(flow);
 
     if (dc->fc.fc_type == RLITE_FC_T_WIN) {
         dtp->max_cwq_len = dc->fc.cfg.w.max_cwq_len;
+    } else if (dc->fc.fc_type == RLITE_FC_T_RATE) {
+        /* Spread sender_rate PDUs evenly over each time period, rather
+         * than letting them out in a burst at the start of the period. */
+        uint64_t ns = div64_u64(dc->fc.cfg.r.time_period * NSEC_PER_USEC,
+                                dc->fc.cfg.r.sender_rate);
+
+        dtp->pace_ns     = max_t(uint64_t, ns, 1);
+        dtp->pace_next   = ktime_get();
+        dtp->max_cwq_len = clamp_t(uint64_t, dc->fc.cfg.r.sender_rate,
+                                   RL_RATE_CWQ_MIN, RL_RATE_CWQ_MAX);
     }
 
     if (flow->cfg.dtcp.flags & (DTCP_CFG_FLOW_CTRL | DTCP_CFG_RTX_CTRL)) {
@@ -846,50 +2530,6 @@ rl_normal_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     return 0;
 }
 
-/* Internet checksum computation is endianness independent, so it can be
- * performed in host order. The caller is expected to store the result in
- * host order. */
-static uint32_t
-inet_csum(const void *data, uint16_t len, uint32_t sum /* host endianness */)
-{
-    const uint8_t *addr = data;
-    uint32_t i;
-#if 0
-    char *sbuf = kmalloc(len * 2 + 10, GFP_ATOMIC);
-    for (i = 0; i < len; i++) {
-        sprintf(sbuf + 2 * i, "%02x", addr[i]);
-    }
-    printk("pkt: %s\n", sbuf);
-    kfree(sbuf);
-#endif
-
-    /* Checksum all the pairs of bytes first... */
-    for (i = 0; i < (len & ~1U); i += 2) {
-        sum += (u_int16_t)(*((u_int16_t *)(addr + i)));
-        if (sum > 0xFFFF)
-            sum -= 0xFFFF;
-    }
-    /*
-     * If there's a single byte left over, checksum it, too.
-     * Network byte order is big-endian, but we need to interpret
-     * it in host order.
-     */
-    if (i < len) {
-        sum += ntohs(addr[i] << 8);
-        if (sum > 0xFFFF)
-            sum -= 0xFFFF;
-    }
-
-    return sum;
-}
-
-static inline uint16_t
-inet_wrapsum(uint32_t sum)
-{
-    sum = ~sum & 0xFFFF;
-    return sum; /* host endianness */
-}
-
 static int
 rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
                 struct rl_buf *rb, unsigned flags)
@@ -917,6 +2557,8 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
              * can, we sleep waiting for the IPCP to become available
              * again. */
             if (maysleep) {
+                struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+
                 if (signal_pending(current)) {
                     rl_buf_free(rb);
                     rb  = NULL;
@@ -924,6 +2566,11 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
                     break;
                 }
 
+                /* The N-1 flow is congested: this is where a queue
+                 * builds up when there is no PDU scheduler. */
+                if (READ_ONCE(priv->ecn_thresh)) {
+                    rl_pdu_ecn_mark(priv, rb);
+                }
                 schedule();
                 continue;
             }
@@ -956,6 +2603,129 @@ rmt_tx_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
     return ret;
 }
 
+/* Maximum number of PDUs dequeued from a PDU scheduler in a batch, and
+ * so maximum length of a train. */
+#define RMT_TRAIN_MAX 32
+
+/* Transmit a train of PDUs directed to the same N-1 flow. If the lower IPCP
+ * supports it, the whole train is passed down with a single call. The train
+ * is always consumed, since the callers set RL_RMT_F_CONSUME. */
+static void
+rmt_tx_train_to_lower(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
+                      struct rb_list *train, unsigned flags)
+{
+    struct ipcp_entry *lower_ipcp = lower_flow->txrx.ipcp;
+    bool maysleep                 = flags & RL_RMT_F_MAYSLEEP;
+    DECLARE_WAITQUEUE(wait, current);
+    struct rl_buf *rb, *tmp;
+
+    if (!lower_ipcp->ops.sdu_write_train) {
+        rb_list_foreach_safe (rb, tmp, train) {
+            rb_list_del(rb);
+            rmt_tx_to_lower(ipcp, lower_flow, rb, flags);
+        }
+        return;
+    }
+
+    if (maysleep) {
+        add_wait_queue(lower_flow->txrx.tx_wqh, &wait);
+    }
+
+    for (;;) {
+        int ret;
+
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        ret = lower_ipcp->ops.sdu_write_train(lower_ipcp, lower_flow, train,
+                                              flags & (~RL_RMT_F_CONSUME));
+        if (ret != -EAGAIN || rb_list_empty(train)) {
+            break;
+        }
+
+        /* Backpressure on the rest of the train. */
+        if (maysleep && !signal_pending(current)) {
+            struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
+
+            /* The N-1 flow is congested, mark the PDUs that are going
+             * to wait, as rmt_tx_to_lower() does. */
+            if (READ_ONCE(priv->ecn_thresh)) {
+                rb_list_foreach (rb, train) {
+                    rl_pdu_ecn_mark(priv, rb);
+                }
+            }
+            schedule();
+            continue;
+        }
+        break;
+    }
+
+    __set_current_state(TASK_RUNNING);
+    if (maysleep) {
+        remove_wait_queue(lower_flow->txrx.tx_wqh, &wait);
+    }
+
+    if (!rb_list_empty(train)) {
+        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+
+        rb_list_foreach_safe (rb, tmp, train) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+            stats->rmt.queue_drop++;
+        }
+    }
+}
+
+/* Transmit a list of PDUs coming out of a PDU scheduler, grouping the
+ * consecutive ones directed to the same N-1 flow into trains. */
+static void
+rmt_tx_trains(struct ipcp_entry *ipcp, struct rb_list *rbs, unsigned flags)
+{
+    while (!rb_list_empty(rbs)) {
+        struct rl_buf *rb             = rb_list_front(rbs);
+        struct flow_entry *lower_flow = RL_BUF_RMT(rb).lower_flow;
+        struct rb_list train;
+
+        BUG_ON(!lower_flow);
+        rb_list_init(&train);
+        for (;;) {
+            rb_list_del(rb);
+            rb_list_enq(rb, &train);
+            if (rb_list_empty(rbs)) {
+                break;
+            }
+            rb = rb_list_front(rbs);
+            if (RL_BUF_RMT(rb).lower_flow != lower_flow) {
+                break;
+            }
+        }
+
+        rmt_tx_train_to_lower(ipcp, lower_flow, &train, flags);
+    }
+}
+
+/* Dequeue a PDU from a PDU scheduler, accounting for the time it spent
+ * queued. Called under the scheduler lock. */
+static inline struct rl_buf *
+rl_sched_deq(struct rl_sched *sched, ktime_t now)
+{
+    struct rl_buf *rb = sched->ops.deq(sched);
+
+    if (rb) {
+        rl_lat_hist_add(&RL_BUF_RMT(rb).lower_flow->lat.rmtq,
+                        ktime_us_delta(now, RL_BUF_RMT(rb).enq_time));
+    }
+
+    return rb;
+}
+
+/* Map an N-1 flow to the scheduler shard in charge of it. */
+static inline struct rl_sched *
+rl_sched_shard(struct rl_sched_mq *sched_mq, struct flow_entry *lower_flow)
+{
+    return sched_mq->shards[lower_flow->local_port &
+                            (sched_mq->num_shards - 1)];
+}
+
 static int
 rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 {
@@ -963,6 +2733,7 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
     struct flow_entry *lower_flow;
     struct rl_pci_match match;
     struct rl_normal *priv = ipcp->priv;
+    struct rl_sched_mq *sched_mq;
     struct rl_sched *sched;
     int ret = 0;
 
@@ -999,31 +2770,35 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 
     /* This SDU will be sent to a remote IPCP, using an N-1 flow. */
 
-    sched = priv->sched;
-    if (!sched) {
+    sched_mq = priv->sched;
+    if (!sched_mq) {
         /* Direct path, bypassing the PDU scheduler. */
         return rmt_tx_to_lower(ipcp, lower_flow, rb, flags);
 
     } else {
-        /* PDU scheduler path. */
+        /* PDU scheduler path. Only the shard that serves the selected
+         * N-1 flow is involved, so that senders directed to different
+         * N-1 flows do not contend on the same lock. */
         struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
         bool maysleep               = flags & RL_RMT_F_MAYSLEEP;
         DECLARE_WAITQUEUE(wait, current);
 
+        sched                     = rl_sched_shard(sched_mq, lower_flow);
         RL_BUF_RMT(rb).lower_flow = lower_flow;
 
         if (!maysleep) {
-            struct rl_buf *drb, *tmp;
             struct rb_list drbs;
 
             rb_list_init(&drbs);
 
             spin_lock_bh(&sched->qlock);
+            RL_BUF_RMT(rb).enq_time = ktime_get();
             while (sched->ops.enq(sched, rb)) {
                 /* The queue backlog is becoming too large.
                  * Since we cannot sleep, we help the dequeuer to do its
                  * job, rather than dropping. */
-                struct rl_buf *drb = sched->ops.deq(sched);
+                struct rl_buf *drb =
+                    rl_sched_deq(sched, RL_BUF_RMT(rb).enq_time);
 
                 BUG_ON(!drb);
                 rb_list_enq(drb, &drbs);
@@ -1033,13 +2808,7 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
             rb = NULL;
 
             /* We cannot backpressure here, so we need to force consumption. */
-            flags |= RL_RMT_F_CONSUME;
-            rb_list_foreach_safe (drb, tmp, &drbs) {
-                rb_list_del(drb);
-                lower_flow = RL_BUF_RMT(drb).lower_flow;
-                BUG_ON(!lower_flow);
-                rmt_tx_to_lower(ipcp, lower_flow, drb, flags);
-            }
+            rmt_tx_trains(ipcp, &drbs, flags | RL_RMT_F_CONSUME);
         } else {
             add_wait_queue(&sched->wqh, &wait);
             for (;;) {
@@ -1047,7 +2816,8 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
 
                 set_current_state(TASK_INTERRUPTIBLE);
                 spin_lock_bh(&sched->qlock);
-                err = sched->ops.enq(sched, rb);
+                RL_BUF_RMT(rb).enq_time = ktime_get();
+                err                     = sched->ops.enq(sched, rb);
                 spin_unlock_bh(&sched->qlock);
                 if (err == 0) {
                     /* PDU enqueued to the scheduler. */
@@ -1069,61 +2839,159 @@ rmt_tx(struct ipcp_entry *ipcp, struct rl_buf *rb, unsigned flags)
             remove_wait_queue(&sched->wqh, &wait);
         }
 
-        /* Kick the dequeuer, since we (most likely) enqueued a new PDU. */
-        schedule_work(&priv->sched_deq_work);
+        /* Kick the dequeuer, since we (most likely) enqueued a new PDU. */
+        schedule_work(&sched->deq_work);
+    }
+
+    return ret;
+}
+
+static void
+sched_deq_worker(struct work_struct *w)
+{
+    struct rl_sched *sched = container_of(w, struct rl_sched, deq_work);
+    struct rl_normal *priv = sched->normal;
+    struct rb_list ready;
+
+    rb_list_init(&ready);
+
+    for (;;) {
+        struct rl_buf *rb;
+        ktime_t now;
+        int i;
+
+        /* Dequeue a batch of PDUs. */
+        spin_lock_bh(&sched->qlock);
+        now = ktime_get();
+        for (i = 0; i < RMT_TRAIN_MAX; i++) {
+            rb = rl_sched_deq(sched, now);
+            if (!rb) {
+                break;
+            }
+            rb_list_enq(rb, &ready);
+        }
+        spin_unlock_bh(&sched->qlock);
+
+        if (rb_list_empty(&ready)) {
+            /* No more PDUs to dequeue, we can stop. */
+            break;
+        }
+
+        /* Transmit the PDUs out of the scheduler lock, in trains. */
+        rmt_tx_trains(priv->ipcp, &ready, RL_RMT_F_MAYSLEEP | RL_RMT_F_CONSUME);
+
+        if (true) {
+            /* Wake up processes that may be blocked waiting for more space on
+             * the scheduler queue. */
+            wake_up_interruptible_poll(&sched->wqh,
+                                       POLLOUT | POLLWRBAND | POLLWRNORM);
+        }
+    }
+}
+
+static void
+rl_sched_mq_free(struct rl_sched_mq *sched_mq)
+{
+    unsigned int i;
+
+    for (i = 0; i < sched_mq->num_shards; i++) {
+        struct rl_sched *sched = sched_mq->shards[i];
+
+        if (!sched) {
+            continue;
+        }
+        cancel_work_sync(&sched->deq_work);
+        if (sched->ops.fini) {
+            sched->ops.fini(sched);
+        }
+        rl_free(sched, RL_MT_SHIM);
+    }
+
+    rl_free(sched_mq, RL_MT_SHIM);
+}
+
+/* Allocate a multi-queue PDU scheduler, with one shard for each online
+ * CPU (up to a maximum). */
+static struct rl_sched_mq *
+rl_sched_mq_alloc(struct rl_normal *priv, struct rl_sched_ops *ops)
+{
+    struct rl_sched_mq *sched_mq;
+    unsigned int num_shards;
+    unsigned int i;
+
+    num_shards = roundup_pow_of_two(
+        min_t(unsigned int, num_online_cpus(), RL_SCHED_SHARDS_MAX));
+    sched_mq = rl_alloc(sizeof(*sched_mq) +
+                            num_shards * sizeof(sched_mq->shards[0]),
+                        GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+    if (!sched_mq) {
+        return NULL;
+    }
+    sched_mq->num_shards = num_shards;
+
+    for (i = 0; i < num_shards; i++) {
+        struct rl_sched *sched;
+
+        sched = rl_alloc(sizeof(*sched) + ops->priv_size,
+                         GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
+        if (!sched) {
+            goto err;
+        }
+
+        sched->ops = *ops;
+        INIT_LIST_HEAD(&sched->ops.node);
+        if (sched->ops.init(sched)) {
+            rl_free(sched, RL_MT_SHIM);
+            goto err;
+        }
+
+        spin_lock_init(&sched->qlock);
+        init_waitqueue_head(&sched->wqh);
+        INIT_WORK(&sched->deq_work, sched_deq_worker);
+        sched->normal       = priv;
+        sched_mq->shards[i] = sched;
     }
 
-    return ret;
+    return sched_mq;
+err:
+    rl_sched_mq_free(sched_mq);
+
+    return NULL;
 }
 
-static void
-sched_deq_worker(struct work_struct *w)
+/* Dump the statistics of all the scheduler shards into a string. */
+static int
+rl_sched_stats(struct rl_normal *priv, char *buf, int buflen)
 {
-    struct rl_normal *priv = container_of(w, struct rl_normal, sched_deq_work);
-    struct rl_sched *sched = priv->sched;
-    struct rb_list ready;
+    struct rl_sched_mq *sched_mq = priv->sched;
+    unsigned int i;
+    int n = 0;
 
-    if (unlikely(!sched)) {
-        return;
+    if (!sched_mq || !sched_mq->shards[0]->ops.stats) {
+        return -ENXIO;
     }
 
-    rb_list_init(&ready);
-
-    for (;;) {
-        struct rl_buf *rb, *tmp;
-        int i;
-
-        /* Dequeue a batch of PDUs. */
-        spin_lock_bh(&sched->qlock);
-        for (i = 0; i < 8; i++) {
-            rb = sched->ops.deq(sched);
-            if (!rb) {
-                break;
-            }
-            rb_list_enq(rb, &ready);
-        }
-        spin_unlock_bh(&sched->qlock);
+    buf[0] = '\0';
+    for (i = 0; i < sched_mq->num_shards && n < buflen - 1; i++) {
+        struct rl_sched *sched = sched_mq->shards[i];
+        int prefix;
+        int ret;
 
-        if (rb_list_empty(&ready)) {
-            /* No more PDUs to dequeue, we can stop. */
+        prefix = snprintf(buf + n, buflen - n, "%s[%u] ", n ? " " : "", i);
+        if (n + prefix >= buflen - 1) {
             break;
         }
-
-        /* Transmit the PDUs out of the scheduler lock. */
-        rb_list_foreach_safe (rb, tmp, &ready) {
-            rb_list_del(rb);
-            BUG_ON(!RL_BUF_RMT(rb).lower_flow);
-            rmt_tx_to_lower(priv->ipcp, RL_BUF_RMT(rb).lower_flow, rb,
-                            RL_RMT_F_MAYSLEEP | RL_RMT_F_CONSUME);
-        }
-
-        if (true) {
-            /* Wake up processes that may be blocked waiting for more space on
-             * the scheduler queue. */
-            wake_up_interruptible_poll(&sched->wqh,
-                                       POLLOUT | POLLWRBAND | POLLWRNORM);
+        spin_lock_bh(&sched->qlock);
+        ret = sched->ops.stats(sched, buf + n + prefix, buflen - n - prefix);
+        spin_unlock_bh(&sched->qlock);
+        if (ret > 0) {
+            n += prefix + ret;
+        } else {
+            buf[n] = '\0'; /* nothing to report for this shard */
         }
     }
+
+    return 0;
 }
 
 /* Replace the current PDU scheduler with a new one ('ops'), which
@@ -1133,11 +3001,11 @@ sched_deq_worker(struct work_struct *w)
 static int
 rl_sched_replace(struct rl_normal *priv, const char *sched_name)
 {
-    struct rl_sched_ops *ops = NULL;
-    struct rl_sched *sched   = NULL;
-    struct rl_sched *old     = priv->sched;
+    struct rl_sched_ops *ops     = NULL;
+    struct rl_sched_mq *sched_mq = NULL;
+    struct rl_sched_mq *old      = priv->sched;
 
-    if (old && sched_name && !strcmp(old->ops.name, sched_name)) {
+    if (old && sched_name && !strcmp(old->shards[0]->ops.name, sched_name)) {
         /* Nothing to do. */
         return 0;
     }
@@ -1165,30 +3033,16 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
     }
 
     if (ops) {
-        sched = rl_alloc(sizeof(*sched) + ops->priv_size,
-                         GFP_KERNEL | __GFP_ZERO, RL_MT_SHIM);
-        if (!sched) {
-            return -1;
-        }
-
-        sched->ops = *ops;
-        INIT_LIST_HEAD(&sched->ops.node);
-        if (sched->ops.init(sched)) {
-            rl_free(sched, RL_MT_SHIM);
+        sched_mq = rl_sched_mq_alloc(priv, ops);
+        if (!sched_mq) {
             return -1;
         }
-
-        spin_lock_init(&sched->qlock);
-        init_waitqueue_head(&sched->wqh);
     }
 
-    priv->sched = sched;
+    priv->sched = sched_mq;
 
     if (old) {
-        if (old->ops.fini) {
-            old->ops.fini(old);
-        }
-        rl_free(old, RL_MT_SHIM);
+        rl_sched_mq_free(old);
     }
 
     return 0;
@@ -1198,41 +3052,172 @@ rl_sched_replace(struct rl_normal *priv, const char *sched_name)
 static int
 rl_rtxq_push(struct flow_entry *flow, struct rl_buf *rb)
 {
-    struct rl_buf *crb = rl_buf_clone(rb, GFP_ATOMIC);
-    struct dtp *dtp    = &flow->dtp;
+    struct dtp *dtp = &flow->dtp;
+    struct rl_buf **slot;
+    struct rl_buf *crb;
+
+    if (unlikely(!dtp->rtxq_ring)) {
+        return -ENOMEM; /* see rl_normal_flow_init() */
+    }
+
+    slot = &dtp->rtxq_ring[RL_BUF_PCI(rb)->seqnum & dtp->rtxq_ring_mask];
+    if (unlikely(*slot)) {
+        RPD(1, "No rtxq slot for [%lu]\n",
+            (long unsigned)RL_BUF_PCI(rb)->seqnum);
+        return -ENOSPC;
+    }
 
+    crb = rl_buf_clone(rb, GFP_ATOMIC);
     if (unlikely(!crb)) {
         RPV(1, "Out of memory\n");
         return -ENOMEM;
     }
 
     /* Record the rtx expiration time and current time. */
-    RL_BUF_RTX(crb).jiffies     = jiffies;
-    RL_BUF_RTX(crb).rtx_jiffies = RL_BUF_RTX(crb).jiffies + rtt_to_rtx(flow);
+    RL_BUF_RTX(crb).tx_time  = ktime_get();
+    RL_BUF_RTX(crb).rtx_time =
+        ktime_add(RL_BUF_RTX(crb).tx_time, rtt_to_rtx(flow));
 
-    /* Add to the rtx queue and start the rtx timer if not already
-     * started. */
+    /* Add to the rtx queue and start the rtx timer if this is the
+     * first PDU to expire. */
+    *slot = crb;
     rb_list_enq(crb, &dtp->rtxq);
+    rtxq_exp_insert(dtp, crb);
     dtp->rtxq_len++;
-    if (!timer_pending(&dtp->rtx_tmr)) {
-        NPD("Forward rtx timer by %u\n",
-            jiffies_to_msecs(RL_BUF_RTX(crb).rtx_jiffies - jiffies));
-        mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(crb).rtx_jiffies);
+    if (rtxq_exp_front(dtp) == crb) {
+        NPD("Forward rtx timer by %u us\n", dtp->rto_us);
+        rl_hrtimer_mod(&dtp->rtx_tmr, RL_BUF_RTX(crb).rtx_time);
     }
     NPD("cloning [%lu] into rtxq\n", (long unsigned)RL_BUF_PCI(crb)->seqnum);
 
     return 0;
 }
 
+/* Take a pacing slot for a PDU departing at @now. Credit is not
+ * accumulated while the flow is idle, apart from one slot that absorbs
+ * the lateness of the pacing timer. Called under DTP lock. */
+static inline void
+dtp_pace_advance(struct dtp *dtp, ktime_t now)
+{
+    ktime_t oldest = ktime_sub_ns(now, dtp->pace_ns);
+
+    if (ktime_compare(dtp->pace_next, oldest) < 0) {
+        dtp->pace_next = oldest;
+    }
+    dtp->pace_next = ktime_add_ns(dtp->pace_next, dtp->pace_ns);
+}
+
+/* Release the cwq PDUs whose departure time has come, and rearm for the
+ * next one. */
+static void
+pace_tmr_cb(struct rl_hrtimer *tmr)
+{
+    struct flow_entry *flow =
+        container_of(tmr, struct flow_entry, dtp.pace_tmr);
+    struct ipcp_entry *ipcp     = flow->txrx.ipcp;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    struct rl_buf *rb, *tmp;
+    struct rb_list qrbs;
+    ktime_t now;
+
+    rb_list_init(&qrbs);
+
+    spin_lock_bh(&dtp->lock);
+    now = ktime_get();
+    while (!rb_list_empty(&dtp->cwq) &&
+           ktime_compare(now, dtp->pace_next) >= 0) {
+        rb = rb_list_front(&dtp->cwq);
+        rb_list_del(rb);
+        dtp->cwq_len--;
+        dtp_pace_advance(dtp, now);
+        dtp->last_seq_num_sent = RL_BUF_PCI(rb)->seqnum;
+        if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
+            rl_rtxq_push(flow, rb);
+        }
+        rb_list_enq(rb, &qrbs);
+        stats->tx_pkt++;
+        stats->tx_byte += rb->len;
+    }
+    if (!rb_list_empty(&dtp->cwq)) {
+        rl_hrtimer_mod(&dtp->pace_tmr, dtp->pace_next);
+    }
+    spin_unlock_bh(&dtp->lock);
+
+    if (rb_list_empty(&qrbs)) {
+        return;
+    }
+
+    rb_list_foreach_safe (rb, tmp, &qrbs) {
+        NPD("sending [%lu] from cwq\n", (long unsigned)RL_BUF_PCI(rb)->seqnum);
+        rb_list_del(rb);
+        rmt_tx(ipcp, rb, RL_RMT_F_CONSUME);
+    }
+
+    /* Room has been made in the cwq. */
+    rl_write_restart_flow(flow);
+}
+
+/* The rtxq is full when max_rtxq_len seqnums have been allocated after
+ * the oldest unacked one, which is in the rtxq or, if that is empty, in
+ * the cwq. This bounds the span of seqnums in the rtxq ring. */
+/* Whether the rtxq would exceed max_rtxq_len seqnums if @n more PDUs
+ * were sent. */
+static inline bool
+rtxq_full(struct dtp *dtp, unsigned int n)
+{
+    struct rb_list *q = rb_list_empty(&dtp->rtxq) ? &dtp->cwq : &dtp->rtxq;
+
+    if (rb_list_empty(q)) {
+        return false;
+    }
+
+    return dtp->next_seq_num_to_use + n - 1 -
+               RL_BUF_PCI(rb_list_front(q))->seqnum >=
+           dtp->max_rtxq_len;
+}
+
+/* Whether writing @n more PDUs would hit backpressure at some point.
+ * A train longer than what the flow can ever hold (e.g. a large
+ * fragmented SDU) only needs the flow to be drained, as its last PDUs
+ * will have to wait for room anyway. */
+static inline bool
+flow_blocked_n(struct rl_flow_config *cfg, struct dtp *dtp, unsigned int n)
+{
+    rlm_seq_t last = dtp->next_seq_num_to_use + n - 1;
+    unsigned int need;
+
+    if (cfg->dtcp.fc.fc_type == RLITE_FC_T_WIN && last > dtp->snd_rwe) {
+        /* The PDUs beyond the sender window go to the cwq. */
+        need = min_t(uint64_t, n, last - dtp->snd_rwe);
+        need = min(need, max(dtp->max_cwq_len, 1U));
+        if (dtp->cwq_len + need > dtp->max_cwq_len) {
+            return true;
+        }
+    } else if (cfg->dtcp.fc.fc_type == RLITE_FC_T_RATE) {
+        /* Any PDU may have to wait in the cwq for the pacing timer. */
+        need = min(n, max(dtp->max_cwq_len, 1U));
+        if (dtp->cwq_len + need > dtp->max_cwq_len) {
+            return true;
+        }
+    }
+
+    if (cfg->dtcp.flags & DTCP_CFG_RTX_CTRL) {
+        need = min(n, max(dtp->cgwin, 1U));
+        if (dtp->next_seq_num_to_use + need - 1 - dtp->snd_lwe >
+                dtp->cgwin ||
+            rtxq_full(dtp, min(n, max(dtp->max_rtxq_len, 1U)))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static inline bool
 flow_blocked(struct rl_flow_config *cfg, struct dtp *dtp)
 {
-    return (cfg->dtcp.fc.fc_type == RLITE_FC_T_WIN &&
-            dtp->next_seq_num_to_use > dtp->snd_rwe &&
-            dtp->cwq_len >= dtp->max_cwq_len) ||
-           ((cfg->dtcp.flags & DTCP_CFG_RTX_CTRL) &&
-            ((dtp->next_seq_num_to_use - dtp->snd_lwe) > dtp->cgwin ||
-             dtp->rtxq_len >= dtp->max_rtxq_len));
+    return flow_blocked_n(cfg, dtp, 1);
 }
 
 static bool
@@ -1241,6 +3226,12 @@ rl_normal_flow_writeable(struct flow_entry *flow)
     return !flow_blocked(&flow->cfg, &flow->dtp);
 }
 
+static bool
+rl_normal_flow_tx_room(struct flow_entry *flow, unsigned int n)
+{
+    return !flow_blocked_n(&flow->cfg, &flow->dtp, n);
+}
+
 static int
 rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                     struct rl_buf *rb, unsigned flags)
@@ -1318,7 +3309,8 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     pci->dst_cep   = flow->remote_cep;
     pci->src_cep   = flow->local_cep;
     pci->pdu_type  = PDU_T_DT;
-    pci->pdu_flags = 0;
+    pci->pdu_flags = ((flags & RL_RMT_F_FRAG_MORE) ? PDU_F_MF : 0) |
+                     ((flags & RL_RMT_F_FRAG_CONT) ? PDU_F_CF : 0);
     pci->pdu_len = len = rb->len;
     pci->pdu_ttl       = priv->ttl;
     pci->pdu_csum      = 0;
@@ -1330,7 +3322,7 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     }
 
     if (priv->csum) {
-        pci->pdu_csum = inet_wrapsum(inet_csum(pci, len, 0));
+        pci->pdu_csum = pdu_csum_compute(priv, pci, len);
     }
 
     if (!dtcp_present) {
@@ -1357,6 +3349,26 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
             dtp->last_seq_num_sent = pci->seqnum;
             NPD("sending [%lu] through sender window\n",
                 (long unsigned)pci->seqnum);
+        } else if (dc->fc.fc_type == RLITE_FC_T_RATE) {
+            ktime_t now = ktime_get();
+
+            if (dtp->cwq_len || ktime_compare(now, dtp->pace_next) < 0) {
+                /* Too early for this PDU, or others are waiting: let
+                 * the pacing timer send it. Because of the check above,
+                 * we are sure that dtp->cwq_len < dtp->max_cwq_len. */
+                rb_list_enq(rb, &dtp->cwq);
+                dtp->cwq_len++;
+                if (!rl_hrtimer_pending(&dtp->pace_tmr)) {
+                    rl_hrtimer_mod(&dtp->pace_tmr, dtp->pace_next);
+                }
+                mod_timer(&dtp->snd_inact_tmr, jiffies + 3 * dtp->mpl_r_a);
+                spin_unlock_bh(&dtp->lock);
+
+                return 0;
+            }
+            /* POL: TxControl. */
+            dtp_pace_advance(dtp, now);
+            dtp->last_seq_num_sent = pci->seqnum;
         }
 
         if (rb && (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL)) {
@@ -1387,6 +3399,8 @@ rl_normal_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
 
     spin_unlock_bh(&dtp->lock);
 
+    /* Fragmentation flags are for DTP only. */
+    flags &= ~(RL_RMT_F_FRAG_MORE | RL_RMT_F_FRAG_CONT);
     ret = rmt_tx(ipcp, rb, flags);
     if (likely(ret != -EAGAIN)) {
         stats->tx_pkt++;
@@ -1463,7 +3477,7 @@ rl_normal_mgmt_sdu_build(struct ipcp_entry *ipcp,
     pci->seqnum    = 0; /* Not valid. */
 
     if (priv->csum) {
-        pci->pdu_csum = inet_wrapsum(inet_csum(pci, rb->len, 0));
+        pci->pdu_csum = pdu_csum_compute(priv, pci, rb->len);
     }
 
     /* Caller can proceed and send the mgmt PDU. */
@@ -1484,14 +3498,38 @@ rl_normal_config(struct ipcp_entry *ipcp, const char *param_name,
         ret = rl_configstr_to_u16(param_value, &priv->ttl, NULL);
     } else if (strcmp(param_name, "csum") == 0) {
         if (strcmp(param_value, "none") == 0 || strcmp(param_value, "") == 0) {
-            priv->csum = false;
+            priv->csum = RL_CSUM_NONE;
             ret        = 0;
         } else if (strcmp(param_value, "inet") == 0) {
-            priv->csum = true;
+            priv->csum = RL_CSUM_INET;
+            ret        = 0;
+        } else if (strcmp(param_value, "crc32c") == 0) {
+            priv->csum = RL_CSUM_CRC32C;
             ret        = 0;
         } else {
             ret = -EINVAL;
         }
+    } else if (strcmp(param_name, "ecn-thresh") == 0) {
+        uint32_t thresh;
+
+        ret = rl_configstr_to_u32(param_value, &thresh, NULL);
+        if (ret == 0) {
+            WRITE_ONCE(priv->ecn_thresh, thresh);
+        }
+    } else if (strcmp(param_name, "seqq-mem-max") == 0) {
+        uint32_t limit;
+
+        ret = rl_configstr_to_u32(param_value, &limit, NULL);
+        if (ret == 0) {
+            WRITE_ONCE(priv->seqq_mem_max, limit);
+        }
+    } else if (strcmp(param_name, "seqq-flow-mem-max") == 0) {
+        uint32_t limit;
+
+        ret = rl_configstr_to_u32(param_value, &limit, NULL);
+        if (ret == 0) {
+            WRITE_ONCE(priv->seqq_flow_mem_max, limit);
+        }
     } else if (strcmp(param_name, "sched") == 0) {
         if (!strcmp(param_value, "none")) {
             param_value = NULL;
@@ -1514,11 +3552,30 @@ rl_normal_config_get(struct ipcp_entry *ipcp, const char *param_name, char *buf,
     } else if (strcmp(param_name, "ttl") == 0) {
         snprintf(buf, buflen, "%u", priv->ttl);
     } else if (strcmp(param_name, "csum") == 0) {
-        const char *value = priv->csum ? "inet" : "none";
+        const char *value = "none";
+
+        if (priv->csum == RL_CSUM_INET) {
+            value = "inet";
+        } else if (priv->csum == RL_CSUM_CRC32C) {
+            value = "crc32c";
+        }
         snprintf(buf, buflen, "%s", value);
+    } else if (strcmp(param_name, "ecn-thresh") == 0) {
+        snprintf(buf, buflen, "%u", priv->ecn_thresh);
+    } else if (strcmp(param_name, "seqq-mem-max") == 0) {
+        snprintf(buf, buflen, "%u", priv->seqq_mem_max);
+    } else if (strcmp(param_name, "seqq-flow-mem-max") == 0) {
+        snprintf(buf, buflen, "%u", priv->seqq_flow_mem_max);
+    } else if (strcmp(param_name, "seqq-mem") == 0) {
+        snprintf(buf, buflen, "%ld", atomic_long_read(&priv->seqq_mem));
     } else if (strcmp(param_name, "sched") == 0) {
-        const char *value = priv->sched ? priv->sched->ops.name : "none";
+        const char *value =
+            priv->sched ? priv->sched->shards[0]->ops.name : "none";
         snprintf(buf, buflen, "%s", value);
+    } else if (strcmp(param_name, "pduft-stats") == 0) {
+        rl_pduft_stats(priv, buf, buflen);
+    } else if (strcmp(param_name, "sched-stats") == 0) {
+        ret = rl_sched_stats(priv, buf, buflen);
     } else {
         ret = -ENOSYS; /* don't know how to manage this parameter */
     }
@@ -1530,7 +3587,9 @@ static int
 rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    int ret                = -ENOSYS;
+    struct rl_sched_ops *ops;
+    int ret = -ENOSYS;
+    unsigned int i;
 
     if (rl_ipcp_has_flows(ipcp, /*report_all=*/false)) {
         /* Do not allow scheduler changes if this IPCP is being
@@ -1542,17 +3601,33 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
     if (!priv->sched) {
         return -ENXIO;
     }
+    ops = &priv->sched->shards[0]->ops;
 
     /* Check that the configuration message matches the current
      * scheduler. */
     switch (bmsg->hdr.msg_type) {
     case RLITE_KER_IPCP_SCHED_WRR:
-        if (strcmp(rl_sched_wrr_ops.name, priv->sched->ops.name)) {
+        if (strcmp(rl_sched_wrr_ops.name, ops->name)) {
             return -ENXIO;
         }
         break;
     case RLITE_KER_IPCP_SCHED_PFIFO:
-        if (strcmp(rl_sched_pfifo_ops.name, priv->sched->ops.name)) {
+        if (strcmp(rl_sched_pfifo_ops.name, ops->name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_DRR:
+        if (strcmp(rl_sched_drr_ops.name, ops->name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_PRIO_DRR:
+        if (strcmp(rl_sched_prio_drr_ops.name, ops->name)) {
+            return -ENXIO;
+        }
+        break;
+    case RLITE_KER_IPCP_SCHED_FQ_CODEL:
+        if (strcmp(rl_sched_fq_codel_ops.name, ops->name)) {
             return -ENXIO;
         }
         break;
@@ -1561,9 +3636,16 @@ rl_normal_sched_config(struct ipcp_entry *ipcp, struct rl_msg_base *bmsg)
         break;
     }
 
-    /* Call the configuration callback, if available. */
-    if (priv->sched->ops.config) {
-        ret = priv->sched->ops.config(priv->sched, bmsg);
+    /* Call the configuration callback on each shard, if available. */
+    if (ops->config) {
+        for (i = 0; i < priv->sched->num_shards; i++) {
+            struct rl_sched *sched = priv->sched->shards[i];
+
+            ret = sched->ops.config(sched, bmsg);
+            if (ret) {
+                break;
+            }
+        }
     }
 
     return ret;
@@ -1578,18 +3660,59 @@ rl_normal_qos_supported(struct ipcp_entry *ipcp, struct rina_flow_spec *spec)
     return 0;
 }
 
+/* Fill @blocks with the ranges of PDUs sitting in the seqq, coalescing
+ * consecutive sequence numbers. Returns the number of blocks. Called
+ * under DTP lock. */
+static unsigned int
+seqq_sack_blocks(struct dtp *dtp, struct rina_sack_block *blocks)
+{
+    unsigned int size    = dtp->seqq_ring_mask + 1;
+    unsigned int nblocks = 0;
+    unsigned int d       = 0;
+
+    while (dtp->seqq_len && nblocks < RL_SACK_BLOCKS_MAX) {
+        unsigned int e;
+
+        d = seqq_find(dtp, d, /*occupied=*/true);
+        if (d >= size) {
+            break;
+        }
+        e                     = seqq_find(dtp, d, /*occupied=*/false);
+        blocks[nblocks].start = dtp->rcv_next_seq_num + d;
+        blocks[nblocks].end   = dtp->rcv_next_seq_num + e;
+        nblocks++;
+        d = e;
+    }
+
+    return nblocks;
+}
+
+/* Called under DTP lock. */
 static struct rl_buf *
 ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
                uint8_t pdu_type)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
-    struct rl_buf *rb =
-        rl_buf_alloc(sizeof(struct rina_pci_ctrl), ipcp->txhdroom,
-                     ipcp->tailroom, GFP_ATOMIC);
+    struct rina_sack_block blocks[RL_SACK_BLOCKS_MAX];
+    bool ecn_echo = flow->dtp.flags & DTP_F_ECN_SEEN;
+    unsigned int nblocks = 0;
     struct rina_pci_ctrl *pcic;
+    void *blocks_dst;
+    struct rl_buf *rb;
+    size_t len;
 
+    if ((pdu_type & PDU_T_ACK_BIT) &&
+        (pdu_type & PDU_T_ACK_MASK) == PDU_T_SACK) {
+        nblocks = seqq_sack_blocks(&flow->dtp, blocks);
+    }
+    len = sizeof(struct rina_pci_ctrl) + nblocks * sizeof(blocks[0]);
+    if (ecn_echo) {
+        len += sizeof(struct rina_ecn_echo);
+    }
+
+    rb = rl_buf_alloc(len, ipcp->txhdroom, ipcp->tailroom, GFP_ATOMIC);
     if (likely(rb)) {
-        rl_buf_append(rb, sizeof(struct rina_pci_ctrl));
+        rl_buf_append(rb, len);
         pcic                         = (struct rina_pci_ctrl *)RL_BUF_DATA(rb);
         pcic->base.dst_addr          = flow->remote_addr;
         pcic->base.src_addr          = ipcp->addr;
@@ -1597,7 +3720,7 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->base.dst_cep           = flow->remote_cep;
         pcic->base.src_cep           = flow->local_cep;
         pcic->base.pdu_type          = pdu_type;
-        pcic->base.pdu_flags         = 0;
+        pcic->base.pdu_flags         = ecn_echo ? PDU_F_ECE : 0;
         pcic->base.pdu_len           = rb->len;
         pcic->base.pdu_ttl           = priv->ttl;
         pcic->base.pdu_csum          = 0;
@@ -1609,17 +3732,63 @@ ctrl_pdu_alloc(struct ipcp_entry *ipcp, struct flow_entry *flow,
         pcic->new_lwe = flow->dtp.last_lwe_sent = flow->dtp.rcv_lwe;
         pcic->my_rwe                            = flow->dtp.snd_rwe;
         pcic->my_lwe                            = flow->dtp.snd_lwe;
+        blocks_dst                              = pcic + 1;
+        if (ecn_echo) {
+            struct rina_ecn_echo *echo = (struct rina_ecn_echo *)(pcic + 1);
+
+            echo->pkts   = flow->dtp.rcv_ecn_pkts;
+            echo->marked = flow->dtp.rcv_ecn_marked;
+            blocks_dst   = echo + 1;
+        }
+        flow->dtp.rcv_ecn_pkts   = 0;
+        flow->dtp.rcv_ecn_marked = 0;
+        flow->dtp.tx_ctrl_pdus++;
+        if (nblocks) {
+            memcpy(blocks_dst, blocks, nblocks * sizeof(blocks[0]));
+        }
         if (priv->csum) {
-            pcic->base.pdu_csum = inet_wrapsum(inet_csum(pcic, rb->len, 0));
+            pcic->base.pdu_csum =
+                pdu_csum_compute(priv, &pcic->base, rb->len);
         }
     }
 
     return rb;
 }
 
+/* Account for the DT PDU @pci in the counters echoed to the sender with
+ * the next control PDU. Returns true on the first ECN mark since the
+ * last control PDU, so that the caller can ack immediately. Called
+ * under DTP lock. */
+static inline bool
+dtp_rcv_ecn(struct flow_entry *flow, const struct rina_pci *pci)
+{
+    struct dtp *dtp = &flow->dtp;
+
+    if (!(flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL)) {
+        return false;
+    }
+
+    dtp->rcv_ecn_pkts++;
+    if (likely(!(pci->pdu_flags & PDU_F_ECN))) {
+        return false;
+    }
+    dtp->flags |= DTP_F_ECN_SEEN;
+
+    return ++dtp->rcv_ecn_marked == 1;
+}
+
 /* This must be called under DTP lock and after rcv_next_seq_num and rcv_lwe
  * have been updated.
  * POL: RcvrFlowControl, ReceivingFlowControl, RcvrAck
+ *
+ * A control PDU is sent when ack_every PDUs have been delivered (RTX) or
+ * consumed (flow control) since the last one, or when the A timer
+ * expires. The ack_every factor follows the PDU rate: it is doubled when
+ * ack_every PDUs come in less than A/8, and halved when the A timer
+ * expires (see a_tmr_cb()). With retransmission control, every PDU is
+ * acked at the start of a run and after losses (quick-ack), so that the
+ * sender can grow its congestion window quickly, and gaps are reported
+ * immediately.
  */
 static struct rl_buf *
 sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
@@ -1628,125 +3797,288 @@ sdu_rx_sv_update(struct ipcp_entry *ipcp, struct flow_entry *flow,
     const struct dtcp_config *dc = &flow->cfg.dtcp;
     rl_seq_t win_size            = dc->fc.cfg.w.initial_credit;
     unsigned int a               = dc->initial_a;
+    struct dtp *dtp              = &flow->dtp;
     bool ack                     = ack_immediate || !a;
+    rl_seq_t thresh              = ack_every_max(flow);
+    bool due                     = false;
     uint8_t pdu_type             = 0;
 
-    /* We send a flow control ack if we have more than an half window of PDUs
-     * that have been correctly consumed by the flow user but yet not published
-     * to the sender, i.e.
-     *     rcv_lwe - last_lwe_sent >= win_size/2
-     */
-    ack |= (flow->dtp.rcv_lwe - flow->dtp.last_lwe_sent >= (win_size >> 1));
-
-    /* We send a retransmission ack if we have more than an half
-     * window of PDUs that have been correctly delivered to the
-     * receive queue, but yet unacked, i.e.
-     *     rcv_next_seq_num - last_seq_num_acked >= win_size/2
-     */
-    ack |= (flow->dtp.rcv_next_seq_num - flow->dtp.last_seq_num_acked >=
-            (win_size >> 1));
+    if (!dtp->ack_quick) {
+        thresh = min_t(rl_seq_t, thresh, dtp->ack_every);
+    } else {
+        thresh = 1;
+    }
 
     if ((dc->flags & DTCP_CFG_FLOW_CTRL) &&
         (dc->fc.fc_type == RLITE_FC_T_WIN)) {
+        /* Publish the PDUs correctly consumed by the flow user, i.e.
+         *     rcv_lwe - last_lwe_sent >= thresh
+         */
+        due |= (dtp->rcv_lwe - dtp->last_lwe_sent >= thresh);
+
         /* Update the rcv_rwe, as rcv_lwe may have changed. */
-        NPD("rcv_rwe [%lu] --> [%lu]\n", (long unsigned)flow->dtp.rcv_rwe,
-            (long unsigned)(flow->dtp.rcv_lwe + win_size));
-        flow->dtp.rcv_rwe = flow->dtp.rcv_lwe + win_size;
+        NPD("rcv_rwe [%lu] --> [%lu]\n", (long unsigned)dtp->rcv_rwe,
+            (long unsigned)(dtp->rcv_lwe + win_size));
+        dtp->rcv_rwe = dtp->rcv_lwe + win_size;
+    }
 
-        if (ack) {
-            pdu_type |= PDU_T_CTRL | PDU_T_FC_BIT;
+    if (dc->flags & DTCP_CFG_RTX_CTRL) {
+        /* Ack the PDUs correctly delivered to the receive queue, i.e.
+         *     rcv_next_seq_num - last_seq_num_acked >= thresh
+         */
+        due |= (dtp->rcv_next_seq_num - dtp->last_seq_num_acked >= thresh);
+    }
+
+    if (due || ack) {
+        ktime_t now = ktime_get();
+
+        if (!ack && !dtp->ack_quick &&
+            ktime_us_delta(now, dtp->last_ack_time) <
+                a * USEC_PER_MSEC / 8) {
+            /* The PDU rate allows for more coalescing. */
+            dtp->ack_every = min_t(rl_seq_t, dtp->ack_every << 1,
+                                   ack_every_max(flow));
         }
+        dtp->last_ack_time = now;
+        ack                = true;
+    }
+
+    if (ack && (dc->flags & DTCP_CFG_FLOW_CTRL) &&
+        (dc->fc.fc_type == RLITE_FC_T_WIN)) {
+        pdu_type |= PDU_T_CTRL | PDU_T_FC_BIT;
     }
 
     if (ack && (dc->flags & DTCP_CFG_RTX_CTRL)) {
-        pdu_type |= PDU_T_CTRL | PDU_T_ACK_BIT | PDU_T_ACK;
+        /* If there are gaps, also report what we got beyond them, so
+         * that the sender can retransmit only the missing PDUs. */
+        pdu_type |= PDU_T_CTRL | PDU_T_ACK_BIT |
+                    (dtp->seqq_len ? PDU_T_SACK : PDU_T_ACK);
     }
 
     if (pdu_type) {
         NPD("ACK %s: llwe %lu lack %lu rlwe %lu rnext %lu lrwe %lu\n",
-            ack ? "immediate" : "delayed",
-            (long unsigned)flow->dtp.last_lwe_sent,
-            (long unsigned)flow->dtp.last_seq_num_acked,
-            (long unsigned)flow->dtp.rcv_lwe,
-            (long unsigned)flow->dtp.rcv_next_seq_num,
-            (long unsigned)flow->dtp.last_lwe_sent + win_size);
+            due ? "delayed" : "immediate",
+            (long unsigned)dtp->last_lwe_sent,
+            (long unsigned)dtp->last_seq_num_acked,
+            (long unsigned)dtp->rcv_lwe, (long unsigned)dtp->rcv_next_seq_num,
+            (long unsigned)dtp->last_lwe_sent + win_size);
+        if (dtp->ack_quick) {
+            dtp->ack_quick--;
+        }
         /* Stop the A timer, we are going to send a control PDU. */
-        del_timer(&flow->dtp.a_tmr);
+        rl_hrtimer_del(&dtp->a_tmr);
         return ctrl_pdu_alloc(ipcp, flow, pdu_type);
     }
 
     /* We are not sending an immediate control PDU, so we need
      * to start the A timer (if it was not already started). */
-    if (a && !timer_pending(&flow->dtp.a_tmr)) {
-        mod_timer(&flow->dtp.a_tmr, jiffies + msecs_to_jiffies(a));
+    if (a && !rl_hrtimer_pending(&dtp->a_tmr)) {
+        rl_hrtimer_mod(&dtp->a_tmr, ktime_add_ms(ktime_get(), a));
         RPV(1, "start A timer\n");
     }
 
     return NULL;
 }
 
-#define SEQQ_MAX_LEN 64
-
-/* Takes the ownership of the rb. */
+/* Takes the ownership of the rb. Called under DTP lock, with @rb
+ * beyond rcv_next_seq_num. */
 static void
 seqq_push(struct flow_entry *flow, struct rl_buf *rb)
 {
+    struct rl_normal *priv      = (struct rl_normal *)flow->txrx.ipcp->priv;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
     rl_seq_t seqnum             = RL_BUF_PCI(rb)->seqnum;
     struct dtp *dtp             = &flow->dtp;
-    struct rb_list *pos         = &dtp->seqq;
-    struct rl_buf *cur;
-
-    if (unlikely(dtp->seqq_len >= SEQQ_MAX_LEN)) {
+    rl_seq_t depth              = seqnum - dtp->rcv_next_seq_num;
+    unsigned int truesize       = rl_buf_truesize(rb);
+    uint32_t flow_mem_max       = READ_ONCE(priv->seqq_flow_mem_max);
+    uint32_t mem_max            = READ_ONCE(priv->seqq_mem_max);
+    unsigned int slot;
+    long mem;
+
+    if (unlikely(!dtp->seqq_ring || depth > dtp->seqq_ring_mask)) {
         RPD(1, "seqq overrun: dropping PDU [%lu]\n", (long unsigned)seqnum);
-        stats->rx_err++;
-        rl_buf_free(rb);
-        return;
+        goto drop;
     }
 
-    rb_list_foreach (cur, &dtp->seqq) {
-        struct rina_pci *pci = RL_BUF_PCI(cur);
+    slot = seqnum & dtp->seqq_ring_mask;
+    if (test_bit(slot, dtp->seqq_bmap)) {
+        /* This is a duplicate amongst the gaps, we can drop it. */
+        RPD(1, "Duplicate amongst the gaps [%lu] dropped\n",
+            (long unsigned)seqnum);
+        goto drop;
+    }
 
-        if (seqnum < pci->seqnum) {
-            pos = rl_buf_listnode(cur);
-            break;
-        } else if (seqnum == pci->seqnum) {
-            /* This is a duplicate amongst the gaps, we can
-             * drop it. */
-            stats->rx_err++;
-            rl_buf_free(rb);
-            RPD(1, "Duplicate amongst the gaps [%lu] dropped\n",
-                (long unsigned)seqnum);
+    if (flow_mem_max && dtp->seqq_mem + truesize > flow_mem_max) {
+        RPD(1, "seqq of flow %u over %u bytes: dropping PDU [%lu]\n",
+            flow->local_port, flow_mem_max, (long unsigned)seqnum);
+        goto drop;
+    }
 
-            return;
-        }
+    mem = atomic_long_add_return(truesize, dtp->seqq_ipcp_mem);
+    if (mem_max && mem > mem_max) {
+        atomic_long_sub(truesize, dtp->seqq_ipcp_mem);
+        RPD(1, "seqqs over %u bytes: dropping PDU [%lu]\n", mem_max,
+            (long unsigned)seqnum);
+        goto drop;
     }
 
-    /* Insert the rb right before 'pos'. */
-    rb_list_enq(rb, pos);
+    dtp->seqq_ring[slot] = rb;
+    __set_bit(slot, dtp->seqq_bmap);
     dtp->seqq_len++;
+    dtp->seqq_mem += truesize;
+    if (depth > dtp->seqq_depth_max) {
+        dtp->seqq_depth_max = depth;
+    }
     stats->rx_pkt++;
     stats->rx_byte += rb->len;
     RPD(1, "[%lu] inserted\n", (long unsigned)seqnum);
+
+    return;
+drop:
+    stats->rx_err++;
+    rl_buf_free(rb);
+}
+
+/* Pop the PDUs that can be delivered, i.e. the ones that are no more than
+ * max_sdu_gap PDUs beyond rcv_next_seq_num, which advances accordingly,
+ * and append them to @qrbs through reassembly. */
+static void
+seqq_pop_many(struct flow_entry *flow, struct rb_list *qrbs)
+{
+    struct dtp *dtp = &flow->dtp;
+
+    while (dtp->seqq_len) {
+        unsigned int d = seqq_find(dtp, 0, /*occupied=*/true);
+        rl_seq_t seqnum;
+
+        if (d > flow->cfg.max_sdu_gap) {
+            break;
+        }
+        seqnum = dtp->rcv_next_seq_num + d;
+        dtp_rsm(flow, seqq_take(dtp, seqnum & dtp->seqq_ring_mask), qrbs);
+        dtp->rcv_next_seq_num = seqnum + 1;
+        RPD(1, "[%lu] popped out from seqq\n", (long unsigned)seqnum);
+    }
+}
+
+/* Update the RTT estimate with the sample provided by @rb, which has
+ * just been acked, using the Jacobson/Karels smoothing of RFC 6298:
+ *     RTTVAR <== RTTVAR * (3/4) + |SRTT - SAMPLE| * (1/4)
+ *     SRTT <== SRTT * (7/8) + SAMPLE * (1/8)
+ * Called under DTP lock. */
+static void
+dtp_rtt_sample(struct flow_entry *flow, struct rl_buf *rb)
+{
+    struct dtp *dtp = &flow->dtp;
+    uint32_t rtt;
+    uint32_t err;
+
+    if (!ktime_to_ns(RL_BUF_RTX(rb).tx_time)) {
+        /* Retransmitted PDU, the sample would be ambiguous. */
+        return;
+    }
+
+    rtt = (uint32_t)min_t(int64_t, RL_RTO_MAX_US,
+                          ktime_us_delta(ktime_get(), RL_BUF_RTX(rb).tx_time));
+    rtt = max(rtt, 1U);
+    rl_lat_hist_add(&flow->lat.rtt, rtt);
+
+    /* SRTT and RTTVAR are kept scaled by 8 and 4, so that the
+     * smoothing does not lose precision on small RTTs. */
+    if (!(dtp->flags & DTP_F_RTT_VALID)) {
+        dtp->srtt_us   = rtt << 3;
+        dtp->rttvar_us = rtt << 1;
+        dtp->flags |= DTP_F_RTT_VALID;
+    } else {
+        uint32_t srtt = dtp->srtt_us >> 3;
+
+        err = rtt > srtt ? rtt - srtt : srtt - rtt;
+        rl_lat_hist_add(&flow->lat.rtt_jitter, err);
+        dtp->rttvar_us += err - (dtp->rttvar_us >> 2);
+        dtp->srtt_us += rtt - srtt;
+    }
+    dtp_rto_update(flow);
+    NPD("RTT est %u us +/- %u us, RTO %u us\n", dtp->srtt_us >> 3,
+        dtp->rttvar_us >> 2, dtp->rto_us);
+
+    if (dtp->cc && dtp->cc->rtt_sample) {
+        dtp->cc->rtt_sample(dtp, rtt);
+    }
+}
+
+/* Remove from the rtxq the PDUs in [start, end), since the receiver
+ * got them. Returns the number of PDUs removed. Called under DTP lock. */
+static unsigned int
+rtxq_ack_range(struct flow_entry *flow, rlm_seq_t start, rlm_seq_t end)
+{
+    struct dtp *dtp = &flow->dtp;
+    unsigned int n  = 0;
+    struct rl_buf *cur;
+    rlm_seq_t seqnum;
+
+    if (!rtxq_clamp(dtp, &start, &end)) {
+        return 0;
+    }
+
+    for (seqnum = start; seqnum < end && dtp->rtxq_len; seqnum++) {
+        cur = rtxq_lookup(dtp, seqnum);
+        if (!cur) {
+            continue; /* already acked */
+        }
+        NPD("Remove [%lu] from rtxq\n", (long unsigned)seqnum);
+        rtxq_unlink(dtp, cur);
+        dtp_rtt_sample(flow, cur);
+        rl_buf_free(cur);
+        n++;
+    }
+
+    return n;
 }
 
-static void
-seqq_pop_many(struct dtp *dtp, rl_seq_t max_sdu_gap, struct rb_list *qrbs)
-{
-    struct rl_buf *qrb, *tmp;
+/* Clone the PDUs in [start, end) from the rtxq into @rrbq, so that the
+ * caller can retransmit them once the DTP lock is released. Unless
+ * @force is set, PDUs that have already been retransmitted are skipped.
+ * Returns the number of PDUs cloned. Called under DTP lock. */
+static unsigned int
+rtxq_rtx_range(struct flow_entry *flow, rlm_seq_t start, rlm_seq_t end,
+               bool force, struct rb_list *rrbq)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
+    struct dtp *dtp             = &flow->dtp;
+    unsigned int n              = 0;
+    struct rl_buf *cur, *crb;
+    rlm_seq_t seqnum;
+
+    if (!rtxq_clamp(dtp, &start, &end)) {
+        return 0;
+    }
 
-    rb_list_init(qrbs);
-    rb_list_foreach_safe (qrb, tmp, &dtp->seqq) {
-        struct rina_pci *pci = RL_BUF_PCI(qrb);
+    for (seqnum = start; seqnum < end; seqnum++) {
+        cur = rtxq_lookup(dtp, seqnum);
+        if (!cur || (!force && !ktime_to_ns(RL_BUF_RTX(cur).tx_time))) {
+            continue;
+        }
 
-        if (pci->seqnum - dtp->rcv_next_seq_num <= max_sdu_gap) {
-            rb_list_del(qrb);
-            dtp->seqq_len--;
-            rb_list_enq(qrb, qrbs);
-            dtp->rcv_next_seq_num = pci->seqnum + 1;
-            RPD(1, "[%lu] popped out from seqq\n", (long unsigned)pci->seqnum);
+        crb = rl_buf_clone(cur, GFP_ATOMIC);
+        if (unlikely(!crb)) {
+            RPV(1, "Out of memory\n");
+            break;
         }
+        /* Same as rtx_tmr_cb(): invalidate RL_BUF_RTX(cur).tx_time so
+         * that RTT is not updated on retransmitted PDUs, and push the
+         * expiration time forward. */
+        RL_BUF_RTX(cur).rtx_time = ktime_add(ktime_get(), rtt_to_rtx(flow));
+        RL_BUF_RTX(cur).tx_time  = ktime_set(0, 0);
+        list_del(&RL_BUF_RTX(cur).exp_node);
+        rtxq_exp_insert(dtp, cur);
+        rb_list_enq(crb, rrbq);
+        stats->rtx_pkt++;
+        stats->rtx_byte += cur->len;
+        n++;
     }
+
+    return n;
 }
 
 static int
@@ -1755,8 +4087,11 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct rina_pci_ctrl *pcic  = RL_BUF_PCI_CTRL(rb);
     struct dtp *dtp             = &flow->dtp;
-    struct rb_list qrbs;
+    const struct rina_ecn_echo *echo = NULL;
+    const struct rina_sack_block *blocks;
+    struct rb_list qrbs, rrbq;
     struct rl_buf *qrb, *tmp;
+    size_t blocks_len;
 
     if (unlikely((pcic->base.pdu_type & PDU_T_CTRL) != PDU_T_CTRL)) {
         PE("Unknown PDU type %X\n", pcic->base.pdu_type);
@@ -1765,7 +4100,30 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
         return 0;
     }
 
+    if (unlikely(rb->len < sizeof(*pcic))) {
+        RPD(1, "Dropping control PDU shorter [%zu] than PCI\n", rb->len);
+        rl_buf_free(rb);
+        stats->rx_err++;
+        return 0;
+    }
+
+    /* The optional ECN echo comes first, then the SACK blocks. */
+    blocks     = (const struct rina_sack_block *)(pcic + 1);
+    blocks_len = rb->len - sizeof(*pcic);
+    if (pcic->base.pdu_flags & PDU_F_ECE) {
+        if (unlikely(blocks_len < sizeof(*echo))) {
+            RPD(1, "Dropping control PDU with truncated ECN echo\n");
+            rl_buf_free(rb);
+            stats->rx_err++;
+            return 0;
+        }
+        echo   = (const struct rina_ecn_echo *)(pcic + 1);
+        blocks = (const struct rina_sack_block *)(echo + 1);
+        blocks_len -= sizeof(*echo);
+    }
+
     rb_list_init(&qrbs);
+    rb_list_init(&rrbq);
 
     spin_lock_bh(&dtp->lock);
 
@@ -1790,7 +4148,8 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
 
     dtp->last_ctrl_seq_num_rcvd = pcic->base.seqnum;
 
-    if (pcic->base.pdu_type & PDU_T_FC_BIT) {
+    if ((pcic->base.pdu_type & PDU_T_FC_BIT) &&
+        flow->cfg.dtcp.fc.fc_type == RLITE_FC_T_WIN) {
         struct rl_buf *tmp;
 
         if (unlikely(pcic->new_rwe < dtp->snd_rwe ||
@@ -1838,81 +4197,70 @@ sdu_rx_ctrl(struct ipcp_entry *ipcp, struct flow_entry *flow, struct rl_buf *rb)
         }
     }
 
+    if (echo) {
+        dtp_cc_ecn(dtp, pcic->ack_nack_seq_num, echo->pkts, echo->marked);
+    }
+
     if (pcic->base.pdu_type & PDU_T_ACK_BIT) {
-        struct rl_buf *cur, *tmp;
-        unsigned now = jiffies;
-        unsigned cur_rtt;
-        int cur_rttdev;
+        unsigned int nblocks = blocks_len / sizeof(struct rina_sack_block);
+        rl_seq_t next        = pcic->ack_nack_seq_num;
+        unsigned int acked;
+        unsigned int nrtx = 0;
+        unsigned int i;
+
+        /* All the ACK types cumulatively ack what comes before
+         * ack_nack_seq_num. */
+        acked = rtxq_ack_range(flow, 0, pcic->ack_nack_seq_num);
 
         switch (pcic->base.pdu_type & PDU_T_ACK_MASK) {
         case PDU_T_ACK:
-            rb_list_foreach_safe (cur, tmp, &dtp->rtxq) {
-                struct rina_pci *pci = RL_BUF_PCI(cur);
-
-                if (pci->seqnum < pcic->ack_nack_seq_num) {
-                    NPD("Remove [%lu] from rtxq\n", (long unsigned)pci->seqnum);
-                    rb_list_del(cur);
-                    dtp->rtxq_len--;
-
-                    if (RL_BUF_RTX(cur).jiffies) {
-                        /* Update our RTT estimate. */
-                        cur_rtt = now - RL_BUF_RTX(cur).jiffies;
-                        if (!cur_rtt) {
-                            cur_rtt = 1;
-                        }
-                        cur_rttdev = (int)cur_rtt - dtp->rtt;
-                        if (cur_rttdev < 0) {
-                            cur_rttdev = -cur_rttdev;
-                        } else if (!cur_rttdev) {
-                            cur_rttdev = 1;
-                        }
-
-                        /* RTT <== RTT * (112/128) + SAMPLE * (16/128)*/
-                        dtp->rtt = (dtp->rtt * 112 + (cur_rtt << 4)) >> 7;
-                        dtp->rtt_stddev =
-                            (dtp->rtt_stddev * 3 + cur_rttdev) >> 2;
-                        NPD(1, "RTT est %u msecs +/- %u msecs\n",
-                            jiffies_to_msecs(dtp->rtt),
-                            jiffies_to_msecs(dtp->rtt_stddev));
-                    }
-
-                    rl_buf_free(cur);
-                } else {
-                    /* The rtxq is sorted by seqnum, so we can safely
-                     * stop here. Let's update the rtx timer
-                     * expiration time, if necessary. */
-                    NPD("Forward rtx timer by %u\n",
-                        jiffies_to_msecs(RL_BUF_RTX(cur).rtx_jiffies -
-                                         jiffies));
-                    mod_timer(&dtp->rtx_tmr, RL_BUF_RTX(cur).rtx_jiffies);
-                    break;
-                }
-            }
+            break;
 
-            if (rb_list_empty(&dtp->rtxq)) {
-                /* Everything has been acked, we can stop the rtx timer. */
-                del_timer(&dtp->rtx_tmr);
-            }
+        case PDU_T_NACK:
+            /* The receiver asks for ack_nack_seq_num. */
+            nrtx = rtxq_rtx_range(flow, next, next + 1, /*force=*/true,
+                                  &rrbq);
+            break;
 
-            /* Update the congestion control window size (up to a maximum).
-             * In case we never experienced retransmissions we double the
-             * size, otherwise we increment it linearly. */
-            if (dtp->cgwin < RL_CGWIN_MAX) {
-                if (stats->rtx_pkt) {
-                    dtp->cgwin++;
-                } else {
-                    dtp->cgwin <<= 1;
+        case PDU_T_SACK:
+            /* The holes between the blocks have been lost. PDUs
+             * retransmitted in response to a previous SACK are left
+             * to the rtx timer, since every out of order PDU received
+             * by the peer generates a SACK reporting the same holes. */
+            for (i = 0; i < nblocks; i++) {
+                if (unlikely(blocks[i].start < next ||
+                             blocks[i].end <= blocks[i].start)) {
+                    RPD(1, "Invalid SACK block [%lu, %lu)\n",
+                        (long unsigned)blocks[i].start,
+                        (long unsigned)blocks[i].end);
+                    break;
                 }
+                nrtx += rtxq_rtx_range(flow, next, blocks[i].start,
+                                       /*force=*/false, &rrbq);
+                acked += rtxq_ack_range(flow, blocks[i].start, blocks[i].end);
+                next = blocks[i].end;
             }
-
             break;
 
-        case PDU_T_NACK:
-        case PDU_T_SACK:
         case PDU_T_SNACK:
-            PI("Missing support for PDU type [%X]\n", pcic->base.pdu_type);
+            /* The blocks report the missing PDUs. */
+            for (i = 0; i < nblocks; i++) {
+                nrtx += rtxq_rtx_range(flow, blocks[i].start, blocks[i].end,
+                                       /*force=*/true, &rrbq);
+            }
             break;
         }
+
+        /* Let the congestion control algorithm update the window. */
+        if (nrtx) {
+            dtp_cc_loss(dtp, pcic->ack_nack_seq_num, /*timeout=*/false);
+        } else {
+            dtp_cc_ack(dtp, acked);
+        }
+
+        /* Forward the rtx timer to the earliest expiration, or stop
+         * it if everything has been acked. */
+        rtxq_tmr_update(dtp);
     }
 
 out:
@@ -1932,15 +4280,152 @@ out:
         stats->tx_byte += len;
     }
 
+    /* Send PDUs selectively retransmitted from the rtxq, if any. */
+    rb_list_foreach_safe (qrb, tmp, &rrbq) {
+        RPD(1, "sending [%lu] from rtxq\n",
+            (long unsigned)RL_BUF_PCI(qrb)->seqnum);
+        rb_list_del(qrb);
+        rmt_tx(ipcp, qrb, RL_RMT_F_CONSUME);
+    }
+
     /* This could be done conditionally. */
     rl_write_restart_flow(flow);
 
     return 0;
 }
 
+/* Pass a train of transit PDUs directed to the same N-1 flow down to the
+ * lower IPCP. Called in softirq context: there is no wait queue to set
+ * up, since we can never sleep, and what the lower IPCP cannot take is
+ * dropped. */
+static void
+rmt_fwd_xmit(struct ipcp_entry *ipcp, struct flow_entry *lower_flow,
+             struct rb_list *train)
+{
+    struct ipcp_entry *lower_ipcp = lower_flow->txrx.ipcp;
+    struct rl_buf *rb, *tmp;
+
+    if (lower_ipcp->ops.sdu_write_train) {
+        lower_ipcp->ops.sdu_write_train(lower_ipcp, lower_flow, train, 0);
+    } else {
+        rb_list_foreach_safe (rb, tmp, train) {
+            rb_list_del(rb);
+            if (lower_ipcp->ops.sdu_write(lower_ipcp, lower_flow, rb, 0) ==
+                -EAGAIN) {
+                rb_list_enq_front(rb, train);
+                break;
+            }
+        }
+    }
+
+    if (unlikely(!rb_list_empty(train))) {
+        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+
+        rb_list_foreach_safe (rb, tmp, train) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+            stats->rmt.queue_drop++;
+        }
+    }
+}
+
+/* Transit fast path, for PDUs that are not directed to this IPCP.
+ * The checksum is not verified here, since the incremental update
+ * preserves any corruption, which is then detected at the destination.
+ * For each PDU the TTL is checked and decremented, and the N-1 flow is
+ * looked up in the (lock-free) PDUFT. Consecutive PDUs directed to the
+ * same N-1 flow are passed down as a train. When a PDU scheduler is
+ * configured the PDUs go through rmt_tx(), so that the scheduling policy
+ * also applies to transit traffic. The list is consumed. */
+static void
+rmt_fwd_train(struct ipcp_entry *ipcp, struct rb_list *rbs)
+{
+    struct rl_ipcp_stats *stats   = raw_cpu_ptr(ipcp->stats);
+    struct rl_normal *priv        = ipcp->priv;
+    struct flow_entry *train_flow = NULL;
+    bool sched                    = READ_ONCE(priv->sched) != NULL;
+    struct rl_buf *rb, *tmp;
+    struct rb_list train;
+
+    rb_list_init(&train);
+
+    rb_list_foreach_safe (rb, tmp, rbs) {
+        struct rina_pci *pci = RL_BUF_PCI(rb);
+        struct flow_entry *lower_flow;
+        struct rl_pci_match match;
+
+        rb_list_del(rb);
+
+        if (unlikely(pci->pdu_ttl == 0)) {
+            RPD(1, "Dropping PDU on zero TTL\n");
+            stats->rmt.ttl_drop++;
+            rl_buf_free(rb);
+            continue;
+        }
+        pci->pdu_ttl--;
+        /* Update the checksum incrementally. */
+        pdu_csum_replace(priv, pci, pci->pdu_ttl + 1, pci->pdu_ttl);
+
+        stats->rmt.fwd_pkt++;
+        stats->rmt.fwd_byte += rb->len;
+
+        if (sched) {
+            rmt_tx(ipcp, rb, RL_RMT_F_CONSUME);
+            continue;
+        }
+
+        match.dst_addr  = (rlm_addr_t)pci->dst_addr;
+        match.src_addr  = (rlm_addr_t)pci->src_addr;
+        match.dst_cepid = (rlm_cepid_t)pci->dst_cep;
+        match.src_cepid = (rlm_cepid_t)pci->src_cep;
+        match.qos_id    = (rlm_qosid_t)pci->qos_id;
+        lower_flow      = rl_pduft_lookup(priv, &match);
+        if (unlikely(!lower_flow)) {
+            RPD(1, "No route to IPCP %lu, dropping packet\n",
+                (long unsigned)match.dst_addr);
+            stats->rmt.noroute_drop++;
+            rl_buf_free(rb);
+            continue;
+        }
+
+        if (lower_flow != train_flow && !rb_list_empty(&train)) {
+            rmt_fwd_xmit(ipcp, train_flow, &train);
+        }
+        train_flow = lower_flow;
+        rb_list_enq(rb, &train);
+    }
+
+    if (!rb_list_empty(&train)) {
+        rmt_fwd_xmit(ipcp, train_flow, &train);
+    }
+}
+
+/* Check if @rb is a PDU for the transit fast path, i.e. if it is not
+ * directed to this IPCP. Management PDUs with a null destination address
+ * are directed to the neighbors, and so to us. */
+static inline bool
+sdu_rx_transit(struct ipcp_entry *ipcp, struct rl_buf *rb)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+
+    if (unlikely(rb->len < sizeof(struct rina_pci))) {
+        return false;
+    }
+
+    if (pci->pdu_len < rb->len) {
+        /* Make up for tail padding introduced at lower layers. */
+        rb->len = pci->pdu_len;
+    }
+
+    return rb->len >= sizeof(struct rina_pci) && pci->dst_addr != ipcp->addr &&
+           !(pci->pdu_type == PDU_T_MGMT && pci->dst_addr == RL_ADDR_NULL);
+}
+
+/* Receive a PDU from a lower flow. If @csum_ok is true, the caller has
+ * already verified the checksum. */
 static struct rl_buf *
-rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
-                 struct flow_entry *lower_flow)
+__rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
+                   struct flow_entry *lower_flow, bool csum_ok)
 {
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
     struct rl_normal *priv      = ipcp->priv;
@@ -1949,8 +4434,10 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     rl_seq_t seqnum    = pci->seqnum;
     struct rl_buf *crb = NULL;
     unsigned int a     = 0;
+    struct rb_list qrbs;
     rl_seq_t gap;
     struct dtp *dtp;
+    bool ecn_ack;
     bool deliver;
     bool drop;
     bool qlimit;
@@ -1968,8 +4455,19 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         return NULL; /* -EINVAL */
     }
 
-    if (priv->csum) {
-        if (unlikely(inet_csum(pci, rb->len, 0) != 0xFFFF)) {
+    if (sdu_rx_transit(ipcp, rb)) {
+        /* The PDU is not for this IPCP, forward it. */
+        struct rb_list fwd;
+
+        rb_list_init(&fwd);
+        rb_list_enq(rb, &fwd);
+        rmt_fwd_train(ipcp, &fwd);
+
+        return NULL;
+    }
+
+    if (priv->csum && !csum_ok) {
+        if (unlikely(!pdu_csum_ok(priv, pci, rb->len))) {
             RPD(1, "Dropping PDU on wrong checksum\n");
             rl_buf_free(rb);
             stats->rmt.csum_drop++;
@@ -2029,38 +4527,7 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         return rb;
 
     } else {
-        /* PDU which is not PDU_T_MGMT or it is to be forwarded. */
-    }
-
-    if (pci->dst_addr != ipcp->addr) {
-        /* The PDU is not for this IPCP, forward it. Don't propagate the
-         * error code of rmt_tx(), since caller does not need it. */
-        size_t len = rb->len;
-
-        /* Check TTL. */
-        if (unlikely(pci->pdu_ttl-- == 0)) {
-            RPD(1, "Dropping PDU on zero TTL\n");
-            stats->rmt.ttl_drop++;
-            rl_buf_free(rb);
-            return NULL; /* -EINVAL */
-        }
-        /* Update the checksum incrementally. */
-        if (priv->csum) {
-            uint32_t sum = pci->pdu_csum;
-            /* We need to use ntohs() on the increment, as we are doing
-             * swapped order computations on little endian machines. */
-            sum += ntohs(0x0100);
-            if (sum > 0xFFFF) {
-                sum -= 0xFFFF;
-            }
-            pci->pdu_csum = (uint16_t)sum;
-        }
-
-        rmt_tx(ipcp, rb, RL_RMT_F_CONSUME);
-        stats->rmt.fwd_pkt++;
-        stats->rmt.fwd_byte += len;
-
-        return NULL;
+        /* PDU which is not PDU_T_MGMT (transit PDUs have been forwarded). */
     }
 
     flow = flow_get_by_cep(ipcp->dm, pci->dst_cep);
@@ -2094,6 +4561,9 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
     }
 
+    dtp->rx_dt_pdus++;
+    ecn_ack = dtp_rcv_ecn(flow, pci);
+
     if (unlikely((dtp->flags & DTP_F_DRF_EXPECTED) ||
                  (pci->pdu_flags & PDU_F_DRF))) {
         /* If we expect DRF being set (new PDU run) we pretend it's there
@@ -2103,13 +4573,16 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
          * packet was lost and can retransmit it. */
         dtp->flags &= ~DTP_F_DRF_EXPECTED;
 
-        /* Flush reassembly queue */
+        /* Flush the sequencing and reassembly queues, what is left
+         * there belongs to the previous run. */
+        stats->rx_err += seqq_flush(dtp) + rsmq_flush(dtp);
 
         /* Init receiver state. The rcv_rwe is not initialized here, but the
          * first time sdu_rx_sv_update is called. */
         dtp->last_lwe_sent = dtp->rcv_lwe = dtp->rcv_next_seq_num =
             dtp->last_seq_num_acked       = seqnum + 1;
         dtp->max_seq_num_rcvd             = seqnum;
+        dtp_ack_reset(flow);
 
         crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
 
@@ -2132,12 +4605,12 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
                dtp->next_snd_ctl_seq);
         }
 
-        spin_unlock_bh(&dtp->lock);
+        rb_list_init(&qrbs);
+        dtp_rsm(flow, rb, &qrbs);
 
-        RL_BUF_RX(rb).cons_seqnum = seqnum;
-        rl_buf_pci_pop(rb);
+        spin_unlock_bh(&dtp->lock);
 
-        rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
+        dtp_deliver(ipcp, flow, &qrbs, qlimit);
 
         goto snd_crb;
     }
@@ -2210,14 +4683,18 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
     deliver = !drop && (gap <= flow->cfg.max_sdu_gap);
 
     if (deliver) {
-        struct rb_list qrbs;
-        struct rl_buf *qrb, *tmp;
+        bool gaps = dtp->seqq_len;
 
         /* Update rcv_next_seq_num only if this PDU is going to be
          * delivered. */
         dtp->rcv_next_seq_num = seqnum + 1;
 
-        seqq_pop_many(dtp, flow->cfg.max_sdu_gap, &qrbs);
+        stats->rx_pkt++;
+        stats->rx_byte += rb->len;
+
+        rb_list_init(&qrbs);
+        dtp_rsm(flow, rb, &qrbs);
+        seqq_pop_many(flow, &qrbs);
 
         /* If this flow is used by an application, this SDU will be acked
          * when the application reads it, since rl_normal_sdu_rx_consumed()
@@ -2227,26 +4704,18 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
         if (flow->upper.ipcp) {
             dtp->rcv_lwe = dtp->rcv_next_seq_num;
         }
-        crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
+        /* If a retransmission filled a gap, let the sender know
+         * immediately, together with the gaps still open. Also echo the
+         * first ECN mark without delay. */
+        crb = sdu_rx_sv_update(
+            ipcp, flow,
+            /*ack_immediate=*/ecn_ack ||
+                ((flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) && gaps));
         spin_unlock_bh(&dtp->lock);
 
-        stats->rx_pkt++;
-        stats->rx_byte += rb->len;
-
-        RL_BUF_RX(rb).cons_seqnum = seqnum;
-        rl_buf_pci_pop(rb);
-
-        ret = rl_sdu_rx_flow(ipcp, flow, rb, qlimit);
-
-        /* Also deliver PDUs just extracted from the seqq. Note
-         * that we must use the safe version of list scanning, since
-         * rl_sdu_rx_flow() will modify qrb->node. */
-        rb_list_foreach_safe (qrb, tmp, &qrbs) {
-            rb_list_del(qrb);
-            RL_BUF_RX(qrb).cons_seqnum = seqnum;
-            rl_buf_pci_pop(qrb);
-            ret |= rl_sdu_rx_flow(ipcp, flow, qrb, qlimit);
-        }
+        /* Deliver this PDU, and also the ones just extracted from the
+         * seqq. */
+        ret = dtp_deliver(ipcp, flow, &qrbs, qlimit);
 
         goto snd_crb;
     }
@@ -2261,9 +4730,19 @@ rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
 
     } else {
         /* What is not dropped nor delivered goes in the sequencing queue.
-         * Don't ack here, we have to wait for the gap to be filled. */
+         * The cumulative ACK cannot move until the gap is filled, but
+         * with retransmission control we immediately send a SACK, so
+         * that the sender can retransmit the missing PDUs without
+         * waiting for the rtx timer. */
         seqq_push(flow, rb);
         rb = NULL;
+        if (flow->cfg.dtcp.flags & DTCP_CFG_RTX_CTRL) {
+            /* The sender is going to shrink its congestion window, ack
+             * every PDU while it recovers. */
+            dtp->ack_every = RL_ACK_EVERY_MIN;
+            dtp->ack_quick = RL_ACK_QUICK_PDUS;
+            crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/true);
+        }
     }
 
     spin_unlock_bh(&dtp->lock);
@@ -2278,6 +4757,206 @@ snd_crb:
     return NULL; /* ret */
 }
 
+static struct rl_buf *
+rl_normal_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb,
+                 struct flow_entry *lower_flow)
+{
+    return __rl_normal_sdu_rx(ipcp, rb, lower_flow, /*csum_ok=*/false);
+}
+
+/* Check if @rb can take the train receive path, i.e. if it is a data
+ * transfer PDU for this IPCP that does not start a new run. */
+static inline bool
+sdu_rx_train_candidate(struct ipcp_entry *ipcp, struct rl_buf *rb)
+{
+    struct rina_pci *pci = RL_BUF_PCI(rb);
+
+    if (unlikely(rb->len < sizeof(struct rina_pci))) {
+        return false;
+    }
+
+    if (pci->pdu_len < rb->len) {
+        /* Make up for tail padding introduced at lower layers. */
+        rb->len = pci->pdu_len;
+    }
+
+    return rb->len >= sizeof(struct rina_pci) && pci->pdu_type == PDU_T_DT &&
+           pci->dst_addr == ipcp->addr && !(pci->pdu_flags & PDU_F_DRF);
+}
+
+/* Process a run of data transfer PDUs directed to the same flow, taking
+ * the DTP lock only once for all the in-order PDUs at the head of the run.
+ * The remaining PDUs are processed one by one by __rl_normal_sdu_rx(),
+ * skipping the checksum verification already done on the whole run. */
+static void
+sdu_rx_train_run(struct ipcp_entry *ipcp, struct rb_list *run,
+                 struct flow_entry *lower_flow)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    rlm_cepid_t cep_id          = RL_BUF_PCI(rb_list_front(run))->dst_cep;
+    struct rl_buf *crb          = NULL;
+    unsigned int pkts           = 0;
+    size_t bytes                = 0;
+    struct rl_buf *rb, *tmp;
+    struct flow_entry *flow;
+    struct rb_list deliver;
+    bool ecn_ack  = false;
+    uint8_t frags = 0;
+    struct dtp *dtp;
+    bool qlimit;
+
+    flow = flow_get_by_cep(ipcp->dm, cep_id);
+    if (!flow) {
+        RPD(1, "No flow for cep-id %u: dropping PDUs\n", cep_id);
+        rb_list_foreach_safe (rb, tmp, run) {
+            rb_list_del(rb);
+            rl_buf_free(rb);
+            stats->rmt.noflow_drop++;
+        }
+        return;
+    }
+
+    dtp    = &flow->dtp;
+    qlimit = !(flow->cfg.dtcp.flags & DTCP_CFG_FLOW_CTRL);
+    rb_list_init(&deliver);
+
+    spin_lock_bh(&dtp->lock);
+    rb_list_foreach_safe (rb, tmp, run) {
+        rl_seq_t seqnum = RL_BUF_PCI(rb)->seqnum;
+
+        /* Stop at the first PDU that is not the next one in order. */
+        if ((dtp->flags & DTP_F_DRF_EXPECTED) || dtp->seqq_len ||
+            seqnum != dtp->rcv_next_seq_num ||
+            seqnum != dtp->max_seq_num_rcvd + 1) {
+            break;
+        }
+
+        dtp->rcv_next_seq_num = seqnum + 1;
+        dtp->max_seq_num_rcvd = seqnum;
+        ecn_ack |= dtp_rcv_ecn(flow, RL_BUF_PCI(rb));
+        frags |= RL_BUF_PCI(rb)->pdu_flags & (PDU_F_MF | PDU_F_CF);
+        rb_list_del(rb);
+        pkts++;
+        bytes += rb->len;
+        dtp_rsm(flow, rb, &deliver);
+    }
+
+    if (pkts) {
+        dtp->rx_dt_pdus += pkts;
+        if (DTCP_PRESENT(flow->cfg.dtcp)) {
+            mod_timer(&dtp->rcv_inact_tmr, jiffies + 2 * dtp->mpl_r_a);
+        }
+        /* See rl_normal_sdu_rx(). */
+        if (flow->upper.ipcp) {
+            dtp->rcv_lwe = dtp->rcv_next_seq_num;
+        }
+        /* A single state vector update for the whole run. */
+        crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/ecn_ack);
+    }
+    spin_unlock_bh(&dtp->lock);
+
+    if (pkts) {
+        stats->rx_pkt += pkts;
+        stats->rx_byte += bytes;
+        if (unlikely(frags)) {
+            dtp_deliver(ipcp, flow, &deliver, qlimit);
+        } else {
+            rb_list_foreach (rb, &deliver) {
+                rl_buf_pci_pop(rb);
+            }
+            rl_sdu_rx_flow_train(ipcp, flow, &deliver, qlimit);
+        }
+    }
+
+    if (crb) {
+        rmt_tx(ipcp, crb, RL_RMT_F_CONSUME);
+    }
+
+    /* Out of order PDUs and the like take the slow path. */
+    rb_list_foreach_safe (rb, tmp, run) {
+        rb_list_del(rb);
+        rb = __rl_normal_sdu_rx(ipcp, rb, lower_flow, /*csum_ok=*/true);
+        BUG_ON(rb != NULL);
+    }
+
+    flow_put(flow);
+}
+
+static void
+rl_normal_sdu_rx_train(struct ipcp_entry *ipcp, struct rb_list *train,
+                       struct flow_entry *lower_flow)
+{
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct rl_normal *priv      = ipcp->priv;
+    struct rl_buf *rb, *tmp;
+    struct rb_list mgmt;
+
+    rb_list_init(&mgmt);
+
+    while (!rb_list_empty(train)) {
+        struct rb_list run;
+
+        rb = rb_list_front(train);
+        rb_list_del(rb);
+        if (sdu_rx_transit(ipcp, rb)) {
+            /* Forward the transit PDUs that follow in the train at once. */
+            rb_list_init(&run);
+            rb_list_enq(rb, &run);
+            while (!rb_list_empty(train) &&
+                   sdu_rx_transit(ipcp, rb_list_front(train))) {
+                rb = rb_list_front(train);
+                rb_list_del(rb);
+                rb_list_enq(rb, &run);
+            }
+            rmt_fwd_train(ipcp, &run);
+            continue;
+        }
+        if (!sdu_rx_train_candidate(ipcp, rb)) {
+            rb = rl_normal_sdu_rx(ipcp, rb, lower_flow);
+            if (rb) {
+                /* Management SDU, give it back to the caller. */
+                rb_list_enq(rb, &mgmt);
+            }
+            continue;
+        }
+
+        /* Coalesce the candidates directed to the same flow that
+         * follow in the train into a run. */
+        rb_list_init(&run);
+        for (;;) {
+            if (priv->csum &&
+                unlikely(!pdu_csum_ok(priv, RL_BUF_PCI(rb), rb->len))) {
+                RPD(1, "Dropping PDU on wrong checksum\n");
+                rl_buf_free(rb);
+                stats->rmt.csum_drop++;
+            } else {
+                rb_list_enq(rb, &run);
+            }
+
+            if (rb_list_empty(train)) {
+                break;
+            }
+            rb = rb_list_front(train);
+            if (!sdu_rx_train_candidate(ipcp, rb) ||
+                (!rb_list_empty(&run) &&
+                 RL_BUF_PCI(rb)->dst_cep !=
+                     RL_BUF_PCI(rb_list_front(&run))->dst_cep)) {
+                break;
+            }
+            rb_list_del(rb);
+        }
+
+        if (!rb_list_empty(&run)) {
+            sdu_rx_train_run(ipcp, &run, lower_flow);
+        }
+    }
+
+    rb_list_foreach_safe (rb, tmp, &mgmt) {
+        rb_list_del(rb);
+        rb_list_enq(rb, train);
+    }
+}
+
 static int
 rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
                           bool maysleep)
@@ -2289,9 +4968,13 @@ rl_normal_sdu_rx_consumed(struct flow_entry *flow, rlm_seq_t seqnum,
     spin_lock_bh(&dtp->lock);
 
     /* Update the advertised rcv_lwe and possibly send a an FC ACK
-     * control PDU. */
+     * control PDU. The fragments under reassembly do not hold the
+     * window (see dtp_rsm()). */
     dtp->rcv_lwe = seqnum + 1;
-    crb          = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
+    if (dtp->rsmq_len && dtp->rcv_lwe == dtp->rsm_first) {
+        dtp->rcv_lwe = dtp->rsm_next;
+    }
+    crb = sdu_rx_sv_update(ipcp, flow, /*ack_immediate=*/false);
 
     spin_unlock_bh(&dtp->lock);
 
@@ -2324,17 +5007,15 @@ rl_normal_create(struct ipcp_entry *ipcp)
     ipcp->txhdroom     = RL_PCI_LEN;
     ipcp->rxhdroom     = 0;
     ipcp->max_sdu_size = (1 << 16) - 1 - ipcp->txhdroom;
+    ipcp->flags |= RL_K_IPCP_SDU_FRAG;
 
     priv->ipcp = ipcp;
-    hash_init(priv->pdu_ft);
-    hash_init(priv->pdu_ft_perflow);
-    priv->perflow_present = false;
-    priv->pduft_dflt      = NULL;
-    rwlock_init(&priv->pduft_lock);
+    if (rl_pduft_init(priv)) {
+        rl_free(priv, RL_MT_SHIM);
+        return NULL;
+    }
     priv->ttl  = RL_TTL_DFLT;
-    priv->csum = false;
-
-    INIT_WORK(&priv->sched_deq_work, sched_deq_worker);
+    priv->csum = RL_CSUM_NONE;
 
     PD("New IPC created [%p]\n", priv);
 
@@ -2346,10 +5027,9 @@ rl_normal_destroy(struct ipcp_entry *ipcp)
 {
     struct rl_normal *priv = (struct rl_normal *)ipcp->priv;
 
-    cancel_work_sync(&priv->sched_deq_work);
     rl_sched_replace(priv, NULL);
 
-    rl_pduft_flush(ipcp);
+    rl_pduft_fini(ipcp);
     rl_free(priv, RL_MT_SHIM);
 
     PD("IPC [%p] destroyed\n", priv);
@@ -2385,7 +5065,9 @@ static struct ipcp_factory normal_factory = {
     .ops.pduft_del_addr      = rl_pduft_del_addr,
     .ops.mgmt_sdu_build      = rl_normal_mgmt_sdu_build,
     .ops.sdu_rx              = rl_normal_sdu_rx,
+    .ops.sdu_rx_train        = rl_normal_sdu_rx_train,
     .ops.flow_writeable      = rl_normal_flow_writeable,
+    .ops.flow_tx_room        = rl_normal_flow_tx_room,
     .ops.qos_supported       = rl_normal_qos_supported,
     .ops.sched_config        = rl_normal_sched_config,
 };
@@ -2413,6 +5095,17 @@ rl_normal_init(void)
     /* Build the (static) list of PDU schedulers. */
     list_add_tail(&rl_sched_pfifo_ops.node, &rl_pdu_schedulers);
     list_add_tail(&rl_sched_wrr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_drr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_prio_drr_ops.node, &rl_pdu_schedulers);
+    list_add_tail(&rl_sched_fq_codel_ops.node, &rl_pdu_schedulers);
+
+    /* Build the (static) list of congestion control algorithms. */
+    BUILD_BUG_ON(sizeof(struct rl_cc_newreno) > RL_CC_PRIV_SIZE);
+    BUILD_BUG_ON(sizeof(struct rl_cc_cubic) > RL_CC_PRIV_SIZE);
+    BUILD_BUG_ON(sizeof(struct rl_cc_vegas) > RL_CC_PRIV_SIZE);
+    list_add_tail(&rl_cc_newreno_ops.node, &rl_cc_algorithms);
+    list_add_tail(&rl_cc_cubic_ops.node, &rl_cc_algorithms);
+    list_add_tail(&rl_cc_vegas_ops.node, &rl_cc_algorithms);
 
     return rl_ipcp_factory_register(&normal_factory);
 }
@@ -31,6 +31,7 @@
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/workqueue.h>
 #include <linux/interrupt.h>
 #include <linux/timer.h>
@@ -38,10 +39,15 @@
 #include <linux/list.h>
 #include <asm/atomic.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/version.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>
 #include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
 
 #include "kerconfig.h"
 
@@ -56,12 +62,6 @@
 #include <linux/socket.h> /* memcpy_{to,from}iovecend */
 #endif
 
-/* Enable if you wish to enable RMT queues. This is currently disabled because
- * it is not SMP scalable, and its advantages are still not clear.
- * We may reintroduce RMT queues once we add support for RMT scheduling; in
- * that case an SMP-scalable RMT implementation is needed. */
-// #define RL_RMT_QUEUES
-
 /*
  * Logging support.
  */
@@ -119,7 +119,12 @@ extern int verbosity;
  */
 
 /* PDU flags */
-#define PDU_F_ECN 0x01
+#define PDU_F_ECN 0x01 /* congestion experienced, on DT PDUs */
+#define PDU_F_ECE 0x02 /* ECN echo, on control PDUs */
+/* Fragmentation of DT PDUs: the first fragment of an SDU carries MF,
+ * the middle ones MF and CF, the last one CF. Whole SDUs carry none. */
+#define PDU_F_MF 0x04 /* more fragments follow */
+#define PDU_F_CF 0x08 /* continuation fragment */
 #define PDU_F_DRF 0x80
 
 /* PDU type definitions. */
@@ -141,41 +146,65 @@ struct rina_pci;
 /*
  * If RL_SKB is defined, we use struct sk_buff for packet data and metadata,
  * rather than using a custom implementation.
- * The custom implementation is smaller and simpler, but it
- * requires copies and allocations at the shim-eth layer.
+ * The custom implementation is smaller and simpler. The shim-eth layer
+ * avoids copies by wrapping received sk_buffs into rl_bufs, and by
+ * building outgoing sk_buffs around the data of rl_bufs that have enough
+ * tailroom (RL_BUF_SKB_TAILROOM) for a struct skb_shared_info.
  */
 
+#include <linux/skbuff.h>
 #ifndef RL_SKB
 struct rl_buf;
+#define RL_BUF_SKB_TAILROOM SKB_DATA_ALIGN(sizeof(struct skb_shared_info))
 #else /* RL_SKB */
-#include <linux/skbuff.h>
 #define rl_buf sk_buff /* just map on sk_buff */
 #endif                 /* RL_SKB */
 
 struct rl_buf *rl_buf_alloc(size_t size, size_t hdroom, size_t tailroom,
                             gfp_t gfp);
 
+#ifndef RL_SKB
+struct rl_buf *rl_buf_from_skb(struct sk_buff *skb, size_t hdroom);
+
+struct sk_buff *rl_buf_to_skb(struct rl_buf *rb, size_t hdroom,
+                              size_t tailroom);
+#endif /* !RL_SKB */
+
 struct rl_buf *rl_buf_clone(struct rl_buf *rb, gfp_t gfp);
 
 void __rl_buf_free(struct rl_buf *rb);
 
+int rl_bufs_init(void);
+void rl_bufs_fini(void);
+void rl_bufs_dump_stats(void);
+
 union rl_buf_ctx {
     struct {
         /* Used in the TX datapath when this rb ends up into
-         * a retransmission queue. */
-        unsigned long rtx_jiffies;
-        unsigned long jiffies;
+         * a retransmission queue. A zero tx_time marks a PDU
+         * that has been retransmitted. */
+        ktime_t rtx_time;
+        ktime_t tx_time;
+        /* Links the rtxq in expiration order. */
+        struct list_head exp_node;
     } rtx;
 
     struct {
         /* Used in the TX datapath when this rb ends up into
          * an RMT queue. */
         struct flow_entry *lower_flow;
+        /* Enqueue time, used by AQM schedulers. */
+        ktime_t enq_time;
     } rmt;
 
     struct {
         /* Used in the RX datapath for flow control. */
         rlm_seq_t cons_seqnum;
+        /* This rb is a fragment of an SDU, and the next fragment
+         * follows it in the same queue. */
+        bool more;
+        /* Time of insertion in the rx queue. */
+        ktime_t enq_time;
     } rx;
 };
 
@@ -186,7 +215,17 @@ union rl_buf_ctx {
 struct rl_rawbuf {
     size_t size;
     atomic_t refcnt;
-    uint8_t buf[0];
+    /* Size class of the cache this buffer comes from, RL_BUF_CLASS_KMALLOC
+     * if it was allocated with kmalloc(), or RL_BUF_CLASS_SKB if the data
+     * is borrowed from an sk_buff. */
+#define RL_BUF_CLASSES 4
+#define RL_BUF_CLASS_KMALLOC RL_BUF_CLASSES
+#define RL_BUF_CLASS_SKB (RL_BUF_CLASSES + 1)
+    uint32_t cls;
+    /* Start of the data area. It immediately follows this struct, unless
+     * the data belongs to @skb. */
+    uint8_t *buf;
+    struct sk_buff *skb;
 };
 
 struct rl_buf {
@@ -201,6 +240,8 @@ struct rl_buf {
 #define RL_BUF_PCI(rb) rb->pci
 #define RL_BUF_PCI_CTRL(rb) ((struct rina_pci_ctrl *)rb->pci)
 #define RL_BUF_RTX(rb) (rb)->u.rtx
+#define RL_BUF_RTX_ENTRY(_node)                                                \
+    container_of(_node, struct rl_buf, u.rtx.exp_node)
 #define RL_BUF_RX(rb) (rb)->u.rx
 #define RL_BUF_RMT(rb) (rb)->u.rmt
 
@@ -228,7 +269,7 @@ rl_buf_custom_pop(struct rl_buf *rb, size_t len)
 static inline int
 rl_buf_custom_push(struct rl_buf *rb, size_t len)
 {
-    if (unlikely((uint8_t *)(rb->pci) - len < &rb->raw->buf[0])) {
+    if (unlikely((uint8_t *)(rb->pci) - len < rb->raw->buf)) {
         RPD(1, "No space to push %zu bytes\n", len);
         return -1;
     }
@@ -262,6 +303,12 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 }
 #endif /* AIO_RW */
 
+static inline void
+rl_buf_copy_bits(struct rl_buf *rb, void *dst, size_t bytes)
+{
+    memcpy(dst, RL_BUF_DATA(rb), bytes);
+}
+
 #define rl_buf_free(_rb)                                                       \
     do {                                                                       \
         BUG_ON((_rb) == NULL);                                                 \
@@ -273,6 +320,11 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define rb_list list_head
 #define rb_list_init(l) INIT_LIST_HEAD((l))
 #define rb_list_enq(rb, q) list_add_tail_safe(&(rb)->node, q)
+#define rb_list_enq_front(rb, q)                                               \
+    do {                                                                       \
+        BUG_ON(!list_empty(&(rb)->node));                                      \
+        list_add(&(rb)->node, q);                                              \
+    } while (0)
 #define rb_list_del(rb) list_del_init(&(rb)->node)
 #define rb_list_empty(l) list_empty(l)
 #define rb_list_front(l) list_first_entry(l, struct rl_buf, node)
@@ -289,6 +341,10 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 #define RL_BUF_PCI(rb) ((struct rina_pci *)(rb)->data)
 #define RL_BUF_PCI_CTRL(rb) ((struct rina_pci_ctrl *)(rb)->data)
 #define RL_BUF_RTX(rb) ((union rl_buf_ctx *)((rb)->cb))->rtx
+#define RL_BUF_RTX_ENTRY(_node)                                                \
+    ((struct rl_buf *)((uint8_t *)(_node) -                                    \
+                       offsetof(union rl_buf_ctx, rtx.exp_node) -              \
+                       offsetof(struct sk_buff, cb)))
 #define RL_BUF_RX(rb) ((union rl_buf_ctx *)((rb)->cb))->rx
 #define RL_BUF_RMT(rb) ((union rl_buf_ctx *)((rb)->cb))->rmt
 
@@ -344,6 +400,12 @@ rl_buf_copy_to_user(struct rl_buf *rb, const struct iovec *to, size_t bytes)
 }
 #endif /* AIO_RW */
 
+static inline void
+rl_buf_copy_bits(struct rl_buf *rb, void *dst, size_t bytes)
+{
+    skb_copy_bits(rb, 0, dst, bytes);
+}
+
 #define rl_buf_free(_rb)                                                       \
     do {                                                                       \
         BUG_ON((_rb) == NULL);                                                 \
@@ -380,6 +442,16 @@ rb_list_enq(struct rl_buf *elem, struct rb_list *list)
     list->prev       = elem;
 }
 
+static inline void
+rb_list_enq_front(struct rl_buf *elem, struct rb_list *list)
+{
+    BUG_ON(elem->prev != NULL || elem->next != NULL);
+    list->next->prev = elem;
+    elem->prev       = (struct rl_buf *)list;
+    elem->next       = list->next;
+    list->next       = elem;
+}
+
 static inline void
 rb_list_del(struct rl_buf *elem)
 {
@@ -412,11 +484,16 @@ rb_list_front(struct rb_list *list)
 
 struct ipcp_entry;
 struct flow_entry;
+struct rl_io_ring;
 struct rl_ctrl;
 struct pduft_entry;
 
 struct ipcp_ops {
     bool (*flow_writeable)(struct flow_entry *flow);
+    /* Optional: whether @n PDUs can be written on the flow without
+     * hitting backpressure. Used to admit fragmented SDUs on
+     * non-blocking flows. */
+    bool (*flow_tx_room)(struct flow_entry *flow, unsigned int n);
     void (*destroy)(struct ipcp_entry *ipcp);
 
     int (*appl_register)(struct ipcp_entry *ipcp, char *appl_name, int reg);
@@ -431,6 +508,9 @@ struct ipcp_ops {
     int (*flow_allocate_resp)(struct ipcp_entry *ipcp, struct flow_entry *flow,
                               uint8_t response);
 
+    /* Invoked by the core in process context (so it may sleep) when
+     * the flow configuration is available. On failure the core
+     * deletes the flow. */
     int (*flow_init)(struct ipcp_entry *ipcp, struct flow_entry *flow);
     int (*flow_cfg_update)(struct flow_entry *flow,
                            const struct rl_flow_config *cfg);
@@ -443,10 +523,27 @@ struct ipcp_ops {
  * alternative to dropping. When this flag is set, RMT cannot return
  * EAGAIN, which is the backpressure signal for the caller. */
 #define RL_RMT_F_CONSUME 2
+/* The SDU is a fragment of a larger one. FRAG_MORE marks all the
+ * fragments but the last, FRAG_CONT all the fragments but the first.
+ * Only used with IPCPs that set RL_K_IPCP_SDU_FRAG. */
+#define RL_RMT_F_FRAG_MORE 4
+#define RL_RMT_F_FRAG_CONT 8
+/* Max size of an SDU that can be fragmented. */
+#define RL_SDU_FRAG_MAX (1 << 20)
     int (*sdu_write)(struct ipcp_entry *ipcp, struct flow_entry *flow,
                      struct rl_buf *rb, unsigned flags);
+    /* Optional. Write a train of PDUs to the same flow as a single unit.
+     * PDUs are removed from @train as they are consumed; on backpressure
+     * (-EAGAIN) the ones left in @train were not transmitted. */
+    int (*sdu_write_train)(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                           struct rb_list *train, unsigned flags);
     struct rl_buf *(*sdu_rx)(struct ipcp_entry *ipcp, struct rl_buf *rb,
                              struct flow_entry *lower_flow);
+    /* Optional. Process a burst of PDUs received on @lower_flow. The
+     * PDUs left in @train on return must be queued to userspace, like
+     * the ones returned by sdu_rx(). */
+    void (*sdu_rx_train)(struct ipcp_entry *ipcp, struct rb_list *train,
+                         struct flow_entry *lower_flow);
     int (*config)(struct ipcp_entry *ipcp, const char *param_name,
                   const char *param_value, int *notify);
     int (*config_get)(struct ipcp_entry *ipcp, const char *param_name,
@@ -476,6 +573,9 @@ struct txrx {
     spinlock_t rx_lock;
 #define RL_TXRX_EOF (1 << 0)
     uint8_t flags;
+    /* Shared-memory rings, if set up by the application (see io-dev.c).
+     * Protected by rx_lock. */
+    struct rl_io_ring *ring;
 
     /* Write operation support. */
     struct ipcp_entry *ipcp;
@@ -505,6 +605,7 @@ struct ipcp_entry {
 
 #define RL_K_IPCP_USE_CEP_IDS (1 << 0)
 #define RL_K_IPCP_ZOMBIE (1 << 1)
+#define RL_K_IPCP_SDU_FRAG (1 << 2) /* fragments and reassembles SDUs */
     uint32_t flags;
 
     /* Receive side optimization. Fields protected by 'lock'. */
@@ -565,6 +666,31 @@ struct tkbk {
     unsigned long intval_ms;
 };
 
+/* A high resolution timer whose callback runs in softirq context, like
+ * the one of a timer_list, so that it can take the DTP lock with
+ * spin_lock_bh(). Without soft hrtimers, the callback is deferred to a
+ * tasklet. */
+struct rl_hrtimer {
+    struct hrtimer hrt;
+#ifndef RL_HAVE_HRTIMER_SOFT
+    struct tasklet_struct tasklet;
+#endif /* !RL_HAVE_HRTIMER_SOFT */
+    void (*func)(struct rl_hrtimer *t);
+};
+
+void rl_hrtimer_init(struct rl_hrtimer *t, void (*func)(struct rl_hrtimer *));
+void rl_hrtimer_mod(struct rl_hrtimer *t, ktime_t expires);
+void rl_hrtimer_del(struct rl_hrtimer *t);
+void rl_hrtimer_del_sync(struct rl_hrtimer *t);
+
+static inline bool
+rl_hrtimer_pending(struct rl_hrtimer *t)
+{
+    return hrtimer_is_queued(&t->hrt);
+}
+
+struct rl_cc_ops;
+
 struct dtp {
     spinlock_t lock;
 
@@ -580,15 +706,43 @@ struct dtp {
     unsigned int cwq_len;
     unsigned int max_cwq_len;
     struct timer_list snd_inact_tmr;
+    /* The retransmission queue, sorted by seqnum. The PDUs are also
+     * indexed by seqnum in a ring, and linked in expiration order. */
     struct rb_list rtxq;
+    struct rl_buf **rtxq_ring;
+    unsigned int rtxq_ring_mask;
+    struct list_head rtxq_exp;
     unsigned int rtxq_len;
     unsigned int max_rtxq_len;
-    struct timer_list rtx_tmr;
+    struct rl_hrtimer rtx_tmr;
     struct rl_buf *rtx_tmr_next; /* the packet is going to expire next */
-    unsigned rtt;                /* estimated round trip time, in jiffies. */
-    unsigned rtt_stddev;
+    /* Jacobson/Karels estimate of the RTT, and the resulting RTO,
+     * backed off on timeout. All in microseconds, with srtt_us
+     * scaled by 8 and rttvar_us scaled by 4. */
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rto_us;
     unsigned cgwin; /* number of PDUs in the congestion window */
+    const struct rl_cc_ops *cc;
+    rlm_seq_t cc_recover; /* losses before this seqnum are not new events */
+    /* DCTCP-like estimate of the fraction of ECN marked PDUs, and the
+     * echoed counters for the current window. */
+#define RL_ECN_ALPHA_SHIFT 10
+    unsigned int ecn_alpha; /* in 1/(1 << RL_ECN_ALPHA_SHIFT) units */
+    unsigned int ecn_pkts;
+    unsigned int ecn_marked;
+    rlm_seq_t ecn_wnd_end;
+#define RL_CC_PRIV_SIZE 64
+#define RL_CC_PRIV(_dtp) ((void *)(_dtp)->cc_priv)
+    /* Private state of the congestion control algorithm. */
+    uint64_t cc_priv[RL_CC_PRIV_SIZE / sizeof(uint64_t)];
     struct tkbk tkbk;
+    /* Rate based flow control: the PDUs are sent one every pace_ns
+     * nanoseconds, and the ones written too early wait in the cwq
+     * until the pacing timer releases them. */
+    uint64_t pace_ns;
+    ktime_t pace_next; /* earliest departure time of the next PDU */
+    struct rl_hrtimer pace_tmr;
 
     /* Receiver state. */
     rlm_seq_t rcv_lwe;
@@ -599,16 +753,60 @@ struct dtp {
     rlm_seq_t last_seq_num_acked;
     rlm_seq_t next_snd_ctl_seq;
     struct timer_list rcv_inact_tmr;
-    struct rb_list seqq;
+    /* The sequencing queue of PDUs received out of order, as a ring
+     * indexed by seqnum that covers the seqnums from rcv_next_seq_num
+     * onwards. A bitmap of the occupied slots makes the lookup of the
+     * next queued PDU (or of the next gap) cheap. */
+    struct rl_buf **seqq_ring;
+    unsigned long *seqq_bmap;
+    unsigned int seqq_ring_mask;
     unsigned int seqq_len;
-    struct timer_list a_tmr;
+    unsigned int seqq_depth_max;  /* max distance from rcv_next_seq_num */
+    size_t seqq_mem;              /* truesize of the queued PDUs */
+    atomic_long_t *seqq_ipcp_mem; /* sum of seqq_mem over the IPCP flows */
+    struct rl_hrtimer a_tmr;
+    /* Fragments of the SDU under reassembly, with their total length,
+     * the seqnum of the first one and the next seqnum expected. */
+    struct rb_list rsmq;
+    unsigned int rsmq_len;
+    size_t rsmq_bytes;
+    rlm_seq_t rsm_first;
+    rlm_seq_t rsm_next;
+    /* DT PDUs received (and ECN marked) since the last control PDU. */
+    unsigned int rcv_ecn_pkts;
+    unsigned int rcv_ecn_marked;
+    /* Adaptive ACK policy: a control PDU covers up to ack_every PDUs,
+     * apart from the next ack_quick ones that are acked one by one. */
+    unsigned int ack_every;
+    unsigned int ack_quick;
+    ktime_t last_ack_time;
+    /* To gauge the overhead of control PDUs. */
+    uint64_t rx_dt_pdus;
+    uint64_t tx_ctrl_pdus;
 
 #define DTP_F_DRF_SET (1 << 0)
 #define DTP_F_DRF_EXPECTED (1 << 1)
 #define DTP_F_TIMERS_INITIALIZED (1 << 2)
+#define DTP_F_ECN_SEEN (1 << 3) /* receiver got ECN marked PDUs */
+#define DTP_F_RTT_VALID (1 << 4) /* srtt_us comes from a sample */
     uint8_t flags;
 };
 
+/* Account for a latency sample of @us microseconds. The caller
+ * serializes the updates of @h. */
+static inline void
+rl_lat_hist_add(struct rl_lat_hist *h, int64_t us)
+{
+    uint64_t v = max_t(int64_t, us, 0);
+
+    h->samples++;
+    h->sum_us += v;
+    if (v > h->max_us) {
+        h->max_us = v;
+    }
+    h->buckets[min_t(unsigned int, fls64(v), RL_LAT_BUCKETS - 1)]++;
+}
+
 struct flow_entry {
     rl_port_t local_port; /* flow table key */
     rl_port_t remote_port;
@@ -631,6 +829,10 @@ struct flow_entry {
     void *priv;
 
     struct rl_flow_stats stats;
+    /* Latency histograms. The rxq one is protected by the rx_lock, the
+     * RTT ones by the DTP lock, and the rmtq one by the lock of the
+     * PDU scheduler in charge of this (N-1) flow. */
+    struct rl_flow_lat lat;
     uint32_t uid;             /* unique id */
     struct list_head node_rm; /* for flows_removeq */
     unsigned long expires;    /* absolute time in jiffies */
@@ -642,14 +844,32 @@ struct flow_entry {
 #define RL_FLOW_DEL_POSTPONED (1 << 4) /* flow removal has been postponed */
 #define RL_FLOW_INITIATOR (1 << 5)     /* local node initiated this flow */
     uint8_t flags;
-    struct hlist_node node;
-    struct hlist_node node_cep;
 };
 
 struct pduft_entry {
     struct rl_pci_match match;
     struct flow_entry *flow;
-    struct hlist_node node; /* for the pdu_ft hash table */
+    /* For the pdu_ft hash tables. Two nodes are needed to link the entry
+     * to both the old and the new bucket array while the table is being
+     * resized. */
+    struct hlist_node node[2];
+    struct rcu_head rcu;
+};
+
+/* Bucket array of a PDUFT hash table. */
+struct rl_pduft_buckets {
+    unsigned int bits;
+    unsigned int idx; /* pduft_entry node used by this array */
+    struct rl_pduft_table *table;
+    struct rcu_head rcu;
+    struct hlist_head heads[0];
+};
+
+/* A resizable PDUFT hash table, with lock-free (RCU) lookups. */
+struct rl_pduft_table {
+    struct rl_pduft_buckets __rcu *buckets;
+    unsigned int count;  /* number of entries */
+    bool resize_pending; /* old bucket array still in use by readers */
 };
 
 int __ipcp_put(struct ipcp_entry *entry);
@@ -701,6 +921,12 @@ int rl_sdu_rx(struct ipcp_entry *ipcp, struct rl_buf *rb, rl_port_t local_port);
 int rl_sdu_rx_flow(struct ipcp_entry *ipcp, struct flow_entry *flow,
                    struct rl_buf *rb, bool qlimit);
 
+int rl_sdu_rx_flow_train(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                         struct rb_list *train, bool qlimit);
+
+int rl_sdu_rx_flow_frags(struct flow_entry *flow, struct rb_list *frags,
+                         bool qlimit);
+
 struct rl_buf *rl_sdu_rx_shortcut(struct ipcp_entry *ipcp, struct rl_buf *rb);
 
 void rl_write_restart_flow(struct flow_entry *flow);
@@ -754,9 +980,36 @@ txrx_init(struct txrx *txrx, struct ipcp_entry *ipcp)
     init_waitqueue_head(&txrx->__tx_wqh);
     txrx->tx_wqh = &txrx->__tx_wqh; /* Use per-flow tx_wqh by default. */
     txrx->flags  = 0;
+    txrx->ring   = NULL;
 }
 
 struct rl_sched;
+struct rl_normal;
+
+/* Congestion control algorithm for DTCP flows with retransmission
+ * control. The hooks are called under the DTP lock, and adjust
+ * dtp->cgwin, which is then clamped by the caller. The algorithm state
+ * lives in RL_CC_PRIV(dtp). */
+struct rl_cc_ops {
+    const char *name;
+    uint8_t type; /* RLITE_CC_T_* */
+    /* (Re)initialize the state when the sender (re)starts. */
+    void (*init)(struct dtp *dtp);
+    /* @acked PDUs have been acked by a control PDU that did not
+     * report any loss. */
+    void (*ack)(struct dtp *dtp, unsigned int acked);
+    /* A loss has been detected, by means of the rtx timer if @timeout
+     * is true, or by means of a SACK or NACK otherwise. */
+    void (*loss)(struct dtp *dtp, bool timeout);
+    /* Optional: ECN marks were echoed during the last window, and
+     * @alpha (in 1/(1 << RL_ECN_ALPHA_SHIFT) units) is the estimated
+     * fraction of marked PDUs. If missing, marks are handled like a
+     * loss. */
+    void (*ecn)(struct dtp *dtp, unsigned int alpha);
+    /* Optional: new RTT sample, in microseconds. */
+    void (*rtt_sample)(struct dtp *dtp, uint32_t rtt_us);
+    struct list_head node;
+};
 
 struct rl_sched_ops {
     const char *name;
@@ -766,6 +1019,8 @@ struct rl_sched_ops {
     int (*config)(struct rl_sched *, const struct rl_msg_base *bmsg);
     int (*enq)(struct rl_sched *, struct rl_buf *);
     struct rl_buf *(*deq)(struct rl_sched *);
+    /* Optional: dump scheduler statistics into a string. */
+    int (*stats)(struct rl_sched *, char *buf, int buflen);
     struct list_head node;
 };
 
@@ -773,38 +1028,71 @@ struct rl_sched {
     struct rl_sched_ops ops;
     wait_queue_head_t wqh;
     spinlock_t qlock;
+    /* Dequeuer for the PDUs enqueued in this scheduler instance. */
+    struct work_struct deq_work;
+    struct rl_normal *normal;
 #define RL_SCHED_PRIV(_sched) ((void *)(_sched)->priv)
     /* Private data allocated at the end of the struct. */
     char priv[0];
 };
 
+/* A multi-queue PDU scheduler is a set of independent scheduler
+ * instances (shards), each one with its own queues, lock and dequeue
+ * worker. Each N-1 flow is statically mapped to a shard, so that PDUs
+ * directed to different N-1 flows can be enqueued and dequeued in
+ * parallel on different CPUs, while the scheduling policy is still
+ * applied to all the PDUs that go through the same N-1 flow. */
+struct rl_sched_mq {
+#define RL_SCHED_SHARDS_MAX 16
+    unsigned int num_shards; /* a power of two */
+    struct rl_sched *shards[0];
+};
+
 /* Implementation of the normal IPCP. */
 struct rl_normal {
     struct ipcp_entry *ipcp;
     uint16_t ttl; /* time to live */
-    bool csum;    /* compute/check internet checksum on each PDU */
+#define RL_CSUM_NONE 0
+#define RL_CSUM_INET 1   /* Internet checksum */
+#define RL_CSUM_CRC32C 2 /* CRC32C, folded to 16 bits */
+    uint8_t csum; /* integrity check to compute/verify on each PDU */
+
+    /* ECN mark the DT PDUs that find more than this number of bytes
+     * in their PDU scheduler queue, or that find the N-1 flow busy.
+     * Zero disables marking. */
+    uint32_t ecn_thresh;
+
+    /* Memory used by the sequencing queues of all the flows, and the
+     * limits on the memory used by all the flows and by a single flow.
+     * Zero limits mean no limit. */
+    atomic_long_t seqq_mem;
+    uint32_t seqq_mem_max;
+    uint32_t seqq_flow_mem_max;
 
     /* Implementation of the PDU Forwarding Table (PDUFT): a lock, a
      * default entry, and two hash tables. One of the has tables maps
      * (dst_addr) --> (lower_flow). The other maps
      * (dst_addr, src_addr, dst_cepid, src_cepid, qosid) --> (lower_flow)
+     * Lookups are lock-free (RCU), the lock only serializes updates.
      */
-    rwlock_t pduft_lock;
-    struct flow_entry *pduft_dflt;
-    bool perflow_present;
+    spinlock_t pduft_lock;
+    struct flow_entry __rcu *pduft_dflt;
 #define PDUFT_HASHTABLE_BITS 3
-    DECLARE_HASHTABLE(pdu_ft, PDUFT_HASHTABLE_BITS);
-    DECLARE_HASHTABLE(pdu_ft_perflow, PDUFT_HASHTABLE_BITS);
+#define PDUFT_HASHTABLE_BITS_MAX 16
+    struct rl_pduft_table pdu_ft;
+    struct rl_pduft_table pdu_ft_perflow;
 
     /* Support for PDU scheduling. May be NULL if no PDU scheduler is
      * actually installed. */
-    struct rl_sched *sched;
-    struct work_struct sched_deq_work;
+    struct rl_sched_mq *sched;
 };
 
 void dtp_init(struct dtp *dtp);
 void dtp_fini(struct dtp *dtp);
 void dtp_dump(struct dtp *dtp);
+int rl_pduft_init(struct rl_normal *priv);
+void rl_pduft_fini(struct ipcp_entry *ipcp);
+int rl_pduft_stats(struct rl_normal *priv, char *buf, int buflen);
 int rl_pduft_del_addr(struct ipcp_entry *ipcp,
                       const struct rl_pci_match *match);
 int rl_pduft_del(struct ipcp_entry *ipcp, struct pduft_entry *entry);
@@ -849,10 +1137,48 @@ void *rl_alloc(size_t size, gfp_t gfp, rl_memtrack_t type);
 char *rl_strdup(const char *s, gfp_t gfp, rl_memtrack_t type);
 void rl_free(void *obj, rl_memtrack_t type);
 void rl_memtrack_dump_stats(void);
+/* Account for objects not allocated through rl_alloc(). */
+void rl_memtrack_get(rl_memtrack_t type);
+void rl_memtrack_put(rl_memtrack_t type);
 #else /* ! RL_MEMTRACK */
 #define rl_alloc(_sz, _gfp, _ty) kmalloc(_sz, _gfp)
 #define rl_strdup(_s, _gfp, _ty) kstrdup(_s, _gfp)
 #define rl_free(_obj, _ty) kfree(_obj)
+#define rl_memtrack_get(_ty)
+#define rl_memtrack_put(_ty)
 #endif /* ! RL_MEMTRACK */
 
+#ifndef RL_HAVE_KVMALLOC
+static inline void *
+kvzalloc(size_t size, gfp_t gfp)
+{
+    void *ret = kzalloc(size, gfp | __GFP_NOWARN | __GFP_NORETRY);
+
+    return ret ? ret : vzalloc(size);
+}
+#endif /* !RL_HAVE_KVMALLOC */
+
+/* Allocate zeroed memory for large tables, falling back to vmalloc()
+ * when contiguous pages are scarce. To be called in process context. */
+static inline void *
+rl_kvzalloc(size_t size, rl_memtrack_t type)
+{
+    void *ret = kvzalloc(size, GFP_KERNEL);
+
+    if (ret) {
+        rl_memtrack_get(type);
+    }
+
+    return ret;
+}
+
+static inline void
+rl_kvfree(void *obj, rl_memtrack_t type)
+{
+    if (obj) {
+        rl_memtrack_put(type);
+        kvfree(obj);
+    }
+}
+
 #endif /* __RLITE_KERNEL_H__ */
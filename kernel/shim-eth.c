@@ -39,9 +39,25 @@
 #include <linux/rtnetlink.h>
 #include <linux/rwlock.h>
 #include <linux/if_ether.h>
+#include <linux/jhash.h>
+#include <linux/poll.h>
 
 #define ETH_P_RLITE 0xD1F0
 
+/* Per TX-queue structure, padded to the cacheline boundary to avoid false
+ * sharing. Each flow is mapped to a TX queue, and backpressure is
+ * handled per queue. */
+struct eth_tx_queue {
+#define RL_TXQ_XMIT_BUSY 0
+    unsigned long xmit_busy;
+
+    /* Number of our skbs queued to the device and not yet released. */
+    atomic_t inflight;
+
+    /* Writers of the flows mapped to this queue wait here. */
+    wait_queue_head_t wqh;
+} __attribute__((aligned(64)));
+
 struct arpt_entry {
     /* Target Hardware Address. Only support 48-bit addresses for now. */
     uint8_t tha[6];
@@ -58,6 +74,11 @@ struct arpt_entry {
     /* The flow entry associated to the remote THA. */
     struct flow_entry *flow;
 
+    /* TX queue the flow is mapped to, and hash set on the skbs
+     * to steer them to that queue. */
+    struct eth_tx_queue *txq;
+    uint32_t txhash;
+
     /* Used on flow allocator slave side while the flow is in pending state. */
     struct rb_list rx_tmpq;
     unsigned int rx_tmpq_len;
@@ -66,19 +87,15 @@ struct arpt_entry {
     struct list_head node;
 };
 
-/* Per TX-queue structure, padded to the cacheline boundary to avoid false
- * sharing. */
-struct eth_tx_queue {
-#define RL_TXQ_XMIT_BUSY 0
-    unsigned long xmit_busy;
-} __attribute__((aligned(64)));
-
 struct rl_shim_eth {
     struct ipcp_entry *ipcp;
     struct net_device *netdev;
 
     struct eth_tx_queue *txq;
 
+    /* Spread the received PDUs across CPUs through RPS. */
+    bool rx_steering;
+
 #define ETH_UPPER_NAMES 4
     char *upper_names[ETH_UPPER_NAMES];
     struct list_head arp_table;
@@ -293,8 +310,13 @@ arp_resolver_cb(
 }
 
 static void
-arpt_flow_bind(struct arpt_entry *entry, struct flow_entry *flow)
+arpt_flow_bind(struct rl_shim_eth *priv, struct arpt_entry *entry,
+               struct flow_entry *flow)
 {
+    struct net_device *netdev = priv->netdev;
+    uint32_t hash;
+    uint32_t idx;
+
     /* We cannot flow_get() here, otherwise flows wouldn't never be
      * removed. However, it would not be necessary, since the core
      * will notify us with ops->flow_deallocated, so that we can
@@ -302,7 +324,24 @@ arpt_flow_bind(struct arpt_entry *entry, struct flow_entry *flow)
     entry->flow = flow;
     flow->priv  = entry;
 
-    rl_flow_share_tx_wqh(flow);
+    /* Map the flow to a TX queue by hashing the local MAC address and
+     * the local port-id (the remote MAC address may still be unknown).
+     * The hash is set on the skbs, so that the stack picks the same
+     * queue. The flows mapped to the same queue share the wait queue,
+     * so that backpressure on a queue only blocks (and restarts) those
+     * flows. This is only a prediction: with XPS, ndo_select_queue()
+     * or mqprio, the stack may pick a different queue, and the mapping
+     * becomes stale if real_num_tx_queues changes. Backpressure is still
+     * safe, because the busy flag, the inflight counter and the wait
+     * queue all belong to our eth_tx_queue, which is also the one that
+     * the skb destructor restarts; only its per-queue precision is lost. */
+    hash = jhash_2words(jhash(netdev->dev_addr, ETH_ALEN, 0), flow->local_port,
+                        0);
+    hash              = hash ? hash : 1;
+    idx               = reciprocal_scale(hash, netdev->real_num_tx_queues);
+    entry->txhash     = hash;
+    entry->txq        = &priv->txq[idx];
+    flow->txrx.tx_wqh = &entry->txq->wqh;
 }
 
 static int
@@ -332,7 +371,7 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
         if (entry->flow) {
             ret = -EBUSY;
         } else {
-            arpt_flow_bind(entry, flow);
+            arpt_flow_bind(priv, entry, flow);
             ret = 0;
         }
 
@@ -363,7 +402,7 @@ rl_shim_eth_fa_req(struct ipcp_entry *ipcp, struct flow_entry *flow,
     entry->fa_req_arrived = false;
     rb_list_init(&entry->rx_tmpq);
     entry->rx_tmpq_len = 0;
-    arpt_flow_bind(entry, flow);
+    arpt_flow_bind(priv, entry, flow);
     list_add_tail(&entry->node, &priv->arp_table);
 
     write_unlock_bh(&priv->arpt_lock);
@@ -433,7 +472,7 @@ rl_shim_eth_fa_resp(struct ipcp_entry *ipcp, struct flow_entry *flow,
             rl_sdu_rx_flow(ipcp, flow, rb, true);
         }
         entry->rx_tmpq_len = 0;
-        arpt_flow_bind(entry, flow);
+        arpt_flow_bind(priv, entry, flow);
         ret = 0;
     }
 
@@ -595,23 +634,33 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
 {
     struct ipcp_entry *ipcp = priv->ipcp;
     struct rl_buf *rb;
-    struct ethhdr *hh = eth_hdr(skb);
     struct arpt_entry *entry;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    uint8_t h_source[ETH_ALEN];
     unsigned len;
 
+    /* The skb may be released before we are done with the source MAC. */
+    memcpy(h_source, eth_hdr(skb)->h_source, ETH_ALEN);
+
     NPD("SHIM ETH PDU from %02X:%02X:%02X:%02X:%02X:%02X [%d]\n",
-        hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
-        hh->h_source[4], hh->h_source[5], skb->len);
+        h_source[0], h_source[1], h_source[2], h_source[3], h_source[4],
+        h_source[5], skb->len);
 
 #ifndef RL_SKB
-    rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom, GFP_ATOMIC);
+    /* Steal the skb data if possible, otherwise fall back to a copy. */
+    rb = rl_buf_from_skb(skb, ipcp->rxhdroom);
     if (unlikely(!rb)) {
-        RPV(1, "Out of memory\n");
-        return;
+        rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom,
+                          GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            RPV(1, "Out of memory\n");
+            dev_kfree_skb_any(skb);
+            return;
+        }
+        skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
+        rl_buf_append(rb, skb->len);
+        dev_kfree_skb_any(skb);
     }
-    skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
-    rl_buf_append(rb, skb->len);
 #else /* RL_SKB */
     rb                       = skb;
 #endif
@@ -628,7 +677,7 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
      * the source MAC address. */
     read_lock_bh(&priv->arpt_lock);
 
-    entry = arpt_rx_lookup(priv, hh->h_source);
+    entry = arpt_rx_lookup(priv, h_source);
 
     if (likely(entry && entry->flow)) {
         struct flow_entry *flow = entry->flow;
@@ -646,13 +695,13 @@ shim_eth_pdu_rx(struct rl_shim_eth *priv, struct sk_buff *skb)
      * allocation initiator. We need to do the lookup again, as we
      * have dropped the read lock. */
     write_lock_bh(&priv->arpt_lock);
-    entry = arpt_rx_lookup(priv, hh->h_source);
+    entry = arpt_rx_lookup(priv, h_source);
     if (!entry) {
         RPD(1,
             "PDU from unknown source MAC "
             "%02X:%02X:%02X:%02X:%02X:%02X\n",
-            hh->h_source[0], hh->h_source[1], hh->h_source[2], hh->h_source[3],
-            hh->h_source[4], hh->h_source[5]);
+            h_source[0], h_source[1], h_source[2], h_source[3], h_source[4],
+            h_source[5]);
         goto drop;
     }
 
@@ -711,6 +760,30 @@ drop:
     rl_buf_free(rb);
 }
 
+/* RSS does not look into our ethertype, so the device usually delivers
+ * all the PDUs to the CPU that serves a single RX queue. Here we set a
+ * hash of the MAC addresses on the skb and reinject it with netif_rx(),
+ * so that RPS (when rps_cpus is configured on the device) moves the skb
+ * to a CPU selected by the hash. The skb then comes back to us, and all
+ * the PDUs of an N-1 flow are processed on the same CPU. Returns true if
+ * the skb has been reinjected. */
+static bool
+shim_eth_rx_steer(struct sk_buff *skb)
+{
+    /* Destination and source addresses are contiguous. */
+    uint32_t hash = jhash(eth_hdr(skb), 2 * ETH_ALEN, 0);
+
+    hash = hash ? hash : 1;
+    if (skb->l4_hash && skb->hash == hash) {
+        return false; /* already steered */
+    }
+
+    skb_set_hash(skb, hash, PKT_HASH_TYPE_L4);
+    netif_rx(skb);
+
+    return true;
+}
+
 static rx_handler_result_t
 shim_eth_rx_handler(struct sk_buff **skbp)
 {
@@ -737,14 +810,11 @@ shim_eth_rx_handler(struct sk_buff **skbp)
 
     } else if (ethertype == ETH_P_RLITE) {
         /* This is a RLITE shim-eth PDU. */
+        if (READ_ONCE(priv->rx_steering) && shim_eth_rx_steer(skb)) {
+            return RX_HANDLER_CONSUMED;
+        }
+        /* The skb is consumed in any case. */
         shim_eth_pdu_rx(priv, skb);
-
-#ifndef RL_SKB
-        /* We should use dev_consume_skb_any(),
-         * for those kernel where this is defined (this would require figure out
-         * the kernel features at configuration time. */
-        dev_kfree_skb_any(skb);
-#endif /* !RL_SKB */
     } else {
         /* This frame doesn't belong to us, do not touch it. */
         return RX_HANDLER_PASS;
@@ -757,29 +827,37 @@ shim_eth_rx_handler(struct sk_buff **skbp)
 static void
 shim_eth_skb_destructor(struct sk_buff *skb)
 {
-    struct flow_entry *flow =
-        (struct flow_entry *)(skb_shinfo(skb)->destructor_arg);
-    struct ipcp_entry *ipcp  = flow->txrx.ipcp;
-    struct rl_shim_eth *priv = ipcp->priv;
-
-    if (test_and_clear_bit(RL_TXQ_XMIT_BUSY,
-                           &priv->txq[skb_get_queue_mapping(skb)].xmit_busy)) {
-        rl_write_restart_flows(ipcp);
+    struct eth_tx_queue *txq =
+        (struct eth_tx_queue *)(skb_shinfo(skb)->destructor_arg);
+
+    atomic_dec(&txq->inflight);
+    smp_mb__after_atomic();
+    if (test_and_clear_bit(RL_TXQ_XMIT_BUSY, &txq->xmit_busy)) {
+        /* Only restart the flows mapped to this queue. */
+        wake_up_interruptible_poll(&txq->wqh,
+                                   POLLOUT | POLLWRBAND | POLLWRNORM);
     }
 }
 
 static bool
 rl_shim_eth_flow_writeable(struct flow_entry *flow)
 {
-    struct rl_shim_eth *priv = (struct rl_shim_eth *)flow->txrx.ipcp->priv;
-    int i;
+    struct arpt_entry *entry = flow->priv;
 
-    for (i = 0; i < priv->netdev->num_tx_queues; i++) {
-        if (!test_bit(RL_TXQ_XMIT_BUSY, &priv->txq[i].xmit_busy)) {
-            return true;
-        }
-    }
-    return false;
+    return !entry || !test_bit(RL_TXQ_XMIT_BUSY, &entry->txq->xmit_busy);
+}
+
+/* Tell whether we recently got backpressure on @txq, or the device
+ * stopped the corresponding queue (which is only a hint, see
+ * arpt_flow_bind()). */
+static inline bool
+shim_eth_txq_busy(struct rl_shim_eth *priv, struct eth_tx_queue *txq)
+{
+    struct netdev_queue *dev_txq =
+        netdev_get_tx_queue(priv->netdev, txq - priv->txq);
+
+    return test_bit(RL_TXQ_XMIT_BUSY, &txq->xmit_busy) ||
+           netif_xmit_stopped(dev_txq);
 }
 
 static int
@@ -792,6 +870,7 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     struct arpt_entry *entry    = flow->priv;
     size_t len                  = rb->len;
     struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    struct eth_tx_queue *txq;
     int hhlen;
     int ret;
 
@@ -811,18 +890,31 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
 
 #ifndef RL_SKB
     hhlen = LL_RESERVED_SPACE(netdev); /* Hardware header length. */
-    skb   = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
-    if (!skb) {
-        rl_buf_free(rb);
-        stats->tx_err++;
-        return -ENOMEM;
+    /* Hand the PDU data over to the skb if possible, otherwise fall
+     * back to a copy. Once handed over, the PDU cannot be given back to
+     * the caller if the transmission fails, so we avoid doing that while
+     * the TX queue of the flow is busy or stopped: a copy allows us to
+     * propagate backpressure without losing the PDU. */
+    if (likely(!shim_eth_txq_busy(priv, entry->txq))) {
+        skb = rl_buf_to_skb(rb, hhlen, netdev->needed_tailroom);
     }
+    if (likely(skb)) {
+        rb = NULL; /* consumed */
+    } else {
+        skb = alloc_skb(hhlen + len + netdev->needed_tailroom, GFP_KERNEL);
+        if (!skb) {
+            rl_buf_free(rb);
+            stats->tx_err++;
+            return -ENOMEM;
+        }
 
-    skb_reserve(skb, hhlen); /* needed by dev_hard_header */
-#else                        /* RL_SKB */
+        skb_reserve(skb, hhlen); /* needed by dev_hard_header */
+        memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
+    }
+#else  /* RL_SKB */
     (void)hhlen;
     skb = rb;
-#endif                       /* RL_SKB */
+#endif /* RL_SKB */
     skb_reset_network_header(skb);
     skb->dev      = netdev;
     skb->protocol = htons(ETH_P_RLITE);
@@ -832,22 +924,29 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     ret = dev_hard_header(skb, skb->dev, ETH_P_RLITE, entry->tha,
                           netdev->dev_addr, skb->len);
     if (unlikely(ret < 0)) {
-        rl_buf_free(rb);
+#ifndef RL_SKB
+        if (rb) {
+            rl_buf_free(rb);
+        }
+#endif /* !RL_SKB */
         kfree_skb(skb);
 
         return ret;
     }
 
+    txq                             = entry->txq;
     skb->destructor                 = &shim_eth_skb_destructor;
-    skb_shinfo(skb)->destructor_arg = (void *)flow;
+    skb_shinfo(skb)->destructor_arg = (void *)txq;
+    atomic_inc(&txq->inflight);
 
-#ifndef RL_SKB
-    /* Copy data into the skb. */
-    memcpy(skb_put(skb, len), RL_BUF_DATA(rb), len);
-#endif /* !RL_SKB */
+    /* Steer the skb to the TX queue of the flow (see arpt_flow_bind()). */
+    skb_set_hash(skb, entry->txhash, PKT_HASH_TYPE_L4);
 
     /* Send the skb to the device for transmission. */
     ret = dev_queue_xmit(skb);
+    if (unlikely(ret != NET_XMIT_SUCCESS)) {
+        stats->tx_err++;
+    }
     if (unlikely(ret != NET_XMIT_SUCCESS && netif_running(netdev) &&
                  netif_carrier_ok(netdev))) {
         /* If we did not get NET_XMIT_SUCCESS (and device is up and running),
@@ -857,23 +956,36 @@ rl_shim_eth_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
          * backpressure (or we get stuck in rmt_tx() for ever). In the latter
          * case we need to return success, with the packet being silently
          * dropped. */
-        int i;
+        bool busy;
 
         RPV(1, "dev_queue_xmit() failed [%d]\n", ret);
-        stats->tx_err++;
-        for (i = 0; i < priv->netdev->num_tx_queues; i++) {
-            set_bit(RL_TXQ_XMIT_BUSY, &priv->txq[i].xmit_busy);
+        set_bit(RL_TXQ_XMIT_BUSY, &txq->xmit_busy);
+        smp_mb__after_atomic();
+        busy = atomic_read(&txq->inflight) > 0;
+        if (!busy) {
+            /* None of our skbs is in flight on this queue, so there is
+             * no destructor that would restart the flows. We cannot
+             * propagate backpressure. */
+            clear_bit(RL_TXQ_XMIT_BUSY, &txq->xmit_busy);
         }
 #ifndef RL_SKB
-        return -EAGAIN; /* backpressure */
+        if (rb && busy) {
+            return -EAGAIN; /* backpressure */
+        }
+        /* The PDU data was handed over to the skb, and it is gone
+         * with it, so we can only drop, like in the RL_SKB case. */
 #endif
     }
 
-    stats->tx_pkt++;
-    stats->tx_byte += len;
+    if (likely(ret == NET_XMIT_SUCCESS)) {
+        stats->tx_pkt++;
+        stats->tx_byte += len;
+    }
 
 #ifndef RL_SKB
-    rl_buf_free(rb);
+    if (rb) {
+        rl_buf_free(rb);
+    }
 #endif /* !RL_SKB */
 
     return 0;
@@ -888,6 +1000,8 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
 
     if (strcmp(param_name, "netdev") == 0) {
         struct net_device *netdev = NULL;
+        uint16_t tailroom;
+        int i;
 
         if (priv->netdev) {
             /* We don't allow to dynamically change netdev to simplify
@@ -907,6 +1021,10 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
             dev_put(netdev);
             return -ENOMEM;
         }
+        for (i = 0; i < netdev->num_tx_queues; i++) {
+            atomic_set(&priv->txq[i].inflight, 0);
+            init_waitqueue_head(&priv->txq[i].wqh);
+        }
 
         rtnl_lock();
         ret = netdev_rx_handler_register(netdev, shim_eth_rx_handler, priv);
@@ -922,17 +1040,21 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
         /* Set IPCP max_sdu_size using the device MTU. However, MTU can be
          * changed; we should intercept those changes, reflect the change
          * in the ipcp_entry and notify userspace. */
+        tailroom = netdev->needed_tailroom;
+#ifndef RL_SKB
+        /* Ask the upper layers for enough tailroom to build the skb
+         * around their buffers, so that no copy is needed on TX. */
+        tailroom += RL_BUF_SKB_TAILROOM;
+#endif /* !RL_SKB */
         *notify = (ipcp->max_sdu_size != netdev->mtu) ||
-                  (ipcp->tailroom != netdev->needed_tailroom);
+                  (ipcp->tailroom != tailroom);
         ipcp->max_sdu_size = netdev->mtu;
-        ipcp->tailroom     = netdev->needed_tailroom;
-#ifdef RL_SKB
+        ipcp->tailroom     = tailroom;
         /* Report the headroom needed for Ethernet header. */
         if (ipcp->txhdroom != LL_RESERVED_SPACE(netdev)) {
             *notify = 1;
         }
         ipcp->txhdroom = LL_RESERVED_SPACE(netdev);
-#endif /* RL_SKB */
 
         PD("netdev set to %p [max_sdu_size=%u, txhdroom=%u, rxhdroom=%u, "
            "troom=%u]\n",
@@ -947,6 +1069,13 @@ rl_shim_eth_config(struct ipcp_entry *ipcp, const char *param_name,
         *notify            = (ipcp->max_sdu_size != priv->netdev->mtu);
         ipcp->max_sdu_size = priv->netdev->mtu;
         return -EPERM;
+    } else if (strcmp(param_name, "rx-steering") == 0) {
+        uint16_t steering = priv->rx_steering;
+
+        ret = rl_configstr_to_u16(param_value, &steering, NULL);
+        if (ret == 0) {
+            WRITE_ONCE(priv->rx_steering, !!steering);
+        }
     }
 
     return ret;
@@ -965,6 +1094,8 @@ rl_shim_eth_config_get(struct ipcp_entry *ipcp, const char *param_name,
         } else {
             snprintf(buf, buflen, "%s", priv->netdev->name);
         }
+    } else if (strcmp(param_name, "rx-steering") == 0) {
+        snprintf(buf, buflen, "%u", priv->rx_steering);
     } else {
         ret = -ENOSYS;
     }
@@ -1085,9 +1216,10 @@ rl_shim_eth_create(struct ipcp_entry *ipcp)
         return NULL;
     }
 
-    priv->ipcp   = ipcp;
-    priv->netdev = NULL;
-    priv->txq    = NULL;
+    priv->ipcp        = ipcp;
+    priv->netdev      = NULL;
+    priv->txq         = NULL;
+    priv->rx_steering = false;
     INIT_LIST_HEAD(&priv->arp_table);
     rwlock_init(&priv->arpt_lock);
 #ifdef RL_HAVE_TIMER_SETUP
@@ -40,15 +40,23 @@
 #include <linux/file.h>
 #include <linux/version.h>
 #include <net/sock.h>
+#include <net/tcp.h>
 
+/* This struct is unnecessary, but we keep it to ease future extensions. */
 struct rl_shim_tcp4 {
     struct ipcp_entry *ipcp;
-    struct work_struct txw;
-    spinlock_t txq_lock;
-    unsigned int txq_len;
-    struct list_head txq;
 };
 
+/* Maximum number of SDUs coalesced in a single sendmsg(). */
+#define SHIM_TCP4_TX_BATCH 32
+
+/* Maximum number of SDUs queued for transmission on a flow, before
+ * sdu_write() starts to exert backpressure. */
+#define SHIM_TCP4_TXQ_MAX 256
+
+/* Maximum number of bytes consumed by a tcp_read_sock() call. */
+#define SHIM_TCP4_RX_BUDGET (1 << 16)
+
 struct shim_tcp4_flow {
     struct flow_entry *flow;
     struct socket *sock;
@@ -61,23 +69,30 @@ struct shim_tcp4_flow {
     );
     void (*sk_write_space)(struct sock *sk);
 
+    /* State of the TCP reader, protected by rxw_lock. */
     struct rl_buf *cur_rx_rb;
     uint16_t cur_rx_rblen;
     int cur_rx_buflen;
     bool cur_rx_hdr;
+    struct rb_list rx_train;
 
     struct mutex rxw_lock;
-};
 
-#define INET4_MAX_TXQ_LEN 64
+    /* SDUs waiting to be sent, protected by txq_lock. */
+    spinlock_t txq_lock;
+    struct rb_list txq;
+    unsigned int txq_len;
 
-struct txq_entry {
-    struct rl_buf *rb;
-    struct shim_tcp4_flow *flow_priv;
-    struct list_head node;
-};
+    /* Bytes of the txq head (including the length header) that have
+     * already been sent. This and the following fields are protected
+     * by txw_lock. */
+    size_t tx_off;
+    uint16_t tx_hdrs[SHIM_TCP4_TX_BATCH];
+    struct kvec tx_iov[2 * SHIM_TCP4_TX_BATCH];
 
-static void tcp4_tx_worker(struct work_struct *w);
+    struct work_struct txw;
+    struct mutex txw_lock;
+};
 
 static void *
 rl_shim_tcp4_create(struct ipcp_entry *ipcp)
@@ -91,11 +106,6 @@ rl_shim_tcp4_create(struct ipcp_entry *ipcp)
 
     priv->ipcp = ipcp;
 
-    priv->txq_len = 0;
-    INIT_LIST_HEAD(&priv->txq);
-    INIT_WORK(&priv->txw, tcp4_tx_worker);
-    spin_lock_init(&priv->txq_lock);
-
     /* The max_sdu_size for this IPCP is limited by the the TCP
      * send socket buffer (which is configurable). The default
      * size is contained in the kernel variable sysctl_wmem_default,
@@ -117,101 +127,303 @@ rl_shim_tcp4_destroy(struct ipcp_entry *ipcp)
     PD("IPCP [%p] destroyed\n", priv);
 }
 
+/* Called by tcp_read_sock() for each skb in the socket receive queue,
+ * with the socket owned through lock_sock(), so in process context and
+ * allowed to sleep. Parses as many length-prefixed SDUs as
+ * possible out of the @len bytes starting at @offset, copying each one
+ * directly into an rl_buf. Complete SDUs are appended to the rx train.
+ * Returns the number of bytes consumed. */
+static int
+tcp4_recv_actor(read_descriptor_t *desc, struct sk_buff *skb,
+                unsigned int offset, size_t len)
+{
+    struct shim_tcp4_flow *priv = desc->arg.data;
+    struct ipcp_entry *ipcp     = priv->flow->txrx.ipcp;
+    struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+    size_t avail                = min_t(size_t, len, desc->count);
+    size_t used                 = 0;
+
+    while (used < avail) {
+        size_t n;
+
+        if (priv->cur_rx_hdr) {
+            /* We're reading the 2-bytes header containing the SDU length,
+             * which may be split across two skbs. */
+            n = min_t(size_t, avail - used,
+                      sizeof(priv->cur_rx_rblen) - priv->cur_rx_buflen);
+            skb_copy_bits(skb, offset + used,
+                          (uint8_t *)&priv->cur_rx_rblen + priv->cur_rx_buflen,
+                          n);
+            used += n;
+            priv->cur_rx_buflen += n;
+            if (priv->cur_rx_buflen < sizeof(priv->cur_rx_rblen)) {
+                break;
+            }
+
+            /* We have completely read the 2-bytes header. */
+            priv->cur_rx_rblen  = ntohs(priv->cur_rx_rblen);
+            priv->cur_rx_buflen = 0;
+            if (unlikely(!priv->cur_rx_rblen)) {
+                PE("Warning: zero length packet\n");
+                continue;
+            }
+
+            priv->cur_rx_hdr = false;
+            priv->cur_rx_rb  = rl_buf_alloc(priv->cur_rx_rblen, ipcp->rxhdroom,
+                                            ipcp->tailroom, GFP_KERNEL);
+            if (unlikely(!priv->cur_rx_rb)) {
+                /* The SDU bytes will be skipped. */
+                stats->rx_err++;
+                RPV(1, "Out of memory\n");
+            } else {
+                rl_buf_append(priv->cur_rx_rb, priv->cur_rx_rblen);
+            }
+            continue;
+        }
+
+        /* We're reading the SDU. */
+        n = min_t(size_t, avail - used,
+                  priv->cur_rx_rblen - priv->cur_rx_buflen);
+        if (likely(priv->cur_rx_rb)) {
+            skb_copy_bits(skb, offset + used,
+                          RL_BUF_DATA(priv->cur_rx_rb) + priv->cur_rx_buflen,
+                          n);
+        }
+        used += n;
+        priv->cur_rx_buflen += n;
+
+        if (priv->cur_rx_buflen == priv->cur_rx_rblen) {
+            /* We have completely read the SDU. */
+            if (likely(priv->cur_rx_rb)) {
+                rb_list_enq(priv->cur_rx_rb, &priv->rx_train);
+                stats->rx_pkt++;
+                stats->rx_byte += priv->cur_rx_rblen;
+            }
+
+            priv->cur_rx_rb     = NULL;
+            priv->cur_rx_hdr    = true;
+            priv->cur_rx_rblen  = 0;
+            priv->cur_rx_buflen = 0;
+        }
+    }
+
+    desc->count -= used;
+
+    return used;
+}
+
 /* This must be called in process context. */
 static void
 tcp4_drain_socket_rxq(struct shim_tcp4_flow *priv)
 {
-    struct flow_entry *flow     = priv->flow;
-    struct rl_ipcp_stats *stats = raw_cpu_ptr(flow->txrx.ipcp->stats);
-    struct socket *sock         = priv->sock;
-    struct msghdr msghdr;
-    struct iovec iov;
-    int ret;
+    struct flow_entry *flow = priv->flow;
+    struct sock *sk         = priv->sock->sk;
 
     mutex_lock(&priv->rxw_lock);
 
     for (;;) {
-        memset(&msghdr, 0, sizeof(msghdr));
-        msghdr.msg_flags = MSG_DONTWAIT;
+        read_descriptor_t desc = {
+            .arg.data = priv,
+            .count    = SHIM_TCP4_RX_BUDGET,
+        };
+        int ret;
+
+        /* Parse the SDUs straight out of the skbs in the socket receive
+         * queue, instead of issuing two recvmsg() calls per SDU. */
+        lock_sock(sk);
+        ret = tcp_read_sock(sk, &desc, tcp4_recv_actor);
+        release_sock(sk);
 
-        if (priv->cur_rx_hdr) {
-            /* We're reading the 2-bytes header containing the SDU length. */
-            iov.iov_base = &priv->cur_rx_rblen;
-            iov.iov_len  = sizeof(priv->cur_rx_rblen);
-
-        } else {
-            /* We're reading the SDU. */
-            iov.iov_base = RL_BUF_DATA(priv->cur_rx_rb);
-            iov.iov_len  = priv->cur_rx_rblen;
-        }
+        NPD("read %d bytes\n", ret);
 
-        iov.iov_base += priv->cur_rx_buflen;
-        iov.iov_len -= priv->cur_rx_buflen;
+        /* Pass the SDUs up as a train, outside of the socket lock. */
+        if (!rb_list_empty(&priv->rx_train)) {
+            rl_sdu_rx_flow_train(flow->txrx.ipcp, flow, &priv->rx_train,
+                                 true);
+        }
 
-        ret = kernel_recvmsg(sock, &msghdr, (struct kvec *)&iov, 1, iov.iov_len,
-                             msghdr.msg_flags);
-        if (ret == -EAGAIN) {
-            break;
-        } else if (unlikely(ret <= 0)) {
-            if (ret) {
-                PE("recvmsg(%zu): %d\n", iov.iov_len, ret);
-                stats->rx_err++;
-            } else {
-                PI("Exit rx loop\n");
+        if (ret <= 0) {
+            if (unlikely(ret < 0 && ret != -EAGAIN)) {
+                PE("tcp_read_sock(): %d\n", ret);
+                raw_cpu_ptr(flow->txrx.ipcp->stats)->rx_err++;
             }
             break;
         }
+        cond_resched();
+    }
 
-        NPD("read %d bytes\n", ret);
+    mutex_unlock(&priv->rxw_lock);
+}
 
-        priv->cur_rx_buflen += ret;
+static void
+tcp4_rx_worker(struct work_struct *w)
+{
+    struct shim_tcp4_flow *priv = container_of(w, struct shim_tcp4_flow, rxw);
 
-        if (priv->cur_rx_hdr &&
-            priv->cur_rx_buflen == sizeof(priv->cur_rx_rblen)) {
-            /* We have completely read the 2-bytes header. */
-            priv->cur_rx_rblen = ntohs(priv->cur_rx_rblen);
-            if (unlikely(!priv->cur_rx_rblen)) {
-                PE("Warning: zero length packet\n");
+    tcp4_drain_socket_rxq(priv);
+}
+
+/* Drop all the SDUs waiting to be sent. Returns the number of SDUs
+ * dropped. */
+static unsigned int
+tcp4_txq_purge(struct shim_tcp4_flow *priv)
+{
+    struct rl_buf *rb, *tmp;
+    unsigned int n = 0;
+    struct rb_list q;
+
+    rb_list_init(&q);
+    spin_lock_bh(&priv->txq_lock);
+    rb_list_foreach_safe (rb, tmp, &priv->txq) {
+        rb_list_del(rb);
+        rb_list_enq(rb, &q);
+        n++;
+    }
+    priv->txq_len = 0;
+    spin_unlock_bh(&priv->txq_lock);
+
+    rb_list_foreach_safe (rb, tmp, &q) {
+        rb_list_del(rb);
+        rl_buf_free(rb);
+    }
+
+    return n;
+}
+
+/* Send as many queued SDUs as the socket send buffer can take, coalescing
+ * up to SHIM_TCP4_TX_BATCH SDUs (with their length headers) in each
+ * sendmsg(). MSG_MORE is set while more SDUs are queued behind the
+ * current batch, so that TCP can build full segments. A partially sent
+ * SDU stays at the head of the queue, and transmission is resumed by
+ * tcp4_write_space(). This must be called in process context. */
+static void
+tcp4_tx_flush(struct shim_tcp4_flow *priv)
+{
+    struct rl_ipcp_stats *stats =
+        raw_cpu_ptr(priv->flow->txrx.ipcp->stats);
+    bool restart = false;
+
+    mutex_lock(&priv->txw_lock);
+
+    for (;;) {
+        size_t skip = priv->tx_off;
+        struct rl_buf *rb, *tmp;
+        struct msghdr msghdr;
+        struct rb_list done;
+        size_t tot = 0;
+        int niov   = 0;
+        int n      = 0;
+        size_t sent;
+        bool more;
+        int ret;
+
+        /* Only this function removes SDUs from the queue, so the ones
+         * collected here stay valid after the lock is released. */
+        spin_lock_bh(&priv->txq_lock);
+        rb_list_foreach (rb, &priv->txq) {
+            uint8_t *hdr, *buf;
+            size_t hlen, blen;
+
+            if (n == SHIM_TCP4_TX_BATCH) {
+                break;
+            }
+
+            priv->tx_hdrs[n] = htons(rb->len);
+            hdr              = (uint8_t *)&priv->tx_hdrs[n];
+            hlen             = sizeof(priv->tx_hdrs[n]);
+            buf              = RL_BUF_DATA(rb);
+            blen             = rb->len;
+            if (skip >= hlen) {
+                buf += skip - hlen;
+                blen -= skip - hlen;
+                hlen = 0;
             } else {
-                priv->cur_rx_hdr = false;
-                priv->cur_rx_rb  = rl_buf_alloc(
-                    priv->cur_rx_rblen, priv->flow->txrx.ipcp->rxhdroom,
-                    priv->flow->txrx.ipcp->tailroom, GFP_ATOMIC);
-                if (unlikely(!priv->cur_rx_rb)) {
-                    stats->rx_err++;
-                    RPV(1, "Out of memory\n");
-                    break;
-                }
-                rl_buf_append(priv->cur_rx_rb, priv->cur_rx_rblen);
+                hdr += skip;
+                hlen -= skip;
             }
+            skip = 0;
 
-            priv->cur_rx_buflen = 0;
+            if (hlen) {
+                priv->tx_iov[niov].iov_base = hdr;
+                priv->tx_iov[niov].iov_len  = hlen;
+                niov++;
+            }
+            priv->tx_iov[niov].iov_base = buf;
+            priv->tx_iov[niov].iov_len  = blen;
+            niov++;
+            tot += hlen + blen;
+            n++;
+        }
+        more = priv->txq_len > n;
+        spin_unlock_bh(&priv->txq_lock);
 
-        } else if (!priv->cur_rx_hdr &&
-                   priv->cur_rx_buflen == priv->cur_rx_rblen) {
-            /* We have completely read the SDU. */
-            rl_sdu_rx_flow(flow->txrx.ipcp, flow, priv->cur_rx_rb, true);
+        if (!n) {
+            break;
+        }
+
+        memset(&msghdr, 0, sizeof(msghdr));
+        msghdr.msg_flags = MSG_DONTWAIT | (more ? MSG_MORE : 0);
+        ret = kernel_sendmsg(priv->sock, &msghdr, priv->tx_iov, niov, tot);
+        if (ret == -EAGAIN) {
+            break; /* tcp4_write_space() will call us again */
+        }
+        if (unlikely(ret < 0)) {
+            /* The byte stream is broken, there is no point in keeping
+             * the queued SDUs. */
+            PE("kernel_sendmsg(%zu): failed [%d]\n", tot, ret);
+            stats->tx_err += tcp4_txq_purge(priv);
+            priv->tx_off = 0;
+            restart      = true;
+            break;
+        }
 
-            stats->rx_pkt++;
-            stats->rx_byte += priv->cur_rx_rblen;
+        NPD("kernel_sendmsg(%zu): %d\n", tot, ret);
 
-            priv->cur_rx_rb    = NULL;
-            priv->cur_rx_hdr   = true;
-            priv->cur_rx_rblen = 0;
+        /* Release the SDUs that have been sent completely. */
+        rb_list_init(&done);
+        sent = priv->tx_off + ret;
+        spin_lock_bh(&priv->txq_lock);
+        rb_list_foreach_safe (rb, tmp, &priv->txq) {
+            size_t sz = rb->len + sizeof(uint16_t);
 
-            priv->cur_rx_buflen = 0;
+            if (sent < sz) {
+                break;
+            }
+            sent -= sz;
+            rb_list_del(rb);
+            rb_list_enq(rb, &done);
+            priv->txq_len--;
+            restart = true;
+        }
+        priv->tx_off = sent;
+        spin_unlock_bh(&priv->txq_lock);
+
+        rb_list_foreach_safe (rb, tmp, &done) {
+            rb_list_del(rb);
+            stats->tx_pkt++;
+            stats->tx_byte += rb->len;
+            rl_buf_free(rb);
+        }
+
+        if ((size_t)ret < tot) {
+            break; /* send buffer full, wait for tcp4_write_space() */
         }
     }
 
-    mutex_unlock(&priv->rxw_lock);
+    mutex_unlock(&priv->txw_lock);
+
+    if (restart) {
+        /* Wake up the writers blocked on a full queue. */
+        rl_write_restart_flow(priv->flow);
+    }
 }
 
 static void
-tcp4_rx_worker(struct work_struct *w)
+tcp4_tx_worker(struct work_struct *w)
 {
-    struct shim_tcp4_flow *priv = container_of(w, struct shim_tcp4_flow, rxw);
+    struct shim_tcp4_flow *priv = container_of(w, struct shim_tcp4_flow, txw);
 
-    tcp4_drain_socket_rxq(priv);
+    tcp4_tx_flush(priv);
 }
 
 static void
@@ -235,7 +447,11 @@ tcp4_write_space(struct sock *sk)
 {
     struct shim_tcp4_flow *priv = sk->sk_user_data;
 
-    rl_write_restart_flow(priv->flow);
+    /* Resume the transmission of the queued SDUs, which in turn
+     * restarts the writers. */
+    if (READ_ONCE(priv->txq_len)) {
+        schedule_work(&priv->txw);
+    }
 }
 
 static int
@@ -260,18 +476,6 @@ rl_shim_tcp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
         return err;
     }
 
-    write_lock_bh(&sock->sk->sk_callback_lock);
-    priv->sk_data_ready      = sock->sk->sk_data_ready;
-    priv->sk_write_space     = sock->sk->sk_write_space;
-    sock->sk->sk_data_ready  = tcp4_data_ready;
-    sock->sk->sk_write_space = tcp4_write_space;
-    sock->sk->sk_user_data   = priv;
-    write_unlock_bh(&sock->sk->sk_callback_lock);
-
-    sock_reset_flag(sock->sk, SOCK_USE_WRITE_QUEUE);
-
-    PD("Got socket %p\n", sock);
-
     priv->sock = sock;
     INIT_WORK(&priv->rxw, tcp4_rx_worker);
     mutex_init(&priv->rxw_lock);
@@ -281,10 +485,33 @@ rl_shim_tcp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     priv->cur_rx_rblen  = 0;
     priv->cur_rx_buflen = 0;
     priv->cur_rx_hdr    = true;
+    rb_list_init(&priv->rx_train);
+
+    /* Initialize TCP writer state. */
+    spin_lock_init(&priv->txq_lock);
+    rb_list_init(&priv->txq);
+    priv->txq_len = 0;
+    priv->tx_off  = 0;
+    INIT_WORK(&priv->txw, tcp4_tx_worker);
+    mutex_init(&priv->txw_lock);
 
     priv->flow = flow;
     flow->priv = priv;
 
+    /* The callbacks can fire as soon as they are installed, so the
+     * flow state must be ready at this point. */
+    write_lock_bh(&sock->sk->sk_callback_lock);
+    priv->sk_data_ready      = sock->sk->sk_data_ready;
+    priv->sk_write_space     = sock->sk->sk_write_space;
+    sock->sk->sk_data_ready  = tcp4_data_ready;
+    sock->sk->sk_write_space = tcp4_write_space;
+    sock->sk->sk_user_data   = priv;
+    write_unlock_bh(&sock->sk->sk_callback_lock);
+
+    sock_reset_flag(sock->sk, SOCK_USE_WRITE_QUEUE);
+
+    PD("Got socket %p\n", sock);
+
     /* It often happens then the remote endpoint sent some data before
      * this flow_init() function is called, and therefore before we
      * have the chance to intercept that data with the sk_data_ready()
@@ -302,13 +529,12 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
 {
     struct shim_tcp4_flow *priv = flow->priv;
     struct socket *sock;
+    unsigned int n;
 
     if (!priv) {
         return 0;
     }
 
-    cancel_work_sync(&priv->rxw);
-
     sock = priv->sock;
 
     write_lock_bh(&sock->sk->sk_callback_lock);
@@ -317,6 +543,19 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     sock->sk->sk_user_data   = NULL;
     write_unlock_bh(&sock->sk->sk_callback_lock);
 
+    cancel_work_sync(&priv->rxw);
+    cancel_work_sync(&priv->txw);
+
+    /* The flow removal is postponed to let the queue drain, so
+     * anything left here is not going to be sent. */
+    n = tcp4_txq_purge(priv);
+    if (n) {
+        PD("Dropped %u queued SDUs\n", n);
+    }
+    if (priv->cur_rx_rb) {
+        rl_buf_free(priv->cur_rx_rb);
+    }
+
     /* Decrement the file descriptor reference counter, in order to
      * match flow_init(). */
     fput(sock->file);
@@ -329,91 +568,12 @@ rl_shim_tcp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
     return 0;
 }
 
-static int
-tcp4_xmit(struct shim_tcp4_flow *flow_priv, struct rl_buf *rb)
-{
-    struct rl_ipcp_stats *stats =
-        raw_cpu_ptr(flow_priv->flow->txrx.ipcp->stats);
-    struct msghdr msghdr;
-    struct iovec iov[2];
-    uint16_t lenhdr = htons(rb->len);
-    int totlen      = rb->len + sizeof(lenhdr);
-    int ret;
-
-    memset(&msghdr, 0, sizeof(msghdr));
-    iov[0].iov_base = &lenhdr;
-    iov[0].iov_len  = sizeof(lenhdr);
-    iov[1].iov_base = RL_BUF_DATA(rb);
-    iov[1].iov_len  = rb->len;
-
-    msghdr.msg_flags = MSG_DONTWAIT;
-    ret =
-        kernel_sendmsg(flow_priv->sock, &msghdr, (struct kvec *)iov, 2, totlen);
-
-    if (unlikely(ret != totlen)) {
-        PD("wspaces: %d, %lu\n", sk_stream_wspace(flow_priv->sock->sk),
-           sock_wspace(flow_priv->sock->sk));
-        if (ret < 0) {
-            PE("kernel_sendmsg(): failed [%d]\n", ret);
-
-        } else {
-            PI("kernel_sendmsg(): partial write %d/%zu\n", ret, rb->len);
-        }
-
-        stats->tx_err++;
-    } else {
-        NPD("kernel_sendmsg(%zu + 2)\n", rb->len);
-        stats->tx_pkt++;
-        stats->tx_byte += rb->len;
-    }
-
-    rl_buf_free(rb);
-
-    return ret;
-}
-
-static void
-tcp4_tx_worker(struct work_struct *w)
-{
-    struct rl_shim_tcp4 *priv = container_of(w, struct rl_shim_tcp4, txw);
-    int totlen;
-
-    for (;;) {
-        struct txq_entry *qe = NULL;
-
-        spin_lock_bh(&priv->txq_lock);
-        if (priv->txq_len) {
-            qe = list_first_entry(&priv->txq, struct txq_entry, node);
-            list_del_init(&qe->node);
-            priv->txq_len--;
-        }
-        spin_unlock_bh(&priv->txq_lock);
-
-        if (!qe) {
-            break;
-        }
-
-        totlen = qe->rb->len + sizeof(uint16_t);
-
-        if (sk_stream_wspace(qe->flow_priv->sock->sk) < totlen + 2) {
-            /* Cannot backpressure here, we have to drop */
-            RPD(1, "Dropping SDU [len=%zu]\n", qe->rb->len);
-            rl_buf_free(qe->rb);
-        } else {
-            tcp4_xmit(qe->flow_priv, qe->rb);
-        }
-
-        flow_put(qe->flow_priv->flow);
-        rl_free(qe, RL_MT_SHIMDATA);
-    }
-}
-
 static bool
 rl_shim_tcp4_flow_writeable(struct flow_entry *flow)
 {
     struct shim_tcp4_flow *flow_priv = flow->priv;
 
-    return sk_stream_wspace(flow_priv->sock->sk) > 0;
+    return READ_ONCE(flow_priv->txq_len) < SHIM_TCP4_TXQ_MAX;
 }
 
 static int
@@ -421,49 +581,22 @@ rl_shim_tcp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
                        struct rl_buf *rb, unsigned flags)
 {
     struct shim_tcp4_flow *flow_priv = flow->priv;
-    struct rl_shim_tcp4 *shim        = ipcp->priv;
-    int totlen                       = rb->len + sizeof(uint16_t);
 
-    if (sk_stream_wspace(flow_priv->sock->sk) < totlen + 2) {
+    spin_lock_bh(&flow_priv->txq_lock);
+    if (flow_priv->txq_len >= SHIM_TCP4_TXQ_MAX) {
+        spin_unlock_bh(&flow_priv->txq_lock);
         /* Backpressure: We will be called again. */
         return -EAGAIN;
     }
+    rb_list_enq(rb, &flow_priv->txq);
+    flow_priv->txq_len++;
+    spin_unlock_bh(&flow_priv->txq_lock);
 
-    if (!(flags & RL_RMT_F_MAYSLEEP)) {
-        struct txq_entry *qe =
-            rl_alloc(sizeof(*qe), GFP_ATOMIC, RL_MT_SHIMDATA);
-        bool drop = false;
-
-        if (unlikely(!qe)) {
-            rl_buf_free(rb);
-            RPV(1, "Out of memory, dropping packet\n");
-            return -ENOMEM;
-        }
-
-        qe->rb = rb;
-        flow_get_ref(flow);
-        qe->flow_priv = flow_priv;
-        spin_lock_bh(&shim->txq_lock);
-        if (shim->txq_len > INET4_MAX_TXQ_LEN) {
-            drop = true;
-        } else {
-            list_add_tail(&qe->node, &shim->txq);
-            shim->txq_len++;
-        }
-        spin_unlock_bh(&shim->txq_lock);
-
-        if (drop) {
-            NPD(2, "Queue full, dropping PDU [len=%u]\n", rb->len);
-            rl_buf_free(rb);
-            return -ENOSPC;
-        }
-
-        schedule_work(&shim->txw);
-
-        return 0;
-    }
+    /* Always defer the transmission to the worker, also when we could
+     * sleep, so that SDUs written back to back are coalesced. */
+    schedule_work(&flow_priv->txw);
 
-    return tcp4_xmit(flow_priv, rb);
+    return 0;
 }
 
 static int
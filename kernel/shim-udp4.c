@@ -41,6 +41,11 @@
 #include <linux/version.h>
 #include <linux/udp.h>
 #include <net/sock.h>
+#ifdef RL_HAVE_UDP_TUNNEL
+#include <linux/percpu.h>
+#include <linux/interrupt.h>
+#include <net/udp_tunnel.h>
+#endif /* RL_HAVE_UDP_TUNNEL */
 
 /* This struct is unnecessary, but we keep it to ease future extensions. */
 struct rl_shim_udp4 {
@@ -61,8 +66,19 @@ struct shim_udp4_flow {
     struct sockaddr_in remote_addr;
 
     struct mutex rxw_lock;
+
+    /* Set if the socket refused UDP segmentation offload. */
+    bool no_gso;
+
+    /* Set if datagrams are intercepted by udp4_encap_rcv() in softirq
+     * context. The rx worker is then only used to drain what was
+     * queued on the socket before flow_init(). */
+    bool encap;
 };
 
+/* Maximum number of datagrams received or sent in a train. */
+#define SHIM_UDP4_TRAIN_MAX 32
+
 static void *
 rl_shim_udp4_create(struct ipcp_entry *ipcp)
 {
@@ -149,7 +165,10 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
         .msg_namelen    = 0,
         .msg_flags      = MSG_DONTWAIT,
     };
+    unsigned int train_len = 0;
+    struct rb_list train;
 
+    rb_list_init(&train);
     mutex_lock(&priv->rxw_lock);
 
     for (;;) {
@@ -205,14 +224,148 @@ udp4_drain_socket_rxq(struct shim_udp4_flow *priv)
 
         NPD("read %d bytes\n", ret);
         rb->len = ret;
-        rl_sdu_rx_flow(flow->txrx.ipcp, flow, rb, true);
         stats->rx_pkt++;
         stats->rx_byte += ret;
+
+        /* Pass the datagrams up in trains, so that the upper IPCP can
+         * process bursts at once. */
+        rb_list_enq(rb, &train);
+        if (++train_len == SHIM_UDP4_TRAIN_MAX) {
+            rl_sdu_rx_flow_train(flow->txrx.ipcp, flow, &train, true);
+            train_len = 0;
+        }
+    }
+
+    if (!rb_list_empty(&train)) {
+        rl_sdu_rx_flow_train(flow->txrx.ipcp, flow, &train, true);
     }
 
     mutex_unlock(&priv->rxw_lock);
 }
 
+#ifdef RL_HAVE_UDP_TUNNEL
+/* Any non-zero value enables encap_rcv for the socket. */
+#define SHIM_UDP4_ENCAP_TYPE 1
+
+/* Datagrams intercepted by udp4_encap_rcv() on a CPU are collected in
+ * a per-CPU train, which is passed up when a datagram for a different
+ * flow shows up, when it is full, or at the latest by the tasklet.
+ * The tasklet is scheduled when the train is started, and since
+ * tasklets run after the NET_RX softirq in the same softirq pass, the
+ * train is flushed at the end of the receive burst. The train and the
+ * tasklet are only accessed in softirq context on the owning CPU, so
+ * no locking is needed. */
+struct shim_udp4_rx_train {
+    /* The flow the train belongs to, with a reference held. */
+    struct flow_entry *flow;
+    struct rb_list train;
+    unsigned int len;
+    struct tasklet_struct tasklet;
+};
+
+static DEFINE_PER_CPU(struct shim_udp4_rx_train, udp4_rx_trains);
+
+static void
+udp4_rx_train_flush(struct shim_udp4_rx_train *t)
+{
+    struct flow_entry *flow = t->flow;
+
+    if (!flow) {
+        return;
+    }
+    t->flow = NULL;
+    t->len  = 0;
+    rl_sdu_rx_flow_train(flow->txrx.ipcp, flow, &t->train, true);
+    flow_put(flow);
+}
+
+static void
+udp4_rx_train_tasklet(unsigned long arg)
+{
+    udp4_rx_train_flush((struct shim_udp4_rx_train *)arg);
+}
+
+/* Called by the UDP stack in softirq context (under RCU), for each
+ * datagram received on the socket, after the checksum has been verified
+ * and with skb->data pointing to the UDP header. The payload is handed
+ * to the upper layer without going through the socket receive queue.
+ * Returns 0 if the skb has been consumed, or a positive value to let
+ * UDP queue it to the socket as usual. */
+static int
+udp4_encap_rcv(struct sock *sk, struct sk_buff *skb)
+{
+    struct shim_udp4_flow *priv = rcu_dereference_sk_user_data(sk);
+    struct shim_udp4_rx_train *t;
+    struct rl_ipcp_stats *stats;
+    struct ipcp_entry *ipcp;
+    struct rl_buf *rb;
+    __be16 sport;
+
+    if (unlikely(!priv)) {
+        return 1; /* the flow is going away */
+    }
+
+    ipcp  = priv->flow->txrx.ipcp;
+    stats = raw_cpu_ptr(ipcp->stats);
+    sport = udp_hdr(skb)->source;
+
+    /* See udp4_drain_socket_rxq(). The 16 bit store is atomic with
+     * respect to sdu_write(). */
+    if (unlikely(priv->remote_addr.sin_port != sport &&
+                 priv->remote_addr.sin_port == htons(RL_SHIM_UDP_PORT))) {
+        WRITE_ONCE(priv->remote_addr.sin_port, sport);
+        PD("sock %p updated with port %u\n", priv->sock, ntohs(sport));
+    }
+
+    __skb_pull(skb, sizeof(struct udphdr));
+
+#ifndef RL_SKB
+    /* Steal the skb data if possible, otherwise fall back to a copy. */
+    rb = rl_buf_from_skb(skb, ipcp->rxhdroom);
+    if (unlikely(!rb)) {
+        rb = rl_buf_alloc(skb->len, ipcp->rxhdroom, ipcp->tailroom,
+                          GFP_ATOMIC);
+        if (unlikely(!rb)) {
+            stats->rx_err++;
+            RPV(1, "Out of memory\n");
+            kfree_skb(skb);
+            return 0;
+        }
+        skb_copy_bits(skb, 0, RL_BUF_DATA(rb), skb->len);
+        rl_buf_append(rb, skb->len);
+        consume_skb(skb);
+    }
+#else  /* RL_SKB */
+    rb = skb;
+#endif /* RL_SKB */
+
+    NPD("read %u bytes\n", rb->len);
+    stats->rx_pkt++;
+    stats->rx_byte += rb->len;
+
+    t = this_cpu_ptr(&udp4_rx_trains);
+    if (t->flow != priv->flow) {
+        udp4_rx_train_flush(t);
+        /* The flow may already be on its way out (reference counter
+         * dropped to zero), in which case the datagram is dropped. */
+        t->flow = flow_get(ipcp->dm, priv->flow->local_port);
+        if (unlikely(t->flow != priv->flow)) {
+            flow_put(t->flow);
+            t->flow = NULL;
+            rl_buf_free(rb);
+            return 0;
+        }
+        tasklet_schedule(&t->tasklet);
+    }
+    rb_list_enq(rb, &t->train);
+    if (++t->len == SHIM_UDP4_TRAIN_MAX) {
+        udp4_rx_train_flush(t);
+    }
+
+    return 0;
+}
+#endif /* RL_HAVE_UDP_TUNNEL */
+
 static void
 udp4_rx_worker(struct work_struct *w)
 {
@@ -231,9 +384,10 @@ udp4_data_ready(struct sock *sk
 {
     struct shim_udp4_flow *priv = sk->sk_user_data;
 
-    /* We cannot receive skbs in softirq context, so we use a work
-     * queue item to execute the work in process context.
-     */
+    /* Without encap_rcv we cannot receive skbs in softirq context, so
+     * we use a work queue item to execute the work in process context.
+     * With encap_rcv this is only reached for the datagrams that
+     * udp4_encap_rcv() did not consume. */
     schedule_work(&priv->rxw);
 }
 
@@ -272,6 +426,8 @@ rl_shim_udp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
     priv->sock = sock;
     INIT_WORK(&priv->rxw, udp4_rx_worker);
     mutex_init(&priv->rxw_lock);
+    priv->no_gso = false;
+    priv->encap  = false;
 
     memset(&priv->remote_addr, 0, sizeof(priv->remote_addr));
     priv->remote_addr.sin_family      = AF_INET;
@@ -289,6 +445,22 @@ rl_shim_udp4_flow_init(struct ipcp_entry *ipcp, struct flow_entry *flow)
 
     sock_reset_flag(sock->sk, SOCK_USE_WRITE_QUEUE);
 
+#ifdef RL_HAVE_UDP_TUNNEL
+    if (sock->sk->sk_protocol == IPPROTO_UDP) {
+        struct udp_tunnel_sock_cfg cfg = {
+            .sk_user_data = priv,
+            .encap_type   = SHIM_UDP4_ENCAP_TYPE,
+            .encap_rcv    = udp4_encap_rcv,
+        };
+
+        /* Receive datagrams directly in softirq context, skipping the
+         * socket receive queue, the context switch to the rx worker
+         * and the copy done by recvmsg(). */
+        setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+        priv->encap = true;
+    }
+#endif /* RL_HAVE_UDP_TUNNEL */
+
     PD("Got socket %p, IP %08x, port %u\n", sock, ntohl(flow->cfg.inet_ip),
        ntohs(flow->cfg.inet_port));
 
@@ -314,16 +486,28 @@ rl_shim_udp4_flow_deallocated(struct ipcp_entry *ipcp, struct flow_entry *flow)
         return 0;
     }
 
-    cancel_work_sync(&priv->rxw);
-
     sock = priv->sock;
 
     write_lock_bh(&sock->sk->sk_callback_lock);
+#ifdef RL_HAVE_UDP_TUNNEL
+    if (priv->encap) {
+        /* The socket belongs to userspace, so we cannot release it with
+         * udp_tunnel_sock_release(). Just stop the interception. */
+        WRITE_ONCE(udp_sk(sock->sk)->encap_rcv, NULL);
+        udp_sk(sock->sk)->encap_type = 0;
+    }
+#endif /* RL_HAVE_UDP_TUNNEL */
     sock->sk->sk_data_ready  = priv->sk_data_ready;
     sock->sk->sk_write_space = priv->sk_write_space;
-    sock->sk->sk_user_data   = NULL;
+    rcu_assign_sk_user_data(sock->sk, NULL);
     write_unlock_bh(&sock->sk->sk_callback_lock);
 
+    if (priv->encap) {
+        /* Wait for the udp4_encap_rcv() calls in progress. */
+        synchronize_net();
+    }
+    cancel_work_sync(&priv->rxw);
+
     /* Decrement the file descriptor reference counter, in order to
      * match flow_init(). */
     fput(sock->file);
@@ -379,6 +563,106 @@ rl_shim_udp4_sdu_write(struct ipcp_entry *ipcp, struct flow_entry *flow,
     return ret;
 }
 
+/* Write a train of PDUs. When UDP segmentation offload is available,
+ * consecutive PDUs of the same size (the last one can be shorter) are
+ * sent with a single sendmsg(), and the UDP stack (or the NIC) splits
+ * them into one datagram each. */
+static int
+rl_shim_udp4_sdu_write_train(struct ipcp_entry *ipcp, struct flow_entry *flow,
+                             struct rb_list *train, unsigned flags)
+{
+    struct shim_udp4_flow *flow_priv = flow->priv;
+    int ret                          = 0;
+
+    while (!rb_list_empty(train)) {
+        struct rl_buf *rb = rb_list_front(train);
+#ifdef UDP_SEGMENT
+        struct rl_ipcp_stats *stats = raw_cpu_ptr(ipcp->stats);
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct kvec iov[SHIM_UDP4_TRAIN_MAX];
+        size_t seglen = rb->len;
+        struct rl_buf *tmp;
+        struct cmsghdr *cm;
+        struct msghdr msg;
+        size_t tot = 0;
+        int n      = 0;
+
+        if (!flow_priv->no_gso) {
+            /* Collect the PDUs that can go in the same super-datagram. */
+            rb_list_foreach (rb, train) {
+                if (n == SHIM_UDP4_TRAIN_MAX || rb->len > seglen ||
+                    tot + rb->len > 0xFFFF - 8 /* UDP hdr */ - 60 /* IP */) {
+                    break;
+                }
+                iov[n].iov_base = RL_BUF_DATA(rb);
+                iov[n].iov_len  = rb->len;
+                tot += rb->len;
+                n++;
+                if (rb->len < seglen) {
+                    break; /* only the last one can be shorter */
+                }
+            }
+        }
+
+        if (n > 1) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name       = (struct sockaddr *)&flow_priv->remote_addr;
+            msg.msg_namelen    = sizeof(flow_priv->remote_addr);
+            msg.msg_control    = control;
+            msg.msg_controllen = sizeof(control);
+            msg.msg_flags      = (flags & RL_RMT_F_MAYSLEEP) ? 0 : MSG_DONTWAIT;
+
+            /* Ask for segmentation into datagrams of seglen bytes. */
+            cm             = (struct cmsghdr *)control;
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type  = UDP_SEGMENT;
+            cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+            *((uint16_t *)CMSG_DATA(cm)) = seglen;
+
+            ret = kernel_sendmsg(flow_priv->sock, &msg, iov, n, tot);
+            if (ret == -EAGAIN) {
+                return -EAGAIN; /* backpressure */
+            }
+            if (unlikely(ret == -EINVAL || ret == -EIO)) {
+                /* No segmentation offload on this path, fall back
+                 * to one datagram per PDU. */
+                PD("UDP segmentation offload not available [%d]\n", ret);
+                flow_priv->no_gso = true;
+                continue;
+            }
+
+            if (unlikely(ret != tot)) {
+                PE("kernel_sendmsg(%zu): failed [%d]\n", tot, ret);
+                stats->tx_err += n;
+            } else {
+                stats->tx_pkt += n;
+                stats->tx_byte += tot;
+            }
+
+            rb_list_foreach_safe (rb, tmp, train) {
+                if (n-- == 0) {
+                    break;
+                }
+                rb_list_del(rb);
+                rl_buf_free(rb);
+            }
+            continue;
+        }
+        rb = rb_list_front(train);
+#endif /* UDP_SEGMENT */
+
+        rb_list_del(rb);
+        ret = rl_shim_udp4_sdu_write(ipcp, flow, rb, flags);
+        if (ret == -EAGAIN) {
+            /* Not consumed, put it back. */
+            rb_list_enq_front(rb, train);
+            return -EAGAIN;
+        }
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
 static bool
 rl_shim_udp4_flow_writeable(struct flow_entry *flow)
 {
@@ -412,6 +696,7 @@ static struct ipcp_factory shim_udp4_factory = {
     .ops.flow_init          = rl_shim_udp4_flow_init,
     .ops.flow_deallocated   = rl_shim_udp4_flow_deallocated,
     .ops.sdu_write          = rl_shim_udp4_sdu_write,
+    .ops.sdu_write_train    = rl_shim_udp4_sdu_write_train,
     .ops.config             = rl_shim_udp4_config,
     .ops.flow_writeable     = rl_shim_udp4_flow_writeable,
 };
@@ -419,13 +704,35 @@ static struct ipcp_factory shim_udp4_factory = {
 static int __init
 rl_shim_udp4_init(void)
 {
+#ifdef RL_HAVE_UDP_TUNNEL
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        struct shim_udp4_rx_train *t = per_cpu_ptr(&udp4_rx_trains, cpu);
+
+        rb_list_init(&t->train);
+        tasklet_init(&t->tasklet, udp4_rx_train_tasklet, (unsigned long)t);
+    }
+#endif /* RL_HAVE_UDP_TUNNEL */
+
     return rl_ipcp_factory_register(&shim_udp4_factory);
 }
 
 static void __exit
 rl_shim_udp4_fini(void)
 {
+#ifdef RL_HAVE_UDP_TUNNEL
+    int cpu;
+#endif /* RL_HAVE_UDP_TUNNEL */
+
     rl_ipcp_factory_unregister(SHIM_DIF_TYPE);
+#ifdef RL_HAVE_UDP_TUNNEL
+    /* The trains hold a flow reference, so they are all empty once
+     * the flows are gone. Wait for the tasklets still scheduled. */
+    for_each_possible_cpu (cpu) {
+        tasklet_kill(&per_cpu_ptr(&udp4_rx_trains, cpu)->tasklet);
+    }
+#endif /* RL_HAVE_UDP_TUNNEL */
 }
 
 module_init(rl_shim_udp4_init);
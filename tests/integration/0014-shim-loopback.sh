@@ -10,4 +10,6 @@ rinaperf -z rpinstance7 -p2 -c 4 -i 0
 start_daemon rinaperf -lw -z rpinstance8
 rinaperf -z rpinstance8  -c 2 -i 0
 rinaperf -z rpinstance7  -c 2 -i 0
+rinaperf -z rpinstance7 -t perf -c 100 -k 8
+rinaperf -z rpinstance7 -t perf -c 100 -r 64
 rlite-ctl ipcp-destroy sl
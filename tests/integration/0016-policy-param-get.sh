@@ -7,7 +7,7 @@ rlite-ctl ipcp-enroller-enable x
 # List per-component parameters, checking that the number of lines is correct
 rlite-ctl dif-policy-param-list dd
 rlite-ctl dif-policy-param-list dd enrollment | wc -l | grep -q "\<4\>"
-rlite-ctl dif-policy-param-list dd flowalloc | wc -l | grep -q "\<6\>"
+rlite-ctl dif-policy-param-list dd flowalloc | wc -l | grep -q "\<7\>"
 rlite-ctl dif-policy-param-list dd resalloc | wc -l | grep -q "\<3\>"
 rlite-ctl dif-policy-param-list dd routing | wc -l | grep -q "\<2\>"
 rlite-ctl dif-policy-param-list dd ribd | wc -l | grep -q "\<1\>"
@@ -62,6 +62,8 @@ rlite-ctl dif-policy-param-mod dd flowalloc max-cwq-len 2961
 rlite-ctl dif-policy-param-mod dd flowalloc max-rtxq-len 915
 rlite-ctl dif-policy-param-list dd flowalloc max-cwq-len | grep 2961
 rlite-ctl dif-policy-param-list dd flowalloc max-rtxq-len | grep 915
+rlite-ctl dif-policy-param-mod dd flowalloc congestion-control cubic
+rlite-ctl dif-policy-param-list dd flowalloc congestion-control | grep cubic
 
 rlite-ctl dif-policy-param-mod dd resalloc reliable-flows true
 rlite-ctl dif-policy-param-list dd resalloc reliable-flows | grep true
@@ -30,6 +30,31 @@ rlite-ctl ipcp-config-get pippo sched | grep "\<pfifo\>"
 rlite-ctl ipcp-sched-config pippo pfifo qsize 0 levels 3 && false
 rlite-ctl ipcp-sched-config pippo pfifo qsize 65535 levels 3
 rlite-ctl ipcp-sched-config pippo wrr qsize 65535 quantum 1600 weights 1 && false
+
+# Check that we can set the DRR scheduler and configure it
+rlite-ctl ipcp-config pippo sched drr
+rlite-ctl ipcp-config-get pippo sched | grep "\<drr\>"
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1500 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 0 weights 1,2 && false
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1500 weights 1,2,4
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 1 quantum 1500 weights 1 && false
+
+# Check that we can set the prio-drr scheduler and configure it
+rlite-ctl ipcp-config pippo sched prio-drr
+rlite-ctl ipcp-config-get pippo sched | grep "\<prio-drr\>"
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 quantum 1500 weights 1,2 && false
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 0 quantum 1500 weights 1,2 && false
+rlite-ctl ipcp-sched-config pippo prio-drr qsize 65535 levels 2 quantum 1500 weights 1,2,4
+rlite-ctl ipcp-sched-config pippo drr qsize 65535 quantum 1500 weights 1 && false
+
+# Check that we can set the fq-codel scheduler and configure it
+rlite-ctl ipcp-config pippo sched fq-codel
+rlite-ctl ipcp-config-get pippo sched | grep "\<fq-codel\>"
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 1048576 flows 64 quantum 1500 && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 1048576 flows 64 quantum 1500 target 5000 interval 5000 && false
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 1048576 flows 64 quantum 1500 target 5000 interval 100000
+rlite-ctl ipcp-sched-config pippo fq-codel qsize 1048576 flows 64 quantum 1500 target 5000 interval 100000 ecn
+rlite-ctl ipcp-config-get pippo sched-stats
 start_daemon rinaperf -lw -z rpi
 rinaperf -z rpi -c 6 -i 1
 # Check that we cannot change the scheduler while the IPCP
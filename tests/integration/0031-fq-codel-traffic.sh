@@ -0,0 +1,43 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# PDU schedulers are bypassed for local flows, so the traffic has to
+# cross a shim-eth IPCP towards a different namespace.
+create_veth_pair veth red green
+create_namespace green
+create_namespace red
+add_veth_to_namespace green veth.green
+add_veth_to_namespace red veth.red
+
+ip netns exec green rlite-ctl ipcp-create green.eth shim-eth edif
+ip netns exec green rlite-ctl ipcp-config green.eth netdev veth.green
+ip netns exec green rlite-ctl ipcp-config green.eth flow-del-wait-ms 100
+ip netns exec green rlite-ctl ipcp-create green.n normal mydif
+ip netns exec green rlite-ctl ipcp-config green.n flow-del-wait-ms 100
+ip netns exec green rlite-ctl ipcp-enroller-enable green.n
+ip netns exec green rlite-ctl ipcp-register green.n edif
+start_daemon_namespace green rinaperf -lw -z rpfqc
+
+# Configure the fq-codel scheduler on the sender, before any flow is
+# allocated.
+ip netns exec red rlite-ctl ipcp-create red.eth shim-eth edif
+ip netns exec red rlite-ctl ipcp-config red.eth netdev veth.red
+ip netns exec red rlite-ctl ipcp-config red.eth flow-del-wait-ms 100
+ip netns exec red rlite-ctl ipcp-create red.n normal mydif
+ip netns exec red rlite-ctl ipcp-config red.n flow-del-wait-ms 100
+ip netns exec red rlite-ctl ipcp-config red.n sched fq-codel
+ip netns exec red rlite-ctl ipcp-sched-config red.n fq-codel qsize 1048576 flows 64 quantum 1500 target 5000 interval 100000
+ip netns exec red rlite-ctl ipcp-register red.n edif
+ip netns exec red rlite-ctl ipcp-enroll red.n mydif edif green.n
+
+# Send traffic through the scheduler, and check that the PDUs show up
+# in the statistics (summed over the scheduler shards), together with
+# the drop counters.
+ip netns exec red rinaperf -z rpfqc -t perf -c 200 -s 100
+STATS=$(ip netns exec red rlite-ctl ipcp-config-get red.n sched-stats)
+echo "${STATS}"
+echo "${STATS}" | grep "\<drops=[0-9]\+"
+echo "${STATS}" | grep "\<overlimit=[0-9]\+"
+PKTS=$(echo "${STATS}" | grep -o "\<pkts=[0-9]\+" | awk -F= '{tot += $2} END {print tot + 0}')
+[ "${PKTS}" -ge 200 ]
@@ -0,0 +1,41 @@
+#!/bin/bash -e
+
+source tests/libtest.sh
+
+# Check that the receiver of the flow that got at least $1 DT PDUs
+# sent at most one control PDU every two DT PDUs, apart from the
+# quick-ack ones at the start of the run.
+check_delayed_acks() {
+    local best_rx=0
+    local best_ctrl=0
+    local port dump rx ctrl
+
+    for port in $(rlite-ctl flows-show | sed -n 's/.*addr:port [0-9]\+:\([0-9]\+\)<-->.*/\1/p'); do
+        dump=$(rlite-ctl flow-dump ${port}) || continue
+        rx=$(echo "${dump}" | awk '/rx_dt_pdus/ {print $3}')
+        ctrl=$(echo "${dump}" | awk '/tx_ctrl_pdus/ {print $3}')
+        if [ "${rx}" -gt "${best_rx}" ]; then
+            best_rx=${rx}
+            best_ctrl=${ctrl}
+        fi
+    done
+    echo "rx_dt_pdus=${best_rx} tx_ctrl_pdus=${best_ctrl}"
+    [ "${best_rx}" -ge "$1" ]
+    [ $((best_ctrl * 2)) -le $((best_rx + 32)) ]
+}
+
+# Keep the flows around after the clients are done, so that their
+# DTP state can be dumped.
+rlite-ctl ipcp-create x normal dd
+rlite-ctl ipcp-config x flow-del-wait-ms 10000
+start_daemon rinaperf -lw -z rpack
+
+# Reliable flows, with retransmission and flow control.
+rinaperf -z rpack -t perf -g 0 -c 2000 -s 100
+check_delayed_acks 2000
+
+# Flows with flow control only. Use more PDUs than above, so that
+# the flow of this run is the one that is checked.
+rlite-ctl dif-policy-param-mod dd flowalloc force-flow-control true
+rinaperf -z rpack -t perf -c 4000 -s 100
+check_delayed_acks 4000
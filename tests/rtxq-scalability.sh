@@ -0,0 +1,126 @@
+#!/bin/bash -e
+
+# Measure how the cost of DTCP acknowledgement and retransmission
+# processing scales with the size of the retransmission window. Two
+# normal IPCPs live in different network namespaces ("rtxq.tx" and
+# "rtxq.rx"), connected through a veth pair (shim-eth) where netem drops
+# a fraction of the frames, so that the rtxq of the sender is kept full
+# and selective acknowledgements and retransmissions are exercised.
+# For each window size W, the max-rtxq-len, initial-credit and
+# max-cwq-len flowalloc parameters are set to W, and a reliable
+# rinaperf flow is run. The script reports the receiver rate in Kpps,
+# and the CPU time spent in kernel context (system and softirq) per
+# delivered PDU, which includes the processing of control PDUs.
+
+function usage {
+    echo "$0 [-w WINDOW_SIZES] [-L LOSS_PERCENT] [-c PACKETS] [-S SDU_SIZE]"
+}
+
+WINDOWS="64 256 1024 4096"
+LOSS=1
+C=200000
+S=64
+
+# Option parsing
+while [[ $# > 0 ]]
+do
+    key="$1"
+    case $key in
+        "-w")
+        if [ -n "$2" ]; then
+            WINDOWS="$2"
+            shift
+        else
+            echo "-w requires a list of window sizes (e.g. \"64 1024\")"
+            exit 255
+        fi
+        ;;
+
+        "-L")
+        if [ -n "$2" ]; then
+            LOSS="$2"
+            shift
+        else
+            echo "-L requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-c")
+        if [ -n "$2" ]; then
+            C="$2"
+            shift
+        else
+            echo "-c requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-S")
+        if [ -n "$2" ]; then
+            S="$2"
+            shift
+        else
+            echo "-S requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-h")
+            usage
+            exit 0
+        ;;
+
+        *)
+        echo "Unknown option '$key'"
+        exit 255
+        ;;
+    esac
+    shift
+done
+
+source $(dirname $0)/libtest.sh
+
+# Print the number of USER_HZ ticks spent by all the CPUs in system and
+# softirq context.
+function kernel_ticks {
+    awk '$1 == "cpu" {print $4 + $8}' /proc/stat
+}
+
+create_veth_pair veth.rtxq tx rx
+create_namespace rtxq.tx
+create_namespace rtxq.rx
+add_veth_to_namespace rtxq.tx veth.rtxq.tx
+add_veth_to_namespace rtxq.rx veth.rtxq.rx
+ip netns exec rtxq.tx tc qdisc add dev veth.rtxq.tx root netem loss ${LOSS}%
+
+ip netns exec rtxq.tx rlite-ctl ipcp-create tx.eth shim-eth edif
+ip netns exec rtxq.tx rlite-ctl ipcp-config tx.eth netdev veth.rtxq.tx
+ip netns exec rtxq.tx rlite-ctl ipcp-create tx.n normal ndif
+ip netns exec rtxq.tx rlite-ctl ipcp-register tx.n edif
+ip netns exec rtxq.tx rlite-ctl ipcp-enroller-enable tx.n
+ip netns exec rtxq.rx rlite-ctl ipcp-create rx.eth shim-eth edif
+ip netns exec rtxq.rx rlite-ctl ipcp-config rx.eth netdev veth.rtxq.rx
+ip netns exec rtxq.rx rlite-ctl ipcp-create rx.n normal ndif
+ip netns exec rtxq.rx rlite-ctl ipcp-register rx.n edif
+ip netns exec rtxq.rx rlite-ctl ipcp-enroll rx.n ndif edif tx.n
+start_daemon_namespace rtxq.rx rinaperf -lw -z rprtxq
+
+OUTFILE=$(mktemp)
+cumulative_trap "rm -f ${OUTFILE}" "EXIT"
+HZ=$(getconf CLK_TCK)
+
+printf "%10s %10s %15s %15s\n" "Window" "Loss(%)" "Kpps" "us/PDU"
+for w in ${WINDOWS}; do
+    for ns in rtxq.tx rtxq.rx; do
+        for p in max-rtxq-len initial-credit max-cwq-len; do
+            ip netns exec ${ns} rlite-ctl dif-policy-param-mod ndif flowalloc ${p} ${w}
+        done
+    done
+    t0=$(kernel_ticks)
+    ip netns exec rtxq.tx rinaperf -z rprtxq -g 0 -t perf -c $C -s $S > ${OUTFILE}
+    t1=$(kernel_ticks)
+    kpps=$(awk '$1 == "Receiver" {printf "%.3f", $3}' ${OUTFILE})
+    uspdu=$(echo "$t0 $t1 $HZ $C" | awk '{printf "%.3f", ($2 - $1) * 1000000 / $3 / $4}')
+    printf "%10s %10s %15s %15s\n" $w ${LOSS} ${kpps} ${uspdu}
+done
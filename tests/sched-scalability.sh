@@ -0,0 +1,131 @@
+#!/bin/bash -e
+
+# Measure how the RMT PDU scheduler scales with the number of sender
+# threads. A normal IPCP in the "sched.tx" network namespace is
+# connected to L neighbors, each one living in its own namespace
+# ("sched.rxJ") and reachable through a dedicated veth pair (shim-eth),
+# so that the sender has L independent N-1 flows. PDU schedulers are
+# bypassed for local flows, and two IPCPs in the same namespace would
+# always pick the same one for both ends of a flow, so namespaces are
+# needed for the traffic to cross the RMT.
+# For each number of threads N in [1, MAX_THREADS], N rinaperf clients
+# are run in parallel (spread over the neighbors), and the aggregate
+# rate is reported in Kpps.
+
+function usage {
+    echo "$0 [-s SCHED_NAME] [-l NEIGHBORS] [-m MAX_THREADS] [-c PER_FLOW_PACKETS] [-S SDU_SIZE]"
+}
+
+SCHED=pfifo
+L=4
+M=$(nproc)
+C=200000
+S=64
+
+# Option parsing
+while [[ $# > 0 ]]
+do
+    key="$1"
+    case $key in
+        "-s")
+        if [ -n "$2" ]; then
+            SCHED="$2"
+            shift
+        else
+            echo "-s requires a scheduler name (none, pfifo, wrr, drr, prio-drr, fq-codel)"
+            exit 255
+        fi
+        ;;
+
+        "-l")
+        if [ -n "$2" ]; then
+            L="$2"
+            shift
+        else
+            echo "-l requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-m")
+        if [ -n "$2" ]; then
+            M="$2"
+            shift
+        else
+            echo "-m requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-c")
+        if [ -n "$2" ]; then
+            C="$2"
+            shift
+        else
+            echo "-c requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-S")
+        if [ -n "$2" ]; then
+            S="$2"
+            shift
+        else
+            echo "-S requires a numeric argument"
+            exit 255
+        fi
+        ;;
+
+        "-h")
+            usage
+            exit 0
+        ;;
+
+        *)
+        echo "Unknown option '$key'"
+        exit 255
+        ;;
+    esac
+    shift
+done
+
+source $(dirname $0)/libtest.sh
+
+create_namespace sched.tx
+ip netns exec sched.tx rlite-ctl ipcp-create tx.n normal ndif
+ip netns exec sched.tx rlite-ctl ipcp-config tx.n sched ${SCHED}
+ip netns exec sched.tx rlite-ctl ipcp-enroller-enable tx.n
+
+for j in $(seq 1 $L); do
+    create_veth_pair veth.sched${j} tx rx
+    create_namespace sched.rx${j}
+    add_veth_to_namespace sched.tx veth.sched${j}.tx
+    add_veth_to_namespace sched.rx${j} veth.sched${j}.rx
+    ip netns exec sched.tx rlite-ctl ipcp-create tx.eth${j} shim-eth edif${j}
+    ip netns exec sched.tx rlite-ctl ipcp-config tx.eth${j} netdev veth.sched${j}.tx
+    ip netns exec sched.tx rlite-ctl ipcp-register tx.n edif${j}
+    ip netns exec sched.rx${j} rlite-ctl ipcp-create rx${j}.eth shim-eth edif${j}
+    ip netns exec sched.rx${j} rlite-ctl ipcp-config rx${j}.eth netdev veth.sched${j}.rx
+    ip netns exec sched.rx${j} rlite-ctl ipcp-create rx${j}.n normal ndif
+    ip netns exec sched.rx${j} rlite-ctl ipcp-register rx${j}.n edif${j}
+    ip netns exec sched.rx${j} rlite-ctl ipcp-enroll rx${j}.n ndif edif${j} tx.n
+    start_daemon_namespace sched.rx${j} rinaperf -lw -z rpsched${j}
+done
+
+OUTDIR=$(mktemp -d)
+cumulative_trap "rm -rf ${OUTDIR}" "EXIT"
+
+printf "%10s %10s %10s %15s\n" "Threads" "Neighbors" "Sched" "Kpps"
+for n in $(seq 1 $M); do
+    for i in $(seq 1 $n); do
+        j=$(( (i - 1) % L + 1 ))
+        ip netns exec sched.tx rinaperf -z rpsched${j} -t perf -c $C -s $S \
+            > ${OUTDIR}/${i}.out &
+    done
+    wait
+    kpps=$(cat ${OUTDIR}/*.out |
+           awk '$1 == "Receiver" {tot += $3} END {printf "%.3f", tot}')
+    rm -f ${OUTDIR}/*.out
+    printf "%10s %10s %10s %15s\n" $n $L ${SCHED} ${kpps}
+done
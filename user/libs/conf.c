@@ -470,6 +470,48 @@ rl_conf_flow_get_stats(rl_port_t port_id, struct rl_flow_stats *stats)
     return rl_conf_flow_get_info(port_id, stats, NULL);
 }
 
+int
+rl_conf_flow_get_lat(rl_port_t port_id, struct rl_flow_lat *lat)
+{
+    struct rl_kmsg_flow_lat_req msg;
+    struct rl_kmsg_flow_lat_resp *resp;
+    int ret;
+    int fd;
+
+    fd = rina_open();
+    if (fd < 0) {
+        return fd;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.hdr.msg_type = RLITE_KER_FLOW_LAT_REQ;
+    msg.hdr.event_id = 1;
+    msg.port_id      = port_id;
+
+    ret = rl_write_msg(fd, RLITE_MB(&msg), 1);
+    if (ret < 0) {
+        rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&msg));
+        goto out;
+    }
+
+    resp = (struct rl_kmsg_flow_lat_resp *)wait_for_next_msg(fd, 3000);
+    if (!resp) {
+        ret = -1;
+        goto out;
+    }
+    assert(resp->hdr.event_id == msg.hdr.event_id);
+
+    *lat = resp->lat;
+
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(&msg));
+    rl_msg_free(rl_ker_numtables, RLITE_KER_MSG_MAX, RLITE_MB(resp));
+    rl_free(resp, RL_MT_MSG);
+out:
+    close(fd);
+
+    return ret;
+}
+
 /* Support for fetching registration information in kernel space. */
 
 static int
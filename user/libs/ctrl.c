@@ -37,6 +37,7 @@
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 #include "rlite/kernel-msg.h"
 #include "rlite/utils.h"
 #include "rlite/ctrl.h"
@@ -700,3 +701,70 @@ rina_flow_mss_get(int fd)
 
     return mss;
 }
+
+int
+rina_flow_write_batch(int fd, const struct iovec *sdus, unsigned int num)
+{
+    struct rl_sdu_desc descs[RLITE_IO_BATCH_MAX];
+    unsigned int done = 0;
+
+    while (done < num) {
+        struct rl_ioctl_batch batch;
+        unsigned int i;
+        int ret;
+
+        batch.num = num - done;
+        if (batch.num > RLITE_IO_BATCH_MAX) {
+            batch.num = RLITE_IO_BATCH_MAX;
+        }
+        for (i = 0; i < batch.num; i++) {
+            descs[i].buf  = (uint64_t)(uintptr_t)sdus[done + i].iov_base;
+            descs[i].len  = sdus[done + i].iov_len;
+            descs[i].pad1 = 0;
+        }
+        batch.descs = (uint64_t)(uintptr_t)descs;
+        batch.pad1  = 0;
+
+        ret = ioctl(fd, RLITE_IOCTL_WRITE_BATCH, &batch);
+        if (ret < 0) {
+            return done ? (int)done : -1;
+        }
+        done += ret;
+        if ((unsigned int)ret < batch.num) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+int
+rina_flow_read_batch(int fd, struct iovec *sdus, unsigned int num)
+{
+    struct rl_sdu_desc descs[RLITE_IO_BATCH_MAX];
+    struct rl_ioctl_batch batch;
+    unsigned int i;
+    int ret;
+
+    if (num > RLITE_IO_BATCH_MAX) {
+        num = RLITE_IO_BATCH_MAX;
+    }
+    for (i = 0; i < num; i++) {
+        descs[i].buf  = (uint64_t)(uintptr_t)sdus[i].iov_base;
+        descs[i].len  = sdus[i].iov_len;
+        descs[i].pad1 = 0;
+    }
+    batch.descs = (uint64_t)(uintptr_t)descs;
+    batch.num   = num;
+    batch.pad1  = 0;
+
+    ret = ioctl(fd, RLITE_IOCTL_READ_BATCH, &batch);
+    if (ret <= 0) {
+        return ret;
+    }
+    for (i = 0; i < (unsigned int)ret; i++) {
+        sdus[i].iov_len = descs[i].len;
+    }
+
+    return ret;
+}
@@ -0,0 +1 @@
+../../common/ker-numtables.c
\ No newline at end of file
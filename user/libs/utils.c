@@ -0,0 +1 @@
+../../common/utils.c
\ No newline at end of file
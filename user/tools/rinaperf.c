@@ -44,8 +44,12 @@
 #include <semaphore.h>
 #include <fcntl.h>
 #include <math.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 
 #include <rina/api.h>
+#include <rlite/common.h>
 
 /*
  * rinaperf: a tool to measure bandwidth and latency of RINA networks.
@@ -106,6 +110,7 @@
 
 #define SDU_SIZE_MAX 65535
 #define RP_MAX_WORKERS 1023
+#define RP_BATCH_MAX 64
 
 #define RP_OPCODE_PING 0
 #define RP_OPCODE_RR 1
@@ -162,6 +167,12 @@ struct worker {
     int retcode; /* for the client to report success/failure */
     unsigned int real_duration_ms; /* measured by the client */
 
+    /* Shared-memory rings for the data flow, if used. */
+    void *ring_mem;
+    size_t ring_mem_size;
+    struct rl_ring *rxr;
+    struct rl_ring *txr;
+
     /* A window of RTT samples to compute ping statistics. */
 #define RTT_WINSIZE 4096
     unsigned int rtt_win_idx;
@@ -184,6 +195,8 @@ struct rinaperf {
     int cli_flow_allocated; /* client flows allocated ? */
     int background;         /* server runs as a daemon process */
     int cdf;                /* report CDF percentiles */
+    unsigned int batch;     /* SDUs per syscall in perf test */
+    unsigned ring_slots;    /* use shared-memory rings in perf test */
 
     /* Synchronization between client threads and main thread. */
     sem_t cli_barrier;
@@ -533,6 +546,133 @@ ping_report(struct worker *w, struct rp_result_msg *snd,
     }
 }
 
+static int
+perf_ring_setup(struct worker *w, unsigned int slot_size)
+{
+    struct rl_ioctl_ring_setup rs;
+
+    rs.num_slots = w->rp->ring_slots;
+    rs.slot_size = slot_size;
+    if (ioctl(w->dfd, RLITE_IOCTL_RING_SETUP, &rs)) {
+        perror("ioctl(RING_SETUP)");
+        return -1;
+    }
+
+    w->ring_mem = mmap(NULL, rs.mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       w->dfd, 0);
+    if (w->ring_mem == MAP_FAILED) {
+        perror("mmap(rings)");
+        w->ring_mem = NULL;
+        return -1;
+    }
+    w->ring_mem_size = rs.mem_size;
+    w->rxr           = (struct rl_ring *)w->ring_mem;
+    w->txr           = (struct rl_ring *)((char *)w->ring_mem + rs.tx_ofs);
+
+    return 0;
+}
+
+static void
+perf_ring_teardown(struct worker *w)
+{
+    if (w->ring_mem) {
+        munmap(w->ring_mem, w->ring_mem_size);
+        w->ring_mem = NULL;
+    }
+}
+
+static struct rl_ring_slot *
+ring_slot(struct rl_ring *r, uint32_t idx)
+{
+    return (struct rl_ring_slot *)((char *)r + r->slots_ofs) +
+           (idx & (r->num_slots - 1));
+}
+
+static char *
+ring_buf(struct rl_ring *r, uint32_t idx)
+{
+    return (char *)r + r->bufs_ofs +
+           (size_t)(idx & (r->num_slots - 1)) * r->slot_size;
+}
+
+/* Publish on the TX ring up to 'max' SDUs (no limit if 0), including the
+ * ones published but not yet transmitted, and ring the doorbell. Returns
+ * the number of SDUs transmitted by the kernel, or -1 with errno set
+ * (EAGAIN if the kernel could not transmit any SDU yet, in which case
+ * the published SDUs stay in the ring and are retried by the next call). */
+static int
+ring_write(struct worker *w, unsigned int max, int size)
+{
+    struct rl_ring *r = w->txr;
+    uint32_t head     = r->head;
+    uint32_t tail     = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    struct rl_ioctl_ring_sync sync;
+
+    while (head - tail < r->num_slots && (!max || head - tail < max)) {
+        ring_slot(r, head)->len = size;
+        head++;
+    }
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+    memset(&sync, 0, sizeof(sync));
+    sync.which = RLITE_RING_TX;
+    if (ioctl(w->dfd, RLITE_IOCTL_RING_SYNC, &sync)) {
+        return -1;
+    }
+    if (sync.tx <= 0) {
+        errno = sync.tx ? -sync.tx : EAGAIN;
+        return -1;
+    }
+
+    return sync.tx;
+}
+
+/* Ask the kernel to refill the RX ring, and consume up to 'max' SDUs
+ * (no limit if 0). An SDU that does not fit in a ring slot is read
+ * with read() into 'buf', of SDU_SIZE_MAX bytes. Returns the number of
+ * bytes consumed, 0 on EOF or -1 with errno set (EAGAIN if there was
+ * nothing to consume). */
+static int
+ring_read(struct worker *w, unsigned int max, unsigned int *cnt, char *buf)
+{
+    struct rl_ring *r = w->rxr;
+    uint32_t tail     = r->tail;
+    struct rl_ioctl_ring_sync sync;
+    uint32_t head;
+    int bytes = 0;
+    int ret;
+
+    memset(&sync, 0, sizeof(sync));
+    sync.which = RLITE_RING_RX;
+    ret        = ioctl(w->dfd, RLITE_IOCTL_RING_SYNC, &sync);
+    if (ret == 0 && sync.rx < 0) {
+        errno = -sync.rx;
+        ret   = -1;
+    }
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for (*cnt = 0; tail != head && (!max || *cnt < max); (*cnt)++, tail++) {
+        bytes += ring_slot(r, tail)->len;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+    if (*cnt) {
+        return bytes;
+    }
+    if (ret < 0 && errno == EMSGSIZE) {
+        ret = read(w->dfd, buf, SDU_SIZE_MAX);
+        if (ret > 0) {
+            *cnt = 1;
+        }
+        return ret;
+    }
+    if (ret < 0) {
+        return errno == EPIPE ? 0 : -1;
+    }
+    errno = EAGAIN;
+
+    return -1;
+}
+
 static int
 perf_client(struct worker *w)
 {
@@ -544,11 +684,13 @@ perf_client(struct worker *w)
     unsigned int cdown    = burst;
     struct timespec t_start, t_end;
     struct timespec w1, w2;
+    struct iovec iov[RP_BATCH_MAX];
     char buf[SDU_SIZE_MAX];
     long long ns;
     struct pollfd pfd[2];
     unsigned int i = 0;
     int timeout    = 0;
+    int err        = 0;
     int ret;
 
     if (rp->flowspec.avg_bandwidth == 0) {
@@ -568,16 +710,53 @@ perf_client(struct worker *w)
     pfd[1].events = POLLIN;
 
     memset(buf, 'x', size);
+    for (i = 0; i < rp->batch; i++) {
+        /* All the SDUs in a batch share the same payload. */
+        iov[i].iov_base = buf;
+        iov[i].iov_len  = size;
+    }
+
+    if (rp->ring_slots) {
+        if (perf_ring_setup(w, size)) {
+            return -1;
+        }
+        /* The payload is written only once. */
+        for (i = 0; i < w->txr->num_slots; i++) {
+            memset(ring_buf(w->txr, i), 'x', size);
+        }
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-    for (i = 0; !rp->cli_stop && (!limit || i < limit); i++) {
-        ret = write(w->dfd, buf, size);
+    for (i = 0; !rp->cli_stop && (!limit || i < limit);) {
+        unsigned int sent = 1;
+
+        if (w->ring_mem) {
+            ret = ring_write(w, limit ? limit - i : 0, size);
+            if (ret > 0) {
+                sent = ret;
+                ret  = size;
+            }
+        } else if (rp->batch > 1) {
+            unsigned int n = rp->batch;
+
+            if (limit && limit - i < n) {
+                n = limit - i;
+            }
+            ret = rina_flow_write_batch(w->dfd, iov, n);
+            if (ret > 0) {
+                sent = ret;
+                ret  = size;
+            }
+        } else {
+            ret = write(w->dfd, buf, size);
+        }
         if (ret < 0 && errno == EAGAIN) {
             ret = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (ret < 0) {
                 perror("poll(flow)");
-                return -1;
+                err = -1;
+                break;
             } else if (ret == 0) {
                 /* Timeout */
                 timeout = 1;
@@ -586,7 +765,6 @@ perf_client(struct worker *w)
             }
             if (pfd[0].revents & POLLOUT) {
                 /* Ready to write. */
-                i--;
                 continue;
             }
             /* Nothing to write and stop signal received. */
@@ -605,8 +783,9 @@ perf_client(struct worker *w)
                 break;
             }
         }
+        i += sent;
 
-        if (interval && --cdown == 0) {
+        if (interval && cdown <= sent) {
             if (interval > 50) { /* slack default is 50 us*/
                 stoppable_usleep(rp, interval);
             } else {
@@ -620,8 +799,14 @@ perf_client(struct worker *w)
                 }
             }
             cdown = burst;
+        } else if (interval) {
+            cdown -= sent;
         }
     }
+    perf_ring_teardown(w);
+    if (err) {
+        return err;
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &t_end);
     ns = nanodiff(&t_end, &t_start);
@@ -694,13 +879,16 @@ perf_server(struct worker *w)
     unsigned long long rate_cnt         = 0;
     unsigned long long rate_bytes_limit = 1000;
     unsigned long long rate_bytes       = 0;
+    unsigned int batch                  = w->rp->batch;
     struct timespec rate_ts, t_start, t_end;
-    char buf[SDU_SIZE_MAX];
+    struct iovec iov[RP_BATCH_MAX];
+    char *buf;
     long long ns;
     struct pollfd pfd[2];
     unsigned int i;
     int verb    = w->rp->verbose;
     int timeout = 0;
+    int ret     = 0;
     int n;
 
     n = fcntl(w->dfd, F_SETFL, O_NONBLOCK);
@@ -709,6 +897,17 @@ perf_server(struct worker *w)
         return -1;
     }
 
+    buf = malloc(batch * SDU_SIZE_MAX);
+    if (!buf) {
+        PRINTF("Out of memory\n");
+        return -1;
+    }
+
+    if (w->rp->ring_slots && perf_ring_setup(w, w->test_config.size)) {
+        free(buf);
+        return -1;
+    }
+
     pfd[0].fd     = w->dfd;
     pfd[1].fd     = w->cfd;
     pfd[0].events = pfd[1].events = POLLIN;
@@ -716,7 +915,9 @@ perf_server(struct worker *w)
     clock_gettime(CLOCK_MONOTONIC, &rate_ts);
     t_start = rate_ts;
 
-    for (i = 0; !limit || i < limit; i++) {
+    for (i = 0; !limit || i < limit;) {
+        unsigned int rcvd = 1;
+
         /* Do a non-blocking read on the data flow. If we are in a livelock
          * situation (or near so), it is highly likely that we will find
          * some data to read; we can therefore read the data directly,
@@ -728,13 +929,39 @@ perf_server(struct worker *w)
          * becomes a bit faster. The only drawback is that we pay the cost of
          * an additional syscall when the receiver is not under pressure, but
          * this is acceptable if we want to maximize throughput.
+         * In batch mode, a single read can return many packets, further
+         * reducing the number of syscalls per packet. In ring mode, packets
+         * are consumed directly from the memory shared with the kernel.
          */
-        n = read(w->dfd, buf, sizeof(buf));
+        if (w->ring_mem) {
+            n = ring_read(w, limit ? limit - i : 0, &rcvd, buf);
+        } else if (batch > 1) {
+            unsigned int nb = batch;
+            unsigned int j;
+
+            if (limit && limit - i < nb) {
+                nb = limit - i;
+            }
+            for (j = 0; j < nb; j++) {
+                iov[j].iov_base = buf + j * SDU_SIZE_MAX;
+                iov[j].iov_len  = SDU_SIZE_MAX;
+            }
+            n = rina_flow_read_batch(w->dfd, iov, nb);
+            if (n > 0) {
+                rcvd = n;
+                for (n = 0, j = 0; j < rcvd; j++) {
+                    n += iov[j].iov_len;
+                }
+            }
+        } else {
+            n = read(w->dfd, buf, SDU_SIZE_MAX);
+        }
         if (n < 0 && errno == EAGAIN) {
             n = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (n < 0) {
                 perror("poll(flow)");
-                return -1;
+                ret = -1;
+                break;
             } else if (n == 0) {
                 /* Timeout */
                 timeout = 1;
@@ -745,12 +972,10 @@ perf_server(struct worker *w)
             }
 
             if (pfd[0].revents & POLLIN) {
-                /* Ready to read. Adjust 'i' and retry. */
-                i--;
+                /* Ready to read. Retry. */
                 continue;
             } else {
                 struct rp_config_msg stop;
-                int ret;
 
                 /* Nothing to read and stop signal received. */
                 assert(pfd[1].revents & POLLIN);
@@ -761,7 +986,7 @@ perf_server(struct worker *w)
 
                 ret = config_msg_read(w->cfd, &stop);
                 if (ret) {
-                    return ret;
+                    break;
                 }
 
                 if (!stop.cnt) {
@@ -770,8 +995,8 @@ perf_server(struct worker *w)
                 }
 
                 /* The stop.cnt field contains the number of expected
-                 * packets. We reset 'limit' to the expected count,
-                 * adjust 'i' and keep going. */
+                 * packets. We reset 'limit' to the expected count
+                 * and keep going. */
                 limit = stop.cnt;
                 if (i != stop.cnt) {
                     if (i < stop.cnt) {
@@ -785,13 +1010,13 @@ perf_server(struct worker *w)
                                (long long unsigned)i);
                     }
                 }
-                i--;
                 continue;
             }
         }
         if (n < 0) {
             perror("read(flow)");
-            return -1;
+            ret = -1;
+            break;
 
         } else if (n == 0) {
             PRINTF("Flow deallocated remotely\n");
@@ -799,13 +1024,19 @@ perf_server(struct worker *w)
         }
 
         rate_bytes += n;
-        rate_cnt++;
+        rate_cnt += rcvd;
+        i += rcvd;
 
         if (rate_bytes >= rate_bytes_limit && verb) {
             rate_print(&rate_bytes, &rate_cnt, &rate_bytes_limit, &rate_ts,
                        &w->result);
         }
     }
+    perf_ring_teardown(w);
+    free(buf);
+    if (ret) {
+        return ret;
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &t_end);
     ns = nanodiff(&t_end, &t_start);
@@ -1509,8 +1740,12 @@ usage(void)
         "   -T : print timestamp (unix time + microseconds as in gettimeofday) "
         "before each line in ping test\n"
         "   -C : client prints cumulative density function in ping mode\n"
+        "   -k NUM : number of SDUs to write or read with a single syscall "
+        "in perf test (default 1, max %u)\n"
+        "   -r NUM : use shared-memory rings with NUM slots for the data "
+        "flow in perf test\n"
         "   -v : be verbose\n",
-        RINA_FLOW_SPEC_LOSS_MAX);
+        RINA_FLOW_SPEC_LOSS_MAX, RP_BATCH_MAX);
 }
 
 int
@@ -1551,12 +1786,14 @@ main(int argc, char **argv)
     pthread_mutex_init(&rp->ticket_lock, NULL);
     rp->background = 0;
     rp->cdf        = 0; /* Don't report CDF percentiles. */
+    rp->batch      = 1; /* One SDU per syscall. */
+    rp->ring_slots = 0; /* Don't use shared-memory rings. */
 
     /* Start with a default flow configuration (unreliable flow). */
     rina_flow_spec_unreliable(&rp->flowspec);
 
-    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvC")) !=
-           -1) {
+    while ((opt = getopt(argc, argv,
+                         "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:k:r:TwvC")) != -1) {
         switch (opt) {
         case 'h':
             usage();
@@ -1674,6 +1911,22 @@ main(int argc, char **argv)
             rp->cdf = 1;
             break;
 
+        case 'r':
+            rp->ring_slots = atoi(optarg);
+            if (rp->ring_slots > RLITE_RING_SLOTS_MAX) {
+                PRINTF("    Invalid 'ring slots' %u\n", rp->ring_slots);
+                return -1;
+            }
+            break;
+
+        case 'k':
+            rp->batch = atoi(optarg);
+            if (rp->batch < 1 || rp->batch > RP_BATCH_MAX) {
+                PRINTF("    Invalid 'batch' %u\n", rp->batch);
+                return -1;
+            }
+            break;
+
         default:
             PRINTF("    Unrecognized option %c\n", opt);
             usage();
@@ -37,6 +37,7 @@
 #include <assert.h>
 #include <sys/ioctl.h>
 #include <poll.h>
+#include <time.h>
 
 #include "rlite/list.h"
 #include "rlite/uipcps-msg.h"
@@ -536,6 +537,48 @@ str_count_elems(const char *s)
     return n;
 }
 
+/* Parse a list of comma separated scheduler weights into a newly allocated
+ * array. Returns the number of weights on success, -1 on error. */
+static int
+sched_weights_parse(const char *s, uint32_t **parr)
+{
+    char *saveptr;
+    uint32_t *arr;
+    char *copy;
+    char *ctmp;
+    int n;
+    int i;
+
+    /* Count weights. */
+    n = str_count_elems(s);
+    if (n <= 0) {
+        PE("No valid weights\n");
+        return -1;
+    }
+
+    /* Allocate array for weights and parse the weights into it. */
+    arr  = malloc_or_quit(n * sizeof(arr[0]));
+    copy = strdup_or_quit(s);
+    ctmp = copy;
+    for (i = 0; i < n; i++, ctmp = NULL) {
+        char *token = strtok_r(ctmp, ", ", &saveptr);
+        if (token == NULL) {
+            break;
+        }
+        arr[i] = atoi(token);
+        if (arr[i] <= 0 || arr[i] >= 1000) {
+            PE("Invalid weight '%s'\n", token);
+            free(copy);
+            free(arr);
+            return -1;
+        }
+    }
+    free(copy);
+    *parr = arr;
+
+    return n;
+}
+
 static int
 kernel_control_write(struct rl_msg_base *msg)
 {
@@ -618,37 +661,11 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
             return -1;
         }
 
-        /* Count weights. */
-        n = str_count_elems(argv[3]);
-        if (n <= 0) {
-            PE("No valid weights\n");
+        n = sched_weights_parse(argv[3], &arr);
+        if (n < 0) {
             return -1;
         }
 
-        /* Allocate array for weights. */
-        arr = malloc_or_quit(n * sizeof(arr[0]));
-
-        /* Parse weights into the array. */
-        {
-            char *copy = strdup_or_quit(argv[3]);
-            char *ctmp = copy;
-            char *saveptr;
-            int i;
-
-            for (i = 0; i < n; i++, ctmp = NULL) {
-                char *token = strtok_r(ctmp, ", ", &saveptr);
-                if (token == NULL) {
-                    break;
-                }
-                arr[i] = atoi(token);
-                if (arr[i] <= 0 || arr[i] >= 1000) {
-                    PE("Invalid weight '%s'\n", token);
-                    return -1;
-                }
-            }
-            free(copy);
-        }
-
         /* Build the request. */
         req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_WRR;
         req.ipcp_hdr.hdr.event_id = 0;
@@ -691,6 +708,169 @@ ipcp_sched_config(int argc, char **argv, struct cmd_descriptor *cd)
         req.ipcp_hdr.ipcp_id      = attrs->id;
         req.max_queue_size        = qsize;
 
+        return kernel_control_write(RLITE_MB(&req));
+
+    } else if (!strcmp(sched_name, "drr") || !strcmp(sched_name, "prio-drr")) {
+        /* Deficit Round Robin configuration, optionally with strict
+         * priority levels served before the DRR classes. Examples:
+         *   ipcp-sched-config x.IPCP drr qsize 65536 quantum 1500
+         * weights 2,5,10
+         *   ipcp-sched-config x.IPCP prio-drr qsize 65536 levels 2
+         * quantum 1500 weights 2,5,10
+         * */
+        int prio                 = !strcmp(sched_name, "prio-drr");
+        unsigned int prio_levels = 0;
+        unsigned int quantum;
+        uint32_t *arr;
+        int ret;
+        int n;
+
+        if (prio) {
+            if (argc < 2 || strcmp(argv[0], "levels")) {
+                PE("Missing 'levels' argument. Example:\n"
+                   "  ipcp-sched-config x.IPCP prio-drr qsize 65536 levels 2 "
+                   "quantum 1500 weights 2,5,10\n");
+                return -1;
+            }
+            prio_levels = atoi(argv[1]);
+            if (prio_levels == 0 || prio_levels > 128) {
+                PE("Invalid number of levels '%s'\n", argv[1]);
+                return -1;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+
+        if (argc < 4) {
+            PE("Not enough arguments for %s. Example:\n"
+               "  ipcp-sched-config x.IPCP drr qsize 65536 quantum 1500 "
+               "weights 2,5,10\n",
+               sched_name);
+            return -1;
+        }
+
+        if (strcmp(argv[0], "quantum")) {
+            PE("Missing 'quantum' argument\n");
+            return -1;
+        }
+        quantum = atoi(argv[1]);
+        if (quantum == 0 || quantum > 1000000) {
+            PE("Invalid quantum '%s'\n", argv[1]);
+            return -1;
+        }
+
+        if (strcmp(argv[2], "weights")) {
+            PE("Missing 'weights' argument\n");
+            return -1;
+        }
+
+        n = sched_weights_parse(argv[3], &arr);
+        if (n < 0) {
+            return -1;
+        }
+
+        /* Build the request. */
+        if (prio) {
+            struct rl_kmsg_ipcp_sched_prio_drr req;
+
+            req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_PRIO_DRR;
+            req.ipcp_hdr.hdr.event_id = 0;
+            req.ipcp_hdr.ipcp_id      = attrs->id;
+            req.max_queue_size        = qsize;
+            req.quantum               = quantum;
+            req.prio_levels           = prio_levels;
+            req.weights.elem_size     = sizeof(arr[0]);
+            req.weights.num_elements  = n;
+            req.weights.slots.dwords  = arr;
+            ret                       = kernel_control_write(RLITE_MB(&req));
+        } else {
+            struct rl_kmsg_ipcp_sched_drr req;
+
+            req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_DRR;
+            req.ipcp_hdr.hdr.event_id = 0;
+            req.ipcp_hdr.ipcp_id      = attrs->id;
+            req.max_queue_size        = qsize;
+            req.quantum               = quantum;
+            req.weights.elem_size     = sizeof(arr[0]);
+            req.weights.num_elements  = n;
+            req.weights.slots.dwords  = arr;
+            ret                       = kernel_control_write(RLITE_MB(&req));
+        }
+        free(arr);
+
+        return ret;
+
+    } else if (!strcmp(sched_name, "fq-codel")) {
+        /* Flow Queue CoDel configuration. Example:
+         *   ipcp-sched-config x.IPCP fq-codel qsize 1048576 flows 1024
+         * quantum 1500 target 5000 interval 100000 ecn
+         * */
+        struct rl_kmsg_ipcp_sched_fq_codel req;
+
+        if (argc < 8) {
+            PE("Not enough arguments for fq-codel. Example:\n"
+               "  ipcp-sched-config x.IPCP fq-codel qsize 1048576 flows 1024 "
+               "quantum 1500 target 5000 interval 100000 [ecn]\n");
+            return -1;
+        }
+
+        if (strcmp(argv[0], "flows")) {
+            PE("Missing 'flows' argument\n");
+            return -1;
+        }
+        req.flows = atoi(argv[1]);
+        if (req.flows == 0 || req.flows > 1024) {
+            PE("Invalid number of flows '%s'\n", argv[1]);
+            return -1;
+        }
+
+        if (strcmp(argv[2], "quantum")) {
+            PE("Missing 'quantum' argument\n");
+            return -1;
+        }
+        req.quantum = atoi(argv[3]);
+        if (req.quantum == 0 || req.quantum > 1000000) {
+            PE("Invalid quantum '%s'\n", argv[3]);
+            return -1;
+        }
+
+        if (strcmp(argv[4], "target")) {
+            PE("Missing 'target' argument (microseconds)\n");
+            return -1;
+        }
+        req.target_us = atoi(argv[5]);
+        if (req.target_us == 0) {
+            PE("Invalid target '%s'\n", argv[5]);
+            return -1;
+        }
+
+        if (strcmp(argv[6], "interval")) {
+            PE("Missing 'interval' argument (microseconds)\n");
+            return -1;
+        }
+        req.interval_us = atoi(argv[7]);
+        if (req.interval_us <= req.target_us) {
+            PE("Invalid interval '%s' (must be larger than target)\n",
+               argv[7]);
+            return -1;
+        }
+
+        req.ecn = 0;
+        if (argc > 8) {
+            if (strcmp(argv[8], "ecn")) {
+                PE("Unknown argument '%s'\n", argv[8]);
+                return -1;
+            }
+            req.ecn = 1;
+        }
+
+        /* Build the request. */
+        req.ipcp_hdr.hdr.msg_type = RLITE_KER_IPCP_SCHED_FQ_CODEL;
+        req.ipcp_hdr.hdr.event_id = 0;
+        req.ipcp_hdr.ipcp_id      = attrs->id;
+        req.max_queue_size        = qsize;
+        memset(req.pad1, 0, sizeof(req.pad1));
+
         return kernel_control_write(RLITE_MB(&req));
     }
 
@@ -903,6 +1083,58 @@ ipcp_stats(int argc, char **argv, struct cmd_descriptor *cd)
     return 0;
 }
 
+static int
+ipcp_fwd_rate(int argc, char **argv, struct cmd_descriptor *cd)
+{
+    struct rl_ipcp_stats s0, s1;
+    struct ipcp_attrs *attrs;
+    unsigned long interval = 1000; /* ms */
+    struct timespec t0, t1;
+    uint64_t drops;
+    double secs;
+    int ret;
+
+    attrs = lookup_ipcp_by_name(argv[0]);
+    if (!attrs) {
+        PE("Could not find IPCP %s\n", argv[0]);
+        return -1;
+    }
+
+    if (argc >= 2) {
+        interval = strtoul(argv[1], NULL, 10);
+        if (interval == 0) {
+            PE("Invalid interval %s\n", argv[1]);
+            return -1;
+        }
+    }
+
+    /* Sample the (cumulative) counters twice. */
+    ret = rl_conf_ipcp_get_stats(attrs->id, &s0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!ret) {
+        usleep(interval * 1000);
+        ret = rl_conf_ipcp_get_stats(attrs->id, &s1);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+    if (ret) {
+        PE("Could not find ipcp with id %u\n", attrs->id);
+        return ret;
+    }
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    drops = (s1.rmt.queue_drop - s0.rmt.queue_drop) +
+            (s1.rmt.noroute_drop - s0.rmt.noroute_drop) +
+            (s1.rmt.ttl_drop - s0.rmt.ttl_drop);
+    printf("Forwarding rate for IPCP %s:\n"
+           "    fwd_pps            = %.0f\n"
+           "    fwd_bps            = %.0f\n"
+           "    drop_pps           = %.0f\n",
+           attrs->name, (s1.rmt.fwd_pkt - s0.rmt.fwd_pkt) / secs,
+           (s1.rmt.fwd_byte - s0.rmt.fwd_byte) * 8 / secs, drops / secs);
+
+    return 0;
+}
+
 static int
 flows_show(int argc, char **argv, struct cmd_descriptor *cd)
 {
@@ -1009,7 +1241,10 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         "    last_lwe_sent          = %lu\n"
         "    last_seq_num_acked     = %lu\n"
         "    next_snd_ctl_seq       = %lu\n"
-        "    seqq_len               = %lu\n",
+        "    seqq_len               = %lu [max_depth=%lu]\n"
+        "    ack_every              = %lu\n"
+        "    rx_dt_pdus             = %llu\n"
+        "    tx_ctrl_pdus           = %llu\n",
         (unsigned long)dtp.snd_lwe, (unsigned long)dtp.snd_rwe,
         (unsigned long)dtp.next_seq_num_to_use,
         (unsigned long)dtp.last_seq_num_sent,
@@ -1022,7 +1257,116 @@ flow_dump(int argc, char **argv, struct cmd_descriptor *cd)
         (unsigned long)dtp.rcv_rwe, (unsigned long)dtp.max_seq_num_rcvd,
 
         (unsigned long)dtp.last_lwe_sent, (unsigned long)dtp.last_seq_num_acked,
-        (unsigned long)dtp.next_snd_ctl_seq, (unsigned long)dtp.seqq_len);
+        (unsigned long)dtp.next_snd_ctl_seq, (unsigned long)dtp.seqq_len,
+        (unsigned long)dtp.seqq_depth_max, (unsigned long)dtp.ack_every,
+        (unsigned long long)dtp.rx_dt_pdus,
+        (unsigned long long)dtp.tx_ctrl_pdus);
+
+    return 0;
+}
+
+/* Upper bound (excluded) of the i-th bucket of a latency histogram, in
+ * microseconds, or 0 for the last one, which has none. */
+static unsigned long long
+lat_bucket_end(unsigned int i)
+{
+    return i < RL_LAT_BUCKETS - 1 ? 1ULL << i : 0;
+}
+
+/* The bucket where the @pct percentile of the samples falls. */
+static unsigned int
+lat_hist_pct(const struct rl_lat_hist *h, unsigned int pct)
+{
+    uint64_t thresh = (h->samples * pct + 99) / 100;
+    uint64_t cnt    = 0;
+    unsigned int i;
+
+    for (i = 0; i < RL_LAT_BUCKETS - 1; i++) {
+        cnt += h->buckets[i];
+        if (cnt >= thresh) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static void
+lat_hist_print(const char *name, const struct rl_lat_hist *h)
+{
+    unsigned int pct[] = {50, 99};
+    unsigned int i;
+
+    printf("    %-12s %llu samples", name, (unsigned long long)h->samples);
+    if (!h->samples) {
+        printf("\n");
+        return;
+    }
+    printf(", avg %llu us, max %llu us",
+           (unsigned long long)(h->sum_us / h->samples),
+           (unsigned long long)h->max_us);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+        unsigned int b = lat_hist_pct(h, pct[i]);
+
+        if (lat_bucket_end(b)) {
+            printf(", p%u < %llu us", pct[i], lat_bucket_end(b));
+        } else {
+            printf(", p%u >= %llu us", pct[i], lat_bucket_end(b - 1));
+        }
+    }
+    printf("\n");
+
+    for (i = 0; i < RL_LAT_BUCKETS; i++) {
+        if (!h->buckets[i]) {
+            continue;
+        }
+        if (lat_bucket_end(i)) {
+            printf("        [%8llu, %8llu) us: %llu\n",
+                   i ? lat_bucket_end(i - 1) : 0ULL, lat_bucket_end(i),
+                   (unsigned long long)h->buckets[i]);
+        } else {
+            printf("        [%8llu,      inf) us: %llu\n",
+                   lat_bucket_end(i - 1), (unsigned long long)h->buckets[i]);
+        }
+    }
+}
+
+static int
+flow_stats(int argc, char **argv, struct cmd_descriptor *cd)
+{
+    struct rl_flow_stats stats;
+    struct rl_flow_lat lat;
+    unsigned long port_id;
+    char bbuf[2][32];
+    int ret;
+
+    assert(argc >= 1);
+    errno   = 0;
+    port_id = strtoul(argv[0], NULL, 10);
+    if (errno) {
+        PE("Invalid flow id %s\n", argv[0]);
+        return -1;
+    }
+
+    ret = rl_conf_flow_get_stats(port_id, &stats);
+    if (!ret) {
+        ret = rl_conf_flow_get_lat(port_id, &lat);
+    }
+    if (ret) {
+        PE("Could not find flow with port id %lu\n", port_id);
+        return ret;
+    }
+
+    printf("    rx(pkt:%llu, %s, drop:%llu), tx(pkt:%llu, %s)\n",
+           (long long unsigned)stats.rx_pkt,
+           byteprint(bbuf[0], sizeof(bbuf[0]), stats.rx_byte),
+           (long long unsigned)stats.rx_overrun_pkt,
+           (long long unsigned)stats.tx_pkt,
+           byteprint(bbuf[1], sizeof(bbuf[1]), stats.tx_byte));
+    lat_hist_print("rxq:", &lat.rxq);
+    lat_hist_print("rtt:", &lat.rtt);
+    lat_hist_print("rtt-jitter:", &lat.rtt_jitter);
+    lat_hist_print("rmtq:", &lat.rmtq);
 
     return 0;
 }
@@ -1642,6 +1986,12 @@ static struct cmd_descriptor cmd_descriptors[] = {
         .num_args = 0,
         .func     = ipcp_stats,
     },
+    {
+        .name     = "ipcp-fwd-rate",
+        .usage    = "IPCP_NAME [INTERVAL_MS]",
+        .num_args = 1,
+        .func     = ipcp_fwd_rate,
+    },
     {
         .name     = "uipcp-stats-show",
         .usage    = "[IPCP_NAME]",
@@ -1702,6 +2052,12 @@ static struct cmd_descriptor cmd_descriptors[] = {
         .num_args = 1,
         .func     = flow_dump,
     },
+    {
+        .name     = "flow-stats",
+        .usage    = "PORT_ID",
+        .num_args = 1,
+        .func     = flow_stats,
+    },
     {
         .name     = "regs-show",
         .usage    = "[DIF_NAME]",
@@ -1157,7 +1157,7 @@ topo_visit(struct uipcps *uipcps)
     struct flow_edge *e;
 
     /*
-     * Stage 1: compute txhdroom and mss.
+     * Stage 1: compute txhdroom, tailroom and mss.
      */
     list_for_each_entry (uipcp, &uipcps->uipcps, node) {
         struct ipcp_node *ipn = &uipcp->topo;
@@ -1166,15 +1166,17 @@ topo_visit(struct uipcps *uipcps)
         ipn->marked         = 0;
         ipn->update_kern_tx = 0;
         ipn->txhdroom       = 0;
+        ipn->tailroom       = 0;
         ipn->max_sdu_size   = 65536;
 
         ipn->hdrsize = ipcp_hdrlen(uipcp);
         if (list_empty(&ipn->lowers)) {
             /* No lowers, it can be a shim or a normal without
              * lowers. We need to start from the kernel-provided
-             * MSS and txhdroom. */
+             * MSS, txhdroom and tailroom. */
             ipn->max_sdu_size = uipcp->max_sdu_size;
             ipn->txhdroom     = uipcp->txhdroom;
+            ipn->tailroom     = uipcp->tailroom;
         } else {
             /* There are some lowers, so we start from the maximum
              * value, which will be overridden during the minimization
@@ -1219,7 +1221,7 @@ topo_visit(struct uipcps *uipcps)
         }
 
         /* Mark (visit) the node, applying the relaxation rule to
-         * maximize txhdroom and minimize max_sdu_size. */
+         * maximize txhdroom and tailroom, and minimize max_sdu_size. */
         ipn->marked = 1;
 
         list_for_each_entry (e, nexts, node) {
@@ -1231,6 +1233,12 @@ topo_visit(struct uipcps *uipcps)
                     ipn->txhdroom + e->uipcp->topo.hdrsize;
             }
 
+            /* PDUs do not have trailers, so the tailroom needed by the
+             * lower IPCP is just inherited. */
+            if (e->uipcp->topo.tailroom < ipn->tailroom) {
+                e->uipcp->topo.tailroom = ipn->tailroom;
+            }
+
             msz = (int)ipn->max_sdu_size - (int)e->uipcp->topo.hdrsize;
             if (msz < 0) {
                 msz = 0; /* just to be on the safe side */
@@ -1316,7 +1324,7 @@ topo_visit(struct uipcps *uipcps)
     }
 }
 
-/* Update kernelspace hdrooms and mss. Called under uipcps lock. */
+/* Update kernelspace hdrooms, tailroom and mss. Called under uipcps lock. */
 static int
 topo_update_kern(struct uipcps *uipcps)
 {
@@ -1343,6 +1351,18 @@ topo_update_kern(struct uipcps *uipcps)
                ipn->txhdroom);
         }
 
+        ret = snprintf(strbuf, sizeof(strbuf), "%u", ipn->tailroom);
+        if (ret <= 0 || ret >= sizeof(strbuf)) {
+            PE("Impossible tailroom %u\n", ipn->tailroom);
+            continue;
+        }
+
+        ret = rl_conf_ipcp_config(uipcp->id, "tailroom", strbuf);
+        if (ret) {
+            PE("'ipcp-config %u tailroom %u' failed\n", uipcp->id,
+               ipn->tailroom);
+        }
+
         ret = snprintf(strbuf, sizeof(strbuf), "%u", ipn->max_sdu_size);
         if (ret <= 0 || ret >= sizeof(strbuf)) {
             PE("Impossible mss %u\n", ipn->max_sdu_size);
@@ -206,6 +206,7 @@ struct ipcp_node {
     unsigned int update_kern_rx; /* should we push rxhdroom to kernel ? */
     unsigned int txhdroom;
     unsigned int rxhdroom;
+    unsigned int tailroom;
     unsigned int max_sdu_size;
     unsigned int hdrsize;
     unsigned int rxcredit; /* used to compute rxhdroom */
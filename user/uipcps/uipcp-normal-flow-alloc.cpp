@@ -177,6 +177,42 @@ private:
     void policies2flowcfg(struct rl_flow_config *cfg, const FlowRequest *freq);
 };
 
+static const struct {
+    const char *name;
+    uint8_t type;
+} cc_algorithms[] = {
+    {"newreno", RLITE_CC_T_NEWRENO},
+    {"cubic", RLITE_CC_T_CUBIC},
+    {"vegas", RLITE_CC_T_VEGAS},
+};
+
+/* On failure, *type is set to the default algorithm. */
+int
+FlowAllocator::cc_name2type(const std::string &name, uint8_t *type)
+{
+    for (const auto &cc : cc_algorithms) {
+        if (name == cc.name) {
+            *type = cc.type;
+            return 0;
+        }
+    }
+    *type = RLITE_CC_T_NEWRENO;
+
+    return -1;
+}
+
+std::string
+FlowAllocator::cc_type2name(uint8_t type)
+{
+    for (const auto &cc : cc_algorithms) {
+        if (type == cc.type) {
+            return cc.name;
+        }
+    }
+
+    return "newreno";
+}
+
 /* Translate a local flow configuration into the standard
  * representation to be used in the FlowRequest CDAP
  * message. */
@@ -228,6 +264,12 @@ flowcfg2policies(const struct rl_flow_config *cfg, FlowRequest *freq)
     rtx_ctrl_cfg->set_data_rxmsn_max(
         cfg->dtcp.rtx.data_rxms_max); /* name mismatch... */
     rtx_ctrl_cfg->set_initial_rtx_timeout(cfg->dtcp.rtx.initial_rtx_timeout);
+    if (cfg->dtcp.flags & DTCP_CFG_RTX_CTRL) {
+        auto cc = new gpb::PolicyDescr();
+
+        rtx_ctrl_cfg->set_allocated_congestion_ctrl(cc);
+        cc->set_name(FlowAllocator::cc_type2name(cfg->dtcp.rtx.cc_type));
+    }
 }
 
 /* Translate a standard flow policies specification from FlowRequest
@@ -277,6 +319,17 @@ LocalFlowAllocator::policies2flowcfg(struct rl_flow_config *cfg,
     if (p.dtcp_cfg().rtx_ctrl()) {
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
+        /* Use the same congestion control algorithm as the initiator,
+         * if we support it. */
+        cfg->dtcp.rtx.cc_type = RLITE_CC_T_NEWRENO;
+        if (p.dtcp_cfg().rtx_ctrl_cfg().has_congestion_ctrl() &&
+            FlowAllocator::cc_name2type(
+                p.dtcp_cfg().rtx_ctrl_cfg().congestion_ctrl().name(),
+                &cfg->dtcp.rtx.cc_type)) {
+            UPW(rib->uipcp, "Unknown congestion control '%s', using %s\n",
+                p.dtcp_cfg().rtx_ctrl_cfg().congestion_ctrl().name().c_str(),
+                FlowAllocator::cc_type2name(cfg->dtcp.rtx.cc_type).c_str());
+        }
     }
 }
 
@@ -314,6 +367,13 @@ LocalFlowAllocator::flowspec2flowcfg(const struct rina_flow_spec *spec,
         cfg->dtcp.rtx.max_rtxq_len =
             rib->get_param_value<int>(FlowAllocator::Prefix, "max-rtxq-len");
         cfg->dtcp.initial_a = initial_a.count();
+        if (FlowAllocator::cc_name2type(
+                rib->get_param_value<std::string>(FlowAllocator::Prefix,
+                                                  "congestion-control"),
+                &cfg->dtcp.rtx.cc_type)) {
+            UPW(rib->uipcp, "Unknown congestion control, using %s\n",
+                FlowAllocator::cc_type2name(cfg->dtcp.rtx.cc_type).c_str());
+        }
     }
 
     /* Delay, loss and jitter ignored for now. */
@@ -739,7 +799,8 @@ UipcpRib::fa_lib_init()
           PolicyParam(Msecs(int(LocalFlowAllocator::kATimerMsecsDflt)))},
          {"initial-rtx-timeout",
           PolicyParam(Msecs(int(LocalFlowAllocator::kRtxTimerMsecsDflt)))},
-         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)}});
+         {"max-rtxq-len", PolicyParam(LocalFlowAllocator::kRtxQueueMaxLen)},
+         {"congestion-control", PolicyParam(string("newreno"))}});
 }
 
 } // namespace rlite
@@ -189,6 +189,15 @@ update_qos_cube(struct rl_flow_config &flowcfg, const string &param,
         return 0;
     }
 
+    if (param == "dtcp.rtx.congestion_control") {
+        if (FlowAllocator::cc_name2type(value, &flowcfg.dtcp.rtx.cc_type)) {
+            return -1;
+        }
+        flowcfg.dtcp.rtx_control = 1;
+        flowcfg.dtcp_present     = 1;
+        return 0;
+    }
+
     return -1;
 }
 
@@ -705,7 +705,9 @@ UipcpRib::dump(std::stringstream &ss) const
            << "   dtcp.rtx.data_rxms_max="
            << static_cast<unsigned int>(c.dtcp.rtx.data_rxms_max) << endl
            << "   dtcp.rtx.initial_rtx_timeout="
-           << static_cast<unsigned int>(c.dtcp.rtx.initial_rtx_timeout) << endl;
+           << static_cast<unsigned int>(c.dtcp.rtx.initial_rtx_timeout) << endl
+           << "   dtcp.rtx.congestion_control="
+           << FlowAllocator::cc_type2name(c.dtcp.rtx.cc_type) << endl;
         ss << "}" << endl;
     }
 #endif /* RL_USE_QOS_CUBES */
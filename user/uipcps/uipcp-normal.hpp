@@ -362,6 +362,11 @@ struct FlowAllocator : public Component {
     static std::string ObjClass;
     static std::string FlowObjClass;
     static std::string Prefix;
+
+    /* Map DTCP congestion control names ("newreno", "cubic", "vegas")
+     * to the RLITE_CC_T_* kernel identifiers and back. */
+    static int cc_name2type(const std::string &name, uint8_t *type);
+    static std::string cc_type2name(uint8_t type);
 };
 
 /* Lower Flows Database and dissemination of routing information,